@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <cjson/cJSON.h>
+
+#include "arena.h"
+#include "log-utils.h" // Include the log utils header
+
+#define ARENA_ALIGN 16
+#define ARENA_MAX_RETAINED (1024 * 1024)
+
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+ * Chunk of arena memory; the allocations follow the header.
+ */
+struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+};
+
+#define ARENA_CHUNK_HEADER ARENA_ROUND(sizeof(struct arena_chunk))
+
+struct arena {
+    struct arena_chunk* chunks;  // Chunk being filled, followed by the full ones
+    size_t used;                 // Bytes handed out in the current scope
+    bool active;
+    struct arena_stats stats;
+};
+
+static size_t arena_chunk_size = 0;
+static _Thread_local struct arena thread_arena;
+static pthread_key_t arena_key; // Releases the chunk kept by a thread when it exits
+
+static uintptr_t chunk_data(const struct arena_chunk* chunk) {
+    return (uintptr_t)chunk + ARENA_CHUNK_HEADER;
+}
+
+static struct arena_chunk* arena_add_chunk(struct arena* arena, size_t size) {
+    struct arena_chunk* chunk = malloc(ARENA_CHUNK_HEADER + size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunks = chunk;
+    arena->stats.chunks++;
+    return chunk;
+}
+
+// Destructor of arena_key, run when a thread that opened a scope exits
+static void arena_release(void* arg) {
+    struct arena* arena = arg;
+    while (arena->chunks != NULL) {
+        struct arena_chunk* next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
+
+// cJSON malloc hook: bump allocation inside a scope, malloc outside
+static void* arena_malloc(size_t size) {
+    struct arena* arena = &thread_arena;
+    if (!arena->active) {
+        return malloc(size);
+    }
+
+    size_t rounded = ARENA_ROUND(size);
+    if (rounded < size) {
+        return NULL;
+    }
+    struct arena_chunk* chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < rounded) {
+        // Oversized allocations get a chunk of their own
+        chunk = arena_add_chunk(arena, rounded > arena->stats.chunk_size ? rounded : arena->stats.chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+    void* ptr = (void*)(chunk_data(chunk) + chunk->used);
+    chunk->used += rounded;
+    arena->used += rounded;
+    return ptr;
+}
+
+// cJSON free hook: arena memory is released by arena_end, anything else by free
+static void arena_free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    for (const struct arena_chunk* chunk = thread_arena.chunks; chunk != NULL; chunk = chunk->next) {
+        if ((uintptr_t)ptr >= chunk_data(chunk) && (uintptr_t)ptr < chunk_data(chunk) + chunk->size) {
+            return;
+        }
+    }
+    free(ptr);
+}
+
+/**
+ * @brief Install the arena as the cJSON allocator
+ *
+ * @param chunk_size The size of the chunk each thread keeps between requests
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int arena_init(size_t chunk_size) {
+    if (chunk_size == 0) {
+        LOG_ERROR("The arena chunk size must not be 0");
+        return EXIT_FAILURE;
+    }
+    if (pthread_key_create(&arena_key, arena_release) != 0) {
+        LOG_ERROR("Failed to create the arena thread key");
+        return EXIT_FAILURE;
+    }
+    arena_chunk_size = ARENA_ROUND(chunk_size);
+
+    cJSON_Hooks hooks = { arena_malloc, arena_free };
+    cJSON_InitHooks(&hooks);
+    LOG_INFO("cJSON request arena enabled, %zu byte chunks", arena_chunk_size);
+    return EXIT_SUCCESS;
+}
+
+void arena_begin(void) {
+    struct arena* arena = &thread_arena;
+    if (arena_chunk_size == 0) {
+        return;
+    }
+    if (arena->stats.chunk_size == 0) {
+        arena->stats.chunk_size = arena_chunk_size;
+        pthread_setspecific(arena_key, arena);
+    }
+    arena->active = true;
+}
+
+/**
+ * @brief End the request scope of the calling thread
+ *
+ * A single chunk is kept for the next request. It grows to the usage of the largest scope
+ * seen so far, up to ARENA_MAX_RETAINED, so that steady traffic allocates no new chunks.
+ */
+void arena_end(void) {
+    struct arena* arena = &thread_arena;
+    if (!arena->active) {
+        return;
+    }
+    arena->active = false;
+    arena->stats.scopes++;
+    if (arena->used > arena->stats.peak_bytes) {
+        arena->stats.peak_bytes = arena->used;
+    }
+
+    size_t keep = arena->stats.chunk_size;
+    if (arena->used > keep && keep < ARENA_MAX_RETAINED) {
+        while (keep < arena->used && keep < ARENA_MAX_RETAINED) {
+            keep *= 2;
+        }
+        if (keep > ARENA_MAX_RETAINED) {
+            keep = ARENA_MAX_RETAINED;
+        }
+    }
+
+    struct arena_chunk* kept = NULL;
+    struct arena_chunk* chunk = arena->chunks;
+    while (chunk != NULL) {
+        struct arena_chunk* next = chunk->next;
+        if (kept == NULL && chunk->size == keep) {
+            kept = chunk;
+        }
+        else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    if (kept != NULL) {
+        kept->next = NULL;
+        kept->used = 0;
+    }
+    arena->chunks = kept;
+    arena->used = 0;
+    arena->stats.chunk_size = keep;
+}
+
+bool arena_enabled(void) {
+    return arena_chunk_size != 0;
+}
+
+void arena_get_stats(struct arena_stats* stats) {
+    *stats = thread_arena.stats;
+}
@@ -0,0 +1,58 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Request-scoped bump allocator for cJSON.
+ *
+ * arena_init installs the arena through cJSON_InitHooks. Between arena_begin and arena_end,
+ * every cJSON allocation of the calling thread is carved out of a thread-local arena and
+ * cJSON_free/cJSON_Delete of those nodes do nothing; arena_end releases them all at once by
+ * resetting the arena, which is reused by the next request of the thread. Outside a scope,
+ * and on threads that never open one, cJSON falls back to malloc and free.
+ *
+ * Memory allocated by cJSON inside a scope (including cJSON_Print* output) is only valid
+ * until arena_end: anything that outlives the request must be copied with malloc.
+ */
+
+/**
+ * Allocation counters of the arena of the calling thread.
+ */
+struct arena_stats {
+    size_t chunk_size;          // Size of the chunk kept between requests
+    unsigned long long scopes;  // Scopes closed by arena_end
+    unsigned long long chunks;  // Chunks allocated with malloc
+    size_t peak_bytes;          // Largest number of bytes used by a single scope
+};
+
+/**
+ * @brief Installs the arena as the cJSON allocator.
+ *
+ * @param chunk_size The size of the chunk each thread keeps between requests.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int arena_init(size_t chunk_size);
+
+/**
+ * @brief Starts a request scope on the calling thread.
+ */
+void arena_begin(void);
+
+/**
+ * @brief Ends the request scope of the calling thread and releases everything allocated in it.
+ */
+void arena_end(void);
+
+/**
+ * @brief Returns whether the arena is installed.
+ */
+bool arena_enabled(void);
+
+/**
+ * @brief Reads the allocation counters of the calling thread.
+ */
+void arena_get_stats(struct arena_stats* stats);
+
+#endif // ARENA_H
@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "auto-pipeline.h"
+#include "log-utils.h" // Include the log utils header
+
+// First wait of the leader once requests come concurrently
+#define AUTO_PIPELINE_MIN_WINDOW_US 10
+
+/**
+ * Commands of a request waiting for their replies.
+ */
+struct pipeline_request {
+    char* const* commands;
+    const size_t* lens;
+    size_t count;
+    redisReply** replies;
+    bool done;
+    bool success;
+    struct pipeline_request* next;
+};
+
+static redisContext* pipeline_context = NULL; // NULL while it cannot be reopened
+static auto_pipeline_reconnect_fn pipeline_reconnect = NULL;
+static bool pipeline_on = false;
+static bool pipeline_broken = false; // The replies no longer match the commands
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipeline_done = PTHREAD_COND_INITIALIZER;    // A batch was answered
+static pthread_cond_t pipeline_arrival = PTHREAD_COND_INITIALIZER; // A request was queued
+static struct pipeline_request* queue_head = NULL;
+static struct pipeline_request* queue_tail = NULL;
+static size_t queue_length = 0;
+static bool flushing = false; // A leader owns the connection
+static size_t last_batch = 0;
+static struct auto_pipeline_stats pipeline_stats = { 0 };
+
+/**
+ * @brief Start pipelining onto a connection
+ *
+ * @param context The shared connection, owned by the auto-pipeline from now on
+ * @param max_window_us The longest time the leader waits for more requests
+ * @param reconnect Replaces the connection once it has failed
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int auto_pipeline_init(redisContext* context, unsigned int max_window_us, auto_pipeline_reconnect_fn reconnect) {
+    if (context == NULL) {
+        return EXIT_FAILURE;
+    }
+    pipeline_context = context;
+    pipeline_reconnect = reconnect;
+    pipeline_on = true;
+    pipeline_broken = false;
+    memset(&pipeline_stats, 0, sizeof(pipeline_stats));
+    pipeline_stats.max_window_us = max_window_us;
+    LOG_INFO("Redis auto-pipelining, waiting up to %u us for concurrent requests", max_window_us);
+    return EXIT_SUCCESS;
+}
+
+bool auto_pipeline_enabled(void) {
+    return pipeline_on;
+}
+
+// Helper function to release the replies of a request that failed
+static void release_replies(struct pipeline_request* request) {
+    for (size_t i = 0; i < request->count; i++) {
+        if (request->replies[i] != NULL) {
+            freeReplyObject(request->replies[i]);
+            request->replies[i] = NULL;
+        }
+    }
+}
+
+/**
+ * @brief Write the commands of a batch and read the replies back in order
+ *
+ * Runs without the lock: only the leader touches the connection.
+ *
+ * @param batch The requests of the batch, in the order they were queued
+ * @param writes Set to the number of write calls
+ */
+static void flush_batch(struct pipeline_request* batch, unsigned long long* writes) {
+    if (pipeline_context == NULL || pipeline_broken || pipeline_context->err != 0) {
+        // The failed connection is handed over, to be closed
+        redisContext* broken = pipeline_context;
+        pipeline_context = pipeline_reconnect != NULL ? pipeline_reconnect(broken) : broken;
+        pipeline_broken = pipeline_context == NULL || pipeline_context == broken;
+        if (!pipeline_broken) {
+            LOG_INFO("Auto-pipeline connection reopened");
+        }
+    }
+    bool success = !pipeline_broken;
+    for (struct pipeline_request* request = batch; success && request != NULL; request = request->next) {
+        for (size_t i = 0; success && i < request->count; i++) {
+            success = redisAppendFormattedCommand(pipeline_context, request->commands[i], request->lens[i]) == REDIS_OK;
+        }
+    }
+    int done = 0;
+    while (success && !done) {
+        success = redisBufferWrite(pipeline_context, &done) == REDIS_OK;
+        (*writes)++;
+    }
+
+    for (struct pipeline_request* request = batch; request != NULL; request = request->next) {
+        memset(request->replies, 0, request->count * sizeof(*request->replies));
+        for (size_t i = 0; success && i < request->count; i++) {
+            success = redisGetReply(pipeline_context, (void**)&request->replies[i]) == REDIS_OK;
+        }
+        request->success = success;
+        if (!success) {
+            release_replies(request);
+        }
+    }
+
+    if (!success && !pipeline_broken) {
+        // Commands may be left half written or unanswered, so the connection is reopened
+        LOG_ERROR("Auto-pipeline connection failed: %s", pipeline_context->errstr[0] ? pipeline_context->errstr : "out of memory");
+        pipeline_broken = true;
+    }
+}
+
+// Helper function to compute the deadline of the wait of the leader
+static struct timespec window_deadline(unsigned int window_us) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)window_us * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    return deadline;
+}
+
+/**
+ * @brief Lead one batch: take the queued requests, flush them and answer them
+ *
+ * Called and returns with the lock held.
+ */
+static void lead_batch(void) {
+    flushing = true;
+
+    // Wait for as many requests as the previous batch held, if they come within the window
+    bool timed_out = false;
+    unsigned int window_us = pipeline_stats.window_us;
+    if (window_us > 0 && queue_length < last_batch) {
+        struct timespec deadline = window_deadline(window_us);
+        while (queue_length < last_batch) {
+            if (pthread_cond_timedwait(&pipeline_arrival, &pipeline_lock, &deadline) == ETIMEDOUT) {
+                timed_out = true;
+                break;
+            }
+        }
+    }
+
+    struct pipeline_request* batch = queue_head;
+    size_t batch_size = queue_length;
+    size_t commands = 0;
+    for (struct pipeline_request* request = batch; request != NULL; request = request->next) {
+        commands += request->count;
+    }
+    queue_head = NULL;
+    queue_tail = NULL;
+    queue_length = 0;
+    pthread_mutex_unlock(&pipeline_lock);
+
+    unsigned long long writes = 0;
+    flush_batch(batch, &writes);
+
+    pthread_mutex_lock(&pipeline_lock);
+    for (struct pipeline_request* request = batch; request != NULL; request = request->next) {
+        request->done = true;
+    }
+    pipeline_stats.batches++;
+    pipeline_stats.commands += commands;
+    pipeline_stats.writes += writes;
+    if (batch_size > pipeline_stats.largest_batch) {
+        pipeline_stats.largest_batch = batch_size;
+    }
+
+    // Adapt the window to the concurrency seen by this batch
+    if (batch_size <= 1 || timed_out) {
+        window_us /= 2;
+        if (window_us < AUTO_PIPELINE_MIN_WINDOW_US) {
+            window_us = 0;
+        }
+    }
+    else {
+        window_us = window_us > 0 ? window_us * 2 : AUTO_PIPELINE_MIN_WINDOW_US;
+    }
+    if (window_us > pipeline_stats.max_window_us) {
+        window_us = pipeline_stats.max_window_us;
+    }
+    pipeline_stats.window_us = window_us;
+    last_batch = batch_size;
+
+    flushing = false;
+    pthread_cond_broadcast(&pipeline_done);
+}
+
+/**
+ * @brief Run the commands of a request on the shared connection
+ *
+ * @param commands The formatted commands
+ * @param lens The lengths of the commands
+ * @param count The number of commands
+ * @param replies Set to the reply of every command on success
+ * @return true if every reply was read, false on a connection error
+ */
+bool auto_pipeline_exec(char* const* commands, const size_t* lens, size_t count, redisReply** replies) {
+    struct pipeline_request request = {
+        .commands = commands,
+        .lens = lens,
+        .count = count,
+        .replies = replies,
+        .done = false,
+        .success = false,
+        .next = NULL
+    };
+    if (count == 0) {
+        return true;
+    }
+
+    pthread_mutex_lock(&pipeline_lock);
+    if (queue_tail != NULL) {
+        queue_tail->next = &request;
+    }
+    else {
+        queue_head = &request;
+    }
+    queue_tail = &request;
+    queue_length++;
+    pipeline_stats.requests++;
+    pthread_cond_signal(&pipeline_arrival);
+
+    while (!request.done) {
+        if (!flushing) {
+            lead_batch();
+        }
+        else {
+            pthread_cond_wait(&pipeline_done, &pipeline_lock);
+        }
+    }
+    pthread_mutex_unlock(&pipeline_lock);
+    return request.success;
+}
+
+void auto_pipeline_get_stats(struct auto_pipeline_stats* stats) {
+    pthread_mutex_lock(&pipeline_lock);
+    *stats = pipeline_stats;
+    pthread_mutex_unlock(&pipeline_lock);
+}
+
+void auto_pipeline_cleanup(void) {
+    if (!pipeline_on) {
+        return;
+    }
+    if (pipeline_context != NULL) {
+        redisFree(pipeline_context);
+        pipeline_context = NULL;
+    }
+    pipeline_reconnect = NULL;
+    pipeline_on = false;
+}
@@ -0,0 +1,86 @@
+#ifndef AUTO_PIPELINE_H
+#define AUTO_PIPELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * Auto-pipelining of the commands of concurrent requests onto one shared Redis connection.
+ *
+ * A thread submits the commands of a request, already formatted with redisFormatCommand,
+ * and blocks until their replies are back. The first thread to find the connection idle
+ * becomes the leader: it takes every request queued so far, writes all their commands at
+ * once and reads the replies back in order, handing each request its own. Requests
+ * submitted while a batch is on the wire wait for the next one, so batches grow with the
+ * concurrency on their own.
+ *
+ * Under load the leader also waits a short window for the requests it expects, the size
+ * of the previous batch. The window doubles while batches fill up before it ends and
+ * halves when they do not, down to no wait at all when requests come one at a time.
+ *
+ * When the connection fails, the requests of the batch fail and the next leader asks the
+ * reconnect function for a new connection; until it gets one, every batch fails at once.
+ */
+
+/**
+ * Replaces the shared connection after a failure.
+ *
+ * @param broken The failed connection, to be closed by the function, or NULL if none is open.
+ * @return redisContext* The new connection, or NULL if it cannot be opened now.
+ */
+typedef redisContext* (*auto_pipeline_reconnect_fn)(redisContext* broken);
+
+/**
+ * Counters of the auto-pipeline.
+ */
+struct auto_pipeline_stats {
+    unsigned long long requests;  // Requests submitted
+    unsigned long long commands;  // Commands written
+    unsigned long long batches;   // Batches written, each in as few writes as the socket allows
+    unsigned long long writes;    // Write calls to the socket
+    size_t largest_batch;         // Most requests written in one batch
+    unsigned int window_us;       // Current wait of the leader for more requests
+    unsigned int max_window_us;
+};
+
+/**
+ * @brief Starts pipelining onto a connection.
+ *
+ * @param context The shared connection, owned by the auto-pipeline from now on.
+ * @param max_window_us The longest time the leader waits for more requests, 0 never to wait.
+ * @param reconnect Replaces the connection once it has failed, or NULL to keep failing.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int auto_pipeline_init(redisContext* context, unsigned int max_window_us, auto_pipeline_reconnect_fn reconnect);
+
+/**
+ * @brief Checks whether commands go through the auto-pipeline.
+ */
+bool auto_pipeline_enabled(void);
+
+/**
+ * @brief Runs the commands of a request on the shared connection.
+ *
+ * @param commands The commands, formatted with redisFormatCommand or redisFormatCommandArgv.
+ * @param lens The lengths of the commands.
+ * @param count The number of commands.
+ * @param replies Set to the reply of every command, in order, on success.
+ *        The caller is responsible for freeing the replies with freeReplyObject.
+ * @return true if every reply was read, false on a connection error (no reply is returned).
+ */
+bool auto_pipeline_exec(char* const* commands, const size_t* lens, size_t count, redisReply** replies);
+
+/**
+ * @brief Copies the counters of the auto-pipeline.
+ */
+void auto_pipeline_get_stats(struct auto_pipeline_stats* stats);
+
+/**
+ * @brief Closes the shared connection.
+ *
+ * Must not be called while requests are submitted.
+ */
+void auto_pipeline_cleanup(void);
+
+#endif // AUTO_PIPELINE_H
@@ -0,0 +1,217 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "body-compress.h"
+#include "keyed-cache.h"
+#include "log-utils.h" // Include the log utils header
+
+#define COMPRESS_CACHE_SLOTS 1024
+#define GZIP_WINDOW_BITS (15 + 16)
+#define DEFLATE_WINDOW_BITS 15
+
+static size_t compress_min_size = 0;
+
+// Compressed bodies under their encoding and the resource key
+static struct keyed_cache body_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * @brief Set the compression parameters and create the cache
+ *
+ * @param min_size Bodies shorter than this are sent uncompressed
+ * @param cache_bytes The size of the cache of compressed bodies, 0 to disable it
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int compress_init(size_t min_size, size_t cache_bytes) {
+    compress_min_size = min_size;
+    if (keyed_cache_init(&body_cache, COMPRESS_CACHE_SLOTS, cache_bytes) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to create the compression cache");
+        return EXIT_FAILURE;
+    }
+    LOG_INFO("Response compression from %zu bytes, %zu byte cache", min_size, cache_bytes);
+    return EXIT_SUCCESS;
+}
+
+void compress_cleanup(void) {
+    keyed_cache_cleanup(&body_cache);
+}
+
+// Helper function to read the quality of one coding of an Accept-Encoding header
+static double coding_quality(const char* params, const char* end) {
+    for (const char* p = params; p < end; p++) {
+        if ((*p == 'q' || *p == 'Q') && p + 1 < end && p[1] == '=') {
+            return strtod(p + 2, NULL);
+        }
+    }
+    return 1.0;
+}
+
+bool compress_eligible(size_t len) {
+    return len >= compress_min_size;
+}
+
+/**
+ * @brief Select the encoding of a response from the Accept-Encoding header of the request
+ *
+ * @param accept_encoding The Accept-Encoding header, or NULL
+ * @param len The length of the body
+ * @return enum content_encoding The encoding, CONTENT_ENCODING_IDENTITY if the body is not compressed
+ */
+enum content_encoding compress_negotiate(const char* accept_encoding, size_t len) {
+    if (accept_encoding == NULL || !compress_eligible(len)) {
+        return CONTENT_ENCODING_IDENTITY;
+    }
+
+    // Codings that are not listed take the quality of "*", if any
+    double gzip = -1;
+    double deflate = -1;
+    double any = -1;
+    const char* p = accept_encoding;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        const char* name = p;
+        while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        size_t name_len = (size_t)(p - name);
+        const char* params = p;
+        while (*p != '\0' && *p != ',') {
+            p++;
+        }
+        double q = coding_quality(params, p);
+        if (name_len == 4 && strncasecmp(name, "gzip", 4) == 0) {
+            gzip = q;
+        }
+        else if (name_len == 7 && strncasecmp(name, "deflate", 7) == 0) {
+            deflate = q;
+        }
+        else if (name_len == 1 && *name == '*') {
+            any = q;
+        }
+    }
+    if (gzip < 0) {
+        gzip = any;
+    }
+    if (deflate < 0) {
+        deflate = any;
+    }
+
+    if (gzip > 0 && gzip >= deflate) {
+        return CONTENT_ENCODING_GZIP;
+    }
+    if (deflate > 0) {
+        return CONTENT_ENCODING_DEFLATE;
+    }
+    return CONTENT_ENCODING_IDENTITY;
+}
+
+const char* compress_encoding_name(enum content_encoding encoding) {
+    switch (encoding) {
+    case CONTENT_ENCODING_GZIP:
+        return "gzip";
+    case CONTENT_ENCODING_DEFLATE:
+        return "deflate";
+    default:
+        return "identity";
+    }
+}
+
+/**
+ * @brief Compress a body with zlib
+ *
+ * gzip uses the gzip wrapper; deflate uses the zlib wrapper, as HTTP defines it.
+ *
+ * @param data The body
+ * @param len The length of the body
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE
+ * @param out_len Set to the length of the compressed body
+ * @return char* The compressed body, or NULL on failure
+ */
+char* compress_body(const char* data, size_t len, enum content_encoding encoding, size_t* out_len) {
+    if (encoding == CONTENT_ENCODING_IDENTITY || len > UINT32_MAX) {
+        return NULL;
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int window_bits = encoding == CONTENT_ENCODING_GZIP ? GZIP_WINDOW_BITS : DEFLATE_WINDOW_BITS;
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        LOG_ERROR("Failed to initialize zlib");
+        return NULL;
+    }
+
+    // The bound covers the whole output, so a single call finishes the stream
+    uLong bound = deflateBound(&stream, (uLong)len);
+    char* out = malloc(bound);
+    if (out == NULL) {
+        LOG_ERROR("Memory allocation failed for the compressed body");
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)len;
+    stream.next_out = (Bytef*)out;
+    stream.avail_out = (uInt)bound;
+    int result = deflate(&stream, Z_FINISH);
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+        LOG_ERROR("Failed to compress the body");
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * @brief Return a compressed body from the cache, compressing and caching it on a miss
+ *
+ * The compression of a miss runs outside the lock of the cache.
+ *
+ * @param key The resource and its content version
+ * @param data The uncompressed body
+ * @param len The length of the uncompressed body
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE
+ * @param out_len Set to the length of the compressed body
+ * @return char* A copy of the compressed body, or NULL on failure
+ */
+char* compress_cached(const char* key, const char* data, size_t len, enum content_encoding encoding, size_t* out_len) {
+    if (!keyed_cache_enabled(&body_cache)) {
+        return compress_body(data, len, encoding, out_len);
+    }
+
+    // The encoding leads the key, so the gzip and deflate bodies of a resource are cached apart
+    const char* name = compress_encoding_name(encoding);
+    size_t key_size = strlen(name) + strlen(key) + 2;
+    char* cache_key = malloc(key_size);
+    if (cache_key == NULL) {
+        return compress_body(data, len, encoding, out_len);
+    }
+    snprintf(cache_key, key_size, "%s %s", name, key);
+
+    char* compressed = keyed_cache_get(&body_cache, cache_key, KEYED_CACHE_ANY_AGE, out_len, NULL);
+    if (compressed == NULL) {
+        compressed = compress_body(data, len, encoding, out_len);
+        if (compressed != NULL) {
+            keyed_cache_put(&body_cache, cache_key, compressed, *out_len);
+        }
+    }
+    free(cache_key);
+    return compressed;
+}
+
+void compress_get_stats(struct compress_stats* stats) {
+    struct keyed_cache_stats cache_stats;
+    keyed_cache_get_stats(&body_cache, &cache_stats);
+    stats->hits = cache_stats.hits;
+    stats->misses = cache_stats.misses;
+    stats->evictions = cache_stats.evictions;
+    stats->entries = cache_stats.entries;
+    stats->bytes = cache_stats.bytes;
+    stats->max_bytes = cache_stats.max_bytes;
+}
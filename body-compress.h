@@ -0,0 +1,103 @@
+#ifndef BODY_COMPRESS_H
+#define BODY_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * gzip/deflate compression of response bodies, with a cache of compressed bodies.
+ *
+ * The encoding is negotiated from the Accept-Encoding header of the request. Bodies with a
+ * content version (an ETag) are compressed once and kept in the cache under a key naming
+ * the resource, its version and the encoding, so hot responses are not compressed again on
+ * every request. A new version gets a new key; stale entries are simply never hit again and
+ * are evicted as the cache fills up.
+ */
+
+enum content_encoding {
+    CONTENT_ENCODING_IDENTITY,
+    CONTENT_ENCODING_GZIP,
+    CONTENT_ENCODING_DEFLATE
+};
+
+/**
+ * Counters of the compressed body cache.
+ */
+struct compress_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+};
+
+/**
+ * @brief Sets the compression parameters and creates the cache.
+ *
+ * @param min_size Bodies shorter than this are sent uncompressed.
+ * @param cache_bytes The size of the cache of compressed bodies, 0 to disable it.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int compress_init(size_t min_size, size_t cache_bytes);
+
+/**
+ * @brief Releases the cache.
+ */
+void compress_cleanup(void);
+
+/**
+ * @brief Checks whether a body is long enough to be compressed.
+ *
+ * Responses that may be compressed carry Vary: Accept-Encoding, whatever the client accepts.
+ */
+bool compress_eligible(size_t len);
+
+/**
+ * @brief Selects the encoding of a response from the Accept-Encoding header of the request.
+ *
+ * gzip is preferred over deflate at equal quality; codings with q=0 are refused.
+ *
+ * @param accept_encoding The Accept-Encoding header, or NULL.
+ * @param len The length of the body.
+ * @return enum content_encoding CONTENT_ENCODING_IDENTITY when the body is shorter than
+ *         the minimum size or no supported coding is acceptable.
+ */
+enum content_encoding compress_negotiate(const char* accept_encoding, size_t len);
+
+/**
+ * @brief Returns the Content-Encoding token of an encoding ("gzip" or "deflate").
+ */
+const char* compress_encoding_name(enum content_encoding encoding);
+
+/**
+ * @brief Compresses a body.
+ *
+ * @param data The body.
+ * @param len The length of the body.
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE.
+ * @param out_len Set to the length of the compressed body.
+ * @return char* The compressed body, or NULL on failure.
+ *         The caller is responsible for freeing the returned buffer.
+ */
+char* compress_body(const char* data, size_t len, enum content_encoding encoding, size_t* out_len);
+
+/**
+ * @brief Returns a compressed body from the cache, compressing and caching it on a miss.
+ *
+ * @param key The resource and its content version, e.g. "/v2/pet/1 \"v3\"".
+ * @param data The uncompressed body, used on a miss.
+ * @param len The length of the uncompressed body.
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE.
+ * @param out_len Set to the length of the compressed body.
+ * @return char* A copy of the compressed body, or NULL on failure.
+ *         The caller is responsible for freeing the returned buffer.
+ */
+char* compress_cached(const char* key, const char* data, size_t len, enum content_encoding encoding, size_t* out_len);
+
+/**
+ * @brief Copies the counters of the cache.
+ */
+void compress_get_stats(struct compress_stats* stats);
+
+#endif // BODY_COMPRESS_H
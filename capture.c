@@ -0,0 +1,163 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "log-utils.h" // Include the log utils header
+
+static int capture_fd = -1;
+static unsigned long capture_interval = 0;
+static unsigned long capture_max_records = 0;
+static unsigned long capture_seen = 0;
+static unsigned long capture_written = 0;
+
+/**
+ * @brief Helper function to append a JSON-escaped string to a record
+ *
+ * @param record The record buffer
+ * @param pos The current position in the record, advanced on success
+ * @param value The string to escape
+ * @param len The length of the string
+ * @return true on success, false if the record is full
+ */
+static bool append_escaped(char* record, size_t* pos, const char* value, size_t len) {
+    // Keep room for the closing of the record: "}\n"
+    size_t limit = CAPTURE_RECORD_SIZE - 2;
+    size_t p = *pos;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)value[i];
+        if (p + 6 >= limit) {
+            return false;
+        }
+        if (c == '"' || c == '\\') {
+            record[p++] = '\\';
+            record[p++] = (char)c;
+        }
+        else if (c == '\n') {
+            record[p++] = '\\';
+            record[p++] = 'n';
+        }
+        else if (c == '\r') {
+            record[p++] = '\\';
+            record[p++] = 'r';
+        }
+        else if (c == '\t') {
+            record[p++] = '\\';
+            record[p++] = 't';
+        }
+        else if (c < 0x20) {
+            p += (size_t)snprintf(record + p, limit - p, "\\u%04x", c);
+        }
+        else {
+            record[p++] = (char)c;
+        }
+    }
+    *pos = p;
+    return true;
+}
+
+static bool append_raw(char* record, size_t* pos, const char* value) {
+    size_t len = strlen(value);
+    if (*pos + len >= CAPTURE_RECORD_SIZE - 2) {
+        return false;
+    }
+    memcpy(record + *pos, value, len);
+    *pos += len;
+    return true;
+}
+
+/**
+ * @brief Open the capture ring file and enable capture
+ *
+ * @param path The path of the capture file
+ * @param sample_rate The fraction of requests to record, between 0 and 1
+ * @param max_records The number of records kept in the ring
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int capture_init(const char* path, double sample_rate, unsigned int max_records) {
+    if (sample_rate <= 0 || max_records == 0) {
+        LOG_ERROR("Invalid capture configuration: rate %f, max records %u", sample_rate, max_records);
+        return EXIT_FAILURE;
+    }
+
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture_fd < 0) {
+        LOG_ERROR("Failed to open capture file %s", path);
+        return EXIT_FAILURE;
+    }
+
+    // Sampling is done by counting: one request out of every capture_interval is recorded
+    capture_interval = sample_rate >= 1 ? 1 : (unsigned long)(1.0 / sample_rate + 0.5);
+    capture_max_records = max_records;
+    LOG_INFO("Capturing 1 out of %lu requests into %s (%u records)", capture_interval, path, max_records);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Decide whether the current request should be recorded
+ *
+ * @return true when capture is enabled and the request is sampled
+ */
+bool capture_sample() {
+    if (capture_fd < 0) {
+        return false;
+    }
+    return __atomic_fetch_add(&capture_seen, 1, __ATOMIC_RELAXED) % capture_interval == 0;
+}
+
+/**
+ * @brief Record a request into the ring file
+ *
+ * @param method The HTTP method
+ * @param url The request URL including the query string
+ * @param body The request body (may be NULL)
+ * @param body_size The length of the request body
+ * @param arrival The time the request arrived
+ */
+void capture_request(const char* method, const char* url, const char* body, size_t body_size, const struct timeval* arrival) {
+    if (capture_fd < 0) {
+        return;
+    }
+
+    char record[CAPTURE_RECORD_SIZE];
+    size_t pos = (size_t)snprintf(record, sizeof(record), "{\"ts\":%lld,\"method\":\"",
+        (long long)arrival->tv_sec * 1000000 + arrival->tv_usec);
+
+    if (!append_escaped(record, &pos, method, strlen(method)) ||
+        !append_raw(record, &pos, "\",\"url\":\"") ||
+        !append_escaped(record, &pos, url, strlen(url))) {
+        LOG_WARN("Request too large to capture: %s %s", method, url);
+        return;
+    }
+
+    // Drop the body rather than the whole record when it does not fit
+    size_t body_start = pos;
+    if (!append_raw(record, &pos, "\",\"body\":\"") ||
+        !append_escaped(record, &pos, body ? body : "", body ? body_size : 0) ||
+        !append_raw(record, &pos, "\"")) {
+        pos = body_start;
+        append_raw(record, &pos, "\",\"body\":\"\",\"truncated\":true");
+    }
+    record[pos++] = '}';
+
+    // Pad the line so every record has the same size and can be overwritten in place
+    memset(record + pos, ' ', CAPTURE_RECORD_SIZE - 1 - pos);
+    record[CAPTURE_RECORD_SIZE - 1] = '\n';
+
+    unsigned long slot = __atomic_fetch_add(&capture_written, 1, __ATOMIC_RELAXED) % capture_max_records;
+    if (pwrite(capture_fd, record, CAPTURE_RECORD_SIZE, (off_t)slot * CAPTURE_RECORD_SIZE) != CAPTURE_RECORD_SIZE) {
+        LOG_ERROR("Failed to write capture record");
+    }
+}
+
+/**
+ * @brief Close the capture file
+ */
+void capture_cleanup() {
+    if (capture_fd >= 0) {
+        close(capture_fd);
+        capture_fd = -1;
+    }
+}
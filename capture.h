@@ -0,0 +1,57 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/**
+ * Traffic capture.
+ *
+ * Sampled requests are written as JSON lines of a fixed size into a ring file, so a
+ * capture never grows past max_records lines. Each line has the form:
+ *
+ * {"ts":1700000000123456,"method":"GET","url":"/v2/pet/findByStatus?status=sold","body":""}
+ *
+ * where ts is the arrival time in microseconds since the epoch. Lines are padded with
+ * spaces to the record size; petstore-replay orders them by ts before playing them back.
+ */
+
+#define CAPTURE_RECORD_SIZE 4096
+
+/**
+ * @brief Opens the capture ring file and enables capture.
+ *
+ * @param path The path of the capture file.
+ * @param sample_rate The fraction of requests to record, between 0 and 1.
+ * @param max_records The number of records kept in the ring before the oldest are overwritten.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int capture_init(const char* path, double sample_rate, unsigned int max_records);
+
+/**
+ * @brief Decides whether the current request should be recorded.
+ *
+ * @return bool Returns true when capture is enabled and the request is sampled.
+ */
+bool capture_sample();
+
+/**
+ * @brief Records a request into the ring file.
+ *
+ * Bodies that do not fit into a record are dropped and the record is marked with "truncated":true.
+ *
+ * @param method The HTTP method.
+ * @param url The request URL including the query string.
+ * @param body The request body (may be NULL).
+ * @param body_size The length of the request body.
+ * @param arrival The time the request arrived.
+ */
+void capture_request(const char* method, const char* url, const char* body, size_t body_size, const struct timeval* arrival);
+
+/**
+ * @brief Closes the capture file.
+ */
+void capture_cleanup();
+
+#endif // CAPTURE_H
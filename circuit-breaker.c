@@ -0,0 +1,139 @@
+#include "circuit-breaker.h"
+#include "clock-utils.h"
+#include "log-utils.h" // Include the log utils header
+
+/**
+ * @brief Initialize a closed circuit breaker
+ *
+ * @param breaker The breaker
+ * @param failure_threshold The consecutive failures that open the breaker, 0 never to open it
+ * @param open_ms The time the breaker stays open before the first probe
+ * @param max_open_ms The longest open period
+ */
+void circuit_breaker_init(struct circuit_breaker* breaker, unsigned int failure_threshold, unsigned int open_ms,
+    unsigned int max_open_ms) {
+    pthread_mutex_init(&breaker->lock, NULL);
+    atomic_init(&breaker->state, BREAKER_CLOSED);
+    atomic_init(&breaker->consecutive_failures, 0);
+    breaker->failure_threshold = failure_threshold;
+    breaker->base_open_ms = open_ms;
+    breaker->max_open_ms = max_open_ms > open_ms ? max_open_ms : open_ms;
+    breaker->open_ms = open_ms;
+    breaker->open_until_ms = 0;
+    breaker->probing = false;
+    breaker->failures = 0;
+    breaker->trips = 0;
+    breaker->rejected = 0;
+}
+
+// Helper function to open the breaker for its current period, with the lock held
+static void breaker_open(struct circuit_breaker* breaker) {
+    atomic_store(&breaker->state, BREAKER_OPEN);
+    breaker->open_until_ms = monotonic_ms() + breaker->open_ms;
+    breaker->probing = false;
+    breaker->trips++;
+    LOG_WARN("Circuit breaker open for %u ms after %u consecutive failures", breaker->open_ms,
+        atomic_load(&breaker->consecutive_failures));
+    // The next open period, if the probe fails
+    breaker->open_ms = breaker->open_ms > breaker->max_open_ms / 2 ? breaker->max_open_ms : breaker->open_ms * 2;
+}
+
+bool circuit_breaker_allow(struct circuit_breaker* breaker, bool* probe) {
+    *probe = false;
+    if (atomic_load_explicit(&breaker->state, memory_order_acquire) == BREAKER_CLOSED) {
+        return true;
+    }
+
+    bool allowed = false;
+    pthread_mutex_lock(&breaker->lock);
+    int state = atomic_load(&breaker->state);
+    if (state == BREAKER_CLOSED) {
+        allowed = true;
+    }
+    else if (!breaker->probing && monotonic_ms() >= breaker->open_until_ms) {
+        // Only one call tests the backend; the others keep failing fast meanwhile
+        atomic_store(&breaker->state, BREAKER_HALF_OPEN);
+        breaker->probing = true;
+        allowed = true;
+        *probe = true;
+    }
+    else {
+        breaker->rejected++;
+    }
+    pthread_mutex_unlock(&breaker->lock);
+    return allowed;
+}
+
+void circuit_breaker_record(struct circuit_breaker* breaker, bool success) {
+    if (success && atomic_load_explicit(&breaker->state, memory_order_acquire) == BREAKER_CLOSED &&
+        atomic_load_explicit(&breaker->consecutive_failures, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&breaker->lock);
+    int state = atomic_load(&breaker->state);
+    if (success) {
+        atomic_store(&breaker->consecutive_failures, 0);
+        if (state != BREAKER_CLOSED) {
+            LOG_INFO("Circuit breaker closed");
+            atomic_store(&breaker->state, BREAKER_CLOSED);
+            breaker->probing = false;
+            breaker->open_ms = breaker->base_open_ms;
+        }
+    }
+    else {
+        breaker->failures++;
+        unsigned int failures = atomic_fetch_add(&breaker->consecutive_failures, 1) + 1;
+        if (state == BREAKER_HALF_OPEN ||
+            (state == BREAKER_CLOSED && breaker->failure_threshold > 0 && failures >= breaker->failure_threshold)) {
+            breaker_open(breaker);
+        }
+    }
+    pthread_mutex_unlock(&breaker->lock);
+}
+
+bool circuit_breaker_closed(struct circuit_breaker* breaker) {
+    return atomic_load_explicit(&breaker->state, memory_order_acquire) == BREAKER_CLOSED;
+}
+
+unsigned int circuit_breaker_retry_after_ms(struct circuit_breaker* breaker) {
+    if (atomic_load_explicit(&breaker->state, memory_order_acquire) == BREAKER_CLOSED) {
+        return 0;
+    }
+    unsigned int retry_after = 0;
+    pthread_mutex_lock(&breaker->lock);
+    uint64_t now = monotonic_ms();
+    if (atomic_load(&breaker->state) != BREAKER_CLOSED && breaker->open_until_ms > now) {
+        retry_after = (unsigned int)(breaker->open_until_ms - now);
+    }
+    pthread_mutex_unlock(&breaker->lock);
+    return retry_after;
+}
+
+void circuit_breaker_get_stats(struct circuit_breaker* breaker, struct circuit_breaker_stats* stats) {
+    unsigned int retry_after = circuit_breaker_retry_after_ms(breaker);
+    pthread_mutex_lock(&breaker->lock);
+    stats->state = (enum breaker_state)atomic_load(&breaker->state);
+    stats->consecutive_failures = atomic_load(&breaker->consecutive_failures);
+    stats->open_ms = breaker->open_ms;
+    stats->retry_after_ms = retry_after;
+    stats->failures = breaker->failures;
+    stats->trips = breaker->trips;
+    stats->rejected = breaker->rejected;
+    pthread_mutex_unlock(&breaker->lock);
+}
+
+const char* circuit_breaker_state_name(enum breaker_state state) {
+    switch (state) {
+    case BREAKER_OPEN:
+        return "open";
+    case BREAKER_HALF_OPEN:
+        return "halfOpen";
+    default:
+        return "closed";
+    }
+}
+
+void circuit_breaker_destroy(struct circuit_breaker* breaker) {
+    pthread_mutex_destroy(&breaker->lock);
+}
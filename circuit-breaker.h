@@ -0,0 +1,107 @@
+#ifndef CIRCUIT_BREAKER_H
+#define CIRCUIT_BREAKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Circuit breaker guarding a backend that may go down.
+ *
+ * The breaker is closed while the backend answers. After failure_threshold consecutive
+ * failures it opens: callers fail fast instead of waiting on a dead socket. Once open_ms
+ * has passed, a single caller is let through as a probe (half-open); its success closes the
+ * breaker, its failure opens it again for twice as long, up to max_open_ms.
+ *
+ * The closed state takes no lock, so a healthy backend costs two atomic loads per call.
+ */
+
+enum breaker_state {
+    BREAKER_CLOSED,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN
+};
+
+struct circuit_breaker {
+    pthread_mutex_t lock;
+    _Atomic int state;                          // enum breaker_state
+    _Atomic unsigned int consecutive_failures;
+    unsigned int failure_threshold;             // 0 never opens the breaker
+    unsigned int base_open_ms;
+    unsigned int max_open_ms;
+    unsigned int open_ms;                       // Length of the next open period
+    uint64_t open_until_ms;
+    bool probing;                               // A probe is on its way in the half-open state
+    unsigned long long failures;
+    unsigned long long trips;
+    unsigned long long rejected;
+};
+
+/**
+ * Counters of a circuit breaker.
+ */
+struct circuit_breaker_stats {
+    enum breaker_state state;
+    unsigned int consecutive_failures;
+    unsigned int open_ms;           // Length of the next open period
+    unsigned int retry_after_ms;    // Time left before the next probe, 0 when closed
+    unsigned long long failures;    // Failures recorded
+    unsigned long long trips;       // Times the breaker opened
+    unsigned long long rejected;    // Calls failed fast
+};
+
+/**
+ * @brief Initializes a closed circuit breaker.
+ *
+ * @param breaker The breaker.
+ * @param failure_threshold The consecutive failures that open the breaker, 0 never to open it.
+ * @param open_ms The time the breaker stays open before the first probe, in milliseconds.
+ * @param max_open_ms The longest open period, reached by doubling after failed probes.
+ */
+void circuit_breaker_init(struct circuit_breaker* breaker, unsigned int failure_threshold, unsigned int open_ms,
+    unsigned int max_open_ms);
+
+/**
+ * @brief Asks whether a call may go to the backend.
+ *
+ * @param breaker The breaker.
+ * @param probe Set to true when the call is the probe of a half-open breaker: the caller
+ *        must then record its outcome.
+ * @return bool Returns false when the call must fail fast.
+ */
+bool circuit_breaker_allow(struct circuit_breaker* breaker, bool* probe);
+
+/**
+ * @brief Records the outcome of a call to the backend.
+ */
+void circuit_breaker_record(struct circuit_breaker* breaker, bool success);
+
+/**
+ * @brief Checks whether the breaker is closed, without taking its lock.
+ */
+bool circuit_breaker_closed(struct circuit_breaker* breaker);
+
+/**
+ * @brief Gets the time left before the breaker lets a probe through.
+ *
+ * @return unsigned int The time in milliseconds, 0 when calls are let through.
+ */
+unsigned int circuit_breaker_retry_after_ms(struct circuit_breaker* breaker);
+
+/**
+ * @brief Copies the counters of a breaker.
+ */
+void circuit_breaker_get_stats(struct circuit_breaker* breaker, struct circuit_breaker_stats* stats);
+
+/**
+ * @brief Gets the name of a breaker state, for the metrics.
+ */
+const char* circuit_breaker_state_name(enum breaker_state state);
+
+/**
+ * @brief Releases the lock of a breaker.
+ */
+void circuit_breaker_destroy(struct circuit_breaker* breaker);
+
+#endif // CIRCUIT_BREAKER_H
@@ -0,0 +1,31 @@
+#ifndef CLOCK_UTILS_H
+#define CLOCK_UTILS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Get the time of the monotonic clock in milliseconds.
+ *
+ * The clock is not affected by changes of the wall clock, so it measures ages and timeouts.
+ *
+ * @return uint64_t The milliseconds since an unspecified point in the past.
+ */
+static inline uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Get the time of the monotonic clock in microseconds.
+ *
+ * @return uint64_t The microseconds since an unspecified point in the past.
+ */
+static inline uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+#endif // CLOCK_UTILS_H
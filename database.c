@@ -1,16 +1,169 @@
 #include <stdbool.h>
 #include <hiredis/hiredis.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <cjson/cJSON.h>
 
 #include "database.h" // Include the database header
+#include "auto-pipeline.h" // Include the Redis auto-pipeline
+#include "circuit-breaker.h" // Include the circuit breaker
+#include "hedged-read.h" // Include the hedged reads
+#include "shard-ring.h" // Include the consistent hash ring of the shards
+#include "id-filter.h" // Include the id filter header
 #include "log-utils.h" // Include the log utils header
 
-redisContext* redis_context = NULL;
+// Connection of the calling thread: db_init opens the one of the main thread, the HTTP
+// threads open theirs with db_thread_attach
+_Thread_local redisContext* redis_context = NULL;
+static char* redis_uri = NULL;
+static pthread_key_t connection_key; // Closes the connection of a thread when it exits
+static pthread_once_t connection_key_once = PTHREAD_ONCE_INIT;
 
-#define REDIS_TIMEOUT 5
+#define DB_DEFAULT_CONNECT_TIMEOUT_MS 1000
+#define HEALTH_CHECK_SLICE_MS 100
+#define LATENCY_EWMA_WEIGHT 8
+
+// Timeouts of the connections; a zero command timeout waits for replies forever
+static struct timeval connect_timeout = { DB_DEFAULT_CONNECT_TIMEOUT_MS / 1000, (DB_DEFAULT_CONNECT_TIMEOUT_MS % 1000) * 1000 };
+static struct timeval command_timeout = { 0, 0 };
+
+// Opened by consecutive connection failures, so that requests fail fast while Redis is down
+static struct circuit_breaker redis_breaker;
+static pthread_t health_thread;
+static volatile int health_running = 0;
+static unsigned int health_interval_ms = 0;
+
+// Moving average of the round trips of the hot reads and health checks, in microseconds
+static _Atomic unsigned int latency_us = 0;
+static unsigned int slow_threshold_us = 0; // Average above which Redis counts as degraded, 0 never
+
+/**
+ * Read replica sharing the reads of GET requests.
+ */
+struct replica {
+    char* uri;
+    struct circuit_breaker breaker;         // Opened by the failures of this replica alone
+    _Atomic unsigned int latency_us;        // Moving average of the round trips
+    _Atomic unsigned long long requests;    // Requests whose reads it served
+};
+
+// Replicas set by db_replicas_init, none by default
+static struct replica* replicas = NULL;
+static size_t replica_count = 0;
+static pthread_key_t replica_key; // Closes the replica connections of a thread when it exits
+static _Thread_local redisContext** replica_contexts = NULL; // Connections of the thread, one per replica
+// Replica chosen for the reads of the current request, NULL for the primary
+static _Thread_local struct replica* read_replica = NULL;
+static _Thread_local redisContext* read_context = NULL;
+static _Thread_local unsigned int replica_seed = 0;
+
+// Second connections of the thread for hedged reads, one per server: the primary, then the replicas
+static pthread_key_t hedge_key; // Closes the hedge connections of a thread when it exits
+static _Thread_local redisContext** hedge_contexts = NULL;
+
+/**
+ * Redis node holding the documents whose ids hash to it on the shard ring.
+ */
+struct shard {
+    char* uri;
+    struct circuit_breaker breaker;     // Opened by the failures of this shard alone; the first shard uses redis_breaker
+    _Atomic unsigned int latency_us;    // Moving average of the health checks
+};
+
+// Shards set by db_shards_init, the first one being the server of db_init; none by default
+static struct shard* shards = NULL;
+static size_t shard_count = 0;
+static struct shard_ring* shard_ring = NULL;
+static pthread_key_t shard_key; // Closes the shard connections of a thread when it exits
+// Connections of the thread to the shards; the first shard uses redis_context instead
+static _Thread_local redisContext** shard_contexts = NULL;
+
+#define PET_FILTER_SCAN_COUNT 1000
+#define USERNAME_INDEX "index:username"
+#define VERSIONS_KEY "versions"
+#define GENERATIONS_KEY "generations"
+#define BUCKET_PREFIX "b:"
+#define MIGRATE_SCAN_COUNT 500
+
+/**
+ * Lua script resolving a username through the username index and returning the stored
+ * document in a single round trip. KEYS[1] is the index, ARGV[1] the username, ARGV[2]
+ * the key prefix of the documents and ARGV[3] the bucket size (0 for one key per document).
+ */
+static const char* USER_BY_USERNAME_SCRIPT =
+    "local id = redis.call('HGET', KEYS[1], ARGV[1]) "
+    "if not id then return false end "
+    "local n = tonumber(ARGV[3]) "
+    "if n == 0 then return redis.call('GET', ARGV[2] .. id) end "
+    "local i = tonumber(id) "
+    "if not i then return false end "
+    "return redis.call('HGET', ARGV[2] .. '" BUCKET_PREFIX "' .. math.floor(i / n), id)";
+
+/**
+ * Lua script removing a username index entry only if it still points to the given id.
+ * KEYS[1] is the index, ARGV[1] the username and ARGV[2] the id.
+ */
+static const char* USERNAME_UNLINK_SCRIPT =
+    "if redis.call('HGET', KEYS[1], ARGV[1]) == ARGV[2] then "
+    "return redis.call('HDEL', KEYS[1], ARGV[1]) end "
+    "return 0";
+
+/**
+ * Lua script running commands only if the version of a document is still the one they
+ * were built from, then bumping it. KEYS[1] is the versions hash, ARGV[1] the id, ARGV[2]
+ * the expected version ("0" for none) and the rest the commands, each given as its number
+ * of arguments followed by the arguments. Returns the new version, or -1 on a conflict.
+ */
+static const char* VERSIONED_WRITE_SCRIPT =
+    "local version = redis.call('HGET', KEYS[1], ARGV[1]) or '0' "
+    "if version ~= ARGV[2] then return -1 end "
+    "local i = 3 "
+    "while i <= #ARGV do "
+    "local n = tonumber(ARGV[i]) "
+    "redis.call(unpack(ARGV, i + 1, i + n)) "
+    "i = i + n + 1 "
+    "end "
+    "return redis.call('HINCRBY', KEYS[1], ARGV[1], 1)";
+
+// SHA1 of USER_BY_USERNAME_SCRIPT once loaded with SCRIPT LOAD, per thread like the connections
+static _Thread_local char user_by_username_sha[41] = { 0 };
+// SHA1 of VERSIONED_WRITE_SCRIPT once loaded with SCRIPT LOAD
+static _Thread_local char versioned_write_sha[41] = { 0 };
+
+// Layout of the stored documents, one string key per document by default
+static struct db_storage storage = { 0 };
+
+// Negative lookup filter of the existing pet ids (NULL when disabled)
+static struct id_filter* pet_filter = NULL;
+// Filter being rebuilt; writes are applied to both filters until it replaces pet_filter
+static struct id_filter* pet_filter_next = NULL;
+static pthread_mutex_t pet_filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t pet_filter_thread;
+static volatile int pet_filter_running = 0;
+static size_t pet_filter_capacity = 0;
+static double pet_filter_fp_rate = 0;
+static unsigned int pet_filter_rebuild_sec = 0;
+
+static struct {
+    unsigned long lookups;
+    unsigned long definite_misses;
+    unsigned long false_positives;
+    unsigned long rebuilds;
+    double last_rebuild_ms;
+} pet_filter_stats;
+
+static void pet_filter_update(long long id, bool add);
+static char* document_key(const struct db_storage* layout, const char* collection_name, const char* id);
+static char* format_document_get(const struct db_storage* layout, const char* collection_name, const char* id, size_t* len);
+static bool append_document_get(redisContext* context, const struct db_storage* layout, const char* collection_name, const char* id);
+static bool append_document_set(const struct db_storage* layout, const char* collection_name, const char* id, const char* data, size_t len);
+static bool append_document_del(const struct db_storage* layout, const char* collection_name, const char* id);
 
 /**
  * @brief Helper function to free redisReply and log error
@@ -66,638 +219,3696 @@ void parseRedisURI(const char* redisURI, char* host, int* port, char* password)
 }
 
 /**
- * @brief Initialize the database connection
+ * @brief Open and authenticate a new connection to Redis
  *
- * @param redisURI The Redis URI string
- * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ * @param redisURI The Redis URI string (redis://[:password@]host[:port] or unix:///path)
+ * @return redisContext* The connection, or NULL on failure
  */
-int db_init(const char* redisURI) {
+static redisContext* db_connect(const char* redisURI) {
     char host[128] = { 0 };
     int port = 6379;
     char password[128] = { 0 };
-    struct timeval timeout = { 1, REDIS_TIMEOUT };
+    redisContext* context = NULL;
 
-    parseRedisURI(redisURI, host, &port, password);
-
-    redis_context = redisConnectWithTimeout(host, port, timeout);
-    if (redis_context == NULL || redis_context->err) {
-        if (redis_context) {
-            LOG_ERROR("Connection error: %s", redis_context->errstr);
-            redisFree(redis_context);
+    if (strncmp(redisURI, "unix://", strlen("unix://")) == 0) {
+        // Unix domain socket: unix:///path/to/redis.sock
+        context = redisConnectUnixWithTimeout(redisURI + strlen("unix://"), connect_timeout);
+    }
+    else {
+        parseRedisURI(redisURI, host, &port, password);
+        context = redisConnectWithTimeout(host, port, connect_timeout);
+    }
+    if (context == NULL || context->err) {
+        if (context) {
+            LOG_ERROR("Connection error: %s", context->errstr);
+            redisFree(context);
         }
         else {
             LOG_ERROR("Connection error: can't allocate redis context");
         }
-        return EXIT_FAILURE;
+        return NULL;
+    }
+    // A command left unanswered fails the connection instead of blocking its thread
+    if ((command_timeout.tv_sec != 0 || command_timeout.tv_usec != 0) && redisSetTimeout(context, command_timeout) != REDIS_OK) {
+        LOG_ERROR("Failed to set the command timeout: %s", context->errstr);
+        redisFree(context);
+        return NULL;
     }
 
     if (strlen(password) > 0) {
-        redisReply* reply = redisCommand(redis_context, "AUTH %s", password);
-        if (reply->type == REDIS_REPLY_ERROR) {
+        redisReply* reply = redisCommand(context, "AUTH %s", password);
+        if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
             freeReplyAndLogError(reply, "Authentication failed");
-            redisFree(redis_context);
-            return EXIT_FAILURE;
+            redisFree(context);
+            return NULL;
         }
         LOG_INFO("Authentication successful\n");
         freeReplyObject(reply);
     }
-    return EXIT_SUCCESS;
+    return context;
 }
 
 /**
- * @brief Cleanup the database connection
+ * @brief Set the timeouts of the connections opened from now on
+ *
+ * @param connect_ms The connect timeout in milliseconds
+ * @param command_ms The time to wait for a reply in milliseconds, 0 to wait forever
  */
-void db_cleanup() {
-    if (redis_context) {
-        redisFree(redis_context);
-    }
+void db_set_timeouts(unsigned int connect_ms, unsigned int command_ms) {
+    connect_timeout.tv_sec = connect_ms / 1000;
+    connect_timeout.tv_usec = (suseconds_t)(connect_ms % 1000) * 1000;
+    command_timeout.tv_sec = command_ms / 1000;
+    command_timeout.tv_usec = (suseconds_t)(command_ms % 1000) * 1000;
+}
+
+// Destructor of connection_key, run when a thread that opened a connection exits
+static void connection_release(void* arg) {
+    redisFree(arg);
+}
+
+static void connection_key_create(void) {
+    pthread_key_create(&connection_key, connection_release);
 }
 
 /**
- * @brief Helper function to process redis replies
+ * @brief Initialize the database connection
  *
- * @param op_num The number of operations to process
- * @return true on success, false on failure
+ * @param redisURI The Redis URI string (redis://[:password@]host[:port] or unix:///path)
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
  */
-bool processRedisReplies(int op_num) {
-    redisReply* reply = NULL;
-    for (int i = 0; i < op_num; i++) {
-        int resultCode = redisGetReply(redis_context, (void**)&reply);
-        if (resultCode == REDIS_OK) {
-            LOG_INFO("Response [%d]: %s", i, reply->str ? reply->str : "(nil)");
-            freeReplyObject(reply);
-        }
-        else {
-            freeReplyAndLogError(reply, "Error processing redis reply");
-            return false;
-        }
+int db_init(const char* redisURI) {
+    redis_context = db_connect(redisURI);
+    if (redis_context == NULL) {
+        return EXIT_FAILURE;
     }
-    return true;
+    pthread_once(&connection_key_once, connection_key_create);
+    pthread_setspecific(connection_key, redis_context);
+    // Never opens until db_health_init sets a threshold
+    circuit_breaker_init(&redis_breaker, 0, 0, 0);
+
+    // Keep the URI for connections opened by background tasks
+    free(redis_uri);
+    redis_uri = strdup(redisURI);
+    return EXIT_SUCCESS;
+}
+
+// Helper function to fold the duration of a round trip into a moving average latency
+static void record_latency(_Atomic unsigned int* latency, const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long sample = (long long)(end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000;
+    long long average = atomic_load_explicit(latency, memory_order_relaxed);
+    average += (sample - average) / LATENCY_EWMA_WEIGHT;
+    // Concurrent updates may overwrite each other, which only drops samples
+    atomic_store_explicit(latency, average < 0 ? 0 : average > UINT32_MAX ? UINT32_MAX : (unsigned int)average, memory_order_relaxed);
+}
+
+// Helper function to check a connection with a PING
+static bool db_ping(redisContext* context, _Atomic unsigned int* latency) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    redisReply* reply = redisCommand(context, "PING");
+    record_latency(latency, &start);
+    // Errors such as LOADING mean Redis cannot serve yet
+    bool healthy = reply != NULL && reply->type != REDIS_REPLY_ERROR;
+    if (reply) {
+        freeReplyObject(reply);
+    }
+    return healthy;
+}
+
+// Helper function to close the connection of the calling thread after a failure
+static void thread_connection_failed(void) {
+    circuit_breaker_record(&redis_breaker, false);
+    pthread_setspecific(connection_key, NULL);
+    redisFree(redis_context);
+    redis_context = NULL;
 }
 
 /**
- * @brief Insert a pet document into the database
+ * @brief Open the connection of the calling thread if it has none or if it failed
  *
- * @param collection_name The name of the collection
- * @param doc The JSON document to insert
- * @return true on success, false on failure
+ * Fails fast while the circuit breaker is open. The probe of a half-open breaker checks the
+ * connection with a PING.
+ *
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
  */
-bool db_pet_insert(const char* collection_name, const cJSON* doc) {
-    int op_num = 0;
-
-    cJSON* id_obj = cJSON_GetObjectItem(doc, "id");
-    if (id_obj == NULL) {
-        LOG_ERROR("Document does not contain an id");
-        return false;
+int db_thread_attach() {
+    db_thread_report();
+    bool probe = false;
+    if (!circuit_breaker_allow(&redis_breaker, &probe)) {
+        return EXIT_FAILURE;
     }
-    int id = id_obj->valueint;
-
-    cJSON* status_obj = cJSON_GetObjectItem(doc, "status");
-    if (status_obj == NULL) {
-        LOG_ERROR("Document does not contain a status");
-        return false;
+    if (redis_context != NULL && !probe) {
+        return EXIT_SUCCESS;
     }
 
-    LOG_INFO("SADD %s:%s:%s %d", collection_name, "status", status_obj->valuestring, id);
-    redisAppendCommand(redis_context, "SADD %s:%s:%s %d", collection_name, "status", status_obj->valuestring, id);
-    op_num++;
-
-    cJSON* tags_obj = cJSON_GetObjectItem(doc, "tags");
-    if (!store_tags(collection_name, tags_obj, id, &op_num)) {
-        return false;
+    if (redis_context == NULL && redis_uri != NULL) {
+        pthread_once(&connection_key_once, connection_key_create);
+        redis_context = db_connect(redis_uri);
+        if (redis_context != NULL) {
+            pthread_setspecific(connection_key, redis_context);
+        }
     }
-
-    char* key = malloc(strlen(collection_name) + 20);
-    if (key == NULL) {
-        LOG_ERROR("Memory allocation failed for key");
-        return false;
+    if (redis_context == NULL) {
+        circuit_breaker_record(&redis_breaker, false);
+        return EXIT_FAILURE;
     }
-
-    sprintf(key, "%s:%s", collection_name, collection_name);
-    LOG_INFO("SADD %s %d", key, id_obj->valueint);
-    redisAppendCommand(redis_context, "SADD %s %d", key, id_obj->valueint);
-    op_num++;
-    free(key);
-
-    if (!store_document(collection_name, doc, id)) {
-        return false;
+    if (probe && !db_ping(redis_context, &latency_us)) {
+        thread_connection_failed();
+        return EXIT_FAILURE;
     }
-    op_num++;
-
-    return processRedisReplies(op_num);
+    // A new connection or a successful probe: Redis is back
+    circuit_breaker_record(&redis_breaker, true);
+    return EXIT_SUCCESS;
 }
 
 /**
- * @brief Update a pet document in the database
+ * @brief Close the connection of the calling thread if a command failed on it
  *
- * @param collection_name The name of the collection
- * @param update The JSON document to update
- * @return true on success, false on failure
+ * Timeouts and I/O errors leave the connection unusable: it is closed and the failure
+ * counts towards opening the circuit breaker.
  */
-bool db_pet_update(const char* collection_name, const cJSON* update) {
-    cJSON* id_obj = cJSON_GetObjectItem(update, "id");
-    if (id_obj == NULL) {
-        LOG_ERROR("Update document does not contain an id");
-        return false;
+void db_thread_report() {
+    if (redis_context != NULL && redis_context->err != 0) {
+        LOG_ERROR("Redis connection failed: %s", redis_context->errstr);
+        thread_connection_failed();
     }
-    char id[20];
-	//convert int to string
-	sprintf(id, "%d", id_obj->valueint);
-
-    if (!db_pet_delete(collection_name, id)) {
-        LOG_ERROR("Failed to delete document before updating");
-        return false;
+    // The reads of the next request are routed again
+    if (read_context != NULL && read_context->err != 0) {
+        LOG_ERROR("Redis replica connection failed: %s", read_context->errstr);
+        circuit_breaker_record(&read_replica->breaker, false);
+        replica_contexts[read_replica - replicas] = NULL;
+        redisFree(read_context);
     }
-
-    if (!db_pet_insert(collection_name, update)) {
-        LOG_ERROR("Failed to insert updated document");
-        return false;
+    read_replica = NULL;
+    read_context = NULL;
+    // A failed shard connection is opened again by the next request that needs it
+    for (size_t i = 1; shard_contexts != NULL && i < shard_count; i++) {
+        if (shard_contexts[i] != NULL && shard_contexts[i]->err != 0) {
+            LOG_ERROR("Redis shard connection failed: %s", shard_contexts[i]->errstr);
+            circuit_breaker_record(&shards[i].breaker, false);
+            redisFree(shard_contexts[i]);
+            shard_contexts[i] = NULL;
+        }
     }
-    return true;
 }
 
 /**
- * @brief Insert a user document into the database
+ * @brief Helper function to PING a Redis server on the connection of the health checks
  *
- * @param collection_name The name of the collection
- * @param doc The JSON document to insert
- * @return true on success, false on failure
+ * While the circuit breaker of the server is open, the check is also the probe that closes it.
+ *
+ * @param breaker The circuit breaker of the server
+ * @param uri The URI of the server
+ * @param latency The moving average latency of the server
+ * @param context The health check connection, opened again after a failure
  */
-bool db_user_insert(const char* collection_name, const cJSON* doc) {
-    int op_num = 0;
-
-    cJSON* id_obj = cJSON_GetObjectItem(doc, "id");
-    if (id_obj == NULL) {
-        LOG_ERROR("Document does not contain an id");
-        return false;
+static void health_check(struct circuit_breaker* breaker, const char* uri, _Atomic unsigned int* latency, redisContext** context) {
+    bool probe = false;
+    if (circuit_breaker_retry_after_ms(breaker) > 0 || !circuit_breaker_allow(breaker, &probe)) {
+        return;
     }
-
-    char* json_str = cJSON_PrintUnformatted(doc);
-    if (json_str == NULL) {
-        LOG_ERROR("Failed to print JSON document");
-        return false;
+    if (*context == NULL) {
+        *context = db_connect(uri);
     }
-
-    char* key = malloc(strlen(collection_name) + 20);
-    if (key == NULL) {
-        LOG_ERROR("Memory allocation failed for key");
-        free(json_str);
-        return false;
+    bool healthy = *context != NULL && db_ping(*context, latency);
+    if (!healthy && *context != NULL) {
+        redisFree(*context);
+        *context = NULL;
     }
-    sprintf(key, "%s:%d", collection_name, id_obj->valueint);
-    LOG_INFO("SET %s %s", key, json_str);
-    redisAppendCommand(redis_context, "SET %s %s", key, json_str);
-    op_num++;
-
-    memset(key, 0, strlen(collection_name) + 20);
-    sprintf(key, "%s:%s", collection_name, collection_name);
-    LOG_INFO("SADD %s %d", key, id_obj->valueint);
-    redisAppendCommand(redis_context, "SADD %s %d", key, id_obj->valueint);
-    op_num++;
-
-    cJSON* username_obj = cJSON_GetObjectItem(doc, "username");
-    if (username_obj == NULL) {
-        LOG_ERROR("Document does not contain a username");
-        free(json_str);
-        return false;
+    // Successes only matter to a probe: the failures counted are consecutive ones
+    if (probe || !healthy) {
+        circuit_breaker_record(breaker, healthy);
     }
-
-    memset(key, 0, strlen(collection_name) + 20);
-    sprintf(key, "%s:%s:%s", collection_name, "username", username_obj->valuestring);
-    LOG_INFO("SADD %s %d", key, id_obj->valueint);
-    redisAppendCommand(redis_context, "SADD %s %d", key, id_obj->valueint);
-    op_num++;
-
-    free(key);
-    free(json_str);
-
-    return processRedisReplies(op_num);
 }
 
 /**
- * @brief Update a user document in the database
- *
- * @param collection_name The name of the collection
- * @param update The JSON document to update
- * @return true on success, false on failure
+ * @brief Background task checking Redis, its replicas and its shards with a PING on connections of their own
  */
-bool db_user_update(const char* collection_name, const cJSON* update) {
-    cJSON* id_obj = cJSON_GetObjectItem(update, "id");
-    if (id_obj == NULL) {
-        LOG_ERROR("Update document does not contain an id");
-        return false;
+static void* health_main(void* arg) {
+    (void)arg; // Mark unused parameter
+    redisContext* context = NULL;
+    // The replicas are checked as well, which keeps their latency current while they are not picked
+    redisContext** replica_checks = calloc(replica_count > 0 ? replica_count : 1, sizeof(*replica_checks));
+    redisContext** shard_checks = calloc(shard_count > 0 ? shard_count : 1, sizeof(*shard_checks));
+    if (replica_checks == NULL || shard_checks == NULL) {
+        LOG_ERROR("Memory allocation failed for the health checks");
+        free(replica_checks);
+        free(shard_checks);
+        return NULL;
     }
 
-    char id[20];
-    // Convert int to string
-    sprintf(id, "%d", id_obj->valueint);
-
-    if (!db_user_delete(collection_name, id)) {
-        LOG_ERROR("Failed to delete document before updating");
-        return false;
+    while (health_running) {
+        for (unsigned int slept = 0; health_running && slept < health_interval_ms; slept += HEALTH_CHECK_SLICE_MS) {
+            unsigned int step = health_interval_ms - slept < HEALTH_CHECK_SLICE_MS ? health_interval_ms - slept : HEALTH_CHECK_SLICE_MS;
+            usleep(step * 1000);
+        }
+        if (!health_running) {
+            break;
+        }
+        health_check(&redis_breaker, redis_uri, &latency_us, &context);
+        for (size_t i = 0; i < replica_count; i++) {
+            health_check(&replicas[i].breaker, replicas[i].uri, &replicas[i].latency_us, &replica_checks[i]);
+        }
+        for (size_t i = 1; i < shard_count; i++) {
+            health_check(&shards[i].breaker, shards[i].uri, &shards[i].latency_us, &shard_checks[i]);
+        }
     }
 
-    if (!db_user_insert(collection_name, update)) {
-        LOG_ERROR("Failed to insert updated document");
-        return false;
+    if (context) {
+        redisFree(context);
     }
-    return true;
+    for (size_t i = 0; i < replica_count; i++) {
+        if (replica_checks[i]) {
+            redisFree(replica_checks[i]);
+        }
+    }
+    free(replica_checks);
+    for (size_t i = 1; i < shard_count; i++) {
+        if (shard_checks[i]) {
+            redisFree(shard_checks[i]);
+        }
+    }
+    free(shard_checks);
+    return NULL;
 }
 
 /**
- * @brief Delete a user document from the database
+ * @brief Enable the circuit breaker and the health checks of Redis
  *
- * @param collection_name The name of the collection
- * @param id The id of the document to delete
- * @return true on success, false on failure
+ * @param check_interval_ms The interval between two PINGs, 0 for no health checks
+ * @param failure_threshold The consecutive connection failures that open the breaker, 0 never to open it
+ * @param open_ms The time the breaker stays open before a probe
+ * @param max_open_ms The longest open period, reached by doubling after failed probes
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
  */
-bool db_user_delete(const char* collection_name, const char* id) {
-    int op_num = 0;
-    cJSON* doc = db_find_one(collection_name, id);
-    if (doc == NULL) {
-        LOG_ERROR("Document not found");
-        return false;
-    }
-
-    cJSON* id_obj = cJSON_GetObjectItem(doc, "id");
-    if (id_obj == NULL) {
-        LOG_ERROR("Document does not contain an id");
-        return false;
+int db_health_init(unsigned int check_interval_ms, unsigned int failure_threshold, unsigned int open_ms, unsigned int max_open_ms) {
+    if (redis_uri == NULL) {
+        return EXIT_FAILURE;
     }
-    int doc_id = id_obj->valueint;
-    cJSON* field_obj = cJSON_GetObjectItem(doc, "username");
-
-    char* field_id = malloc(strlen(collection_name) + 20);
-    if (field_id == NULL) {
-        LOG_ERROR("Memory allocation failed for key");
-        return false;
+    circuit_breaker_destroy(&redis_breaker);
+    circuit_breaker_init(&redis_breaker, failure_threshold, open_ms, max_open_ms);
+    for (size_t i = 0; i < replica_count; i++) {
+        circuit_breaker_destroy(&replicas[i].breaker);
+        circuit_breaker_init(&replicas[i].breaker, failure_threshold, open_ms, max_open_ms);
     }
-    sprintf(field_id, "%s:%s", collection_name, "username");
-    if (!remove_document_from_field(field_id, field_obj, doc_id, &op_num)) {
-        free(field_id);
-        return false;
+    for (size_t i = 1; i < shard_count; i++) {
+        circuit_breaker_destroy(&shards[i].breaker);
+        circuit_breaker_init(&shards[i].breaker, failure_threshold, open_ms, max_open_ms);
     }
 
-    if (!remove_document_from_collection(collection_name, doc_id, &op_num)) {
-        free(field_id);
-        return false;
+    health_interval_ms = check_interval_ms;
+    if (check_interval_ms > 0) {
+        health_running = 1;
+        if (pthread_create(&health_thread, NULL, health_main, NULL) != 0) {
+            LOG_ERROR("Failed to start the Redis health check thread");
+            health_running = 0;
+            return EXIT_FAILURE;
+        }
     }
+    LOG_INFO("Redis circuit breaker: open after %u failures for %u to %u ms, health check every %u ms",
+        failure_threshold, open_ms, max_open_ms, check_interval_ms);
+    return EXIT_SUCCESS;
+}
 
-    free(field_id);
+/**
+ * @brief Set the average latency above which Redis counts as degraded
+ *
+ * @param threshold_ms The threshold in milliseconds, 0 for latency never to count
+ */
+void db_set_slow_threshold(unsigned int threshold_ms) {
+    slow_threshold_us = threshold_ms * 1000;
+}
 
-    return processRedisReplies(op_num);
+/**
+ * @brief Check whether Redis is unreachable or slow
+ *
+ * @return true while the circuit breaker is not closed or the average latency is above the threshold
+ */
+bool db_degraded() {
+    return !circuit_breaker_closed(&redis_breaker) ||
+        (slow_threshold_us > 0 && atomic_load_explicit(&latency_us, memory_order_relaxed) > slow_threshold_us);
 }
 
 /**
- * @brief Delete a pet document from the database
+ * @brief Get the time before requests may reach Redis again
  *
- * @param collection_name The name of the collection
- * @param id The id of the document to delete
- * @return true on success, false on failure
+ * @return unsigned int The time in seconds, rounded up, 0 when the circuit breaker is closed
  */
-bool db_pet_delete(const char* collection_name, const char* id) {
-    int op_num = 0;
-    cJSON* doc = db_find_one(collection_name, id);
-    if (doc == NULL) {
-        LOG_ERROR("Document not found");
-        return false;
-    }
+unsigned int db_retry_after_sec() {
+    unsigned int retry_after_ms = circuit_breaker_retry_after_ms(&redis_breaker);
+    return (retry_after_ms + 999) / 1000;
+}
 
-    cJSON* id_obj = cJSON_GetObjectItem(doc, "id");
-    if (id_obj == NULL) {
-        LOG_ERROR("Document does not contain an id");
-        return false;
+/**
+ * @brief Get the metrics of the Redis connections
+ *
+ * @return cJSON* A JSON object with the circuit breaker state and counters
+ */
+cJSON* db_connection_stats() {
+    struct circuit_breaker_stats breaker;
+    circuit_breaker_get_stats(&redis_breaker, &breaker);
+    cJSON* stats = cJSON_CreateObject();
+    cJSON_AddStringToObject(stats, "breaker", circuit_breaker_state_name(breaker.state));
+    cJSON_AddNumberToObject(stats, "consecutiveFailures", (double)breaker.consecutive_failures);
+    cJSON_AddNumberToObject(stats, "failures", (double)breaker.failures);
+    cJSON_AddNumberToObject(stats, "trips", (double)breaker.trips);
+    cJSON_AddNumberToObject(stats, "rejected", (double)breaker.rejected);
+    cJSON_AddNumberToObject(stats, "nextOpenMs", (double)breaker.open_ms);
+    cJSON_AddNumberToObject(stats, "retryAfterMs", (double)breaker.retry_after_ms);
+    cJSON_AddNumberToObject(stats, "healthCheckMs", (double)health_interval_ms);
+    cJSON_AddNumberToObject(stats, "latencyUs", (double)atomic_load_explicit(&latency_us, memory_order_relaxed));
+    cJSON_AddBoolToObject(stats, "degraded", db_degraded());
+    if (replica_count > 0) {
+        cJSON* list = cJSON_AddArrayToObject(stats, "replicas");
+        for (size_t i = 0; i < replica_count; i++) {
+            circuit_breaker_get_stats(&replicas[i].breaker, &breaker);
+            cJSON* replica = cJSON_CreateObject();
+            cJSON_AddStringToObject(replica, "breaker", circuit_breaker_state_name(breaker.state));
+            cJSON_AddNumberToObject(replica, "failures", (double)breaker.failures);
+            cJSON_AddNumberToObject(replica, "latencyUs", (double)atomic_load_explicit(&replicas[i].latency_us, memory_order_relaxed));
+            cJSON_AddNumberToObject(replica, "requests", (double)atomic_load_explicit(&replicas[i].requests, memory_order_relaxed));
+            cJSON_AddItemToArray(list, replica);
+        }
     }
-    int doc_id = id_obj->valueint;
-    cJSON* status_obj = cJSON_GetObjectItem(doc, "status");
-
-    if (!remove_document_from_field(collection_name, status_obj, doc_id, &op_num)) {
-        return false;
+    if (shard_count > 0) {
+        cJSON* list = cJSON_AddArrayToObject(stats, "shards");
+        for (size_t i = 0; i < shard_count; i++) {
+            circuit_breaker_get_stats(i == 0 ? &redis_breaker : &shards[i].breaker, &breaker);
+            cJSON* shard = cJSON_CreateObject();
+            cJSON_AddStringToObject(shard, "node", shard_ring_node_id(shards[i].uri));
+            cJSON_AddStringToObject(shard, "breaker", circuit_breaker_state_name(breaker.state));
+            cJSON_AddNumberToObject(shard, "failures", (double)breaker.failures);
+            cJSON_AddNumberToObject(shard, "latencyUs",
+                (double)atomic_load_explicit(i == 0 ? &latency_us : &shards[i].latency_us, memory_order_relaxed));
+            cJSON_AddItemToArray(list, shard);
+        }
     }
+    return stats;
+}
 
-    if (!remove_document_from_tags(collection_name, doc, doc_id, &op_num)) {
-        return false;
+// auto_pipeline_reconnect_fn: reopens the shared connection unless the circuit breaker is open
+static redisContext* pipeline_reconnect(redisContext* broken) {
+    if (broken != NULL) {
+        circuit_breaker_record(&redis_breaker, false);
+        redisFree(broken);
     }
-
-    if (!remove_document_from_collection(collection_name, doc_id, &op_num)) {
-        return false;
+    bool probe = false;
+    if (!circuit_breaker_allow(&redis_breaker, &probe)) {
+        return NULL;
     }
-
-    return processRedisReplies(op_num);
+    redisContext* context = db_connect(redis_uri);
+    circuit_breaker_record(&redis_breaker, context != NULL);
+    return context;
 }
 
 /**
- * @brief Helper function to store tags in the database
+ * @brief Send the reads of single documents through a connection shared by all the threads
  *
- * @param collection_name The name of the collection
- * @param tags_obj The JSON object containing tags
- * @param id The id of the document
- * @param num_op The number of operations
- * @return true on success, false on failure
+ * @param max_window_us The longest time a batch waits for concurrent requests
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
  */
-bool store_tags(const char* collection_name, const cJSON* tags_obj, int id, int* num_op) {
-   
-    if (tags_obj != NULL && cJSON_IsArray(tags_obj)) {
-    
-        int array_size = cJSON_GetArraySize(tags_obj);
-        for (int i = 0; i < array_size; i++) {
-            cJSON* tag = cJSON_GetArrayItem(tags_obj, i);
-            cJSON* name_obj = cJSON_GetObjectItem(tag, "name");
-            if (name_obj == NULL) {
-                LOG_ERROR("Category does not contain a name");
-                return false;
-            }
-            char* name = cJSON_GetStringValue(name_obj);
-            if (name != NULL) {
-                LOG_INFO("SADD %s:%s:%s %d", collection_name, "tags", name, id);
-                redisAppendCommand(redis_context, "SADD %s:%s:%s %d", collection_name, "tags", name, id);
-                (*num_op)++;
-            }
-        }
+int db_auto_pipeline_init(unsigned int max_window_us) {
+    if (redis_uri == NULL) {
+        return EXIT_FAILURE;
     }
-    return true;
+    if (shard_count > 0) {
+        LOG_ERROR("The auto-pipeline is not supported with sharding");
+        return EXIT_FAILURE;
+    }
+    redisContext* context = db_connect(redis_uri);
+    if (context == NULL) {
+        return EXIT_FAILURE;
+    }
+    return auto_pipeline_init(context, max_window_us, pipeline_reconnect);
 }
 
-/**
- * @brief Helper function to remove document from tags in the database
- *
- * @param collection_name The name of the collection
- * @param doc The JSON document
- * @param id The id of the document
- * @param op_number The number of operations
- * @return true on success, false on failure
- */
-bool remove_document_from_tags(const char* collection_name, const cJSON* doc, int id, int* op_number) {
-  
-    cJSON* tags_obj = cJSON_GetObjectItem(doc, "tags");
-    
-    if (tags_obj != NULL && cJSON_IsArray(tags_obj)) {
-        int array_size = cJSON_GetArraySize(tags_obj);
-        for (int i = 0; i < array_size; i++) {
-            cJSON* tag = cJSON_GetArrayItem(tags_obj, i);
-            cJSON* name_obj = cJSON_GetObjectItem(tag, "name");
-            if (name_obj == NULL) {
-                LOG_ERROR("Category does not contain a name");
-                return false;
-            }
-            char* name = cJSON_GetStringValue(name_obj);
-            if (name != NULL) {
-                char* key = malloc(strlen(collection_name) + strlen(name) + 2);
-                if (key == NULL) {
-                    LOG_ERROR("Memory allocation failed for key");
-                    return false;
-                }
-                sprintf(key, "%s:%s", collection_name, name);
-                LOG_INFO("SREM %s %d", key, id);
-                redisAppendCommand(redis_context, "SREM %s %d", key, id);
-                (*op_number)++;
-                free(key);
-            }
+// Destructor of replica_key, run when a thread that read from the replicas exits
+static void replica_connections_release(void* arg) {
+    redisContext** contexts = arg;
+    for (size_t i = 0; i < replica_count; i++) {
+        if (contexts[i]) {
+            redisFree(contexts[i]);
         }
     }
-    return true;
+    free(contexts);
 }
 
 /**
- * @brief Find a single document in the database
+ * @brief Add read replicas, sharing the reads of the GET requests
  *
- * @param collection_name The name of the collection
- * @param id The id of the document to find
- * @return cJSON* The JSON document found, or NULL on failure
+ * @param uris The comma separated URIs of the replicas
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int db_replicas_init(const char* uris) {
+    if (replica_count > 0 || health_running) {
+        LOG_ERROR("Replicas must be added once, before the health checks start");
+        return EXIT_FAILURE;
+    }
+    if (shard_count > 0) {
+        LOG_ERROR("Read replicas are not supported with sharding");
+        return EXIT_FAILURE;
+    }
+    size_t count = 1;
+    for (const char* c = uris; *c; c++) {
+        count += *c == ',';
+    }
+    char* list = strdup(uris);
+    replicas = calloc(count, sizeof(*replicas));
+    if (list == NULL || replicas == NULL || pthread_key_create(&replica_key, replica_connections_release) != 0) {
+        LOG_ERROR("Failed to set up the read replicas");
+        free(list);
+        free(replicas);
+        replicas = NULL;
+        return EXIT_FAILURE;
+    }
+    char* saveptr = NULL;
+    for (char* uri = strtok_r(list, ",", &saveptr); uri != NULL; uri = strtok_r(NULL, ",", &saveptr)) {
+        struct replica* replica = &replicas[replica_count];
+        replica->uri = strdup(uri);
+        if (replica->uri == NULL) {
+            continue;
+        }
+        // Never opens until db_health_init sets a threshold, as the breaker of the primary
+        circuit_breaker_init(&replica->breaker, 0, 0, 0);
+        atomic_init(&replica->latency_us, 0);
+        atomic_init(&replica->requests, 0);
+        replica_count++;
+    }
+    free(list);
+    LOG_INFO("Reads of GET requests shared by %zu replicas", replica_count);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Helper function to get the connection of the calling thread to a replica
+ *
+ * @param index The index of the replica
+ * @return redisContext* The connection, or NULL if the replica is down
+ */
+static redisContext* replica_attach(size_t index) {
+    struct replica* replica = &replicas[index];
+    bool probe = false;
+    if (!circuit_breaker_allow(&replica->breaker, &probe)) {
+        return NULL;
+    }
+    redisContext* context = replica_contexts[index];
+    if (context != NULL && !probe) {
+        return context;
+    }
+    if (context == NULL) {
+        context = db_connect(replica->uri);
+    }
+    if (context != NULL && probe && !db_ping(context, &replica->latency_us)) {
+        redisFree(context);
+        context = NULL;
+    }
+    replica_contexts[index] = context;
+    circuit_breaker_record(&replica->breaker, context != NULL);
+    return context;
+}
+
+// Helper function to read the moving average latency of a replica
+static unsigned int replica_latency(size_t index) {
+    return atomic_load_explicit(&replicas[index].latency_us, memory_order_relaxed);
+}
+
+/**
+ * @brief Route the reads of the calling thread, until its next db_thread_report
+ *
+ * Two replicas are drawn at random and the one with the lower average latency is used, or
+ * the other one if it is down. The primary serves the reads when both are down.
+ *
+ * @param replica Whether the reads may go to a replica
+ */
+void db_route_reads(bool replica) {
+    read_replica = NULL;
+    read_context = NULL;
+    if (!replica || replica_count == 0) {
+        return;
+    }
+    if (replica_contexts == NULL) {
+        replica_contexts = calloc(replica_count, sizeof(*replica_contexts));
+        if (replica_contexts == NULL) {
+            return;
+        }
+        pthread_setspecific(replica_key, replica_contexts);
+    }
+    if (replica_seed == 0) {
+        replica_seed = (unsigned int)(uintptr_t)&replica_seed ^ (unsigned int)time(NULL);
+    }
+
+    size_t first = (size_t)rand_r(&replica_seed) % replica_count;
+    size_t second = first;
+    if (replica_count > 1) {
+        second = (first + 1 + (size_t)rand_r(&replica_seed) % (replica_count - 1)) % replica_count;
+        if (replica_latency(second) < replica_latency(first)) {
+            size_t faster = second;
+            second = first;
+            first = faster;
+        }
+    }
+    redisContext* context = replica_attach(first);
+    if (context == NULL && second != first) {
+        first = second;
+        context = replica_attach(first);
+    }
+    if (context != NULL) {
+        read_replica = &replicas[first];
+        read_context = context;
+        atomic_fetch_add_explicit(&read_replica->requests, 1, memory_order_relaxed);
+    }
+}
+
+// Helper function to get the connection of the reads of the calling thread
+static redisContext* read_connection(void) {
+    return read_context != NULL ? read_context : redis_context;
+}
+
+// Destructor of hedge_key, run when a thread that hedged reads exits
+static void hedge_connections_release(void* arg) {
+    redisContext** contexts = arg;
+    for (size_t i = 0; i <= replica_count; i++) {
+        if (contexts[i]) {
+            redisFree(contexts[i]);
+        }
+    }
+    free(contexts);
+}
+
+/**
+ * @brief Hedge the reads of documents by id that are slower than most
+ *
+ * Must be called after db_replicas_init.
+ *
+ * @param percentile The percentile of the read latencies after which a read is hedged
+ * @param min_delay_us The shortest hedge delay
+ * @param max_percent The most reads hedged, in percent of all the reads
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int db_hedged_reads_init(unsigned int percentile, unsigned int min_delay_us, unsigned int max_percent) {
+    if (shard_count > 0) {
+        LOG_ERROR("Hedged reads are not supported with sharding");
+        return EXIT_FAILURE;
+    }
+    if (pthread_key_create(&hedge_key, hedge_connections_release) != 0) {
+        LOG_ERROR("Failed to set up the hedged reads");
+        return EXIT_FAILURE;
+    }
+    return hedged_read_init(percentile, min_delay_us, max_percent);
+}
+
+// Destructor of shard_key, run when a thread that used the shards exits
+static void shard_connections_release(void* arg) {
+    redisContext** contexts = arg;
+    for (size_t i = 1; i < shard_count; i++) {
+        if (contexts[i]) {
+            redisFree(contexts[i]);
+        }
+    }
+    free(contexts);
+}
+
+// Helper function to forget the shards
+static void shards_free(void) {
+    for (size_t i = 0; i < shard_count; i++) {
+        circuit_breaker_destroy(&shards[i].breaker);
+        free(shards[i].uri);
+    }
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+    shard_ring_free(shard_ring);
+    shard_ring = NULL;
+}
+
+/**
+ * @brief Spread the documents over several Redis servers by consistent hashing of their ids
+ *
+ * @param uris The comma separated URIs of the other shards, the server of db_init being the first
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int db_shards_init(const char* uris) {
+    if (redis_uri == NULL || shard_count > 0 || replica_count > 0 || health_running) {
+        LOG_ERROR("Shards must be added once, after db_init and before the replicas and the health checks");
+        return EXIT_FAILURE;
+    }
+    size_t count = 2;
+    for (const char* c = uris; *c; c++) {
+        count += *c == ',';
+    }
+    char* list = strdup(uris);
+    shards = calloc(count, sizeof(*shards));
+    const char** ring_uris = calloc(count, sizeof(*ring_uris));
+    if (list == NULL || shards == NULL || ring_uris == NULL || pthread_key_create(&shard_key, shard_connections_release) != 0) {
+        LOG_ERROR("Failed to set up the shards");
+        free(list);
+        free(shards);
+        shards = NULL;
+        free(ring_uris);
+        return EXIT_FAILURE;
+    }
+    char* saveptr = NULL;
+    char* uri = redis_uri;
+    while (uri != NULL) {
+        struct shard* shard = &shards[shard_count];
+        shard->uri = strdup(uri);
+        if (shard->uri != NULL) {
+            // Never opens until db_health_init sets a threshold, as the breaker of the primary
+            circuit_breaker_init(&shard->breaker, 0, 0, 0);
+            atomic_init(&shard->latency_us, 0);
+            ring_uris[shard_count++] = shard->uri;
+        }
+        uri = strtok_r(uri == redis_uri ? list : NULL, ",", &saveptr);
+    }
+    free(list);
+    shard_ring = shard_count > 1 ? shard_ring_create(ring_uris, shard_count) : NULL;
+    free(ring_uris);
+    if (shard_ring == NULL) {
+        LOG_ERROR("Failed to build the shard ring");
+        shards_free();
+        return EXIT_FAILURE;
+    }
+    LOG_INFO("Documents sharded over %zu Redis servers", shard_count);
+    return EXIT_SUCCESS;
+}
+
+// Helper function to find the shard of a document, 0 when the documents are not sharded
+static size_t shard_of(const char* id) {
+    return shard_ring != NULL ? shard_ring_locate(shard_ring, id, strlen(id)) : 0;
+}
+
+static size_t shard_of_id(long long id) {
+    if (shard_ring == NULL) {
+        return 0;
+    }
+    char key[24];
+    sprintf(key, "%lld", id);
+    return shard_of(key);
+}
+
+/**
+ * @brief Helper function to get the connection of the calling thread to a shard
+ *
+ * The first shard is the server of db_init, reached through the connection of
+ * db_thread_attach. The connections to the others are opened on first use.
+ *
+ * @param shard The index of the shard
+ * @return redisContext* The connection, or NULL if the shard is down
+ */
+static redisContext* shard_connection(size_t shard) {
+    if (shard == 0) {
+        // Even while redis_context points to another shard
+        return pthread_getspecific(connection_key);
+    }
+    if (shard_contexts == NULL) {
+        shard_contexts = calloc(shard_count, sizeof(*shard_contexts));
+        if (shard_contexts == NULL) {
+            return NULL;
+        }
+        pthread_setspecific(shard_key, shard_contexts);
+    }
+    struct shard* node = &shards[shard];
+    bool probe = false;
+    if (!circuit_breaker_allow(&node->breaker, &probe)) {
+        return NULL;
+    }
+    redisContext* context = shard_contexts[shard];
+    if (context != NULL && !probe) {
+        return context;
+    }
+    if (context == NULL) {
+        context = db_connect(node->uri);
+    }
+    if (context != NULL && probe && !db_ping(context, &node->latency_us)) {
+        redisFree(context);
+        context = NULL;
+    }
+    shard_contexts[shard] = context;
+    circuit_breaker_record(&node->breaker, context != NULL);
+    return context;
+}
+
+/**
+ * @brief Helper function to point redis_context at the connection to a shard
+ *
+ * The write helpers queue their commands on redis_context: a document, its version and its
+ * index entries all go to the shard of its id. Nothing changes when the documents are not
+ * sharded. The connection replaced is restored by shard_leave.
+ *
+ * @param shard The index of the shard
+ * @param previous Set to the connection to restore
+ * @return true on success, false if the shard is down
+ */
+static bool shard_enter(size_t shard, redisContext** previous) {
+    *previous = redis_context;
+    if (shard_ring == NULL) {
+        return true;
+    }
+    redisContext* context = shard_connection(shard);
+    if (context == NULL) {
+        LOG_ERROR("Shard %s is unavailable", shard_ring_node_id(shards[shard].uri));
+        return false;
+    }
+    redis_context = context;
+    return true;
+}
+
+static void shard_leave(redisContext* previous) {
+    redis_context = previous;
+}
+
+// Helper function to send the commands queued on a connection without waiting for their replies
+static void flush_commands(redisContext* context) {
+    int done = 0;
+    while (!done && redisBufferWrite(context, &done) == REDIS_OK) {
+    }
+}
+
+// Helper function to read and drop the replies pending on a connection, to keep it in step
+static void discard_replies(redisContext* context, int count) {
+    for (int i = 0; i < count && context->err == 0; i++) {
+        redisReply* reply = NULL;
+        if (redisGetReply(context, (void**)&reply) == REDIS_OK) {
+            freeReplyObject(reply);
+        }
+    }
+}
+
+/**
+ * Connections a read is scattered to, with the replies pending on each: one per shard, or
+ * the connection of the reads when the documents are not sharded.
+ */
+struct scatter {
+    redisContext** contexts;
+    int* ops;
+    size_t count;
+};
+
+static void scatter_end(struct scatter* scatter) {
+    // Replies left after a failure would be read by the next request
+    for (size_t i = 0; scatter->contexts != NULL && scatter->ops != NULL && i < scatter->count; i++) {
+        if (scatter->contexts[i] != NULL) {
+            discard_replies(scatter->contexts[i], scatter->ops[i]);
+        }
+    }
+    free(scatter->contexts);
+    free(scatter->ops);
+    scatter->contexts = NULL;
+    scatter->ops = NULL;
+}
+
+/**
+ * @brief Helper function to prepare the connections of a scattered read
+ *
+ * @param scatter The connections
+ * @param connect Whether every shard must be reached now; otherwise the connections are
+ *        opened with scatter_connection as they are needed
+ * @return true on success, false if a shard is down
+ */
+static bool scatter_begin(struct scatter* scatter, bool connect) {
+    scatter->count = shard_ring != NULL ? shard_count : 1;
+    scatter->contexts = calloc(scatter->count, sizeof(*scatter->contexts));
+    scatter->ops = calloc(scatter->count, sizeof(*scatter->ops));
+    bool success = scatter->contexts != NULL && scatter->ops != NULL;
+    if (!success) {
+        LOG_ERROR("Memory allocation failed for the shards");
+    }
+    for (size_t i = 0; success && connect && i < scatter->count; i++) {
+        scatter->contexts[i] = shard_ring != NULL ? shard_connection(i) : read_connection();
+        if (scatter->contexts[i] == NULL) {
+            LOG_ERROR("Shard %s is unavailable", shard_ring_node_id(shard_ring != NULL ? shards[i].uri : redis_uri));
+            success = false;
+        }
+    }
+    if (!success) {
+        scatter_end(scatter);
+    }
+    return success;
+}
+
+// Helper function to send the commands queued on every connection of a scattered read
+static void scatter_flush(struct scatter* scatter) {
+    for (size_t i = 0; i < scatter->count; i++) {
+        flush_commands(scatter->contexts[i]);
+    }
+}
+
+// Helper function to get the connection of a scattered read to a shard, NULL if it is down
+static redisContext* scatter_connection(struct scatter* scatter, size_t shard) {
+    if (scatter->contexts[shard] == NULL) {
+        scatter->contexts[shard] = shard_ring != NULL ? shard_connection(shard) : read_connection();
+    }
+    return scatter->contexts[shard];
+}
+
+/**
+ * @brief Cleanup the database connection
+ */
+void db_cleanup() {
+    if (pet_filter_running) {
+        pet_filter_running = 0;
+        pthread_join(pet_filter_thread, NULL);
+    }
+    id_filter_free(pet_filter);
+    pet_filter = NULL;
+    if (health_running) {
+        health_running = 0;
+        pthread_join(health_thread, NULL);
+    }
+
+    if (redis_context) {
+        pthread_setspecific(connection_key, NULL);
+        redisFree(redis_context);
+        redis_context = NULL;
+    }
+    auto_pipeline_cleanup();
+    circuit_breaker_destroy(&redis_breaker);
+    free(redis_uri);
+    redis_uri = NULL;
+
+    // The connections of the threads that read from the replicas are closed as they exit
+    if (replica_contexts != NULL) {
+        pthread_setspecific(replica_key, NULL);
+        replica_connections_release(replica_contexts);
+        replica_contexts = NULL;
+    }
+    if (hedge_contexts != NULL) {
+        pthread_setspecific(hedge_key, NULL);
+        hedge_connections_release(hedge_contexts);
+        hedge_contexts = NULL;
+    }
+    if (shard_contexts != NULL) {
+        pthread_setspecific(shard_key, NULL);
+        shard_connections_release(shard_contexts);
+        shard_contexts = NULL;
+    }
+    shards_free();
+    for (size_t i = 0; i < replica_count; i++) {
+        circuit_breaker_destroy(&replicas[i].breaker);
+        free(replicas[i].uri);
+    }
+    free(replicas);
+    replicas = NULL;
+    replica_count = 0;
+}
+
+/**
+ * @brief Helper function to format a command for run_commands
+ *
+ * @param len Set to the length of the command
+ * @return char* The command, or NULL on failure
+ */
+static char* format_command(size_t* len, const char* format, ...) {
+    char* command = NULL;
+    va_list ap;
+    va_start(ap, format);
+    int n = redisvFormatCommand(&command, format, ap);
+    va_end(ap);
+    if (n < 0) {
+        LOG_ERROR("Failed to format command");
+        return NULL;
+    }
+    *len = (size_t)n;
+    return command;
+}
+
+/**
+ * @brief Helper function to format a command given as arguments for run_commands
+ *
+ * @param len Set to the length of the command
+ * @return char* The command, or NULL on failure
+ */
+static char* format_command_argv(size_t* len, int argc, const char** argv) {
+    char* command = NULL;
+    long long n = redisFormatCommandArgv(&command, argc, argv, NULL);
+    if (n < 0) {
+        LOG_ERROR("Failed to format command");
+        return NULL;
+    }
+    *len = (size_t)n;
+    return command;
+}
+
+/**
+ * @brief Helper function to run formatted commands and collect their replies
+ *
+ * The commands are reads. They go to the replica chosen for the request, if any. Otherwise
+ * they go through the auto-pipeline when it is enabled, with those of concurrent requests,
+ * and on the connection of the thread when it is not. The commands are freed.
+ *
+ * @param commands The formatted commands, NULL for a command that failed to format
+ * @param lens The lengths of the commands
+ * @param count The number of commands
+ * @param replies Set to the replies of the commands, in order
+ * @return true if every reply was read, false otherwise (no reply is returned)
+ */
+static bool run_commands(char** commands, const size_t* lens, size_t count, redisReply** replies) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool success = true;
+    for (size_t i = 0; i < count; i++) {
+        replies[i] = NULL;
+        success = success && commands[i] != NULL;
+    }
+
+    if (success && read_context == NULL && auto_pipeline_enabled()) {
+        success = auto_pipeline_exec(commands, lens, count, replies);
+    }
+    else if (success) {
+        redisContext* context = read_connection();
+        for (size_t i = 0; i < count; i++) {
+            redisAppendFormattedCommand(context, commands[i], lens[i]);
+        }
+        for (size_t i = 0; success && i < count; i++) {
+            success = redisGetReply(context, (void**)&replies[i]) == REDIS_OK;
+        }
+        for (size_t i = 0; !success && i < count; i++) {
+            if (replies[i] != NULL) {
+                freeReplyObject(replies[i]);
+                replies[i] = NULL;
+            }
+        }
+    }
+    record_latency(read_replica != NULL ? &read_replica->latency_us : &latency_us, &start);
+
+    for (size_t i = 0; i < count; i++) {
+        if (commands[i] != NULL) {
+            redisFreeCommand(commands[i]);
+        }
+    }
+    return success;
+}
+
+/**
+ * @brief Helper function to run formatted reads, sent a second time if they are slow
+ *
+ * A read of the primary is hedged on a second connection to the primary. A read of a replica
+ * is hedged on the next replica, or on a second connection to the same one if the next one is
+ * down. When the hedge answers first, the connection it beat is closed, and the other reads of
+ * the request go to the server of the hedge. Reads through the auto-pipeline are not hedged.
+ * The commands are freed.
+ *
+ * @param commands The formatted commands, NULL for a command that failed to format
+ * @param lens The lengths of the commands
+ * @param count The number of commands
+ * @param replies Set to the replies of the commands, in order
+ * @return true if every reply was read, false otherwise (no reply is returned)
+ */
+static bool run_hedged_commands(char** commands, const size_t* lens, size_t count, redisReply** replies) {
+    if (!hedged_read_enabled() || (read_context == NULL && auto_pipeline_enabled())) {
+        return run_commands(commands, lens, count, replies);
+    }
+    // Server of the hedge: 0 for the primary, 1 + i for the replica i
+    size_t target = 0;
+    struct circuit_breaker* breaker = &redis_breaker;
+    if (read_replica != NULL) {
+        size_t index = (size_t)(read_replica - replicas);
+        size_t next = (index + 1) % replica_count;
+        if (!circuit_breaker_closed(&replicas[next].breaker)) {
+            next = index;
+        }
+        target = 1 + next;
+        breaker = &replicas[next].breaker;
+    }
+    bool success = circuit_breaker_closed(breaker) && read_connection() != NULL;
+    for (size_t i = 0; i < count; i++) {
+        success = success && commands[i] != NULL;
+    }
+    if (success && hedge_contexts == NULL) {
+        hedge_contexts = calloc(replica_count + 1, sizeof(*hedge_contexts));
+        success = hedge_contexts != NULL;
+        if (success) {
+            pthread_setspecific(hedge_key, hedge_contexts);
+        }
+    }
+    if (!success) {
+        return run_commands(commands, lens, count, replies);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    redisContext* context = read_connection();
+    unsigned int timeout_ms = (unsigned int)(command_timeout.tv_sec * 1000 + command_timeout.tv_usec / 1000);
+    enum hedged_read_winner winner = hedged_read_exec(context, &hedge_contexts[target], db_connect,
+        target == 0 ? redis_uri : replicas[target - 1].uri, commands, lens, count, replies, timeout_ms);
+    record_latency(read_replica != NULL ? &read_replica->latency_us : &latency_us, &start);
+
+    if (winner == HEDGED_READ_SECOND) {
+        // The beaten connection still has replies on the way
+        if (read_replica != NULL) {
+            replica_contexts[read_replica - replicas] = NULL;
+        }
+        else {
+            pthread_setspecific(connection_key, NULL);
+            redis_context = NULL;
+        }
+        redisFree(context);
+        // The hedge replaces the connection of its server if it has none, or stays a hedge
+        redisContext** server_context = target == 0 ? &redis_context : &replica_contexts[target - 1];
+        if (*server_context == NULL) {
+            *server_context = hedge_contexts[target];
+            hedge_contexts[target] = NULL;
+            if (target == 0) {
+                pthread_setspecific(connection_key, redis_context);
+            }
+        }
+        read_replica = target == 0 ? NULL : &replicas[target - 1];
+        read_context = target == 0 ? NULL : *server_context;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        redisFreeCommand(commands[i]);
+    }
+    return winner != HEDGED_READ_FAILED;
+}
+
+/**
+ * @brief Helper function to run formatted reads on the shards they belong to
+ *
+ * The commands of every shard are sent before any reply is read, so the shards answer in
+ * parallel. Without sharding, the commands go through run_commands. The commands are freed.
+ *
+ * @param commands The formatted commands, NULL for a command that failed to format
+ * @param lens The lengths of the commands
+ * @param command_shards The shard of every command
+ * @param count The number of commands
+ * @param replies Set to the replies of the commands, in order
+ * @return true if every reply was read, false otherwise (no reply is returned)
+ */
+static bool run_sharded_commands(char** commands, const size_t* lens, const size_t* command_shards, size_t count, redisReply** replies) {
+    if (shard_ring == NULL) {
+        return run_commands(commands, lens, count, replies);
+    }
+    struct scatter scatter;
+    bool success = scatter_begin(&scatter, false);
+    for (size_t i = 0; i < count; i++) {
+        replies[i] = NULL;
+        success = success && commands[i] != NULL && scatter_connection(&scatter, command_shards[i]) != NULL;
+    }
+    for (size_t i = 0; success && i < count; i++) {
+        redisAppendFormattedCommand(scatter.contexts[command_shards[i]], commands[i], lens[i]);
+        scatter.ops[command_shards[i]]++;
+    }
+    for (size_t i = 0; success && i < scatter.count; i++) {
+        if (scatter.ops[i] > 0) {
+            flush_commands(scatter.contexts[i]);
+        }
+    }
+    for (size_t i = 0; success && i < count; i++) {
+        scatter.ops[command_shards[i]]--;
+        success = redisGetReply(scatter.contexts[command_shards[i]], (void**)&replies[i]) == REDIS_OK;
+    }
+    for (size_t i = 0; !success && i < count; i++) {
+        if (replies[i] != NULL) {
+            freeReplyObject(replies[i]);
+            replies[i] = NULL;
+        }
+    }
+    if (scatter.contexts != NULL) {
+        scatter_end(&scatter);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (commands[i] != NULL) {
+            redisFreeCommand(commands[i]);
+        }
+    }
+    return success;
+}
+
+/**
+ * @brief Helper function to process redis replies
+ *
+ * @param op_num The number of operations to process
+ * @return true on success, false on failure
+ */
+bool processRedisReplies(int op_num) {
+    redisReply* reply = NULL;
+    for (int i = 0; i < op_num; i++) {
+        int resultCode = redisGetReply(redis_context, (void**)&reply);
+        if (resultCode == REDIS_OK) {
+            LOG_INFO("Response [%d]: %s", i, reply->str ? reply->str : "(nil)");
+            freeReplyObject(reply);
+        }
+        else {
+            freeReplyAndLogError(reply, "Error processing redis reply");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Helper function to queue the version bumps of a written pet
+ *
+ * The version of the document and the generations of its status and tag indexes are
+ * incremented after the writes themselves are queued, so a reader that sees the new
+ * version or generation also sees the new data.
+ *
+ * @param collection_name The name of the collection
+ * @param pet The pet written or removed
+ * @param op_num Incremented for every command queued
+ */
+static void append_pet_versions(const char* collection_name, const struct pet* pet, int* op_num) {
+    LOG_INFO("HINCRBY %s:%s %lld 1", collection_name, VERSIONS_KEY, pet->id);
+    redisAppendCommand(redis_context, "HINCRBY %s:%s %lld 1", collection_name, VERSIONS_KEY, pet->id);
+    (*op_num)++;
+
+    if (pet->status != NULL) {
+        LOG_INFO("HINCRBY %s:%s status:%s 1", collection_name, GENERATIONS_KEY, pet->status);
+        redisAppendCommand(redis_context, "HINCRBY %s:%s status:%s 1", collection_name, GENERATIONS_KEY, pet->status);
+        (*op_num)++;
+    }
+    for (size_t i = 0; i < pet->tag_count; i++) {
+        const char* name = pet->tags[i].name;
+        if (name != NULL) {
+            LOG_INFO("HINCRBY %s:%s tags:%s 1", collection_name, GENERATIONS_KEY, name);
+            redisAppendCommand(redis_context, "HINCRBY %s:%s tags:%s 1", collection_name, GENERATIONS_KEY, name);
+            (*op_num)++;
+        }
+    }
+}
+
+/**
+ * @brief Helper function to queue the commands inserting a pet
+ *
+ * @param collection_name The name of the collection
+ * @param pet The pet to insert
+ * @param op_num Incremented for every command queued, even when a later one fails
+ * @return true on success, false on failure
+ */
+static bool append_pet_insert(const char* collection_name, const struct pet* pet, int* op_num) {
+    if (!pet->has_id) {
+        LOG_ERROR("Document does not contain an id");
+        return false;
+    }
+    long long id = pet->id;
+
+    if (pet->status == NULL) {
+        LOG_ERROR("Document does not contain a status");
+        return false;
+    }
+
+    struct doc_buffer json = { 0 };
+    if (!pet_write(pet, &json)) {
+        LOG_ERROR("Failed to print JSON document");
+        doc_buffer_free(&json);
+        return false;
+    }
+
+    LOG_INFO("SADD %s:%s:%s %lld", collection_name, "status", pet->status, id);
+    redisAppendCommand(redis_context, "SADD %s:%s:%s %lld", collection_name, "status", pet->status, id);
+    (*op_num)++;
+
+    store_tags(collection_name, pet, op_num);
+
+    LOG_INFO("SADD %s:%s %lld", collection_name, collection_name, id);
+    redisAppendCommand(redis_context, "SADD %s:%s %lld", collection_name, collection_name, id);
+    (*op_num)++;
+
+    bool queued = store_document(collection_name, json.data, json.len, id);
+    doc_buffer_free(&json);
+    if (queued) {
+        (*op_num)++;
+        append_pet_versions(collection_name, pet, op_num);
+    }
+    return queued;
+}
+
+/**
+ * @brief Insert a pet document into the database
+ *
+ * @param collection_name The name of the collection
+ * @param pet The pet to insert
+ * @return true on success, false on failure
+ */
+bool db_pet_insert(const char* collection_name, const struct pet* pet) {
+    int op_num = 0;
+    redisContext* previous = NULL;
+    bool queued = shard_enter(shard_of_id(pet->id), &previous) && append_pet_insert(collection_name, pet, &op_num);
+
+    // Replies of the commands already queued must be consumed even on failure
+    bool success = processRedisReplies(op_num) && queued;
+    shard_leave(previous);
+    // A write that failed on its reply may still be stored, and an extra id is only a false positive
+    if (op_num > 0) {
+        pet_filter_update(pet->id, true);
+    }
+    return success;
+}
+
+/**
+ * @brief Update a pet document in the database
+ *
+ * @param collection_name The name of the collection
+ * @param update The pet replacing the stored one with the same id
+ * @return true on success, false on failure
+ */
+bool db_pet_update(const char* collection_name, const struct pet* update) {
+    if (!update->has_id) {
+        LOG_ERROR("Update document does not contain an id");
+        return false;
+    }
+    char id[24];
+    sprintf(id, "%lld", update->id);
+
+    if (!db_pet_delete(collection_name, id)) {
+        LOG_ERROR("Failed to delete document before updating");
+        return false;
+    }
+
+    if (!db_pet_insert(collection_name, update)) {
+        LOG_ERROR("Failed to insert updated document");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Helper function to queue the commands inserting a user
+ *
+ * @param collection_name The name of the collection
+ * @param user The user to insert
+ * @param op_num Incremented for every command queued, even when a later one fails
+ * @return true on success, false on failure
+ */
+static bool append_user_insert(const char* collection_name, const struct user* user, int* op_num) {
+    if (!user->has_id) {
+        LOG_ERROR("Document does not contain an id");
+        return false;
+    }
+
+    if (user->username == NULL) {
+        LOG_ERROR("Document does not contain a username");
+        return false;
+    }
+
+    struct doc_buffer json = { 0 };
+    if (!user_write(user, &json)) {
+        LOG_ERROR("Failed to print JSON document");
+        doc_buffer_free(&json);
+        return false;
+    }
+
+    char* key = malloc(strlen(collection_name) * 2 + strlen(user->username) + 24);
+    if (key == NULL) {
+        LOG_ERROR("Memory allocation failed for key");
+        doc_buffer_free(&json);
+        return false;
+    }
+    sprintf(key, "%lld", user->id);
+    bool queued = append_document_set(&storage, collection_name, key, json.data, json.len);
+    doc_buffer_free(&json);
+    if (!queued) {
+        free(key);
+        return false;
+    }
+    (*op_num)++;
+
+    sprintf(key, "%s:%s", collection_name, collection_name);
+    LOG_INFO("SADD %s %lld", key, user->id);
+    redisAppendCommand(redis_context, "SADD %s %lld", key, user->id);
+    (*op_num)++;
+
+    sprintf(key, "%s:%s:%s", collection_name, "username", user->username);
+    LOG_INFO("SADD %s %lld", key, user->id);
+    redisAppendCommand(redis_context, "SADD %s %lld", key, user->id);
+    (*op_num)++;
+
+    // Unique username -> id index used by db_find_user_by_username
+    sprintf(key, "%s:%s", collection_name, USERNAME_INDEX);
+    LOG_INFO("HSET %s %s %lld", key, user->username, user->id);
+    redisAppendCommand(redis_context, "HSET %s %s %lld", key, user->username, user->id);
+    (*op_num)++;
+
+    free(key);
+    return true;
+}
+
+/**
+ * @brief Insert a user document into the database
+ *
+ * @param collection_name The name of the collection
+ * @param user The user to insert
+ * @return true on success, false on failure
+ */
+bool db_user_insert(const char* collection_name, const struct user* user) {
+    int op_num = 0;
+    redisContext* previous = NULL;
+    bool queued = shard_enter(shard_of_id(user->id), &previous) && append_user_insert(collection_name, user, &op_num);
+
+    // Replies of the commands already queued must be consumed even on failure
+    bool success = processRedisReplies(op_num) && queued;
+    shard_leave(previous);
+    return success;
+}
+
+/**
+ * @brief Update a user document in the database
+ *
+ * @param collection_name The name of the collection
+ * @param update The user replacing the stored one with the same id
+ * @return true on success, false on failure
+ */
+bool db_user_update(const char* collection_name, const struct user* update) {
+    if (!update->has_id) {
+        LOG_ERROR("Update document does not contain an id");
+        return false;
+    }
+
+    char id[24];
+    sprintf(id, "%lld", update->id);
+
+    if (!db_user_delete(collection_name, id)) {
+        LOG_ERROR("Failed to delete document before updating");
+        return false;
+    }
+
+    if (!db_user_insert(collection_name, update)) {
+        LOG_ERROR("Failed to insert updated document");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Helper function to queue the removal of a stored user and of its index entries
+ *
+ * @param collection_name The name of the collection
+ * @param user The stored user
+ * @param op_num Incremented for every command queued
+ * @return true if every command was queued, false otherwise
+ */
+static bool append_user_delete(const char* collection_name, const struct user* user, int* op_num) {
+    char* field_id = malloc(strlen(collection_name) + 20);
+    if (field_id == NULL) {
+        LOG_ERROR("Memory allocation failed for key");
+        return false;
+    }
+    sprintf(field_id, "%s:%s", collection_name, "username");
+    bool queued = remove_document_from_field(field_id, user->username, user->id, op_num) &&
+        remove_document_from_collection(collection_name, user->id, op_num);
+
+    // Drop the username index entry unless it already points to another user
+    if (queued && user->username != NULL) {
+        char doc_id_str[24];
+        sprintf(doc_id_str, "%lld", user->id);
+        sprintf(field_id, "%s:%s", collection_name, USERNAME_INDEX);
+        LOG_INFO("EVAL <username unlink> %s %s %s", field_id, user->username, doc_id_str);
+        redisAppendCommand(redis_context, "EVAL %s 1 %s %s %s", USERNAME_UNLINK_SCRIPT, field_id, user->username, doc_id_str);
+        (*op_num)++;
+    }
+    free(field_id);
+    return queued;
+}
+
+/**
+ * @brief Delete a user document from the database
+ *
+ * @param collection_name The name of the collection
+ * @param id The id of the document to delete
+ * @return true on success, false on failure
+ */
+bool db_user_delete(const char* collection_name, const char* id) {
+    char* json = db_find_one_json(collection_name, id);
+    if (json == NULL) {
+        LOG_ERROR("Document not found");
+        return false;
+    }
+
+    struct user user;
+    bool parsed = user_parse(json, strlen(json), &user);
+    free(json);
+    if (!parsed) {
+        LOG_ERROR("Stored document is not a valid user");
+        return false;
+    }
+    if (!user.has_id) {
+        LOG_ERROR("Document does not contain an id");
+        user_free(&user);
+        return false;
+    }
+
+    int op_num = 0;
+    redisContext* previous = NULL;
+    bool queued = shard_enter(shard_of(id), &previous) && append_user_delete(collection_name, &user, &op_num);
+    user_free(&user);
+
+    // Replies of the commands already queued must be consumed even on failure
+    bool success = processRedisReplies(op_num) && queued;
+    shard_leave(previous);
+    return success;
+}
+
+/**
+ * @brief Helper function to queue the removal of a stored pet and of its index entries
+ *
+ * @param collection_name The name of the collection
+ * @param pet The stored pet
+ * @param op_num Incremented for every command queued
+ * @return true if every command was queued, false otherwise
+ */
+static bool append_pet_delete(const char* collection_name, const struct pet* pet, int* op_num) {
+    char* field_id = malloc(strlen(collection_name) + 20);
+    if (field_id == NULL) {
+        LOG_ERROR("Memory allocation failed for key");
+        return false;
+    }
+    sprintf(field_id, "%s:%s", collection_name, "status");
+    bool queued = remove_document_from_field(field_id, pet->status, pet->id, op_num) &&
+        remove_document_from_tags(collection_name, pet, op_num) &&
+        remove_document_from_collection(collection_name, pet->id, op_num);
+    if (queued) {
+        append_pet_versions(collection_name, pet, op_num);
+    }
+    free(field_id);
+    return queued;
+}
+
+/**
+ * @brief Delete a pet document from the database
+ *
+ * @param collection_name The name of the collection
+ * @param id The id of the document to delete
+ * @return true on success, false on failure
+ */
+bool db_pet_delete(const char* collection_name, const char* id) {
+    char* json = db_find_one_json(collection_name, id);
+    if (json == NULL) {
+        LOG_ERROR("Document not found");
+        return false;
+    }
+
+    struct pet pet;
+    bool parsed = pet_parse(json, strlen(json), &pet);
+    free(json);
+    if (!parsed) {
+        LOG_ERROR("Stored document is not a valid pet");
+        return false;
+    }
+    if (!pet.has_id) {
+        LOG_ERROR("Document does not contain an id");
+        pet_free(&pet);
+        return false;
+    }
+    long long doc_id = pet.id;
+
+    int op_num = 0;
+    redisContext* previous = NULL;
+    bool queued = shard_enter(shard_of(id), &previous) && append_pet_delete(collection_name, &pet, &op_num);
+    pet_free(&pet);
+
+    // Replies of the commands already queued must be consumed even on failure
+    bool success = processRedisReplies(op_num) && queued;
+    shard_leave(previous);
+    if (!success) {
+        return false;
+    }
+    pet_filter_update(doc_id, false);
+    return true;
+}
+
+/**
+ * @brief Helper function to store tags in the database
+ *
+ * @param collection_name The name of the collection
+ * @param pet The pet whose tags are stored
+ * @param num_op The number of operations
+ * @return true on success, false on failure
+ */
+bool store_tags(const char* collection_name, const struct pet* pet, int* num_op) {
+    for (size_t i = 0; i < pet->tag_count; i++) {
+        const char* name = pet->tags[i].name;
+        if (name != NULL) {
+            LOG_INFO("SADD %s:%s:%s %lld", collection_name, "tags", name, pet->id);
+            redisAppendCommand(redis_context, "SADD %s:%s:%s %lld", collection_name, "tags", name, pet->id);
+            (*num_op)++;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Helper function to remove document from tags in the database
+ *
+ * @param collection_name The name of the collection
+ * @param pet The stored pet
+ * @param op_number The number of operations
+ * @return true on success, false on failure
+ */
+bool remove_document_from_tags(const char* collection_name, const struct pet* pet, int* op_number) {
+    for (size_t i = 0; i < pet->tag_count; i++) {
+        const char* name = pet->tags[i].name;
+        if (name != NULL) {
+            LOG_INFO("SREM %s:%s:%s %lld", collection_name, "tags", name, pet->id);
+            redisAppendCommand(redis_context, "SREM %s:%s:%s %lld", collection_name, "tags", name, pet->id);
+            (*op_number)++;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Helper function to convert a stored document of any format to JSON text
+ *
+ * @param data The stored document
+ * @param len The length of the stored document
+ * @return char* The NUL-terminated JSON text, or NULL if the document is corrupt.
+ *         The caller is responsible for freeing the returned string.
+ */
+static char* document_json(const char* data, size_t len) {
+    if (doc_format_of(data, len) == DOC_FORMAT_JSON) {
+        return strndup(data, len);
+    }
+    struct doc_buffer json = { 0 };
+    if (!doc_append_json(&json, data, len) || !doc_buffer_append(&json, "", 1)) {
+        LOG_ERROR("Failed to decode stored document");
+        doc_buffer_free(&json);
+        return NULL;
+    }
+    return json.data;
+}
+
+/**
+ * @brief Helper function to parse a stored document of any format
+ *
+ * @param reply The string reply holding the document
+ * @return cJSON* The parsed document, or NULL on failure
+ */
+static cJSON* parse_document(const redisReply* reply) {
+    // Replies are NUL-terminated, JSON documents are parsed in place
+    if (doc_format_of(reply->str, reply->len) == DOC_FORMAT_JSON) {
+        return cJSON_Parse(reply->str);
+    }
+    char* json = document_json(reply->str, reply->len);
+    cJSON* doc = json ? cJSON_Parse(json) : NULL;
+    free(json);
+    return doc;
+}
+
+/**
+ * @brief Find a single document in the database
+ *
+ * @param collection_name The name of the collection
+ * @param id The id of the document to find
+ * @return cJSON* The JSON document found, or NULL on failure
+ */
+cJSON* db_find_one(const char* collection_name, const char* id) {
+    size_t len = 0;
+    char* command = format_document_get(&storage, collection_name, id, &len);
+    if (command == NULL) {
+        return NULL;
+    }
+
+    redisReply* reply = NULL;
+    size_t shard = shard_of(id);
+    if (!run_sharded_commands(&command, &len, &shard, 1, &reply)) {
+        LOG_ERROR("Failed to retrieve response");
+        return NULL;
+    }
+    if (reply->type != REDIS_REPLY_STRING) {
+        freeReplyAndLogError(reply, "Failed to retrieve response");
+        return NULL;
+    }
+    cJSON* result = parse_document(reply);
+    freeReplyObject(reply);
+    if (result == NULL) {
+        LOG_ERROR("Failed to parse JSON");
+    }
+    return result;
+}
+
+/**
+ * @brief Find a single document in the database as JSON text
+ *
+ * The stored document is converted to JSON text without building a cJSON tree.
+ *
+ * @param collection_name The name of the collection
+ * @param id The id of the document to find
+ * @return char* The JSON text of the document, or NULL if it does not exist
+ */
+char* db_find_one_json(const char* collection_name, const char* id) {
+    size_t len = 0;
+    char* command = format_document_get(&storage, collection_name, id, &len);
+    redisReply* reply = NULL;
+    size_t shard = shard_of(id);
+    if (command == NULL || !run_sharded_commands(&command, &len, &shard, 1, &reply)) {
+        return NULL;
+    }
+    char* result = NULL;
+    if (reply->type == REDIS_REPLY_STRING) {
+        result = document_json(reply->str, reply->len);
+    }
+    freeReplyObject(reply);
+    return result;
+}
+
+/**
+ * @brief Helper function to read the reply of an HGET of a version
+ *
+ * @return long long The version, 0 if there is none yet, or -1 on failure
+ */
+static long long reply_version(const redisReply* reply) {
+    if (reply->type == REDIS_REPLY_NIL) {
+        return 0;
+    }
+    if (reply->type == REDIS_REPLY_STRING) {
+        return strtoll(reply->str, NULL, 10);
+    }
+    LOG_ERROR("Unexpected version reply");
+    return -1;
+}
+
+/**
+ * @brief Get the version of a document
+ *
+ * @param collection_name The name of the collection
+ * @param id The id of the document
+ * @return long long The version, 0 if the document was never written, or -1 on failure
+ */
+long long db_document_version(const char* collection_name, const char* id) {
+    LOG_INFO("HGET %s:%s %s", collection_name, VERSIONS_KEY, id);
+    size_t len = 0;
+    char* command = format_command(&len, "HGET %s:%s %s", collection_name, VERSIONS_KEY, id);
+    redisReply* reply = NULL;
+    size_t shard = shard_of(id);
+    if (!run_sharded_commands(&command, &len, &shard, 1, &reply)) {
+        LOG_ERROR("Error processing redis reply");
+        return -1;
+    }
+    long long version = reply_version(reply);
+    freeReplyObject(reply);
+    return version;
+}
+
+/**
+ * @brief Find a single document and its version in one round trip, as JSON text
+ *
+ * The version is read before the document, so it is never newer than the document.
+ *
+ * @param collection_name The name of the collection
+ * @param id The id of the document to find
+ * @param version Set to the version of the document, or -1 if it or the document could not be read
+ * @return char* The JSON text of the document, or NULL if it does not exist
+ */
+char* db_find_one_json_versioned(const char* collection_name, const char* id, long long* version) {
+    LOG_INFO("HGET %s:%s %s", collection_name, VERSIONS_KEY, id);
+    char* commands[2];
+    size_t lens[2] = { 0, 0 };
+    redisReply* replies[2];
+    commands[0] = format_command(&lens[0], "HGET %s:%s %s", collection_name, VERSIONS_KEY, id);
+    // Ids that cannot be bucketed have no document, only the version is read
+    commands[1] = format_document_get(&storage, collection_name, id, &lens[1]);
+    size_t count = commands[1] != NULL ? 2 : 1;
+    // Reads are not hedged when the documents are sharded
+    size_t shards_of_commands[2] = { shard_of(id), shard_of(id) };
+    bool success = shard_ring != NULL ? run_sharded_commands(commands, lens, shards_of_commands, count, replies) :
+        run_hedged_commands(commands, lens, count, replies);
+    if (!success) {
+        LOG_ERROR("Error processing redis reply");
+        *version = -1;
+        return NULL;
+    }
+    *version = reply_version(replies[0]);
+    if (count == 2 && replies[1]->type == REDIS_REPLY_ERROR) {
+        LOG_ERROR("Failed to read the document: %s", replies[1]->str);
+        *version = -1;
+    }
+
+    char* result = NULL;
+    if (count == 2 && replies[1]->type == REDIS_REPLY_STRING) {
+        result = document_json(replies[1]->str, replies[1]->len);
+    }
+    for (size_t i = 0; i < count; i++) {
+        freeReplyObject(replies[i]);
+    }
+    return result;
+}
+
+/**
+ * @brief Get the generations of the entries of a field index
+ *
+ * A generation is incremented by every write of a document listed by the entry, so the
+ * documents found by a query can be validated without reading them.
+ *
+ * @param collection_name The name of the collection
+ * @param field The indexed field ("status" or "tags")
+ * @param values The values of the field
+ * @param count The number of values
+ * @param generations Set to the generation of every value, 0 for values never written
+ * @return true on success, false on failure
+ */
+bool db_index_generations(const char* collection_name, const char* field, const char* const* values, size_t count, long long* generations) {
+    char* key = malloc(strlen(collection_name) + strlen(GENERATIONS_KEY) + 2);
+    char** fields = calloc(count > 0 ? count : 1, sizeof(*fields));
+    const char** argv = malloc((count + 2) * sizeof(*argv));
+    bool success = key != NULL && fields != NULL && argv != NULL;
+    for (size_t i = 0; success && i < count; i++) {
+        fields[i] = malloc(strlen(field) + strlen(values[i]) + 2);
+        if (fields[i] == NULL) {
+            success = false;
+            break;
+        }
+        sprintf(fields[i], "%s:%s", field, values[i]);
+    }
+
+    redisReply* reply = NULL;
+    if (!success) {
+        LOG_ERROR("Memory allocation failed for the generations");
+    }
+    else if (count > 0) {
+        sprintf(key, "%s:%s", collection_name, GENERATIONS_KEY);
+        argv[0] = "HMGET";
+        argv[1] = key;
+        for (size_t i = 0; i < count; i++) {
+            argv[i + 2] = fields[i];
+        }
+        // Every shard counts the writes of its own documents: the sums grow with every write as well
+        size_t servers = shard_ring != NULL ? shard_count : 1;
+        char** commands = calloc(servers, sizeof(*commands));
+        size_t* lens = calloc(servers, sizeof(*lens));
+        size_t* command_shards = calloc(servers, sizeof(*command_shards));
+        redisReply** replies = calloc(servers, sizeof(*replies));
+        success = commands != NULL && lens != NULL && command_shards != NULL && replies != NULL;
+        for (size_t s = 0; success && s < servers; s++) {
+            LOG_INFO("HMGET %s <%zu fields>", key, count);
+            commands[s] = format_command_argv(&lens[s], (int)count + 2, argv);
+            command_shards[s] = s;
+        }
+        if (!success || !run_sharded_commands(commands, lens, command_shards, servers, replies)) {
+            LOG_ERROR("Error processing redis reply");
+            success = false;
+        }
+        for (size_t i = 0; success && i < count; i++) {
+            generations[i] = 0;
+        }
+        for (size_t s = 0; success && s < servers; s++) {
+            reply = replies[s];
+            if (reply->type != REDIS_REPLY_ARRAY || reply->elements != count) {
+                LOG_ERROR("Unexpected generations reply");
+                success = false;
+                break;
+            }
+            for (size_t i = 0; i < count; i++) {
+                const redisReply* element = reply->element[i];
+                generations[i] += element->type == REDIS_REPLY_STRING ? strtoll(element->str, NULL, 10) : 0;
+            }
+        }
+        for (size_t s = 0; replies != NULL && s < servers; s++) {
+            if (replies[s] != NULL) {
+                freeReplyObject(replies[s]);
+            }
+        }
+        free(commands);
+        free(lens);
+        free(command_shards);
+        free(replies);
+    }
+
+    if (fields != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            free(fields[i]);
+        }
+    }
+    free(fields);
+    free(argv);
+    free(key);
+    return success;
+}
+
+/**
+ * @brief Helper function to queue the reads of the documents listed by queued SMEMBERS
+ *
+ * Every shard lists its own documents, which are read from the same shard. The reads of a
+ * shard are sent as soon as its lists are read, while the next shards are still answering.
+ *
+ * @param collection_name The name of the collection
+ * @param scatter The connections, with sets SMEMBERS pending on each
+ * @param sets The number of SMEMBERS pending on every connection
+ * @return true on success, false on failure
+ */
+static bool queue_member_documents(const char* collection_name, struct scatter* scatter, int sets) {
+    scatter_flush(scatter);
+    for (size_t s = 0; s < scatter->count; s++) {
+        redisContext* context = scatter->contexts[s];
+        for (int i = 0; i < sets; i++) {
+            redisReply* reply = NULL;
+            scatter->ops[s]--;
+            int resultCode = redisGetReply(context, (void**)&reply);
+            if (resultCode != REDIS_OK) {
+                freeReplyAndLogError(reply, "Error processing redis reply");
+                return false;
+            }
+            for (size_t j = 0; j < reply->elements; j++) {
+                if (append_document_get(context, &storage, collection_name, reply->element[j]->str)) {
+                    scatter->ops[s]++;
+                }
+            }
+            freeReplyObject(reply);
+        }
+        flush_commands(context);
+    }
+    return true;
+}
+
+/**
+ * @brief Helper function to queue the reads of the documents matching a query
+ *
+ * @param collection_name The name of the collection
+ * @param query The JSON query object
+ * @param scatter The connections the reads are queued on
+ * @return true on success, false on failure
+ */
+static bool queue_query_documents(const char* collection_name, const cJSON* query, struct scatter* scatter) {
+    LOG_INFO("db_find query: %s", cJSON_PrintUnformatted(query));
+
+    cJSON* operator_obj = cJSON_GetObjectItem(query, "operator");
+    if (operator_obj == NULL) {
+        LOG_ERROR("Query does not contain an operator");
+        return false;
+    }
+    cJSON* field_obj = cJSON_GetObjectItem(query, "field");
+    if (field_obj == NULL) {
+        LOG_ERROR("Query does not contain a field");
+        return false;
+    }
+
+    cJSON* value_obj = cJSON_GetObjectItem(query, "value");
+    if (value_obj == NULL) {
+        LOG_ERROR("Query does not contain a value");
+        return false;
+    }
+    if (!cJSON_IsArray(value_obj)) {
+        LOG_ERROR("Value is not an array");
+        return false;
+    }
+
+    int array_size = cJSON_GetArraySize(value_obj);
+    for (int i = 0; i < array_size; i++) {
+        if (cJSON_GetArrayItem(value_obj, i) == NULL) {
+            LOG_ERROR("Value is not a string");
+            return false;
+        }
+    }
+    for (int i = 0; i < array_size; i++) {
+        cJSON* value = cJSON_GetArrayItem(value_obj, i);
+        LOG_INFO("SMEMBERS %s:%s", field_obj->valuestring, value->valuestring);
+        for (size_t s = 0; s < scatter->count; s++) {
+            redisAppendCommand(scatter->contexts[s], "SMEMBERS %s:%s", field_obj->valuestring, value->valuestring);
+            scatter->ops[s]++;
+        }
+    }
+    return queue_member_documents(collection_name, scatter, array_size);
+}
+
+/**
+ * @brief Helper function to queue the reads of all the documents of a collection
+ *
+ * @param collection_name The name of the collection
+ * @param scatter The connections the reads are queued on
+ * @return true on success, false on failure
+ */
+static bool queue_all_documents(const char* collection_name, struct scatter* scatter) {
+    // Get all the document IDs from the collection
+    LOG_INFO("SMEMBERS %s:%s", collection_name, collection_name);
+    for (size_t s = 0; s < scatter->count; s++) {
+        redisAppendCommand(scatter->contexts[s], "SMEMBERS %s:%s", collection_name, collection_name);
+        scatter->ops[s]++;
+    }
+    // Get the document for each ID
+    return queue_member_documents(collection_name, scatter, 1);
+}
+
+/**
+ * @brief Helper function to read the replies of queued document reads into an array
+ *
+ * @param scatter The connections the reads are queued on
+ * @return cJSON* The JSON array of documents found, or NULL on failure
+ */
+static cJSON* read_documents(struct scatter* scatter) {
+    redisReply* reply = NULL;
+    cJSON* result = cJSON_CreateArray();
+    for (size_t s = 0; s < scatter->count; s++) {
+        for (; scatter->ops[s] > 0; scatter->ops[s]--) {
+            int resultCode = redisGetReply(scatter->contexts[s], (void**)&reply);
+            if (resultCode == REDIS_OK) {
+                if (reply->type == REDIS_REPLY_STRING) {
+                    cJSON* doc = parse_document(reply);
+                    if (doc != NULL) {
+                        cJSON_AddItemToArray(result, doc);
+                    }
+                }
+                freeReplyObject(reply);
+            }
+            else {
+                freeReplyAndLogError(reply, "Error processing redis reply");
+                cJSON_Delete(result);
+                return NULL;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Helper function to read the replies of queued document reads as a JSON array text
+ *
+ * @param scatter The connections the reads are queued on
+ * @return char* The JSON text of the array, or NULL on failure
+ */
+static char* read_documents_json(struct scatter* scatter) {
+    redisReply* reply = NULL;
+    struct doc_buffer result = { 0 };
+    bool success = doc_buffer_append(&result, "[", 1);
+    bool first = true;
+    for (size_t s = 0; s < scatter->count; s++) {
+        for (; scatter->ops[s] > 0; scatter->ops[s]--) {
+            int resultCode = redisGetReply(scatter->contexts[s], (void**)&reply);
+            if (resultCode != REDIS_OK) {
+                freeReplyAndLogError(reply, "Error processing redis reply");
+                doc_buffer_free(&result);
+                return NULL;
+            }
+            if (success && reply->type == REDIS_REPLY_STRING) {
+                size_t mark = result.len;
+                if (!first && !doc_buffer_append(&result, ",", 1)) {
+                    success = false;
+                }
+                else if (doc_append_json(&result, reply->str, reply->len)) {
+                    first = false;
+                }
+                else {
+                    // Skip corrupt documents, as db_find does
+                    result.len = mark;
+                }
+            }
+            freeReplyObject(reply);
+        }
+    }
+    if (!success || !doc_buffer_append(&result, "]", 2)) {
+        LOG_ERROR("Memory allocation failed for the result");
+        doc_buffer_free(&result);
+        return NULL;
+    }
+    return result.data;
+}
+
+/**
+ * @brief Find documents in the database based on a query
+ *
+ * With sharding, the query is scattered to every shard and the documents gathered.
+ *
+ * @param collection_name The name of the collection
+ * @param query The JSON query object
+ * @return cJSON* The JSON array of documents found, or NULL on failure
+ */
+cJSON* db_find(const char* collection_name, const cJSON* query) {
+    struct scatter scatter;
+    if (!scatter_begin(&scatter, true)) {
+        return NULL;
+    }
+    cJSON* result = queue_query_documents(collection_name, query, &scatter) ? read_documents(&scatter) : NULL;
+    scatter_end(&scatter);
+    return result;
+}
+
+/**
+ * @brief Find documents in the database based on a query, as JSON text
+ *
+ * @param collection_name The name of the collection
+ * @param query The JSON query object
+ * @return char* The JSON text of the array of documents found, or NULL on failure
+ */
+char* db_find_json(const char* collection_name, const cJSON* query) {
+    struct scatter scatter;
+    if (!scatter_begin(&scatter, true)) {
+        return NULL;
+    }
+    char* result = queue_query_documents(collection_name, query, &scatter) ? read_documents_json(&scatter) : NULL;
+    scatter_end(&scatter);
+    return result;
+}
+
+/**
+ * @brief Find all documents in a collection
+ *
+ * @param collection_name The name of the collection
+ * @return cJSON* The JSON array of documents found, or NULL on failure
+ */
+cJSON* db_find_all(const char* collection_name) {
+    struct scatter scatter;
+    if (!scatter_begin(&scatter, true)) {
+        return NULL;
+    }
+    cJSON* result = queue_all_documents(collection_name, &scatter) ? read_documents(&scatter) : NULL;
+    scatter_end(&scatter);
+    return result;
+}
+
+/**
+ * @brief Find all documents in a collection, as JSON text
+ *
+ * @param collection_name The name of the collection
+ * @return char* The JSON text of the array of documents found, or NULL on failure
+ */
+char* db_find_all_json(const char* collection_name) {
+    struct scatter scatter;
+    if (!scatter_begin(&scatter, true)) {
+        return NULL;
+    }
+    char* result = queue_all_documents(collection_name, &scatter) ? read_documents_json(&scatter) : NULL;
+    scatter_end(&scatter);
+    return result;
+}
+
+// Key of a document read by db_find_many_json, its shard and the position of its id in the request
+struct multi_get_key {
+    char* key;
+    size_t shard;
+    size_t index;
+};
+
+static int compare_multi_get_keys(const void* a, const void* b) {
+    const struct multi_get_key* left = a;
+    const struct multi_get_key* right = b;
+    if (left->shard != right->shard) {
+        return left->shard < right->shard ? -1 : 1;
+    }
+    return strcmp(left->key, right->key);
+}
+
+/**
+ * @brief Find documents by id, as JSON text
+ *
+ * All the documents are read in a single round trip: one MGET, or with bucketed storage
+ * one pipelined HMGET per bucket. The stored documents are spliced into the array in the
+ * order of the ids; missing documents are left out.
+ *
+ * @param collection_name The name of the collection
+ * @param ids The ids of the documents
+ * @param count The number of ids
+ * @return char* The JSON text of the array of documents found, or NULL on failure
+ */
+char* db_find_many_json(const char* collection_name, const char* const* ids, size_t count) {
+    size_t slots = count > 0 ? count : 1;
+    struct multi_get_key* keys = calloc(slots, sizeof(*keys));
+    size_t* group_starts = calloc(slots + 1, sizeof(*group_starts));
+    const redisReply** docs = calloc(slots, sizeof(*docs));
+    redisReply** replies = calloc(slots, sizeof(*replies));
+    char** commands = calloc(slots, sizeof(*commands));
+    size_t* lens = calloc(slots, sizeof(*lens));
+    size_t* group_shards = calloc(slots, sizeof(*group_shards));
+    const char** argv = malloc((count + 2) * sizeof(*argv));
+    if (keys == NULL || group_starts == NULL || docs == NULL || replies == NULL || commands == NULL || lens == NULL ||
+        group_shards == NULL || argv == NULL) {
+        LOG_ERROR("Memory allocation failed for the multi-get");
+        free(keys);
+        free(group_starts);
+        free(docs);
+        free(replies);
+        free(commands);
+        free(lens);
+        free(group_shards);
+        free(argv);
+        return NULL;
+    }
+
+    // Ids that cannot be bucketed have no document
+    size_t key_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        char* key = document_key(&storage, collection_name, ids[i]);
+        if (key != NULL) {
+            keys[key_count].key = key;
+            keys[key_count].shard = shard_of(ids[i]);
+            keys[key_count].index = i;
+            key_count++;
+        }
+    }
+    if (storage.bucket_size != 0 || shard_ring != NULL) {
+        qsort(keys, key_count, sizeof(*keys), compare_multi_get_keys);
+    }
+
+    // One MGET per shard, or one HMGET per bucket of every shard
+    size_t group_count = 0;
+    size_t start = 0;
+    while (start < key_count) {
+        size_t end = start + 1;
+        int argc = 0;
+        if (storage.bucket_size == 0) {
+            while (end < key_count && keys[end].shard == keys[start].shard) {
+                end++;
+            }
+            argv[argc++] = "MGET";
+            for (size_t j = start; j < end; j++) {
+                argv[argc++] = keys[j].key;
+            }
+            LOG_INFO("MGET %s:<%zu ids>", collection_name, end - start);
+        }
+        else {
+            while (end < key_count && keys[end].shard == keys[start].shard && strcmp(keys[end].key, keys[start].key) == 0) {
+                end++;
+            }
+            argv[argc++] = "HMGET";
+            argv[argc++] = keys[start].key;
+            for (size_t j = start; j < end; j++) {
+                argv[argc++] = ids[keys[j].index];
+            }
+            LOG_INFO("HMGET %s <%zu ids>", keys[start].key, end - start);
+        }
+        commands[group_count] = format_command_argv(&lens[group_count], argc, argv);
+        group_shards[group_count] = keys[start].shard;
+        group_starts[group_count++] = start;
+        start = end;
+    }
+    group_starts[group_count] = key_count;
+
+    bool success = run_sharded_commands(commands, lens, group_shards, group_count, replies);
+    if (!success) {
+        LOG_ERROR("Error processing redis reply");
+    }
+    for (size_t g = 0; success && g < group_count; g++) {
+        const redisReply* reply = replies[g];
+        size_t members = group_starts[g + 1] - group_starts[g];
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != members) {
+            LOG_ERROR("Unexpected multi-get reply");
+            success = false;
+            continue;
+        }
+        for (size_t j = 0; j < members; j++) {
+            docs[keys[group_starts[g] + j].index] = reply->element[j];
+        }
+    }
+
+    // Splice the documents in the order of the ids
+    struct doc_buffer result = { 0 };
+    if (success) {
+        success = doc_buffer_append(&result, "[", 1);
+        bool first = true;
+        for (size_t i = 0; success && i < count; i++) {
+            if (docs[i] == NULL || docs[i]->type != REDIS_REPLY_STRING) {
+                continue;
+            }
+            size_t mark = result.len;
+            if (!first && !doc_buffer_append(&result, ",", 1)) {
+                success = false;
+            }
+            else if (doc_append_json(&result, docs[i]->str, docs[i]->len)) {
+                first = false;
+            }
+            else {
+                // Skip corrupt documents, as db_find does
+                result.len = mark;
+            }
+        }
+        if (!success || !doc_buffer_append(&result, "]", 2)) {
+            LOG_ERROR("Memory allocation failed for the result");
+            success = false;
+        }
+    }
+
+    for (size_t g = 0; g < group_count; g++) {
+        if (replies[g] != NULL) {
+            freeReplyObject(replies[g]);
+        }
+    }
+    for (size_t i = 0; i < key_count; i++) {
+        free(keys[i].key);
+    }
+    free(keys);
+    free(group_starts);
+    free(docs);
+    free(replies);
+    free(commands);
+    free(lens);
+    free(group_shards);
+    free(argv);
+    if (!success) {
+        doc_buffer_free(&result);
+        return NULL;
+    }
+    return result.data;
+}
+
+/**
+ * @brief Read stored pets by id in one round trip
+ *
+ * @param collection_name The name of the collection
+ * @param ids The ids of the pets
+ * @param count The number of ids
+ * @param pets Set to the stored pet of every id, with has_id false when there is none.
+ *        Release them with pet_free on success.
+ * @return true on success, false if the connection failed
+ */
+bool db_pet_find_many(const char* collection_name, const long long* ids, size_t count, struct pet* pets) {
+    size_t slots = count > 0 ? count : 1;
+    char** commands = calloc(slots, sizeof(*commands));
+    size_t* lens = calloc(slots, sizeof(*lens));
+    size_t* command_shards = calloc(slots, sizeof(*command_shards));
+    size_t* indexes = calloc(slots, sizeof(*indexes));
+    redisReply** replies = calloc(slots, sizeof(*replies));
+    if (commands == NULL || lens == NULL || command_shards == NULL || indexes == NULL || replies == NULL) {
+        LOG_ERROR("Memory allocation failed for the pets");
+        free(commands);
+        free(lens);
+        free(command_shards);
+        free(indexes);
+        free(replies);
+        return false;
+    }
+    memset(pets, 0, count * sizeof(*pets));
+    // Ids that cannot be bucketed have no document
+    size_t command_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        char id[24];
+        sprintf(id, "%lld", ids[i]);
+        commands[command_count] = format_document_get(&storage, collection_name, id, &lens[command_count]);
+        if (commands[command_count] != NULL) {
+            command_shards[command_count] = shard_of(id);
+            indexes[command_count++] = i;
+        }
+    }
+
+    bool success = run_sharded_commands(commands, lens, command_shards, command_count, replies);
+    if (!success) {
+        LOG_ERROR("Error processing redis reply");
+    }
+    for (size_t j = 0; success && j < command_count; j++) {
+        const redisReply* reply = replies[j];
+        size_t i = indexes[j];
+        if (reply->type == REDIS_REPLY_STRING) {
+            char* json = document_json(reply->str, reply->len);
+            if (json == NULL || !pet_parse(json, strlen(json), &pets[i])) {
+                LOG_ERROR("Stored document %lld is not a valid pet", ids[i]);
+            }
+            free(json);
+        }
+        freeReplyObject(replies[j]);
+    }
+
+    free(commands);
+    free(lens);
+    free(command_shards);
+    free(indexes);
+    free(replies);
+    return success;
+}
+
+/**
+ * @brief Helper function to remove a document from a field index in the database
+ *
+ * @param field_id The field identifier
+ * @param value The value of the field, or NULL when the document has none
+ * @param id The id of the document
+ * @param op_num The number of operations
+ * @return true on success, false on failure
+ */
+bool remove_document_from_field(const char* field_id, const char* value, long long id, int* op_num) {
+    if (value != NULL) {
+        LOG_INFO("SREM %s:%s %lld", field_id, value, id);
+        redisAppendCommand(redis_context, "SREM %s:%s %lld", field_id, value, id);
+        (*op_num)++;
+    }
+    return true;
+}
+
+/**
+ * @brief Helper function to remove a document from a collection in the database
+ *
+ * Removes the id from the collection set and deletes the stored document.
+ *
+ * @param collection_name The name of the collection
+ * @param id The id of the document
+ * @param op_num The number of operations
+ * @return true on success, false on failure
+ */
+bool remove_document_from_collection(const char* collection_name, long long id, int* op_num) {
+    LOG_INFO("SREM %s:%s %lld", collection_name, collection_name, id);
+    redisAppendCommand(redis_context, "SREM %s:%s %lld", collection_name, collection_name, id);
+    (*op_num)++;
+
+    char id_str[24];
+    sprintf(id_str, "%lld", id);
+    if (!append_document_del(&storage, collection_name, id_str)) {
+        return false;
+    }
+    (*op_num)++;
+    return true;
+}
+
+/**
+ * @brief Helper function to store a document in the database
+ *
+ * @param collection_name The name of the collection
+ * @param json The JSON text of the document
+ * @param len The length of the JSON text
+ * @param id The id of the document
+ * @return true on success, false on failure
+ */
+bool store_document(const char* collection_name, const char* json, size_t len, long long id) {
+    char id_str[24];
+    sprintf(id_str, "%lld", id);
+    return append_document_set(&storage, collection_name, id_str, json, len);
+}
+
+/**
+ * @brief Helper function to build the key holding a document
+ *
+ * With the string layout a document is the value of <collection>:<id>. With the bucketed
+ * layout it is the field <id> of the hash <collection>:b:<id/N>, so that N documents share
+ * one key and small buckets keep the compact listpack encoding.
+ *
+ * @param layout The storage layout
+ * @param collection_name The name of the collection
+ * @param id The id of the document
+ * @return char* The key, or NULL if the id cannot be bucketed (not an integer).
+ *         The caller is responsible for freeing the returned string.
+ */
+static char* document_key(const struct db_storage* layout, const char* collection_name, const char* id) {
+    char* key = malloc(strlen(collection_name) + strlen(id) + strlen(BUCKET_PREFIX) + 24);
+    if (key == NULL) {
+        LOG_ERROR("Memory allocation failed for key");
+        return NULL;
+    }
+    if (layout->bucket_size == 0) {
+        sprintf(key, "%s:%s", collection_name, id);
+        return key;
+    }
+
+    char* end = NULL;
+    long long value = strtoll(id, &end, 10);
+    if (*id == '\0' || *end != '\0') {
+        LOG_ERROR("Document id %s cannot be bucketed", id);
+        free(key);
+        return NULL;
+    }
+    // Floor division so that negative ids get buckets of their own as well
+    long long n = layout->bucket_size;
+    long long bucket = value >= 0 ? value / n : -((-value + n - 1) / n);
+    sprintf(key, "%s:%s%lld", collection_name, BUCKET_PREFIX, bucket);
+    return key;
+}
+
+/**
+ * @brief Helper function to format the read of a document, for run_commands
+ *
+ * The reply is the stored document, or nil when it does not exist.
+ *
+ * @param len Set to the length of the command
+ * @return char* The command, or NULL if the id cannot be bucketed
+ */
+static char* format_document_get(const struct db_storage* layout, const char* collection_name, const char* id, size_t* len) {
+    char* key = document_key(layout, collection_name, id);
+    if (key == NULL) {
+        return NULL;
+    }
+    char* command = NULL;
+    if (layout->bucket_size == 0) {
+        LOG_INFO("GET %s", key);
+        command = format_command(len, "GET %s", key);
+    }
+    else {
+        LOG_INFO("HGET %s %s", key, id);
+        command = format_command(len, "HGET %s %s", key, id);
+    }
+    free(key);
+    return command;
+}
+
+/**
+ * @brief Helper function to queue the read of a document
+ *
+ * The reply is the stored document, or nil when it does not exist.
+ *
+ * @return true if the command was queued, false otherwise
+ */
+static bool append_document_get(redisContext* context, const struct db_storage* layout, const char* collection_name, const char* id) {
+    size_t len = 0;
+    char* command = format_document_get(layout, collection_name, id, &len);
+    if (command == NULL) {
+        return false;
+    }
+    redisAppendFormattedCommand(context, command, len);
+    redisFreeCommand(command);
+    return true;
+}
+
+/**
+ * @brief Helper function to queue the write of a document
+ *
+ * The document is given as JSON text and stored in the format of the layout.
+ *
+ * @return true if the command was queued, false otherwise
+ */
+static bool append_document_set(const struct db_storage* layout, const char* collection_name, const char* id, const char* data, size_t len) {
+    struct doc_buffer encoded = { 0 };
+    if (layout->format == DOC_FORMAT_MSGPACK) {
+        if (!doc_encode_msgpack(data, len, &encoded)) {
+            LOG_ERROR("Failed to encode document %s", id);
+            doc_buffer_free(&encoded);
+            return false;
+        }
+        data = encoded.data;
+        len = encoded.len;
+    }
+
+    char* key = document_key(layout, collection_name, id);
+    if (key == NULL) {
+        doc_buffer_free(&encoded);
+        return false;
+    }
+    if (layout->bucket_size == 0) {
+        LOG_INFO("SET %s <%zu bytes, %s>", key, len, doc_format_name(layout->format));
+        redisAppendCommand(redis_context, "SET %s %b", key, data, len);
+    }
+    else {
+        LOG_INFO("HSET %s %s <%zu bytes, %s>", key, id, len, doc_format_name(layout->format));
+        redisAppendCommand(redis_context, "HSET %s %s %b", key, id, data, len);
+    }
+    free(key);
+    doc_buffer_free(&encoded);
+    return true;
+}
+
+/**
+ * @brief Helper function to queue the removal of a document
+ *
+ * @return true if the command was queued, false otherwise
+ */
+static bool append_document_del(const struct db_storage* layout, const char* collection_name, const char* id) {
+    char* key = document_key(layout, collection_name, id);
+    if (key == NULL) {
+        return false;
+    }
+    if (layout->bucket_size == 0) {
+        LOG_INFO("DEL %s", key);
+        redisAppendCommand(redis_context, "DEL %s", key);
+    }
+    else {
+        LOG_INFO("HDEL %s %s", key, id);
+        redisAppendCommand(redis_context, "HDEL %s %s", key, id);
+    }
+    free(key);
+    return true;
+}
+
+/**
+ * @brief Select the layout of the stored documents
+ *
+ * @param layout The storage layout used by all reads and writes from now on
+ */
+void db_set_storage(const struct db_storage* layout) {
+    storage = *layout;
+    LOG_INFO("Document storage: %s (bucket size %u), %s encoding", storage.bucket_size ? "bucketed" : "string",
+        storage.bucket_size, doc_format_name(storage.format));
+}
+
+/**
+ * @brief Get the memory used by the Redis server
+ *
+ * @return long long The used_memory field of INFO memory in bytes, or -1 if unavailable
+ */
+long long db_used_memory() {
+    long long total = 0;
+    // Summed over the shards
+    size_t servers = shard_ring != NULL ? shard_count : 1;
+    for (size_t s = 0; total >= 0 && s < servers; s++) {
+        long long used = -1;
+        redisContext* context = shard_ring != NULL ? shard_connection(s) : redis_context;
+        redisReply* reply = context != NULL ? redisCommand(context, "INFO memory") : NULL;
+        if (reply && reply->type == REDIS_REPLY_STRING) {
+            const char* field = strstr(reply->str, "used_memory:");
+            if (field) {
+                used = strtoll(field + strlen("used_memory:"), NULL, 10);
+            }
+        }
+        if (reply) {
+            freeReplyObject(reply);
+        }
+        total = used < 0 ? -1 : total + used;
+    }
+    return total;
+}
+
+/**
+ * @brief Helper function to move one batch of documents between two layouts
+ *
+ * Documents stored in any format are rewritten in the format of the target layout.
+ *
+ * @param collection_name The name of the collection
+ * @param ids The ids of the batch (an array reply of SSCAN)
+ * @param from The current layout
+ * @param to The target layout
+ * @param migrated Incremented by the number of documents moved
+ * @return true on success, false on failure
+ */
+static bool migrate_batch(const char* collection_name, const redisReply* ids, const struct db_storage* from,
+    const struct db_storage* to, size_t* migrated) {
+    int op_num = 0;
+    for (size_t i = 0; i < ids->elements; i++) {
+        if (!append_document_get(redis_context, from, collection_name, ids->element[i]->str)) {
+            processRedisReplies(op_num);
+            return false;
+        }
+        op_num++;
+    }
+
+    // Documents are kept as JSON text and re-encoded in the format of the target layout
+    char** docs = calloc(ids->elements ? ids->elements : 1, sizeof(char*));
+    if (docs == NULL) {
+        LOG_ERROR("Memory allocation failed for migration batch");
+        processRedisReplies(op_num);
+        return false;
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < ids->elements; i++) {
+        redisReply* reply = NULL;
+        if (redisGetReply(redis_context, (void**)&reply) != REDIS_OK) {
+            freeReplyAndLogError(reply, "Error processing redis reply");
+            success = false;
+            break;
+        }
+        if (reply->type == REDIS_REPLY_STRING) {
+            docs[i] = document_json(reply->str, reply->len);
+        }
+        freeReplyObject(reply);
+    }
+
+    // Write every document to its new place before dropping the old copy; the old copy is
+    // kept when both layouts resolve to the same key and field
+    op_num = 0;
+    for (size_t i = 0; success && i < ids->elements; i++) {
+        if (docs[i] == NULL) {
+            continue;
+        }
+        const char* id = ids->element[i]->str;
+        char* from_key = document_key(from, collection_name, id);
+        char* to_key = document_key(to, collection_name, id);
+        bool same = from_key && to_key && (from->bucket_size == 0) == (to->bucket_size == 0) &&
+            strcmp(from_key, to_key) == 0;
+        free(from_key);
+        free(to_key);
+
+        if (!append_document_set(to, collection_name, id, docs[i], strlen(docs[i]))) {
+            success = false;
+            break;
+        }
+        op_num++;
+        if (!same) {
+            if (!append_document_del(from, collection_name, id)) {
+                success = false;
+                break;
+            }
+            op_num++;
+        }
+        (*migrated)++;
+    }
+    success = processRedisReplies(op_num) && success;
+
+    for (size_t i = 0; i < ids->elements; i++) {
+        free(docs[i]);
+    }
+    free(docs);
+    return success;
+}
+
+// Helper function to migrate the documents of the server of redis_context
+static bool migrate_shard(const char* collection_name, const struct db_storage* from, const struct db_storage* to, size_t* migrated) {
+    char cursor[32] = "0";
+    do {
+        LOG_INFO("SSCAN %s:%s %s COUNT %d", collection_name, collection_name, cursor, MIGRATE_SCAN_COUNT);
+        redisReply* reply = redisCommand(redis_context, "SSCAN %s:%s %s COUNT %d", collection_name, collection_name, cursor, MIGRATE_SCAN_COUNT);
+        if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+            freeReplyAndLogError(reply, "Failed to scan the collection");
+            return false;
+        }
+        snprintf(cursor, sizeof(cursor), "%s", reply->element[0]->str);
+        bool success = migrate_batch(collection_name, reply->element[1], from, to, migrated);
+        freeReplyObject(reply);
+        if (!success) {
+            return false;
+        }
+    } while (strcmp(cursor, "0") != 0);
+    return true;
+}
+
+/**
+ * @brief Move the documents of a collection from one storage layout to another
+ *
+ * The ids are scanned from the <collection>:<collection> set in batches; every batch is
+ * read with one pipeline and rewritten with another.
+ *
+ * @param collection_name The name of the collection
+ * @param from The current layout
+ * @param to The target layout
+ * @param migrated Set to the number of documents moved
+ * @return true on success, false on failure
+ */
+bool db_migrate_storage(const char* collection_name, const struct db_storage* from, const struct db_storage* to, size_t* migrated) {
+    *migrated = 0;
+    // Every shard migrates its own documents
+    size_t servers = shard_ring != NULL ? shard_count : 1;
+    for (size_t s = 0; s < servers; s++) {
+        redisContext* previous = NULL;
+        bool success = shard_enter(s, &previous) && migrate_shard(collection_name, from, to, migrated);
+        shard_leave(previous);
+        if (!success) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Helper function to get the connection to a node of the current layout
+static redisContext* node_connection(size_t node) {
+    return shard_ring != NULL ? shard_connection(node) : pthread_getspecific(connection_key);
+}
+
+/**
+ * @brief Helper function to move a document from the server of redis_context to its shard
+ *
+ * The document is written on its shard before it is removed from the old one, so that an
+ * interrupted rebalance leaves copies, never losses: running it again finishes the move.
+ * A pet gets a version above the one it had, so that stale conditional writes still fail.
+ *
+ * @param collection_name The name of the collection
+ * @param id The id of the document
+ * @param pets true for a pet, false for a user
+ * @param target The shard of the document
+ * @return true on success, false on failure
+ */
+static bool rebalance_document(const char* collection_name, const char* id, bool pets, size_t target) {
+    redisContext* source = redis_context;
+    size_t len = 0;
+    char* command = format_document_get(&storage, collection_name, id, &len);
+    if (command == NULL) {
+        // Ids that cannot be bucketed have no document
+        return true;
+    }
+    redisAppendFormattedCommand(source, command, len);
+    redisFreeCommand(command);
+    LOG_INFO("HGET %s:%s %s", collection_name, VERSIONS_KEY, id);
+    redisAppendCommand(source, "HGET %s:%s %s", collection_name, VERSIONS_KEY, id);
+    redisReply* doc = NULL;
+    redisReply* version_reply = NULL;
+    if (redisGetReply(source, (void**)&doc) != REDIS_OK || redisGetReply(source, (void**)&version_reply) != REDIS_OK) {
+        if (doc) {
+            freeReplyObject(doc);
+        }
+        freeReplyAndLogError(version_reply, "Failed to read the document to move");
+        return false;
+    }
+    char* json = doc->type == REDIS_REPLY_STRING ? document_json(doc->str, doc->len) : NULL;
+    long long version = reply_version(version_reply);
+    freeReplyObject(doc);
+    freeReplyObject(version_reply);
+    if (json == NULL) {
+        LOG_WARN("Document %s is listed in %s but not stored, left in place", id, collection_name);
+        return true;
+    }
+
+    struct pet pet;
+    struct user user;
+    bool parsed = pets ? pet_parse(json, strlen(json), &pet) : user_parse(json, strlen(json), &user);
+    free(json);
+    if (!parsed) {
+        LOG_ERROR("Stored document %s is not valid", id);
+        return false;
+    }
+
+    int op_num = 0;
+    redis_context = node_connection(target);
+    bool queued = redis_context != NULL &&
+        (pets ? append_pet_insert(collection_name, &pet, &op_num) : append_user_insert(collection_name, &user, &op_num));
+    if (queued && pets && version > 0) {
+        LOG_INFO("HINCRBY %s:%s %s %lld", collection_name, VERSIONS_KEY, id, version);
+        redisAppendCommand(redis_context, "HINCRBY %s:%s %s %lld", collection_name, VERSIONS_KEY, id, version);
+        op_num++;
+    }
+    bool success = processRedisReplies(op_num) && queued;
+    redis_context = source;
+
+    if (success) {
+        op_num = 0;
+        queued = pets ? append_pet_delete(collection_name, &pet, &op_num) : append_user_delete(collection_name, &user, &op_num);
+        if (queued && pets) {
+            LOG_INFO("HDEL %s:%s %s", collection_name, VERSIONS_KEY, id);
+            redisAppendCommand(redis_context, "HDEL %s:%s %s", collection_name, VERSIONS_KEY, id);
+            op_num++;
+        }
+        success = processRedisReplies(op_num) && queued;
+    }
+    if (pets) {
+        pet_free(&pet);
+    }
+    else {
+        user_free(&user);
+    }
+    return success;
+}
+
+// Helper function to move the documents of the server of redis_context that belong to other shards
+static bool rebalance_node(const char* collection_name, bool pets, size_t node, size_t* moved) {
+    char cursor[32] = "0";
+    do {
+        LOG_INFO("SSCAN %s:%s %s COUNT %d", collection_name, collection_name, cursor, MIGRATE_SCAN_COUNT);
+        redisReply* reply = redisCommand(redis_context, "SSCAN %s:%s %s COUNT %d", collection_name, collection_name, cursor, MIGRATE_SCAN_COUNT);
+        if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+            freeReplyAndLogError(reply, "Failed to scan the collection");
+            return false;
+        }
+        snprintf(cursor, sizeof(cursor), "%s", reply->element[0]->str);
+        const redisReply* ids = reply->element[1];
+        bool success = true;
+        for (size_t i = 0; success && i < ids->elements; i++) {
+            size_t target = shard_of(ids->element[i]->str);
+            if (target == node) {
+                continue;
+            }
+            success = rebalance_document(collection_name, ids->element[i]->str, pets, target);
+            if (success) {
+                (*moved)++;
+            }
+        }
+        freeReplyObject(reply);
+        if (!success) {
+            return false;
+        }
+    } while (strcmp(cursor, "0") != 0);
+    return true;
+}
+
+// Helper function to move the documents of every old node that belong to another shard
+static bool rebalance(const char* collection_name, const char* from_uris, bool pets, size_t* moved) {
+    *moved = 0;
+    char* list = strdup(from_uris);
+    if (list == NULL) {
+        LOG_ERROR("Memory allocation failed for the shards");
+        return false;
+    }
+    size_t servers = shard_ring != NULL ? shard_count : 1;
+    bool success = true;
+    char* saveptr = NULL;
+    for (char* uri = strtok_r(list, ",", &saveptr); success && uri != NULL; uri = strtok_r(NULL, ",", &saveptr)) {
+        // A node kept in the new layout is reached through its shard connection, a removed one directly
+        size_t node = servers;
+        for (size_t i = 0; i < servers; i++) {
+            const char* current = shard_ring != NULL ? shards[i].uri : redis_uri;
+            if (strcmp(shard_ring_node_id(uri), shard_ring_node_id(current)) == 0) {
+                node = i;
+            }
+        }
+        redisContext* removed = node == servers ? db_connect(uri) : NULL;
+        redisContext* source = node == servers ? removed : node_connection(node);
+        if (source == NULL) {
+            LOG_ERROR("Failed to connect to %s", shard_ring_node_id(uri));
+            success = false;
+            break;
+        }
+        LOG_INFO("Rebalancing %s from %s", collection_name, shard_ring_node_id(uri));
+        redisContext* previous = redis_context;
+        redis_context = source;
+        success = rebalance_node(collection_name, pets, node, moved);
+        redis_context = previous;
+        if (removed != NULL) {
+            redisFree(removed);
+        }
+    }
+    free(list);
+    return success;
+}
+
+/**
+ * @brief Move the pets of a collection to the shards they belong to after the shards changed
+ *
+ * The current shards are those of db_init and db_shards_init. Every old node is scanned,
+ * and the pets it holds that now belong to another shard are moved there with their index
+ * entries and versions. Writes must be stopped while the pets move.
+ *
+ * @param collection_name The name of the collection
+ * @param from_uris The comma separated URIs of the shards the pets were spread over
+ * @param moved Set to the number of pets moved
+ * @return true on success, false on failure
+ */
+bool db_rebalance_pets(const char* collection_name, const char* from_uris, size_t* moved) {
+    return rebalance(collection_name, from_uris, true, moved);
+}
+
+/**
+ * @brief Move the users of a collection to the shards they belong to after the shards changed
+ *
+ * @param collection_name The name of the collection
+ * @param from_uris The comma separated URIs of the shards the users were spread over
+ * @param moved Set to the number of users moved
+ * @return true on success, false on failure
+ */
+bool db_rebalance_users(const char* collection_name, const char* from_uris, size_t* moved) {
+    return rebalance(collection_name, from_uris, false, moved);
+}
+
+/**
+ * @brief Helper function to apply a pet insert or delete to the negative lookup filter
+ *
+ * Deletes are not applied to a filter being rebuilt: the scan may not have added the id yet,
+ * and removing it would decrement counters shared with ids already scanned. The deleted id
+ * stays in the new filter as a false positive until the following rebuild.
+ *
+ * @param id The id of the pet
+ * @param add true when the pet was inserted, false when it was deleted
+ */
+static void pet_filter_update(long long id, bool add) {
+    char key[24];
+    int len = sprintf(key, "%lld", id);
+
+    pthread_mutex_lock(&pet_filter_lock);
+    struct id_filter* filters[2] = { pet_filter, pet_filter_next };
+    for (int i = 0; i < 2; i++) {
+        if (filters[i] == NULL) {
+            continue;
+        }
+        if (add) {
+            id_filter_add(filters[i], key, (size_t)len);
+        }
+        else if (filters[i] == pet_filter) {
+            id_filter_remove(filters[i], key, (size_t)len);
+        }
+    }
+    pthread_mutex_unlock(&pet_filter_lock);
+}
+
+/**
+ * @brief Helper function to rebuild the pet filter by scanning the pets:pets set
+ *
+ * Inserts made while the scan is running are added to the new filter as well, and deletes
+ * are left out of it, so a rebuild can only add false positives, never false negatives.
+ *
+ * @param context The Redis connection used for the scan
+ * @return true on success, false on failure
+ */
+static bool pet_filter_rebuild(redisContext** contexts, size_t count) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Size the new filter for the current number of pets on every shard, with room to grow
+    size_t capacity = pet_filter_capacity;
+    size_t pets = 0;
+    redisReply* reply = NULL;
+    for (size_t s = 0; s < count; s++) {
+        reply = redisCommand(contexts[s], "SCARD pets:pets");
+        if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+            freeReplyAndLogError(reply, "Failed to count pets for the pet filter");
+            return false;
+        }
+        pets += (size_t)reply->integer;
+        freeReplyObject(reply);
+    }
+    if (pets * 2 > capacity) {
+        capacity = pets * 2;
+    }
+
+    struct id_filter* filter = id_filter_create(capacity, pet_filter_fp_rate);
+    if (filter == NULL) {
+        LOG_ERROR("Memory allocation failed for the pet filter");
+        return false;
+    }
+    pthread_mutex_lock(&pet_filter_lock);
+    pet_filter_next = filter;
+    pthread_mutex_unlock(&pet_filter_lock);
+
+    bool success = true;
+    for (size_t s = 0; success && s < count; s++) {
+        char cursor[32] = "0";
+        do {
+            reply = redisCommand(contexts[s], "SSCAN pets:pets %s COUNT %d", cursor, PET_FILTER_SCAN_COUNT);
+            if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+                freeReplyAndLogError(reply, "Failed to scan pets for the pet filter");
+                success = false;
+                break;
+            }
+            snprintf(cursor, sizeof(cursor), "%s", reply->element[0]->str);
+            redisReply* ids = reply->element[1];
+            pthread_mutex_lock(&pet_filter_lock);
+            for (size_t i = 0; i < ids->elements; i++) {
+                id_filter_add(filter, ids->element[i]->str, ids->element[i]->len);
+            }
+            pthread_mutex_unlock(&pet_filter_lock);
+            freeReplyObject(reply);
+        } while (strcmp(cursor, "0") != 0);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    struct id_filter* old = NULL;
+    pthread_mutex_lock(&pet_filter_lock);
+    pet_filter_next = NULL;
+    if (success) {
+        old = pet_filter;
+        pet_filter = filter;
+        pet_filter_stats.rebuilds++;
+        pet_filter_stats.last_rebuild_ms = elapsed_ms;
+        LOG_INFO("Pet filter rebuilt: %zu ids, %zu bytes, estimated false positive rate %.4f, %.1f ms",
+            id_filter_count(filter), id_filter_size(filter), id_filter_estimated_fp_rate(filter), elapsed_ms);
+    }
+    pthread_mutex_unlock(&pet_filter_lock);
+    id_filter_free(success ? old : filter);
+    return success;
+}
+
+/**
+ * @brief Background task rebuilding the pet filter periodically on connections of its own
+ */
+static void* pet_filter_main(void* arg) {
+    (void)arg; // Mark unused parameter
+    // One connection per shard
+    size_t servers = shard_ring != NULL ? shard_count : 1;
+    redisContext** contexts = calloc(servers, sizeof(*contexts));
+    if (contexts == NULL) {
+        LOG_ERROR("Memory allocation failed for the pet filter connections");
+        return NULL;
+    }
+    unsigned int elapsed = 0;
+
+    while (pet_filter_running) {
+        sleep(1);
+        if (++elapsed < pet_filter_rebuild_sec) {
+            continue;
+        }
+        elapsed = 0;
+
+        bool connected = true;
+        for (size_t s = 0; connected && s < servers; s++) {
+            if (contexts[s] == NULL) {
+                contexts[s] = db_connect(shard_ring != NULL ? shards[s].uri : redis_uri);
+            }
+            connected = contexts[s] != NULL;
+        }
+        if (!connected || !pet_filter_rebuild(contexts, servers)) {
+            // Drop the connections so the next rebuild starts from a clean state
+            for (size_t s = 0; s < servers; s++) {
+                if (contexts[s]) {
+                    redisFree(contexts[s]);
+                    contexts[s] = NULL;
+                }
+            }
+        }
+    }
+
+    for (size_t s = 0; s < servers; s++) {
+        if (contexts[s]) {
+            redisFree(contexts[s]);
+        }
+    }
+    free(contexts);
+    return NULL;
+}
+
+/**
+ * @brief Build the pet filter and start its periodic rebuilds
+ *
+ * @param capacity The number of ids the filter is sized for
+ * @param fp_rate The target false positive rate
+ * @param rebuild_interval_sec The interval between rebuilds in seconds (0 disables rebuilds)
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int db_pet_filter_init(size_t capacity, double fp_rate, unsigned int rebuild_interval_sec) {
+    pet_filter_capacity = capacity;
+    pet_filter_fp_rate = fp_rate;
+    pet_filter_rebuild_sec = rebuild_interval_sec;
+
+    size_t servers = shard_ring != NULL ? shard_count : 1;
+    redisContext** contexts = calloc(servers, sizeof(*contexts));
+    bool connected = contexts != NULL;
+    for (size_t s = 0; connected && s < servers; s++) {
+        contexts[s] = shard_ring != NULL ? shard_connection(s) : redis_context;
+        connected = contexts[s] != NULL;
+    }
+    bool built = connected && pet_filter_rebuild(contexts, servers);
+    free(contexts);
+    if (!built) {
+        return EXIT_FAILURE;
+    }
+
+    if (rebuild_interval_sec > 0) {
+        pet_filter_running = 1;
+        if (pthread_create(&pet_filter_thread, NULL, pet_filter_main, NULL) != 0) {
+            LOG_ERROR("Failed to start the pet filter rebuild thread");
+            pet_filter_running = 0;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Check the pet filter for an id
+ *
+ * @param id The id of the pet
+ * @return false when the pet definitely does not exist, true otherwise
  */
-cJSON* db_find_one(const char* collection_name, const char* id) {
-    cJSON* result = NULL;
-    redisReply* reply = NULL;
+bool db_pet_filter_might_contain(const char* id) {
+    bool result = true;
+    pthread_mutex_lock(&pet_filter_lock);
+    if (pet_filter) {
+        pet_filter_stats.lookups++;
+        result = id_filter_might_contain(pet_filter, id, strlen(id));
+        if (!result) {
+            pet_filter_stats.definite_misses++;
+        }
+    }
+    pthread_mutex_unlock(&pet_filter_lock);
+    return result;
+}
 
-    LOG_INFO("GET %s:%s", collection_name, id);
-    redisAppendCommand(redis_context, "GET %s:%s", collection_name, id);
+/**
+ * @brief Record a lookup that passed the pet filter but found no pet
+ */
+void db_pet_filter_report_false_positive() {
+    pthread_mutex_lock(&pet_filter_lock);
+    if (pet_filter) {
+        pet_filter_stats.false_positives++;
+    }
+    pthread_mutex_unlock(&pet_filter_lock);
+}
 
-    if (redisGetReply(redis_context, (void**)&reply) == REDIS_OK) {
-        if (reply == NULL || reply->type != REDIS_REPLY_STRING) {
-            freeReplyAndLogError(reply, "Failed to retrieve response");
-            return NULL;
-        }
-        char* json = strdup(reply->str);
-        result = cJSON_Parse(json);
+/**
+ * @brief Get the pet filter metrics
+ *
+ * @return cJSON* A JSON object with the filter metrics, or NULL when the filter is disabled
+ */
+cJSON* db_pet_filter_stats() {
+    pthread_mutex_lock(&pet_filter_lock);
+    if (pet_filter == NULL) {
+        pthread_mutex_unlock(&pet_filter_lock);
+        return NULL;
+    }
+
+    // Observed rate: lookups of missing ids that the filter let through
+    unsigned long negatives = pet_filter_stats.definite_misses + pet_filter_stats.false_positives;
+    cJSON* stats = cJSON_CreateObject();
+    cJSON_AddNumberToObject(stats, "ids", (double)id_filter_count(pet_filter));
+    cJSON_AddNumberToObject(stats, "sizeBytes", (double)id_filter_size(pet_filter));
+    cJSON_AddNumberToObject(stats, "lookups", (double)pet_filter_stats.lookups);
+    cJSON_AddNumberToObject(stats, "definiteMisses", (double)pet_filter_stats.definite_misses);
+    cJSON_AddNumberToObject(stats, "falsePositives", (double)pet_filter_stats.false_positives);
+    cJSON_AddNumberToObject(stats, "falsePositiveRate", negatives ? (double)pet_filter_stats.false_positives / negatives : 0);
+    cJSON_AddNumberToObject(stats, "estimatedFalsePositiveRate", id_filter_estimated_fp_rate(pet_filter));
+    cJSON_AddNumberToObject(stats, "rebuilds", (double)pet_filter_stats.rebuilds);
+    cJSON_AddNumberToObject(stats, "lastRebuildMs", pet_filter_stats.last_rebuild_ms);
+    pthread_mutex_unlock(&pet_filter_lock);
+    return stats;
+}
+
+/**
+ * @brief Helper function to run a command and return its string reply
+ *
+ * @param format The command format, as for redisCommand
+ * @return char* A copy of the string reply, or NULL if the reply is not a string.
+ *         The caller is responsible for freeing the returned string.
+ */
+static char* db_command_string(const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    redisReply* reply = redisvCommand(redis_context, format, ap);
+    va_end(ap);
+
+    char* result = NULL;
+    if (reply && reply->type == REDIS_REPLY_STRING) {
+        result = strndup(reply->str, reply->len);
+    }
+    if (reply) {
         freeReplyObject(reply);
-        free(json);
-        if (result == NULL) {
-            LOG_ERROR("Failed to parse JSON");
-            return NULL;
+    }
+    return result;
+}
+
+/**
+ * @brief Helper function to run the username lookup script
+ *
+ * The script is loaded once and then invoked with EVALSHA; it is reloaded if Redis
+ * answers NOSCRIPT (e.g. after a restart or SCRIPT FLUSH).
+ *
+ * @param index_key The key of the username index
+ * @param username The username to look up
+ * @param prefix The key prefix of the documents
+ * @return redisReply* The script reply, or NULL on a connection error
+ */
+static redisReply* eval_user_by_username(const char* index_key, const char* username, const char* prefix) {
+    char bucket_size[16];
+    sprintf(bucket_size, "%u", storage.bucket_size);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (user_by_username_sha[0] == '\0') {
+            redisReply* load = redisCommand(redis_context, "SCRIPT LOAD %s", USER_BY_USERNAME_SCRIPT);
+            if (load == NULL || load->type != REDIS_REPLY_STRING || load->len != 40) {
+                // Scripting not available: hand the error back to the caller
+                return load;
+            }
+            memcpy(user_by_username_sha, load->str, 40);
+            freeReplyObject(load);
+        }
+
+        LOG_INFO("EVALSHA %s 1 %s %s %s %s", user_by_username_sha, index_key, username, prefix, bucket_size);
+        redisReply* reply = redisCommand(redis_context, "EVALSHA %s 1 %s %s %s %s", user_by_username_sha, index_key, username, prefix, bucket_size);
+        if (reply && reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "NOSCRIPT", 8) == 0) {
+            freeReplyObject(reply);
+            user_by_username_sha[0] = '\0';
+            continue;
         }
+        return reply;
     }
-    else {
-        LOG_ERROR("Failed to retrieve response");
+    return NULL;
+}
+
+// Helper function to look a username up on the server of redis_context
+static char* find_user_by_username(const char* collection_name, const char* username, const char* index_key, const char* prefix) {
+    char* json = NULL;
+    redisReply* reply = eval_user_by_username(index_key, username, prefix);
+    if (reply && reply->type == REDIS_REPLY_STRING) {
+        json = document_json(reply->str, reply->len);
     }
-    return result;
+    else if (reply && reply->type == REDIS_REPLY_ERROR) {
+        // Without scripting the index is read with two round trips
+        char* id = db_command_string("HGET %s %s", index_key, username);
+        if (id) {
+            json = db_find_one_json(collection_name, id);
+            free(id);
+        }
+    }
+    if (reply) {
+        freeReplyObject(reply);
+    }
+
+    if (json == NULL) {
+        // Fall back to the legacy username set and backfill the index
+        LOG_INFO("SRANDMEMBER %s:username:%s", collection_name, username);
+        char* id = db_command_string("SRANDMEMBER %s:username:%s", collection_name, username);
+        if (id) {
+            json = db_find_one_json(collection_name, id);
+            if (json) {
+                LOG_INFO("HSET %s %s %s", index_key, username, id);
+                redisReply* backfill = redisCommand(redis_context, "HSET %s %s %s", index_key, username, id);
+                if (backfill) {
+                    freeReplyObject(backfill);
+                }
+            }
+            free(id);
+        }
+    }
+    return json;
 }
+
 /**
- * @brief Find documents in the database based on a query
+ * @brief Find a user document by username through the username index
+ *
+ * The lookup costs a single round trip. Users stored before the index existed are
+ * found through the legacy username sets and added to the index. With sharding, the
+ * shards are asked in turn until one knows the username.
  *
  * @param collection_name The name of the collection
- * @param query The JSON query object
- * @return cJSON* The JSON array of documents found, or NULL on failure
+ * @param username The username to look up
+ * @return char* The stored JSON document, or NULL if no user has this username.
+ *         The caller is responsible for freeing the returned string.
  */
-cJSON* db_find(const char* collection_name, const cJSON* query) {
-    int op_num = 0;
-    int op_getid_num = 0;
+char* db_find_user_by_username(const char* collection_name, const char* username) {
+    char* json = NULL;
+    char* index_key = malloc(strlen(collection_name) + strlen(USERNAME_INDEX) + 2);
+    char* prefix = malloc(strlen(collection_name) + 2);
+    if (index_key == NULL || prefix == NULL) {
+        LOG_ERROR("Memory allocation failed for key");
+        free(index_key);
+        free(prefix);
+        return NULL;
+    }
+    sprintf(index_key, "%s:%s", collection_name, USERNAME_INDEX);
+    sprintf(prefix, "%s:", collection_name);
+
+    // The index entry of a user lives on the shard of the user: the shards are asked in turn
+    size_t servers = shard_ring != NULL ? shard_count : 1;
+    for (size_t s = 0; json == NULL && s < servers; s++) {
+        redisContext* previous = NULL;
+        if (shard_enter(s, &previous)) {
+            json = find_user_by_username(collection_name, username, index_key, prefix);
+        }
+        shard_leave(previous);
+    }
 
-    LOG_INFO("db_find query: %s", cJSON_PrintUnformatted(query));
+    free(index_key);
+    free(prefix);
+    return json;
+}
 
-    cJSON* operator_obj = cJSON_GetObjectItem(query, "operator");
-    if (operator_obj == NULL) {
-        LOG_ERROR("Query does not contain an operator");
-        return NULL;
+/**
+ * Arguments of a script call, built up command by command.
+ */
+struct script_args {
+    char** argv;
+    size_t* argvlen;
+    size_t count;
+    size_t cap;
+};
+
+// Helper function to append a copy of an argument
+static bool args_push(struct script_args* args, const char* data, size_t len) {
+    if (args->count == args->cap) {
+        size_t cap = args->cap ? args->cap * 2 : 32;
+        char** argv = realloc(args->argv, cap * sizeof(*argv));
+        if (argv == NULL) {
+            return false;
+        }
+        args->argv = argv;
+        size_t* argvlen = realloc(args->argvlen, cap * sizeof(*argvlen));
+        if (argvlen == NULL) {
+            return false;
+        }
+        args->argvlen = argvlen;
+        args->cap = cap;
     }
-    cJSON* field_obj = cJSON_GetObjectItem(query, "field");
-    if (field_obj == NULL) {
-        LOG_ERROR("Query does not contain a field");
-        return NULL;
+    char* copy = malloc(len + 1);
+    if (copy == NULL) {
+        return false;
     }
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    args->argv[args->count] = copy;
+    args->argvlen[args->count] = len;
+    args->count++;
+    return true;
+}
 
-    cJSON* value_obj = cJSON_GetObjectItem(query, "value");
-    if (value_obj == NULL) {
-        LOG_ERROR("Query does not contain a value");
-        return NULL;
+// Helper function to append a formatted argument
+static bool args_pushf(struct script_args* args, const char* format, ...) {
+    char buffer[256];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, ap);
+    va_end(ap);
+    if (len < 0) {
+        return false;
     }
-    if (!cJSON_IsArray(value_obj)) {
-        LOG_ERROR("Value is not an array");
-        return NULL;
+    if ((size_t)len < sizeof(buffer)) {
+        return args_push(args, buffer, (size_t)len);
     }
 
-    int array_size = cJSON_GetArraySize(value_obj);
-    for (int i = 0; i < array_size; i++) {
-        cJSON* value = cJSON_GetArrayItem(value_obj, i);
-        if (value == NULL) {
-            LOG_ERROR("Value is not a string");
-            return NULL;
+    // Longer arguments are formatted again into a buffer of their size
+    char* arg = malloc((size_t)len + 1);
+    if (arg == NULL) {
+        return false;
+    }
+    va_start(ap, format);
+    vsnprintf(arg, (size_t)len + 1, format, ap);
+    va_end(ap);
+    bool pushed = args_push(args, arg, (size_t)len);
+    free(arg);
+    return pushed;
+}
+
+static void args_free(struct script_args* args) {
+    for (size_t i = 0; i < args->count; i++) {
+        free(args->argv[i]);
+    }
+    free(args->argv);
+    free(args->argvlen);
+}
+
+/**
+ * @brief Helper function to append the index commands of a pet to a versioned write
+ *
+ * @param args The script arguments
+ * @param collection_name The name of the collection
+ * @param pet The pet
+ * @param command SADD to add the pet to its indexes, SREM to remove it
+ * @return true on success, false on failure
+ */
+static bool args_push_pet_indexes(struct script_args* args, const char* collection_name, const struct pet* pet, const char* command) {
+    bool success = true;
+    if (pet->status != NULL) {
+        success = args_push(args, "3", 1) && args_pushf(args, "%s", command) &&
+            args_pushf(args, "%s:status:%s", collection_name, pet->status) && args_pushf(args, "%lld", pet->id) &&
+            args_push(args, "4", 1) && args_push(args, "HINCRBY", 7) &&
+            args_pushf(args, "%s:%s", collection_name, GENERATIONS_KEY) && args_pushf(args, "status:%s", pet->status) && args_push(args, "1", 1);
+    }
+    for (size_t i = 0; success && i < pet->tag_count; i++) {
+        const char* name = pet->tags[i].name;
+        if (name != NULL) {
+            success = args_push(args, "3", 1) && args_pushf(args, "%s", command) &&
+                args_pushf(args, "%s:tags:%s", collection_name, name) && args_pushf(args, "%lld", pet->id) &&
+                args_push(args, "4", 1) && args_push(args, "HINCRBY", 7) &&
+                args_pushf(args, "%s:%s", collection_name, GENERATIONS_KEY) && args_pushf(args, "tags:%s", name) && args_push(args, "1", 1);
         }
-        LOG_INFO("SMEMBERS %s:%s", field_obj->valuestring, value->valuestring);
-        redisAppendCommand(redis_context, "SMEMBERS %s:%s", field_obj->valuestring, value->valuestring);
-        op_num++;
     }
+    return success;
+}
 
-    redisReply* reply = NULL;
-    for (int i = 0; i < op_num; i++) {
-        int resultCode = redisGetReply(redis_context, (void**)&reply);
-        if (resultCode == REDIS_OK) {
-            for (size_t j = 0; j < reply->elements; j++) {
-                char* set_id = reply->element[j]->str;
-                LOG_INFO("GET %s:%s", collection_name, set_id);
-                redisAppendCommand(redis_context, "GET %s:%s", collection_name, set_id);
-                op_getid_num++;
+/**
+ * @brief Helper function to run the versioned write script
+ *
+ * The script is loaded once and then invoked with EVALSHA; it is reloaded if Redis
+ * answers NOSCRIPT. The first two arguments are reserved for EVALSHA and the SHA1.
+ *
+ * @param args The script arguments
+ * @return redisReply* The script reply, or NULL on a connection error
+ */
+static redisReply* eval_versioned_write(struct script_args* args) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (versioned_write_sha[0] == '\0') {
+            redisReply* load = redisCommand(redis_context, "SCRIPT LOAD %s", VERSIONED_WRITE_SCRIPT);
+            if (load == NULL || load->type != REDIS_REPLY_STRING || load->len != 40) {
+                // Scripting not available: hand the error back to the caller
+                return load;
             }
-            freeReplyObject(reply);
+            memcpy(versioned_write_sha, load->str, 40);
+            freeReplyObject(load);
         }
-        else {
-            freeReplyAndLogError(reply, "Error processing redis reply");
-            return NULL;
+        memcpy(args->argv[1], versioned_write_sha, 40);
+
+        LOG_INFO("EVALSHA %s 1 %s %s %s <%zu arguments>", args->argv[1], args->argv[3], args->argv[4], args->argv[5], args->count - 6);
+        redisReply* reply = redisCommandArgv(redis_context, (int)args->count, (const char**)args->argv, args->argvlen);
+        if (reply && reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "NOSCRIPT", 8) == 0) {
+            freeReplyObject(reply);
+            versioned_write_sha[0] = '\0';
+            continue;
         }
+        return reply;
     }
+    return NULL;
+}
 
-    reply = NULL;
-    cJSON* result = cJSON_CreateArray();
-    for (int i = 0; i < op_getid_num; i++) {
-        int resultCode = redisGetReply(redis_context, (void**)&reply);
-        if (resultCode == REDIS_OK) {
-            
-            if (reply->type == REDIS_REPLY_STRING) {
-                char* json = strdup(reply->str);
-                cJSON* doc = cJSON_Parse(json);
-                free(json);
-                if (doc != NULL) {
-                    cJSON_AddItemToArray(result, doc);
-                }
-            }
-            freeReplyObject(reply);
+/**
+ * @brief Update a pet document only if it is still at the given version
+ *
+ * The stored pet and its version are read in one round trip, then the update is applied
+ * by a script that compares the version and writes the indexes, the document and the new
+ * version atomically, in a second round trip.
+ *
+ * @param collection_name The name of the collection
+ * @param update The pet replacing the stored one with the same id
+ * @param expected_version The version the update is based on, or -1 for any existing version
+ * @param new_version Set to the version of the updated document
+ * @return enum db_write_result DB_WRITE_CONFLICT if the pet does not exist or has another version
+ */
+enum db_write_result db_pet_update_versioned(const char* collection_name, const struct pet* update, long long expected_version, long long* new_version) {
+    if (!update->has_id || update->status == NULL) {
+        LOG_ERROR("Update document does not contain an id and a status");
+        return DB_WRITE_FAILED;
+    }
+    char id[24];
+    sprintf(id, "%lld", update->id);
+
+    long long version = -1;
+    char* json = db_find_one_json_versioned(collection_name, id, &version);
+    if (json == NULL) {
+        LOG_ERROR("Document not found");
+        return version < 0 ? DB_WRITE_FAILED : DB_WRITE_CONFLICT;
+    }
+    if (version < 0 || (expected_version >= 0 && version != expected_version)) {
+        free(json);
+        return version < 0 ? DB_WRITE_FAILED : DB_WRITE_CONFLICT;
+    }
+
+    struct pet stored;
+    bool parsed = pet_parse(json, strlen(json), &stored);
+    free(json);
+    if (!parsed) {
+        LOG_ERROR("Stored document is not a valid pet");
+        return DB_WRITE_FAILED;
+    }
+
+    struct doc_buffer document = { 0 };
+    struct doc_buffer encoded = { 0 };
+    struct doc_buffer* stored_form = &document;
+    bool success = pet_write(update, &document);
+    if (success && storage.format == DOC_FORMAT_MSGPACK) {
+        success = doc_encode_msgpack(document.data, document.len, &encoded);
+        stored_form = &encoded;
+    }
+    char* key = success ? document_key(&storage, collection_name, id) : NULL;
+
+    // EVALSHA <sha> 1 <versions> <id> <version>, then the index removals, the index additions and the document
+    struct script_args args = { 0 };
+    success = key != NULL && args_push(&args, "EVALSHA", 7) && args_push(&args, "0000000000000000000000000000000000000000", 40) &&
+        args_push(&args, "1", 1) && args_pushf(&args, "%s:%s", collection_name, VERSIONS_KEY) &&
+        args_pushf(&args, "%s", id) && args_pushf(&args, "%lld", version) &&
+        args_push_pet_indexes(&args, collection_name, &stored, "SREM") &&
+        args_push_pet_indexes(&args, collection_name, update, "SADD");
+    if (success && storage.bucket_size == 0) {
+        success = args_push(&args, "3", 1) && args_push(&args, "SET", 3) && args_pushf(&args, "%s", key) &&
+            args_push(&args, stored_form->data, stored_form->len);
+    }
+    else if (success) {
+        success = args_push(&args, "4", 1) && args_push(&args, "HSET", 4) && args_pushf(&args, "%s", key) &&
+            args_pushf(&args, "%s", id) && args_push(&args, stored_form->data, stored_form->len);
+    }
+    free(key);
+    doc_buffer_free(&document);
+    doc_buffer_free(&encoded);
+    pet_free(&stored);
+    if (!success) {
+        LOG_ERROR("Failed to build the versioned update");
+        args_free(&args);
+        return DB_WRITE_FAILED;
+    }
+
+    enum db_write_result result = DB_WRITE_FAILED;
+    redisContext* previous = NULL;
+    redisReply* reply = shard_enter(shard_of(id), &previous) ? eval_versioned_write(&args) : NULL;
+    shard_leave(previous);
+    if (reply && reply->type == REDIS_REPLY_INTEGER) {
+        if (reply->integer < 0) {
+            result = DB_WRITE_CONFLICT;
         }
         else {
-            freeReplyAndLogError(reply, "Error processing redis reply");
-            return NULL;
+            *new_version = reply->integer;
+            result = DB_WRITE_DONE;
         }
     }
+    else {
+        LOG_ERROR("Versioned update failed: %s", reply && reply->type == REDIS_REPLY_ERROR ? reply->str : "no reply");
+    }
+    if (reply) {
+        freeReplyObject(reply);
+    }
+    args_free(&args);
     return result;
 }
 
 /**
- * @brief Find all documents in a collection
+ * A document queued in a batch, waiting for its replies.
+ */
+struct db_batch_item {
+    size_t tag;
+    long long id;
+    int ops;      // Commands queued for the document
+    bool queued;  // false if queuing failed part way
+    int filter;   // 1 adds the id to the pet filter on success, -1 removes it, 0 for users
+    size_t shard; // Shard whose connection the commands were queued on
+};
+
+struct db_batch {
+    const char* collection_name;
+    size_t max_in_flight;
+    db_batch_result_fn on_result;
+    void* arg;
+    struct db_batch_item* items;
+    size_t count;
+    size_t cap;
+};
+
+/**
+ * @brief Create a batch of pipelined writes
  *
- * @param collection_name The name of the collection
- * @return cJSON* The JSON array of documents found, or NULL on failure
+ * @param collection_name The name of the collection, which must outlive the batch
+ * @param max_in_flight The number of documents queued before the batch is flushed, 0 for no limit
+ * @param on_result Called with the tag and outcome of every queued document when its replies are read
+ * @param arg Passed to on_result
+ * @return struct db_batch* The batch, or NULL on failure
  */
-cJSON* db_find_all(const char* collection_name) {
+struct db_batch* db_batch_create(const char* collection_name, size_t max_in_flight, db_batch_result_fn on_result, void* arg) {
+    struct db_batch* batch = calloc(1, sizeof(struct db_batch));
+    if (batch == NULL) {
+        LOG_ERROR("Memory allocation failed for batch");
+        return NULL;
+    }
+    batch->collection_name = collection_name;
+    batch->max_in_flight = max_in_flight;
+    batch->on_result = on_result;
+    batch->arg = arg;
+    return batch;
+}
 
-	// Get all the document IDs from the collection
-    LOG_INFO("SMEMBERS %s:%s", collection_name, collection_name);
-    redisAppendCommand(redis_context, "SMEMBERS %s:%s", collection_name, collection_name);
-    redisReply* reply = NULL;
-   
-	// Get the document for each ID
-	int op_getid_num = 0;
-    int resultCode = redisGetReply(redis_context, (void**)&reply);
-    if (resultCode == REDIS_OK) {
-        for (size_t j = 0; j < reply->elements; j++) {
-            char* set_id = reply->element[j]->str;
-            LOG_INFO("GET %s:%s", collection_name, set_id);
-            redisAppendCommand(redis_context, "GET %s:%s", collection_name, set_id);
-            op_getid_num++;
+// Records a document whose commands were (at least partly) queued
+static bool batch_push(struct db_batch* batch, size_t tag, long long id, int ops, bool queued, int filter) {
+    if (batch->count == batch->cap) {
+        size_t cap = batch->cap ? batch->cap * 2 : 64;
+        struct db_batch_item* items = realloc(batch->items, cap * sizeof(struct db_batch_item));
+        if (items == NULL) {
+            return false;
         }
-        freeReplyObject(reply);
+        batch->items = items;
+        batch->cap = cap;
     }
-    else {
-        freeReplyAndLogError(reply, "Error processing redis reply");
-        return NULL;
-    }   
-    
-    reply = NULL;
-    cJSON* result = cJSON_CreateArray();
-	
-    // Get the document for each ID
-    for (int i = 0; i < op_getid_num; i++) {
-        int resultCode = redisGetReply(redis_context, (void**)&reply);
-        if (resultCode == REDIS_OK) {
-            
-            LOG_INFO("Response [%d]: %s", i, reply->str ? reply->str : "(nil)");
-            if (reply->type == REDIS_REPLY_STRING) {
-                char* json = strdup(reply->str);
-                cJSON* doc = cJSON_Parse(json);
-                free(json);
-                if (doc != NULL) {
-                    cJSON_AddItemToArray(result, doc);
-                }
+    struct db_batch_item* item = &batch->items[batch->count++];
+    item->tag = tag;
+    item->id = id;
+    item->ops = ops;
+    item->queued = queued;
+    item->filter = filter;
+    item->shard = shard_of_id(id);
+    return true;
+}
+
+// Records the commands queued for a document, flushing the batch when it is full
+static bool batch_queued(struct db_batch* batch, size_t tag, long long id, int ops, bool queued, int filter) {
+    if (ops == 0) {
+        return false;
+    }
+    if (!batch_push(batch, tag, id, ops, queued, filter)) {
+        // The replies must still be read to keep the connection in step
+        LOG_ERROR("Memory allocation failed for batch item");
+        processRedisReplies(ops);
+        return false;
+    }
+    if (batch->max_in_flight != 0 && batch->count >= batch->max_in_flight) {
+        db_batch_flush(batch);
+    }
+    return true;
+}
+
+/**
+ * @brief Send the queued commands and read all their replies
+ *
+ * Every reply is read even after an error reply, so the connection stays in step. The
+ * outcome of each document is reported through the on_result callback.
+ *
+ * @param batch The batch
+ * @return true on success, false if the connection failed
+ */
+bool db_batch_flush(struct db_batch* batch) {
+    bool connected = true;
+    for (size_t i = 0; i < batch->count; i++) {
+        struct db_batch_item* item = &batch->items[i];
+        redisContext* context = redis_context;
+        if (shard_ring != NULL) {
+            context = item->shard == 0 ? pthread_getspecific(connection_key) :
+                shard_contexts != NULL ? shard_contexts[item->shard] : NULL;
+        }
+        bool success = item->queued;
+        // A failed connection is not read again, the other shards still are
+        for (int op = 0; op < item->ops; op++) {
+            redisReply* reply = NULL;
+            if (context == NULL || context->err != 0 || redisGetReply(context, (void**)&reply) != REDIS_OK) {
+                freeReplyAndLogError(reply, "Error processing redis reply");
+                connected = false;
+                success = false;
+                break;
+            }
+            if (reply->type == REDIS_REPLY_ERROR) {
+                LOG_ERROR("Batch command failed: %s", reply->str);
+                success = false;
             }
             freeReplyObject(reply);
         }
-        else {
-            freeReplyAndLogError(reply, "Error processing redis reply");
-            return NULL;
+        // An insert that failed on its reply may still be stored, as in db_pet_insert
+        if (item->filter > 0 || (success && item->filter < 0)) {
+            pet_filter_update(item->id, item->filter > 0);
+        }
+        if (batch->on_result) {
+            batch->on_result(batch->arg, item->tag, success);
         }
     }
-    return result;    
-   
+    LOG_INFO("Batch of %zu documents flushed", batch->count);
+    batch->count = 0;
+    return connected;
 }
 
 /**
- * @brief Helper function to remove a document from a field in the database
+ * @brief Queue the insert of a pet, flushing the batch when it is full
  *
- * @param field_id The field identifier
- * @param field_name The field name
- * @param id The id of the document
- * @param op_num The number of operations
- * @return true on success, false on failure
+ * @param batch The batch
+ * @param pet The pet to insert; it is not referenced once the call returns
+ * @param tag Passed back to on_result with the outcome of the insert
+ * @return true if the outcome will be reported through on_result, false if nothing was queued
  */
-bool remove_document_from_field(const char* field_id, const cJSON* field_name, int id, int* op_num) {
-    if (field_name != NULL) {
-        LOG_INFO("SREM %s:%s %d", field_id, field_name->valuestring, id);
-        redisAppendCommand(redis_context, "SREM %s:%s %d", field_id, field_name->valuestring, id);
-        (*op_num)++;
-    }
-    return true;
+bool db_batch_add_pet(struct db_batch* batch, const struct pet* pet, size_t tag) {
+    int op_num = 0;
+    redisContext* previous = NULL;
+    bool queued = shard_enter(shard_of_id(pet->id), &previous) && append_pet_insert(batch->collection_name, pet, &op_num);
+    bool result = batch_queued(batch, tag, pet->id, op_num, queued, 1);
+    shard_leave(previous);
+    return result;
 }
 
 /**
- * @brief Helper function to remove a document from a collection in the database
+ * @brief Queue the update of a pet, flushing the batch when it is full
  *
- * @param collection_name The name of the collection
- * @param id The id of the document
- * @param op_num The number of operations
- * @return true on success, false on failure
+ * The stored pet is removed with its index entries and the update is inserted, as
+ * db_pet_update does, without reading the stored pet again.
+ *
+ * @param batch The batch
+ * @param stored The pet currently stored under the id of the update
+ * @param update The new pet; neither pet is referenced once the call returns
+ * @param tag Passed back to on_result with the outcome of the update
+ * @return true if the outcome will be reported through on_result, false if nothing was queued
  */
-bool remove_document_from_collection(const char* collection_name, int id, int* op_num) {
-    LOG_INFO("SREM %s %d", collection_name, id);
-    redisAppendCommand(redis_context, "SREM %s %d", collection_name, id);
-    (*op_num)++;
-    return true;
+bool db_batch_add_pet_update(struct db_batch* batch, const struct pet* stored, const struct pet* update, size_t tag) {
+    int op_num = 0;
+    redisContext* previous = NULL;
+    bool queued = shard_enter(shard_of_id(update->id), &previous) && append_pet_delete(batch->collection_name, stored, &op_num) &&
+        append_pet_insert(batch->collection_name, update, &op_num);
+    // The id stays a member of the filter: adding it again would leave its counters unbalanced
+    bool result = batch_queued(batch, tag, update->id, op_num, queued, 0);
+    shard_leave(previous);
+    return result;
 }
 
 /**
- * @brief Helper function to store a document in the database
+ * @brief Queue the removal of a pet, flushing the batch when it is full
  *
- * @param collection_name The name of the collection
- * @param doc The JSON document to store
- * @param id The id of the document
- * @return true on success, false on failure
+ * @param batch The batch
+ * @param stored The pet currently stored; it is not referenced once the call returns
+ * @param tag Passed back to on_result with the outcome of the removal
+ * @return true if the outcome will be reported through on_result, false if nothing was queued
  */
-bool store_document(const char* collection_name, const cJSON* doc, int id) {
-    char* json_str = cJSON_PrintUnformatted(doc);
+bool db_batch_add_pet_delete(struct db_batch* batch, const struct pet* stored, size_t tag) {
+    int op_num = 0;
+    redisContext* previous = NULL;
+    bool queued = shard_enter(shard_of_id(stored->id), &previous) && append_pet_delete(batch->collection_name, stored, &op_num);
+    bool result = batch_queued(batch, tag, stored->id, op_num, queued, -1);
+    shard_leave(previous);
+    return result;
+}
 
-    if (json_str == NULL) {
-        LOG_ERROR("Failed to print JSON document");
-        return false;
-    }
+/**
+ * @brief Queue the insert of a user, flushing the batch when it is full
+ *
+ * @param batch The batch
+ * @param user The user to insert; it is not referenced once the call returns
+ * @param tag Passed back to on_result with the outcome of the insert
+ * @return true if the outcome will be reported through on_result, false if nothing was queued
+ */
+bool db_batch_add_user(struct db_batch* batch, const struct user* user, size_t tag) {
+    int op_num = 0;
+    redisContext* previous = NULL;
+    bool queued = shard_enter(shard_of_id(user->id), &previous) && append_user_insert(batch->collection_name, user, &op_num);
+    bool result = batch_queued(batch, tag, user->id, op_num, queued, 0);
+    shard_leave(previous);
+    return result;
+}
 
-    char* key = malloc(strlen(collection_name) + 20);
-    if (key == NULL) {
-        LOG_ERROR("Memory allocation failed for key");
-        free(json_str);
-        return false;
+/**
+ * @brief Flush and release a batch
+ *
+ * @param batch The batch, may be NULL
+ */
+void db_batch_free(struct db_batch* batch) {
+    if (batch == NULL) {
+        return;
     }
-    sprintf(key, "%s:%d", collection_name, id);
-
-    LOG_INFO("SET %s %s", key, json_str);
-    redisAppendCommand(redis_context, "SET %s %s", key, json_str);
-
-    free(key);
-    free(json_str);
-    return true;
-}
\ No newline at end of file
+    if (batch->count != 0) {
+        db_batch_flush(batch);
+    }
+    free(batch->items);
+    free(batch);
+}
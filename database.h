@@ -2,12 +2,33 @@
 #define DATABASE_H
 
 #include <stdbool.h> // Include this header if you are working in a C environment
+#include <stddef.h>
 #include <cjson/cJSON.h> // Include cJSON header
 
+#include "doc-codec.h" // Include the document codec header
+#include "model.h" // Include the Pet and User model
+
+/**
+ * Layout of the stored documents.
+ *
+ * With bucket_size 0 every document is a string key <collection>:<id>. Otherwise documents
+ * are packed as fields of hashes, HSET <collection>:b:<id/bucket_size> <id> <json>, which
+ * requires integer ids. Buckets smaller than hash-max-listpack-entries whose documents fit
+ * in hash-max-listpack-value use the compact listpack encoding.
+ *
+ * format selects the encoding of the documents written; documents are read in whatever
+ * format their tag says (see doc-codec.h).
+ */
+struct db_storage {
+    unsigned int bucket_size;
+    enum doc_format format;
+};
+
 /**
  * @brief Initializes the database connection.
  *
  * This function initializes the connection to the database using the provided URI.
+ * Both TCP (redis://[:password@]host[:port]) and Unix socket (unix:///path) URIs are accepted.
  *
  * @param redisURI The URI of the database to connect to.
  * @return int Returns 0 on success, 1 on failure.
@@ -22,27 +43,176 @@ int db_init(const char* redisURI);
  */
 void db_cleanup();
 
+/**
+ * @brief Sets the timeouts of the connections opened from now on.
+ *
+ * Call it before db_init. By default connecting times out after a second and replies are
+ * waited for forever.
+ *
+ * @param connect_ms The connect timeout in milliseconds.
+ * @param command_ms The time to wait for a reply in milliseconds, 0 to wait forever.
+ */
+void db_set_timeouts(unsigned int connect_ms, unsigned int command_ms);
+
+/**
+ * @brief Opens the database connection of the calling thread.
+ *
+ * Each thread uses a connection of its own. db_init opens the one of the calling thread;
+ * other threads call this function before their database operations. A connection that
+ * failed is replaced. The connection is closed when the thread exits.
+ *
+ * @return int Returns 0 on success (or if the thread already has a working connection),
+ *         1 on failure or while the circuit breaker is open.
+ */
+int db_thread_attach();
+
+/**
+ * @brief Closes the connection of the calling thread if a command failed on it.
+ *
+ * Call it once the database operations of a request are done, so that a connection left
+ * unusable by a timeout or an I/O error counts towards the circuit breaker right away.
+ */
+void db_thread_report();
+
+/**
+ * @brief Enables the circuit breaker of the Redis connections and their health checks.
+ *
+ * After failure_threshold consecutive connection failures, db_thread_attach fails fast for
+ * open_ms, then lets one request probe Redis; each failed probe doubles the wait, up to
+ * max_open_ms. A background thread PINGs Redis every check_interval_ms on its own
+ * connection, which also closes the breaker when Redis is back without traffic. Must be
+ * called after db_init, and after db_replicas_init: every replica gets a breaker and health
+ * checks of its own, with the same settings.
+ *
+ * @param check_interval_ms The interval between two health checks, 0 for none.
+ * @param failure_threshold The consecutive failures that open the breaker, 0 never to open it.
+ * @param open_ms The first open period in milliseconds.
+ * @param max_open_ms The longest open period in milliseconds.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int db_health_init(unsigned int check_interval_ms, unsigned int failure_threshold, unsigned int open_ms, unsigned int max_open_ms);
+
+/**
+ * @brief Adds read replicas of the Redis server.
+ *
+ * The reads of the requests routed with db_route_reads are then shared by the replicas,
+ * while writes and all the other requests keep using the primary. Must be called after
+ * db_init and before db_health_init.
+ *
+ * @param uris The comma separated URIs of the replicas, in the format of db_init.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int db_replicas_init(const char* uris);
+
+/**
+ * @brief Picks the server of the reads of the calling thread, until its next db_thread_report.
+ *
+ * Every read of the request then goes to the same replica, so that an ETag and the body it
+ * validates come from the same copy of the data. Of two replicas drawn at random, the one with
+ * the lower average latency is picked, or the other one if it is down. The primary serves the
+ * reads when no replica is configured or both are down. Reads on a replica bypass the
+ * auto-pipeline.
+ *
+ * @param replica Whether the reads may go to a replica; false sends them to the primary.
+ */
+void db_route_reads(bool replica);
+
+/**
+ * @brief Hedges the reads of documents by id.
+ *
+ * A read still unanswered after a percentile of the recent read latencies is sent again,
+ * to the next replica or on a second connection to the same server, and the first answer
+ * is used (see hedged-read.h). Reads through the auto-pipeline are not hedged. Must be
+ * called after db_replicas_init.
+ *
+ * @param percentile The percentile of the read latencies used as the hedge delay, from 1 to 99.
+ * @param min_delay_us The shortest hedge delay, in microseconds.
+ * @param max_percent The most reads hedged, in percent of all the reads.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int db_hedged_reads_init(unsigned int percentile, unsigned int min_delay_us, unsigned int max_percent);
+
+/**
+ * @brief Spreads the documents over several Redis servers.
+ *
+ * A document belongs to the shard its id hashes to on a consistent hash ring (see
+ * shard-ring.h), and its index entries and version are kept on the same shard, so that
+ * every write stays on one server. Reads by id go to their shard, queries are scattered
+ * to every shard and their results gathered. Must be called after db_init and before
+ * db_health_init; replicas, the auto-pipeline and hedged reads are not supported with
+ * sharding. The documents already stored are moved with db_rebalance_pets and
+ * db_rebalance_users when the shards change.
+ *
+ * @param uris The comma separated URIs of the shards besides the server of db_init, in the format of db_init.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int db_shards_init(const char* uris);
+
+/**
+ * @brief Sets the average latency above which Redis counts as degraded.
+ *
+ * The average is taken over the reads of single documents and the health checks.
+ *
+ * @param threshold_ms The threshold in milliseconds, 0 for latency never to count.
+ */
+void db_set_slow_threshold(unsigned int threshold_ms);
+
+/**
+ * @brief Checks whether Redis is unreachable or slow.
+ *
+ * @return bool Returns true while the circuit breaker is not closed, or while the average
+ *         latency is above the threshold set with db_set_slow_threshold.
+ */
+bool db_degraded();
+
+/**
+ * @brief Returns the time before requests may reach Redis again.
+ *
+ * @return unsigned int The time in seconds, rounded up, 0 when the circuit breaker is closed.
+ */
+unsigned int db_retry_after_sec();
+
+/**
+ * @brief Returns the metrics of the Redis connections.
+ *
+ * @return cJSON* A JSON object with the circuit breaker state and counters.
+ *         The caller is responsible for freeing the returned document.
+ */
+cJSON* db_connection_stats();
+
+/**
+ * @brief Enables the auto-pipelining of the reads of single documents.
+ *
+ * The reads of documents by id, of their versions and of the index generations then go
+ * through one connection shared by all the threads, where the commands of concurrent
+ * requests are written together (see auto-pipeline.h). Must be called after db_init.
+ *
+ * @param max_window_us The longest time a batch waits for concurrent requests, in microseconds.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int db_auto_pipeline_init(unsigned int max_window_us);
+
 /**
  * @brief Inserts a pet document into the specified collection.
  *
- * This function inserts a JSON document into the specified collection in the database.
+ * This function stores the pet as a JSON document in the specified collection in the database.
  *
  * @param collection_name The name of the collection to insert the document into.
- * @param doc The JSON document to insert.
+ * @param pet The pet to insert.
  * @return bool Returns true on success, false on failure.
  */
-bool db_pet_insert(const char* collection_name, const cJSON* doc);
+bool db_pet_insert(const char* collection_name, const struct pet* pet);
 
 /**
  * @brief Inserts a user document into the specified collection.
  *
- * This function inserts a JSON document into the specified collection in the database.
+ * This function stores the user as a JSON document in the specified collection in the database.
  *
  * @param collection_name The name of the collection to insert the document into.
- * @param doc The JSON document to insert.
+ * @param user The user to insert.
  * @return bool Returns true on success, false on failure.
  */
-bool db_user_insert(const char* collection_name, const cJSON* doc);
+bool db_user_insert(const char* collection_name, const struct user* user);
 
 /**
  * @brief Updates a pet document in the specified collection.
@@ -54,7 +224,30 @@ bool db_user_insert(const char* collection_name, const cJSON* doc);
  * @param update The update to apply to the document.
  * @return bool Returns true on success, false on failure.
  */
-bool db_pet_update(const char* collection_name, const cJSON* update);
+bool db_pet_update(const char* collection_name, const struct pet* update);
+
+/**
+ * Outcome of a conditional write.
+ */
+enum db_write_result {
+    DB_WRITE_DONE,      // The document was written
+    DB_WRITE_CONFLICT,  // The document does not exist or is at another version
+    DB_WRITE_FAILED     // The write could not be performed
+};
+
+/**
+ * @brief Updates a pet document only if it is still at the given version.
+ *
+ * The version is compared and the document, its indexes and its version are written
+ * atomically by a script on the Redis side, so concurrent writers cannot interleave.
+ *
+ * @param collection_name The name of the collection to update the document in.
+ * @param update The pet replacing the stored one with the same id.
+ * @param expected_version The version the update is based on, or -1 for any existing version.
+ * @param new_version Set to the version of the updated document.
+ * @return enum db_write_result DB_WRITE_DONE on success.
+ */
+enum db_write_result db_pet_update_versioned(const char* collection_name, const struct pet* update, long long expected_version, long long* new_version);
 
 /**
  * @brief Updates a user document in the specified collection.
@@ -66,7 +259,7 @@ bool db_pet_update(const char* collection_name, const cJSON* update);
  * @param update The update to apply to the document.
  * @return bool Returns true on success, false on failure.
  */
-bool db_user_update(const char* collection_name, const cJSON* update);
+bool db_user_update(const char* collection_name, const struct user* update);
 
 /**
  * @brief Deletes a document from the pet collection.
@@ -116,6 +309,80 @@ cJSON* db_find(const char* collection_name, const cJSON* query);
  */
 cJSON* db_find_one(const char* collection_name, const char* id);
 
+/**
+ * @brief Finds a document by id and returns it as JSON text.
+ *
+ * The stored document is converted to JSON text directly, without building a cJSON tree.
+ *
+ * @param collection_name The name of the collection to search.
+ * @param id The id of the document to find.
+ * @return char* The JSON text of the document, or NULL if not found.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* db_find_one_json(const char* collection_name, const char* id);
+
+/**
+ * @brief Returns the version of a document.
+ *
+ * Versions are kept in the <collection>:versions hash and incremented by every write and
+ * delete of the document, so they never repeat.
+ *
+ * @param collection_name The name of the collection.
+ * @param id The id of the document.
+ * @return long long The version, 0 if the document was never written, or -1 on failure.
+ */
+long long db_document_version(const char* collection_name, const char* id);
+
+/**
+ * @brief Finds a document by id together with its version, in a single round trip.
+ *
+ * @param collection_name The name of the collection to search.
+ * @param id The id of the document to find.
+ * @param version Set to the version of the document, or -1 if it or the document could not be read.
+ * @return char* The JSON text of the document, or NULL if not found.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* db_find_one_json_versioned(const char* collection_name, const char* id, long long* version);
+
+/**
+ * @brief Returns the generations of entries of a field index.
+ *
+ * Generations are kept in the <collection>:generations hash, one field per entry
+ * ("status:available", "tags:dog"), and incremented by every write or delete of a document
+ * listed by the entry.
+ *
+ * @param collection_name The name of the collection.
+ * @param field The indexed field ("status" or "tags").
+ * @param values The values of the field.
+ * @param count The number of values.
+ * @param generations Set to the generation of every value, 0 for values never written.
+ * @return bool Returns true on success, false on failure.
+ */
+bool db_index_generations(const char* collection_name, const char* field, const char* const* values, size_t count, long long* generations);
+
+/**
+ * @brief Finds documents matching the query and returns them as a JSON array text.
+ *
+ * @param collection_name The name of the collection to search.
+ * @param query The query to find the documents, as for db_find.
+ * @return char* The JSON text of the array of documents, or NULL on failure.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* db_find_json(const char* collection_name, const cJSON* query);
+
+/**
+ * @brief Finds a user document by username.
+ *
+ * The username is resolved through the unique username -> id index and the stored
+ * document is fetched in a single round trip (a Lua script run with EVALSHA).
+ *
+ * @param collection_name The name of the collection to search.
+ * @param username The username to look up.
+ * @return char* The stored JSON document, returned verbatim, or NULL if not found.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* db_find_user_by_username(const char* collection_name, const char* username);
+
 /**
  * @brief Finds all documents in the specified collection.
  *
@@ -125,11 +392,211 @@ cJSON* db_find_one(const char* collection_name, const char* id);
  */
 cJSON* db_find_all(const char* collection_name);
 
+/**
+ * @brief Finds all documents in the specified collection and returns them as a JSON array text.
+ *
+ * @param collection_name The name of the collection to search.
+ * @return char* The JSON text of the array of documents, or NULL on failure.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* db_find_all_json(const char* collection_name);
+
+/**
+ * @brief Finds documents by id in a single round trip and returns them as a JSON array text.
+ *
+ * The documents are in the order of the ids; ids without a document are left out.
+ *
+ * @param collection_name The name of the collection to search.
+ * @param ids The ids of the documents to find.
+ * @param count The number of ids.
+ * @return char* The JSON text of the array of documents, or NULL on failure.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* db_find_many_json(const char* collection_name, const char* const* ids, size_t count);
+
+/**
+ * @brief Selects the layout of the stored documents.
+ *
+ * Must be called before serving requests; the documents already stored have to be
+ * migrated with db_migrate_storage when the layout changes.
+ *
+ * @param layout The storage layout.
+ */
+void db_set_storage(const struct db_storage* layout);
+
+/**
+ * @brief Moves the documents of a collection from one storage layout to another.
+ *
+ * Every document listed in the <collection>:<collection> set is rewritten in the target
+ * layout and format and removed from the source layout. The format of the source documents
+ * is read from their tags, so from->format is ignored. Writes made while the migration runs may be lost.
+ *
+ * @param collection_name The name of the collection to migrate.
+ * @param from The layout the documents are currently stored in.
+ * @param to The target layout.
+ * @param migrated Set to the number of documents moved.
+ * @return bool Returns true on success, false on failure.
+ */
+bool db_migrate_storage(const char* collection_name, const struct db_storage* from, const struct db_storage* to, size_t* migrated);
+
+/**
+ * @brief Moves the pets of a collection to their shards after the shards changed.
+ *
+ * The shards are those set up by db_init and db_shards_init. Every pet of the old nodes
+ * that belongs to another shard is written there with its index entries and a higher
+ * version, then removed from its old node. An interrupted run leaves copies behind, which
+ * the next run moves. Writes made while the pets move may be lost.
+ *
+ * @param collection_name The name of the collection.
+ * @param from_uris The comma separated URIs of all the shards the pets were spread over.
+ * @param moved Set to the number of pets moved.
+ * @return bool Returns true on success, false on failure.
+ */
+bool db_rebalance_pets(const char* collection_name, const char* from_uris, size_t* moved);
+
+/**
+ * @brief Moves the users of a collection to their shards after the shards changed.
+ *
+ * @param collection_name The name of the collection.
+ * @param from_uris The comma separated URIs of all the shards the users were spread over.
+ * @param moved Set to the number of users moved.
+ * @return bool Returns true on success, false on failure.
+ * @see db_rebalance_pets
+ */
+bool db_rebalance_users(const char* collection_name, const char* from_uris, size_t* moved);
+
+/**
+ * @brief Returns the memory used by the Redis server.
+ *
+ * @return long long The used_memory reported by INFO memory in bytes, or -1 if the server does not report it.
+ */
+long long db_used_memory();
+
+/**
+ * @brief Builds the negative lookup filter of pet ids and starts its periodic rebuilds.
+ *
+ * The filter is built by scanning the pets:pets set and kept up to date by db_pet_insert
+ * and db_pet_delete. Rebuilds run on a background thread with their own connection.
+ *
+ * @param capacity The number of ids the filter is sized for (grown to twice the current count if larger).
+ * @param fp_rate The target false positive rate.
+ * @param rebuild_interval_sec The interval between rebuilds in seconds, 0 to disable rebuilds.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int db_pet_filter_init(size_t capacity, double fp_rate, unsigned int rebuild_interval_sec);
+
+/**
+ * @brief Checks the negative lookup filter for a pet id.
+ *
+ * @param id The id of the pet.
+ * @return bool Returns false when the pet definitely does not exist (or true when the filter is disabled).
+ */
+bool db_pet_filter_might_contain(const char* id);
+
+/**
+ * @brief Records a lookup that passed the filter but did not find the pet.
+ */
+void db_pet_filter_report_false_positive();
+
+/**
+ * @brief Returns the metrics of the negative lookup filter.
+ *
+ * @return cJSON* A JSON object with the filter metrics, or NULL when the filter is disabled.
+ *         The caller is responsible for freeing the returned document.
+ */
+cJSON* db_pet_filter_stats();
+
+/**
+ * @brief Reads stored pets by id in one round trip.
+ *
+ * @param collection_name The name of the collection.
+ * @param ids The ids of the pets.
+ * @param count The number of ids.
+ * @param pets Set to the stored pet of every id, with has_id false when there is none.
+ *        The caller releases them with pet_free.
+ * @return bool Returns false if the connection failed (no pet is returned).
+ */
+bool db_pet_find_many(const char* collection_name, const long long* ids, size_t count, struct pet* pets);
+
 // Helper functions for pet methods
-bool store_tags(const char* collection_name, const cJSON* tags_obj, int id, int* num_op);
-bool store_document(const char* collection_name, const cJSON* doc, int id);
-bool remove_document_from_collection(const char* collection_name, int id, int* op_num);
-bool remove_document_from_field(const char* field_id, const cJSON* field_name, int id, int* op_num);
-bool remove_document_from_tags(const char* collection_name, const cJSON* doc, int id, int* op_number);
+/**
+ * Batch of pipelined writes.
+ *
+ * The commands of many documents are queued on the connection and their replies read in one
+ * go by db_batch_flush, automatically every max_in_flight documents. The connection is shared
+ * by every request served by the thread, so a batch must be flushed before returning to the
+ * event loop.
+ */
+struct db_batch;
+
+/**
+ * @brief Callback reporting the outcome of a document of a batch.
+ *
+ * @param arg The argument given to db_batch_create.
+ * @param tag The tag given when the document was added.
+ * @param success Whether every command of the document succeeded.
+ */
+typedef void (*db_batch_result_fn)(void* arg, size_t tag, bool success);
+
+/**
+ * @brief Creates a batch of writes into a collection.
+ *
+ * @param collection_name The name of the collection, which must outlive the batch.
+ * @param max_in_flight The number of documents queued before the batch is flushed, 0 for no limit.
+ * @param on_result Called for every queued document once its replies have been read.
+ * @param arg Passed to on_result.
+ * @return struct db_batch* The batch, or NULL on failure.
+ */
+struct db_batch* db_batch_create(const char* collection_name, size_t max_in_flight, db_batch_result_fn on_result, void* arg);
+
+/**
+ * @brief Queues the insert of a pet, flushing the batch when it is full.
+ *
+ * @return bool Returns false if nothing was queued (the pet has no id or status); on_result is then not called.
+ */
+bool db_batch_add_pet(struct db_batch* batch, const struct pet* pet, size_t tag);
+
+/**
+ * @brief Queues the update of a pet, flushing the batch when it is full.
+ *
+ * The stored pet and its index entries are removed and the update is inserted, as with
+ * db_pet_update, without reading the stored pet again.
+ *
+ * @param stored The pet currently stored under the id of the update.
+ * @return bool Returns false if nothing was queued; on_result is then not called.
+ */
+bool db_batch_add_pet_update(struct db_batch* batch, const struct pet* stored, const struct pet* update, size_t tag);
+
+/**
+ * @brief Queues the removal of a stored pet and of its index entries, flushing the batch when it is full.
+ *
+ * @return bool Returns false if nothing was queued; on_result is then not called.
+ */
+bool db_batch_add_pet_delete(struct db_batch* batch, const struct pet* stored, size_t tag);
+
+/**
+ * @brief Queues the insert of a user, flushing the batch when it is full.
+ *
+ * @return bool Returns false if nothing was queued (the user has no id or username); on_result is then not called.
+ */
+bool db_batch_add_user(struct db_batch* batch, const struct user* user, size_t tag);
+
+/**
+ * @brief Sends the queued commands and reads all their replies.
+ *
+ * @return bool Returns false if the connection failed.
+ */
+bool db_batch_flush(struct db_batch* batch);
+
+/**
+ * @brief Flushes and releases a batch.
+ */
+void db_batch_free(struct db_batch* batch);
+
+bool store_tags(const char* collection_name, const struct pet* pet, int* num_op);
+bool store_document(const char* collection_name, const char* json, size_t len, long long id);
+bool remove_document_from_collection(const char* collection_name, long long id, int* op_num);
+bool remove_document_from_field(const char* field_id, const char* value, long long id, int* op_num);
+bool remove_document_from_tags(const char* collection_name, const struct pet* pet, int* op_number);
 
 #endif // DATABASE_H
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <cjson/cJSON.h>
+
+#include "database.h" // Include Redis database functions
+#include "resp-server.h" // Include the in-process RESP stand-in server
+#include "log-utils.h" // Include the log utils header
+
+#define BENCH_DEFAULT_OPS 10000
+
+static const char* bench_statuses[] = { "available", "pending", "sold" };
+
+struct bench_result {
+    const char* name;
+    int ops;
+    double* samples_us;
+};
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Prints mean and percentiles of the samples collected for one benchmark
+static void bench_report(struct bench_result* result) {
+    double total = 0;
+    for (int i = 0; i < result->ops; i++) {
+        total += result->samples_us[i];
+    }
+    qsort(result->samples_us, result->ops, sizeof(double), compare_double);
+    fprintf(stderr, "%-16s %8d %10.1f %10.2f %10.2f %10.2f %10.2f\n",
+        result->name,
+        result->ops,
+        total / 1000.0,
+        total / result->ops,
+        result->samples_us[result->ops / 2],
+        result->samples_us[(int)(result->ops * 0.99)],
+        result->samples_us[result->ops - 1]);
+}
+
+// A pet built in place; its strings point into the name buffers instead of pet.strings
+struct bench_pet {
+    struct pet pet;
+    struct pet_tag tag;
+    const char* photo_url;
+    char name[32];
+    char tag_name[32];
+};
+
+static void bench_create_pet(struct bench_pet* bench, int id) {
+    memset(bench, 0, sizeof(*bench));
+    snprintf(bench->name, sizeof(bench->name), "pet%d", id);
+    snprintf(bench->tag_name, sizeof(bench->tag_name), "tag%02d", id % 16);
+
+    struct pet* pet = &bench->pet;
+    pet->has_id = true;
+    pet->id = id;
+    pet->name = bench->name;
+    pet->has_category = true;
+    pet->has_category_id = true;
+    pet->category_id = id % 4;
+    pet->category_name = "dogs";
+    bench->photo_url = "https://example.com/photo.png";
+    pet->has_photo_urls = true;
+    pet->photo_urls = &bench->photo_url;
+    pet->photo_url_count = 1;
+    bench->tag.has_id = true;
+    bench->tag.id = id % 16;
+    bench->tag.name = bench->tag_name;
+    pet->has_tags = true;
+    pet->tags = &bench->tag;
+    pet->tag_count = 1;
+    pet->status = bench_statuses[id % 3];
+}
+
+static cJSON* bench_create_status_query() {
+    cJSON* query = cJSON_CreateObject();
+    cJSON_AddStringToObject(query, "operator", "eq");
+    cJSON_AddStringToObject(query, "field", "pets:status");
+    cJSON* values = cJSON_AddArrayToObject(query, "value");
+    cJSON_AddItemToArray(values, cJSON_CreateString("pending"));
+    return query;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [-n ops] [-b bucket_size] [-e format] [-l latency_us] [-t] [-u redisURI] [-v]\n"
+        "  -n ops         Number of operations per benchmark (default %d)\n"
+        "  -b bucket_size Store the documents in hash buckets of this size (default 0: one key per document)\n"
+        "  -e format      Encoding of the stored documents, json or msgpack (default json)\n"
+        "  -l latency_us  Latency injected per round trip by the stand-in server (default 0)\n"
+        "  -t             Run the stand-in server on TCP instead of a Unix socket\n"
+        "  -u redisURI    Benchmark an external Redis instead of the stand-in server\n"
+        "  -v             Keep the database log output on stdout\n",
+        program, BENCH_DEFAULT_OPS);
+}
+
+/**
+ * @brief Benchmarks the db_* functions against the in-process RESP stand-in server.
+ *
+ * Results are printed to stderr; the database log output on stdout is discarded unless -v is given.
+ *
+ * @return int Returns 0 on success, 1 on failure, including writes that failed or any error reply of
+ *         the stand-in server.
+ */
+int main(int argc, char** argv) {
+    int ops = BENCH_DEFAULT_OPS;
+    unsigned int latency_us = 0;
+    int use_tcp = 0;
+    int verbose = 0;
+    const char* redis_uri = NULL;
+    struct db_storage layout = { 0 };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:e:l:tu:vh")) != -1) {
+        switch (opt) {
+        case 'n': ops = atoi(optarg); break;
+        case 'b': layout.bucket_size = (unsigned int)atoi(optarg); break;
+        case 'e':
+            if (!doc_format_parse(optarg, &layout.format)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'l': latency_us = (unsigned int)atoi(optarg); break;
+        case 't': use_tcp = 1; break;
+        case 'u': redis_uri = optarg; break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (ops <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct resp_server* server = NULL;
+    char uri[128];
+    char socket_path[64];
+    if (redis_uri == NULL) {
+        snprintf(socket_path, sizeof(socket_path), "/tmp/petstore-bench-%d.sock", (int)getpid());
+        server = resp_server_start(use_tcp ? NULL : socket_path, 0, latency_us);
+        if (server == NULL) {
+            LOG_ERROR("Failed to start the RESP stand-in server");
+            return 1;
+        }
+        if (use_tcp) {
+            snprintf(uri, sizeof(uri), "redis://127.0.0.1:%d", resp_server_port(server));
+        }
+        else {
+            snprintf(uri, sizeof(uri), "unix://%s", socket_path);
+        }
+        redis_uri = uri;
+    }
+
+    if (db_init(redis_uri) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to initialize the database");
+        resp_server_stop(server);
+        return 1;
+    }
+
+    db_set_storage(&layout);
+
+    if (!verbose && freopen("/dev/null", "w", stdout) == NULL) {
+        LOG_WARN("Failed to silence stdout");
+    }
+
+    struct bench_result results[4] = {
+        { "db_pet_insert", ops, NULL },
+        { "db_find_one", ops, NULL },
+        { "db_find", ops / 100 > 0 ? ops / 100 : 1, NULL },
+        { "db_pet_update", ops / 10 > 0 ? ops / 10 : 1, NULL },
+    };
+    for (int i = 0; i < 4; i++) {
+        results[i].samples_us = calloc(results[i].ops, sizeof(double));
+    }
+
+    // A write that fails, or any error reply, would leave timings that measure nothing
+    int failures = 0;
+    srand(42);
+    long long memory_before = db_used_memory();
+    for (int i = 0; i < results[0].ops; i++) {
+        struct bench_pet pet;
+        bench_create_pet(&pet, i + 1);
+        double start = now_us();
+        failures += !db_pet_insert("pets", &pet.pet);
+        results[0].samples_us[i] = now_us() - start;
+    }
+    long long memory_after = db_used_memory();
+
+    for (int i = 0; i < results[1].ops; i++) {
+        char id[20];
+        snprintf(id, sizeof(id), "%d", rand() % ops + 1);
+        double start = now_us();
+        cJSON* doc = db_find_one("pets", id);
+        results[1].samples_us[i] = now_us() - start;
+        cJSON_Delete(doc);
+    }
+
+    cJSON* query = bench_create_status_query();
+    for (int i = 0; i < results[2].ops; i++) {
+        double start = now_us();
+        cJSON* docs = db_find("pets", query);
+        results[2].samples_us[i] = now_us() - start;
+        cJSON_Delete(docs);
+    }
+    cJSON_Delete(query);
+
+    for (int i = 0; i < results[3].ops; i++) {
+        struct bench_pet pet;
+        bench_create_pet(&pet, rand() % ops + 1);
+        double start = now_us();
+        failures += !db_pet_update("pets", &pet.pet);
+        results[3].samples_us[i] = now_us() - start;
+    }
+
+    fprintf(stderr, "target: %s, injected latency: %u us, layout: %s (bucket size %u), %s encoding\n",
+        server ? "resp-server" : redis_uri, latency_us, layout.bucket_size ? "bucketed" : "string", layout.bucket_size,
+        doc_format_name(layout.format));
+    if (memory_before >= 0 && memory_after >= 0) {
+        fprintf(stderr, "used_memory: %+lld bytes after %d inserts (%.1f bytes per pet)\n",
+            memory_after - memory_before, results[0].ops, (double)(memory_after - memory_before) / results[0].ops);
+    }
+    else {
+        fprintf(stderr, "used_memory: not reported by the target\n");
+    }
+    fprintf(stderr, "%-16s %8s %10s %10s %10s %10s %10s\n", "benchmark", "ops", "total(ms)", "mean(us)", "p50(us)", "p99(us)", "max(us)");
+    for (int i = 0; i < 4; i++) {
+        bench_report(&results[i]);
+        free(results[i].samples_us);
+    }
+
+    unsigned long long errors = server ? resp_server_errors(server) : 0;
+    if (failures > 0 || errors > 0) {
+        fprintf(stderr, "FAILED: %d writes failed, %llu error replies\n", failures, errors);
+    }
+
+    db_cleanup();
+    resp_server_stop(server);
+    return failures > 0 || errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,681 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "doc-codec.h"
+
+#define DOC_MAX_DEPTH 64
+// Largest MessagePack header (map32, array32, str32): type byte and 32-bit length
+#define DOC_MAX_HEADER 5
+
+struct json_reader {
+    const char* p;
+    const char* end;
+    int depth;
+};
+
+struct msgpack_reader {
+    const unsigned char* p;
+    const unsigned char* end;
+    int depth;
+};
+
+bool doc_buffer_reserve(struct doc_buffer* buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) {
+        return true;
+    }
+    size_t cap = buf->cap ? buf->cap * 2 : 256;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+    char* data = realloc(buf->data, cap);
+    if (data == NULL) {
+        return false;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return true;
+}
+
+bool doc_buffer_append(struct doc_buffer* buf, const char* data, size_t len) {
+    if (!doc_buffer_reserve(buf, len)) {
+        return false;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+static bool doc_buffer_byte(struct doc_buffer* buf, unsigned char byte) {
+    if (!doc_buffer_reserve(buf, 1)) {
+        return false;
+    }
+    buf->data[buf->len++] = (char)byte;
+    return true;
+}
+
+void doc_buffer_free(struct doc_buffer* buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * JSON text -> MessagePack
+ * ------------------------------------------------------------------------ */
+
+static void put_be(unsigned char* dst, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        dst[i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+static bool put_typed(struct doc_buffer* out, unsigned char type, uint64_t value, int bytes) {
+    unsigned char encoded[9];
+    encoded[0] = type;
+    put_be(encoded + 1, value, bytes);
+    return doc_buffer_append(out, (const char*)encoded, (size_t)bytes + 1);
+}
+
+/**
+ * @brief Helper function to write the header of a container or string whose length is
+ * only known once its content has been encoded
+ *
+ * DOC_MAX_HEADER bytes were reserved at start; the content is moved back over the
+ * unused part of the reservation.
+ */
+static void patch_header(struct doc_buffer* out, size_t start, size_t count, unsigned char fix, unsigned char fix_limit,
+    unsigned char type8, unsigned char type16, unsigned char type32) {
+    unsigned char header[DOC_MAX_HEADER];
+    int len;
+    if (count < fix_limit) {
+        header[0] = (unsigned char)(fix | count);
+        len = 1;
+    }
+    else if (type8 && count <= 0xff) {
+        header[0] = type8;
+        header[1] = (unsigned char)count;
+        len = 2;
+    }
+    else if (count <= 0xffff) {
+        header[0] = type16;
+        put_be(header + 1, count, 2);
+        len = 3;
+    }
+    else {
+        header[0] = type32;
+        put_be(header + 1, count, 4);
+        len = 5;
+    }
+    size_t content = start + DOC_MAX_HEADER;
+    memmove(out->data + start + len, out->data + content, out->len - content);
+    memcpy(out->data + start, header, (size_t)len);
+    out->len -= (size_t)(DOC_MAX_HEADER - len);
+}
+
+static void skip_whitespace(struct json_reader* r) {
+    while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r')) {
+        r->p++;
+    }
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool read_hex4(const char** p, const char* end, unsigned int* value) {
+    if (end - *p < 4) {
+        return false;
+    }
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hex_value((*p)[i]);
+        if (digit < 0) {
+            return false;
+        }
+        *value = (*value << 4) | (unsigned int)digit;
+    }
+    *p += 4;
+    return true;
+}
+
+static size_t put_utf8(char* dst, unsigned int cp) {
+    if (cp < 0x80) {
+        dst[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        dst[0] = (char)(0xc0 | (cp >> 6));
+        dst[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        dst[0] = (char)(0xe0 | (cp >> 12));
+        dst[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        dst[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    dst[0] = (char)(0xf0 | (cp >> 18));
+    dst[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    dst[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    dst[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+/**
+ * @brief Unescape a JSON string
+ *
+ * @param p The position of the opening quote, moved past the closing quote on success
+ * @param end The end of the JSON text
+ * @param dst The destination, with room for end - *p bytes
+ * @param len Set to the length of the unescaped string
+ * @return true on success, false if the string is not valid JSON
+ */
+bool doc_json_unescape(const char** p, const char* end, char* dst, size_t* len) {
+    const char* src = *p + 1;
+    size_t n = 0;
+    for (;;) {
+        // Copy the run of characters that need no unescaping in one go
+        const char* run = src;
+        while (src < end && *src != '"' && *src != '\\' && (unsigned char)*src >= 0x20) {
+            src++;
+        }
+        memcpy(dst + n, run, (size_t)(src - run));
+        n += (size_t)(src - run);
+        if (src >= end || (unsigned char)*src < 0x20) {
+            return false;
+        }
+        if (*src == '"') {
+            break;
+        }
+
+        // Escape sequence
+        if (end - src < 2) {
+            return false;
+        }
+        char escaped = src[1];
+        src += 2;
+        switch (escaped) {
+        case '"': dst[n++] = '"'; break;
+        case '\\': dst[n++] = '\\'; break;
+        case '/': dst[n++] = '/'; break;
+        case 'b': dst[n++] = '\b'; break;
+        case 'f': dst[n++] = '\f'; break;
+        case 'n': dst[n++] = '\n'; break;
+        case 'r': dst[n++] = '\r'; break;
+        case 't': dst[n++] = '\t'; break;
+        case 'u': {
+            unsigned int cp;
+            if (!read_hex4(&src, end, &cp)) {
+                return false;
+            }
+            if (cp >= 0xd800 && cp <= 0xdbff) {
+                // High surrogate: must be followed by a low surrogate
+                unsigned int low;
+                if (end - src < 2 || src[0] != '\\' || src[1] != 'u') {
+                    return false;
+                }
+                src += 2;
+                if (!read_hex4(&src, end, &low) || low < 0xdc00 || low > 0xdfff) {
+                    return false;
+                }
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            }
+            else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                return false;
+            }
+            n += put_utf8(dst + n, cp);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    *p = src + 1;
+    *len = n;
+    return true;
+}
+
+// Unescapes a JSON string (r->p on the opening quote) into a MessagePack str
+static bool encode_string(struct json_reader* r, struct doc_buffer* out) {
+    // Unescaping never makes a string longer, so the rest of the text bounds its length
+    size_t start = out->len;
+    if (!doc_buffer_reserve(out, DOC_MAX_HEADER + (size_t)(r->end - r->p))) {
+        return false;
+    }
+    size_t len;
+    if (!doc_json_unescape(&r->p, r->end, out->data + start + DOC_MAX_HEADER, &len) || len > UINT32_MAX) {
+        return false;
+    }
+    out->len = start + DOC_MAX_HEADER + len;
+    patch_header(out, start, len, 0xa0, 32, 0xd9, 0xda, 0xdb);
+    return true;
+}
+
+static bool encode_integer(struct doc_buffer* out, long long value) {
+    if (value >= 0) {
+        uint64_t v = (uint64_t)value;
+        if (v < 0x80) return doc_buffer_byte(out, (unsigned char)v);
+        if (v <= 0xff) return put_typed(out, 0xcc, v, 1);
+        if (v <= 0xffff) return put_typed(out, 0xcd, v, 2);
+        if (v <= 0xffffffffULL) return put_typed(out, 0xce, v, 4);
+        return put_typed(out, 0xcf, v, 8);
+    }
+    if (value >= -32) return doc_buffer_byte(out, (unsigned char)(int8_t)value);
+    if (value >= INT8_MIN) return put_typed(out, 0xd0, (uint64_t)value & 0xff, 1);
+    if (value >= INT16_MIN) return put_typed(out, 0xd1, (uint64_t)value & 0xffff, 2);
+    if (value >= INT32_MIN) return put_typed(out, 0xd2, (uint64_t)value & 0xffffffffULL, 4);
+    return put_typed(out, 0xd3, (uint64_t)value, 8);
+}
+
+static bool encode_number(struct json_reader* r, struct doc_buffer* out) {
+    const char* start = r->p;
+    bool integer = true;
+    if (r->p < r->end && *r->p == '-') {
+        r->p++;
+    }
+    const char* digits = r->p;
+    while (r->p < r->end && *r->p >= '0' && *r->p <= '9') {
+        r->p++;
+    }
+    if (r->p == digits) {
+        return false;
+    }
+    if (r->p < r->end && *r->p == '.') {
+        integer = false;
+        r->p++;
+        const char* fraction = r->p;
+        while (r->p < r->end && *r->p >= '0' && *r->p <= '9') {
+            r->p++;
+        }
+        if (r->p == fraction) {
+            return false;
+        }
+    }
+    if (r->p < r->end && (*r->p == 'e' || *r->p == 'E')) {
+        integer = false;
+        r->p++;
+        if (r->p < r->end && (*r->p == '+' || *r->p == '-')) {
+            r->p++;
+        }
+        const char* exponent = r->p;
+        while (r->p < r->end && *r->p >= '0' && *r->p <= '9') {
+            r->p++;
+        }
+        if (r->p == exponent) {
+            return false;
+        }
+    }
+
+    // The literal is copied so that strtoll/strtod stop at its end; long ones go to the heap
+    char buffer[64];
+    size_t len = (size_t)(r->p - start);
+    char* literal = len < sizeof(buffer) ? buffer : malloc(len + 1);
+    if (literal == NULL) {
+        return false;
+    }
+    memcpy(literal, start, len);
+    literal[len] = '\0';
+
+    if (integer) {
+        errno = 0;
+        long long value = strtoll(literal, NULL, 10);
+        if (errno == 0) {
+            if (literal != buffer) {
+                free(literal);
+            }
+            return encode_integer(out, value);
+        }
+    }
+    double value = strtod(literal, NULL);
+    if (literal != buffer) {
+        free(literal);
+    }
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return put_typed(out, 0xcb, bits, 8);
+}
+
+static bool encode_literal(struct json_reader* r, struct doc_buffer* out, const char* word, unsigned char type) {
+    size_t len = strlen(word);
+    if ((size_t)(r->end - r->p) < len || memcmp(r->p, word, len) != 0) {
+        return false;
+    }
+    r->p += len;
+    return doc_buffer_byte(out, type);
+}
+
+static bool encode_value(struct json_reader* r, struct doc_buffer* out);
+
+static bool encode_container(struct json_reader* r, struct doc_buffer* out, bool object) {
+    if (++r->depth > DOC_MAX_DEPTH) {
+        return false;
+    }
+    char close = object ? '}' : ']';
+    r->p++;
+    size_t start = out->len;
+    if (!doc_buffer_append(out, "\0\0\0\0\0", DOC_MAX_HEADER)) {
+        return false;
+    }
+
+    size_t count = 0;
+    skip_whitespace(r);
+    if (r->p < r->end && *r->p == close) {
+        r->p++;
+    }
+    else {
+        for (;;) {
+            if (object) {
+                skip_whitespace(r);
+                if (r->p >= r->end || *r->p != '"' || !encode_string(r, out)) {
+                    return false;
+                }
+                skip_whitespace(r);
+                if (r->p >= r->end || *r->p != ':') {
+                    return false;
+                }
+                r->p++;
+            }
+            if (!encode_value(r, out)) {
+                return false;
+            }
+            count++;
+            skip_whitespace(r);
+            if (r->p < r->end && *r->p == ',') {
+                r->p++;
+                continue;
+            }
+            if (r->p < r->end && *r->p == close) {
+                r->p++;
+                break;
+            }
+            return false;
+        }
+    }
+
+    if (count > UINT32_MAX) {
+        return false;
+    }
+    if (object) {
+        patch_header(out, start, count, 0x80, 16, 0, 0xde, 0xdf);
+    }
+    else {
+        patch_header(out, start, count, 0x90, 16, 0, 0xdc, 0xdd);
+    }
+    r->depth--;
+    return true;
+}
+
+static bool encode_value(struct json_reader* r, struct doc_buffer* out) {
+    skip_whitespace(r);
+    if (r->p >= r->end) {
+        return false;
+    }
+    switch (*r->p) {
+    case '{': return encode_container(r, out, true);
+    case '[': return encode_container(r, out, false);
+    case '"': return encode_string(r, out);
+    case 't': return encode_literal(r, out, "true", 0xc3);
+    case 'f': return encode_literal(r, out, "false", 0xc2);
+    case 'n': return encode_literal(r, out, "null", 0xc0);
+    default: return encode_number(r, out);
+    }
+}
+
+/**
+ * @brief Encode JSON text as a tagged MessagePack document
+ *
+ * @param json The JSON text
+ * @param len The length of the JSON text
+ * @param out The buffer the document is appended to
+ * @return true on success, false if the text is not valid JSON
+ */
+bool doc_encode_msgpack(const char* json, size_t len, struct doc_buffer* out) {
+    size_t start = out->len;
+    struct json_reader reader = { json, json + len, 0 };
+    if (doc_buffer_byte(out, DOC_TAG_MSGPACK) && encode_value(&reader, out)) {
+        skip_whitespace(&reader);
+        if (reader.p == reader.end) {
+            return true;
+        }
+    }
+    out->len = start;
+    return false;
+}
+
+/* ---------------------------------------------------------------------------
+ * MessagePack -> JSON text
+ * ------------------------------------------------------------------------ */
+
+static bool read_be(struct msgpack_reader* r, int bytes, uint64_t* value) {
+    if (r->end - r->p < bytes) {
+        return false;
+    }
+    *value = 0;
+    for (int i = 0; i < bytes; i++) {
+        *value = (*value << 8) | r->p[i];
+    }
+    r->p += bytes;
+    return true;
+}
+
+/**
+ * @brief Append a string as JSON text, escaped the way cJSON_PrintUnformatted does
+ *
+ * @param out The buffer the string is appended to
+ * @param str The string
+ * @param len The length of the string
+ * @return true on success, false if the buffer cannot grow
+ */
+bool doc_json_write_string(struct doc_buffer* out, const char* str, size_t len) {
+    // Worst case: every byte escaped as \u00XX
+    if (!doc_buffer_reserve(out, len * 6 + 2)) {
+        return false;
+    }
+    char* dst = out->data + out->len;
+    *dst++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            *dst++ = (char)c;
+            continue;
+        }
+        *dst++ = '\\';
+        switch (c) {
+        case '"': *dst++ = '"'; break;
+        case '\\': *dst++ = '\\'; break;
+        case '\b': *dst++ = 'b'; break;
+        case '\f': *dst++ = 'f'; break;
+        case '\n': *dst++ = 'n'; break;
+        case '\r': *dst++ = 'r'; break;
+        case '\t': *dst++ = 't'; break;
+        default:
+            sprintf(dst, "u%04x", c);
+            dst += 5;
+            break;
+        }
+    }
+    *dst++ = '"';
+    out->len = (size_t)(dst - out->data);
+    return true;
+}
+
+// Writes a double the way cJSON_PrintUnformatted does
+static bool write_double(struct doc_buffer* out, double value) {
+    char number[32];
+    int len;
+    if (isnan(value) || isinf(value)) {
+        len = sprintf(number, "null");
+    }
+    else {
+        len = sprintf(number, "%1.15g", value);
+        if (strtod(number, NULL) != value) {
+            len = sprintf(number, "%1.17g", value);
+        }
+    }
+    return doc_buffer_append(out, number, (size_t)len);
+}
+
+static bool decode_value(struct msgpack_reader* r, struct doc_buffer* out);
+
+static bool decode_string(struct msgpack_reader* r, struct doc_buffer* out, size_t len) {
+    if ((size_t)(r->end - r->p) < len) {
+        return false;
+    }
+    bool success = doc_json_write_string(out, (const char*)r->p, len);
+    r->p += len;
+    return success;
+}
+
+static bool decode_container(struct msgpack_reader* r, struct doc_buffer* out, size_t count, bool object) {
+    if (++r->depth > DOC_MAX_DEPTH) {
+        return false;
+    }
+    if (!doc_buffer_byte(out, object ? '{' : '[')) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && !doc_buffer_byte(out, ',')) {
+            return false;
+        }
+        if (object) {
+            // JSON keys are strings
+            if (r->p >= r->end) {
+                return false;
+            }
+            unsigned char type = *r->p;
+            if (!((type >= 0xa0 && type <= 0xbf) || (type >= 0xd9 && type <= 0xdb))) {
+                return false;
+            }
+            if (!decode_value(r, out) || !doc_buffer_byte(out, ':')) {
+                return false;
+            }
+        }
+        if (!decode_value(r, out)) {
+            return false;
+        }
+    }
+    r->depth--;
+    return doc_buffer_byte(out, object ? '}' : ']');
+}
+
+static bool decode_value(struct msgpack_reader* r, struct doc_buffer* out) {
+    if (r->p >= r->end) {
+        return false;
+    }
+    unsigned char type = *r->p++;
+    uint64_t value = 0;
+    char number[32];
+
+    if (type <= 0x7f) {
+        return doc_buffer_append(out, number, (size_t)sprintf(number, "%u", type));
+    }
+    if (type >= 0xe0) {
+        return doc_buffer_append(out, number, (size_t)sprintf(number, "%d", (int8_t)type));
+    }
+    if (type >= 0x80 && type <= 0x8f) {
+        return decode_container(r, out, type & 0x0f, true);
+    }
+    if (type >= 0x90 && type <= 0x9f) {
+        return decode_container(r, out, type & 0x0f, false);
+    }
+    if (type >= 0xa0 && type <= 0xbf) {
+        return decode_string(r, out, type & 0x1f);
+    }
+
+    switch (type) {
+    case 0xc0: return doc_buffer_append(out, "null", 4);
+    case 0xc2: return doc_buffer_append(out, "false", 5);
+    case 0xc3: return doc_buffer_append(out, "true", 4);
+    case 0xca: {
+        if (!read_be(r, 4, &value)) return false;
+        uint32_t bits = (uint32_t)value;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return write_double(out, f);
+    }
+    case 0xcb: {
+        if (!read_be(r, 8, &value)) return false;
+        double d;
+        memcpy(&d, &value, sizeof(d));
+        return write_double(out, d);
+    }
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+        if (!read_be(r, 1 << (type - 0xcc), &value)) return false;
+        return doc_buffer_append(out, number, (size_t)sprintf(number, "%llu", (unsigned long long)value));
+    case 0xd0:
+        if (!read_be(r, 1, &value)) return false;
+        return doc_buffer_append(out, number, (size_t)sprintf(number, "%d", (int8_t)value));
+    case 0xd1:
+        if (!read_be(r, 2, &value)) return false;
+        return doc_buffer_append(out, number, (size_t)sprintf(number, "%d", (int16_t)value));
+    case 0xd2:
+        if (!read_be(r, 4, &value)) return false;
+        return doc_buffer_append(out, number, (size_t)sprintf(number, "%d", (int32_t)value));
+    case 0xd3:
+        if (!read_be(r, 8, &value)) return false;
+        return doc_buffer_append(out, number, (size_t)sprintf(number, "%lld", (long long)(int64_t)value));
+    case 0xd9: case 0xda: case 0xdb:
+        if (!read_be(r, 1 << (type - 0xd9), &value)) return false;
+        return decode_string(r, out, (size_t)value);
+    case 0xdc: case 0xdd:
+        if (!read_be(r, type == 0xdc ? 2 : 4, &value)) return false;
+        return decode_container(r, out, (size_t)value, false);
+    case 0xde: case 0xdf:
+        if (!read_be(r, type == 0xde ? 2 : 4, &value)) return false;
+        return decode_container(r, out, (size_t)value, true);
+    default:
+        // bin, ext and the unused 0xc1 never appear in documents
+        return false;
+    }
+}
+
+/**
+ * @brief Append the JSON text of a stored document of any format
+ *
+ * @param out The buffer the JSON text is appended to
+ * @param data The stored document
+ * @param len The length of the stored document
+ * @return true on success, false if the document is corrupt
+ */
+bool doc_append_json(struct doc_buffer* out, const char* data, size_t len) {
+    if (doc_format_of(data, len) == DOC_FORMAT_JSON) {
+        return doc_buffer_append(out, data, len);
+    }
+
+    size_t start = out->len;
+    struct msgpack_reader reader = { (const unsigned char*)data + 1, (const unsigned char*)data + len, 0 };
+    if (decode_value(&reader, out) && reader.p == reader.end) {
+        return true;
+    }
+    out->len = start;
+    return false;
+}
+
+enum doc_format doc_format_of(const char* data, size_t len) {
+    return len > 0 && (unsigned char)data[0] == DOC_TAG_MSGPACK ? DOC_FORMAT_MSGPACK : DOC_FORMAT_JSON;
+}
+
+bool doc_format_parse(const char* name, enum doc_format* format) {
+    if (strcmp(name, "json") == 0) {
+        *format = DOC_FORMAT_JSON;
+        return true;
+    }
+    if (strcmp(name, "msgpack") == 0) {
+        *format = DOC_FORMAT_MSGPACK;
+        return true;
+    }
+    return false;
+}
+
+const char* doc_format_name(enum doc_format format) {
+    return format == DOC_FORMAT_MSGPACK ? "msgpack" : "json";
+}
@@ -0,0 +1,114 @@
+#ifndef DOC_CODEC_H
+#define DOC_CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Encodings of the stored documents.
+ *
+ * JSON documents are stored as text. MessagePack documents start with the format tag
+ * DOC_TAG_MSGPACK, a byte that neither JSON text nor MessagePack ever uses, followed by
+ * the MessagePack encoding of the document. The tag makes every stored document
+ * self-describing, so stores holding both formats can be read.
+ */
+enum doc_format {
+    DOC_FORMAT_JSON = 0,
+    DOC_FORMAT_MSGPACK = 1
+};
+
+#define DOC_TAG_MSGPACK 0xC1
+
+/**
+ * Growable output buffer of the codec. Initialize with { 0 } and release with doc_buffer_free.
+ */
+struct doc_buffer {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * @brief Makes room for extra bytes at the end of a buffer.
+ *
+ * @return bool Returns false if the buffer cannot grow.
+ */
+bool doc_buffer_reserve(struct doc_buffer* buf, size_t extra);
+
+/**
+ * @brief Appends bytes to a buffer.
+ *
+ * @return bool Returns false if the buffer cannot grow.
+ */
+bool doc_buffer_append(struct doc_buffer* buf, const char* data, size_t len);
+
+/**
+ * @brief Releases the memory of a buffer and resets it.
+ */
+void doc_buffer_free(struct doc_buffer* buf);
+
+/**
+ * @brief Encodes JSON text as a tagged MessagePack document.
+ *
+ * The text is converted directly, without building a cJSON tree. Integers are stored as
+ * MessagePack integers, other numbers as 64-bit floats.
+ *
+ * @param json The JSON text.
+ * @param len The length of the JSON text.
+ * @param out The buffer the document is appended to.
+ * @return bool Returns false if the text is not valid JSON (out is left unchanged).
+ */
+bool doc_encode_msgpack(const char* json, size_t len, struct doc_buffer* out);
+
+/**
+ * @brief Appends the JSON text of a stored document of any format.
+ *
+ * JSON documents are copied as stored; MessagePack documents are written in the compact
+ * form produced by cJSON_PrintUnformatted.
+ *
+ * @param out The buffer the JSON text is appended to.
+ * @param data The stored document.
+ * @param len The length of the stored document.
+ * @return bool Returns false if the document is corrupt (out is left unchanged).
+ */
+bool doc_append_json(struct doc_buffer* out, const char* data, size_t len);
+
+/**
+ * @brief Unescapes a JSON string.
+ *
+ * Unescaping never makes a string longer, so a destination with room for end - *p bytes
+ * is always large enough. The result is not NUL-terminated.
+ *
+ * @param p Points to the opening quote; moved past the closing quote on success.
+ * @param end The end of the JSON text.
+ * @param dst The destination of the unescaped string.
+ * @param len Set to the length of the unescaped string.
+ * @return bool Returns false if the string is not valid JSON.
+ */
+bool doc_json_unescape(const char** p, const char* end, char* dst, size_t* len);
+
+/**
+ * @brief Appends a string as JSON text, escaped the way cJSON_PrintUnformatted does.
+ *
+ * @return bool Returns false if the buffer cannot grow.
+ */
+bool doc_json_write_string(struct doc_buffer* out, const char* str, size_t len);
+
+/**
+ * @brief Returns the format of a stored document, read from its tag.
+ */
+enum doc_format doc_format_of(const char* data, size_t len);
+
+/**
+ * @brief Parses a format name ("json" or "msgpack").
+ *
+ * @return bool Returns false if the name is unknown.
+ */
+bool doc_format_parse(const char* name, enum doc_format* format);
+
+/**
+ * @brief Returns the name of a format.
+ */
+const char* doc_format_name(enum doc_format format);
+
+#endif // DOC_CODEC_H
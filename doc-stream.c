@@ -0,0 +1,159 @@
+#include "doc-stream.h"
+
+// What may come next between documents
+enum stream_state {
+    STREAM_START,             // Nothing but whitespace so far
+    STREAM_NDJSON,            // Between documents of an NDJSON stream
+    STREAM_ARRAY_FIRST,       // After '[': a document or ']'
+    STREAM_ARRAY_ITEM,        // After ',': a document
+    STREAM_ARRAY_SEPARATOR,   // After a document of the array: ',' or ']'
+    STREAM_ARRAY_CLOSED,      // After ']': whitespace only
+    STREAM_FAILED
+};
+
+void doc_stream_init(struct doc_stream* stream) {
+    stream->state = STREAM_START;
+    stream->depth = 0;
+    stream->in_string = false;
+    stream->escape = false;
+    stream->pos = 0;
+    stream->start = 0;
+    stream->offset = 0;
+}
+
+static bool is_whitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Starts a document at the current position if c opens an object
+static bool begin_document(struct doc_stream* stream, char c) {
+    if (c != '{') {
+        return false;
+    }
+    stream->start = stream->pos;
+    stream->depth = 1;
+    stream->in_string = false;
+    stream->escape = false;
+    return true;
+}
+
+/**
+ * @brief Find the next complete document in the buffer
+ *
+ * @param stream The splitter
+ * @param buf The buffered bytes of the stream
+ * @param len The number of buffered bytes
+ * @param doc_start Set to the offset of the document in buf
+ * @param doc_len Set to the length of the document
+ * @return enum doc_stream_status DOC_STREAM_DOCUMENT when a document was found
+ */
+enum doc_stream_status doc_stream_next(struct doc_stream* stream, const char* buf, size_t len, size_t* doc_start, size_t* doc_len) {
+    if (stream->state == STREAM_FAILED) {
+        return DOC_STREAM_ERROR;
+    }
+
+    while (stream->pos < len) {
+        char c = buf[stream->pos];
+
+        // Inside a document only strings and nesting matter
+        if (stream->depth > 0) {
+            if (stream->in_string) {
+                if (stream->escape) {
+                    stream->escape = false;
+                }
+                else if (c == '\\') {
+                    stream->escape = true;
+                }
+                else if (c == '"') {
+                    stream->in_string = false;
+                }
+            }
+            else if (c == '"') {
+                stream->in_string = true;
+            }
+            else if (c == '{' || c == '[') {
+                stream->depth++;
+            }
+            else if ((c == '}' || c == ']') && --stream->depth == 0) {
+                stream->pos++;
+                *doc_start = stream->start;
+                *doc_len = stream->pos - stream->start;
+                if (stream->state != STREAM_NDJSON) {
+                    stream->state = STREAM_ARRAY_SEPARATOR;
+                }
+                return DOC_STREAM_DOCUMENT;
+            }
+            stream->pos++;
+            continue;
+        }
+
+        if (is_whitespace(c)) {
+            stream->pos++;
+            continue;
+        }
+
+        bool valid;
+        switch (stream->state) {
+        case STREAM_START:
+            if (c == '[') {
+                stream->state = STREAM_ARRAY_FIRST;
+                valid = true;
+            }
+            else {
+                stream->state = STREAM_NDJSON;
+                valid = begin_document(stream, c);
+            }
+            break;
+        case STREAM_NDJSON:
+        case STREAM_ARRAY_ITEM:
+            valid = begin_document(stream, c);
+            break;
+        case STREAM_ARRAY_FIRST:
+            if (c == ']') {
+                stream->state = STREAM_ARRAY_CLOSED;
+                valid = true;
+            }
+            else {
+                stream->state = STREAM_ARRAY_ITEM;
+                valid = begin_document(stream, c);
+            }
+            break;
+        case STREAM_ARRAY_SEPARATOR:
+            valid = c == ',' || c == ']';
+            stream->state = c == ',' ? STREAM_ARRAY_ITEM : STREAM_ARRAY_CLOSED;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+        if (!valid) {
+            stream->state = STREAM_FAILED;
+            return DOC_STREAM_ERROR;
+        }
+        stream->pos++;
+    }
+    return DOC_STREAM_MORE;
+}
+
+size_t doc_stream_consumed(const struct doc_stream* stream) {
+    return stream->depth > 0 ? stream->start : stream->pos;
+}
+
+void doc_stream_discard(struct doc_stream* stream, size_t n) {
+    stream->pos -= n;
+    if (stream->depth > 0) {
+        stream->start -= n;
+    }
+    stream->offset += n;
+}
+
+bool doc_stream_finish(const struct doc_stream* stream) {
+    if (stream->depth > 0) {
+        return false;
+    }
+    return stream->state == STREAM_START || stream->state == STREAM_NDJSON || stream->state == STREAM_ARRAY_CLOSED;
+}
+
+size_t doc_stream_position(const struct doc_stream* stream) {
+    return stream->offset + stream->pos;
+}
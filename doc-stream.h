@@ -0,0 +1,69 @@
+#ifndef DOC_STREAM_H
+#define DOC_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Splitter of a stream of JSON objects, as newline-delimited JSON (NDJSON) or as one JSON
+ * array of objects, that returns each document as soon as its last byte has arrived.
+ *
+ * The splitter only tracks nesting and strings to find where documents end; the documents
+ * themselves are validated by whoever parses them. The caller owns the buffer: it appends
+ * the bytes received, calls doc_stream_next until more input is needed, then may drop the
+ * first doc_stream_consumed bytes and report it with doc_stream_discard.
+ */
+struct doc_stream {
+    int state;
+    int depth;      // Nesting inside the current document, 0 between documents
+    bool in_string;
+    bool escape;
+    size_t pos;     // Scan position in the buffer
+    size_t start;   // Start of the current document in the buffer
+    size_t offset;  // Bytes discarded from the front of the buffer so far
+};
+
+enum doc_stream_status {
+    DOC_STREAM_DOCUMENT,  // A complete document was found
+    DOC_STREAM_MORE,      // The buffer holds no further complete document
+    DOC_STREAM_ERROR      // The stream is neither NDJSON nor a JSON array of objects
+};
+
+/**
+ * @brief Initializes a splitter at the start of a stream.
+ */
+void doc_stream_init(struct doc_stream* stream);
+
+/**
+ * @brief Finds the next complete document in the buffer.
+ *
+ * @param stream The splitter.
+ * @param buf The buffered bytes of the stream.
+ * @param len The number of buffered bytes.
+ * @param doc_start Set to the offset of the document in buf.
+ * @param doc_len Set to the length of the document.
+ * @return enum doc_stream_status DOC_STREAM_DOCUMENT when a document was found.
+ */
+enum doc_stream_status doc_stream_next(struct doc_stream* stream, const char* buf, size_t len, size_t* doc_start, size_t* doc_len);
+
+/**
+ * @brief Returns the number of bytes at the front of the buffer that are no longer needed.
+ */
+size_t doc_stream_consumed(const struct doc_stream* stream);
+
+/**
+ * @brief Records that the first n bytes (at most doc_stream_consumed) were dropped from the buffer.
+ */
+void doc_stream_discard(struct doc_stream* stream, size_t n);
+
+/**
+ * @brief Checks that the stream ended cleanly: no partial document and, for an array, the closing bracket.
+ */
+bool doc_stream_finish(const struct doc_stream* stream);
+
+/**
+ * @brief Returns the position in the stream where scanning stopped, for error messages.
+ */
+size_t doc_stream_position(const struct doc_stream* stream);
+
+#endif // DOC_STREAM_H
@@ -0,0 +1,522 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "group-commit.h"
+#include "database.h" // Include Redis database functions
+#include "log-utils.h" // Include the log utils header
+#include "shm-cache.h" // Include the shared document cache
+
+enum group_write_kind {
+    GROUP_WRITE_INSERT,
+    GROUP_WRITE_UPDATE,
+    GROUP_WRITE_DELETE
+};
+
+/**
+ * A write waiting in the queue, owned by the request that submitted it, or by the queue
+ * itself for an asynchronous write.
+ */
+struct group_write {
+    enum group_write_kind kind;
+    long long id;
+    const struct pet* pet;    // The pet written, NULL for a delete
+    const struct pet* after;  // The pet stored once the write is applied, set by the writer
+    struct timespec queued_at;
+    bool done;
+    bool success;
+    bool async;               // Released by the writer once applied
+    long long operation;      // Operation id of an asynchronous write
+    struct pet owned;         // Pet of an asynchronous write
+    struct group_write* next;
+};
+
+/**
+ * Outcome of a recent asynchronous write, in a ring indexed by operation id.
+ */
+struct operation_status {
+    long long operation;
+    enum group_commit_status status;
+};
+
+static const char* group_collection = NULL;
+static size_t group_max_ops = 0;
+static unsigned int group_window_us = 0;
+static pthread_t group_writer;
+static struct group_write** group_batch = NULL; // Writes of the batch being applied
+static bool group_running = false;
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_arrival = PTHREAD_COND_INITIALIZER; // A write was queued
+static pthread_cond_t group_done = PTHREAD_COND_INITIALIZER;    // A batch was applied
+static pthread_cond_t group_room = PTHREAD_COND_INITIALIZER;    // Asynchronous writes were applied
+static struct group_write* queue_head = NULL;
+static struct group_write* queue_tail = NULL;
+static size_t queue_length = 0;
+static size_t async_limit = 0;   // Most asynchronous writes queued at once, 0 when disabled
+static size_t async_length = 0;  // Asynchronous writes queued
+static bool async_block = false; // Wait for room rather than reject when the queue is full
+static struct operation_status* statuses = NULL;
+static size_t status_slots = 0;
+static long long next_operation = 1;
+static struct group_commit_stats group_stats = { 0 };
+
+// Helper function to record the status of an operation, with the lock held
+static void record_status(long long operation, enum group_commit_status status) {
+    struct operation_status* entry = &statuses[(size_t)operation % status_slots];
+    entry->operation = operation;
+    entry->status = status;
+}
+
+// Helper function to release the asynchronous writes of a batch once they are applied
+static void release_writes(struct group_write* applied) {
+    while (applied != NULL) {
+        struct group_write* write = applied;
+        applied = write->next;
+        // Even after a failure: the write may have reached Redis
+        shm_cache_invalidate(write->id);
+        pet_free(&write->owned);
+        free(write);
+    }
+}
+
+// db_batch_result_fn recording the outcome of a write of the batch
+static void group_write_result(void* arg, size_t tag, bool success) {
+    struct group_write** writes = arg;
+    writes[tag]->success = success;
+}
+
+/**
+ * @brief Apply a batch of writes in one pipeline
+ *
+ * The stored pets replaced by updates and deletes are read first, in one round trip. A
+ * pet written earlier in the batch is not read again: the later writes apply to the pet
+ * the earlier one leaves, as if they had been sent one after the other.
+ *
+ * @param writes The writes, in the order they were queued
+ * @param count The number of writes
+ */
+static void apply_batch(struct group_write** writes, size_t count) {
+    size_t* first = malloc(count * sizeof(*first));     // First write of the same pet
+    long long* slots = malloc(count * sizeof(*slots));  // Read slot of a pet, by first write
+    long long* ids = malloc(count * sizeof(*ids));
+    struct pet* stored = calloc(count, sizeof(*stored));
+    if (first == NULL || slots == NULL || ids == NULL || stored == NULL) {
+        LOG_ERROR("Memory allocation failed for the group commit");
+        free(first);
+        free(slots);
+        free(ids);
+        free(stored);
+        return;
+    }
+
+    size_t read_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        first[i] = i;
+        slots[i] = -1;
+        for (size_t j = 0; j < i; j++) {
+            if (writes[j]->id == writes[i]->id) {
+                first[i] = first[j];
+                break;
+            }
+        }
+        if (writes[i]->kind != GROUP_WRITE_INSERT && slots[first[i]] < 0) {
+            slots[first[i]] = (long long)read_count;
+            ids[read_count++] = writes[i]->id;
+        }
+    }
+
+    struct db_batch* batch = NULL;
+    if (db_thread_attach() != EXIT_SUCCESS) {
+        LOG_ERROR("Group commit writer is not connected to the database");
+    }
+    else if (read_count > 0 && !db_pet_find_many(group_collection, ids, read_count, stored)) {
+        LOG_ERROR("Failed to read the pets of the group commit");
+    }
+    else {
+        batch = db_batch_create(group_collection, 0, group_write_result, writes);
+    }
+
+    for (size_t i = 0; batch != NULL && i < count; i++) {
+        struct group_write* write = writes[i];
+        const struct pet* current = NULL;
+        bool written = false;
+        for (size_t j = i; j-- > first[i];) {
+            if (writes[j]->id == write->id) {
+                current = writes[j]->after;
+                written = true;
+                break;
+            }
+        }
+        if (!written && slots[first[i]] >= 0 && stored[slots[first[i]]].has_id) {
+            current = &stored[slots[first[i]]];
+        }
+
+        bool queued = false;
+        switch (write->kind) {
+        case GROUP_WRITE_INSERT:
+            queued = db_batch_add_pet(batch, write->pet, i);
+            break;
+        case GROUP_WRITE_UPDATE:
+            queued = current != NULL && db_batch_add_pet_update(batch, current, write->pet, i);
+            break;
+        case GROUP_WRITE_DELETE:
+            queued = current != NULL && db_batch_add_pet_delete(batch, current, i);
+            break;
+        }
+        if (!queued) {
+            if (current == NULL && write->kind != GROUP_WRITE_INSERT) {
+                LOG_ERROR("Document %lld not found", write->id);
+            }
+            write->after = current;
+        }
+        else {
+            write->after = write->kind == GROUP_WRITE_DELETE ? NULL : write->pet;
+        }
+    }
+    // Flushes the batch, reporting the outcome of every queued write
+    db_batch_free(batch);
+    db_thread_report();
+
+    for (size_t i = 0; i < read_count; i++) {
+        pet_free(&stored[i]);
+    }
+    free(first);
+    free(slots);
+    free(ids);
+    free(stored);
+}
+
+// Helper function to compute the time a batch is flushed at the latest
+static struct timespec batch_deadline(const struct timespec* queued_at) {
+    struct timespec deadline = *queued_at;
+    deadline.tv_nsec += (long)group_window_us * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    return deadline;
+}
+
+// Writer thread: applies the queued writes until stopped and drained
+static void* group_writer_main(void* arg) {
+    (void)arg; // Mark unused parameter
+    struct group_write** writes = group_batch;
+    pthread_mutex_lock(&group_lock);
+    while (true) {
+        while (queue_length == 0 && group_running) {
+            pthread_cond_wait(&group_arrival, &group_lock);
+        }
+        if (queue_length == 0) {
+            break;
+        }
+
+        // Flush when the batch is full or its oldest write has waited the window
+        struct timespec deadline = batch_deadline(&queue_head->queued_at);
+        while (group_running && queue_length < group_max_ops) {
+            if (pthread_cond_timedwait(&group_arrival, &group_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        size_t count = 0;
+        while (queue_head != NULL && count < group_max_ops) {
+            struct group_write* write = queue_head;
+            queue_head = write->next;
+            write->success = false;
+            writes[count++] = write;
+        }
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        queue_length -= count;
+        pthread_mutex_unlock(&group_lock);
+
+        apply_batch(writes, count);
+
+        pthread_mutex_lock(&group_lock);
+        group_stats.batches++;
+        if (count > group_stats.largest_batch) {
+            group_stats.largest_batch = count;
+        }
+        // A write belongs to its request again as soon as it is done
+        struct group_write* applied = NULL;
+        for (size_t i = 0; i < count; i++) {
+            struct group_write* write = writes[i];
+            if (!write->async) {
+                write->done = true;
+                continue;
+            }
+            record_status(write->operation, write->success ? GROUP_COMMIT_APPLIED : GROUP_COMMIT_FAILED);
+            if (!write->success) {
+                group_stats.failures++;
+            }
+            async_length--;
+            write->next = applied;
+            applied = write;
+        }
+        pthread_cond_broadcast(&group_done);
+        if (applied != NULL) {
+            pthread_cond_broadcast(&group_room);
+            pthread_mutex_unlock(&group_lock);
+            release_writes(applied);
+            pthread_mutex_lock(&group_lock);
+        }
+    }
+    pthread_mutex_unlock(&group_lock);
+    return NULL;
+}
+
+/**
+ * @brief Start the writer thread
+ *
+ * @param collection_name The name of the pet collection
+ * @param max_ops The number of writes that flushes a batch
+ * @param window_us The longest time a write waits for others
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int group_commit_init(const char* collection_name, size_t max_ops, unsigned int window_us) {
+    if (max_ops == 0) {
+        LOG_ERROR("The group commit batch size must not be 0");
+        return EXIT_FAILURE;
+    }
+    group_batch = malloc(max_ops * sizeof(*group_batch));
+    if (group_batch == NULL) {
+        LOG_ERROR("Memory allocation failed for the group commit");
+        return EXIT_FAILURE;
+    }
+    group_collection = collection_name;
+    group_max_ops = max_ops;
+    group_window_us = window_us;
+    group_stats.max_ops = max_ops;
+    group_stats.window_us = window_us;
+    group_running = true;
+    if (pthread_create(&group_writer, NULL, group_writer_main, NULL) != 0) {
+        LOG_ERROR("Failed to start the group commit writer");
+        group_running = false;
+        group_collection = NULL;
+        free(group_batch);
+        group_batch = NULL;
+        return EXIT_FAILURE;
+    }
+    LOG_INFO("Group commit of pet writes: %zu writes or %u us per batch", max_ops, window_us);
+    return EXIT_SUCCESS;
+}
+
+bool group_commit_enabled(void) {
+    return group_collection != NULL;
+}
+
+// Helper function to queue a write and wait until the writer has applied it
+static bool submit_write(enum group_write_kind kind, long long id, const struct pet* pet) {
+    struct group_write write = {
+        .kind = kind,
+        .id = id,
+        .pet = pet,
+        .after = NULL,
+        .done = false,
+        .success = false,
+        .next = NULL
+    };
+    clock_gettime(CLOCK_REALTIME, &write.queued_at);
+
+    pthread_mutex_lock(&group_lock);
+    if (!group_running) {
+        pthread_mutex_unlock(&group_lock);
+        return false;
+    }
+    if (queue_tail != NULL) {
+        queue_tail->next = &write;
+    }
+    else {
+        queue_head = &write;
+    }
+    queue_tail = &write;
+    queue_length++;
+    group_stats.writes++;
+    pthread_cond_signal(&group_arrival);
+
+    while (!write.done) {
+        pthread_cond_wait(&group_done, &group_lock);
+    }
+    if (!write.success) {
+        group_stats.failures++;
+    }
+    pthread_mutex_unlock(&group_lock);
+    return write.success;
+}
+
+bool group_commit_pet_insert(const struct pet* pet) {
+    return submit_write(GROUP_WRITE_INSERT, pet->has_id ? pet->id : 0, pet);
+}
+
+bool group_commit_pet_update(const struct pet* update) {
+    if (!update->has_id) {
+        LOG_ERROR("Update document does not contain an id");
+        return false;
+    }
+    return submit_write(GROUP_WRITE_UPDATE, update->id, update);
+}
+
+bool group_commit_pet_delete(long long id) {
+    return submit_write(GROUP_WRITE_DELETE, id, NULL);
+}
+
+/**
+ * @brief Accept asynchronous writes
+ *
+ * @param queue_limit The most asynchronous writes queued at once
+ * @param status_count The number of recent operations whose status is kept
+ * @param block_when_full Wait for room rather than reject a write when the queue is full
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int group_commit_async_init(size_t queue_limit, size_t status_count, bool block_when_full) {
+    if (group_collection == NULL) {
+        LOG_ERROR("Asynchronous writes need the group commit");
+        return EXIT_FAILURE;
+    }
+    if (queue_limit == 0) {
+        LOG_ERROR("The asynchronous write queue size must not be 0");
+        return EXIT_FAILURE;
+    }
+    // Every queued operation keeps its status until it is applied
+    if (status_count < queue_limit) {
+        status_count = queue_limit;
+    }
+    struct operation_status* ring = calloc(status_count, sizeof(*ring));
+    if (ring == NULL) {
+        LOG_ERROR("Memory allocation failed for the operation statuses");
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_lock(&group_lock);
+    statuses = ring;
+    status_slots = status_count;
+    async_block = block_when_full;
+    async_limit = queue_limit;
+    group_stats.async_limit = queue_limit;
+    pthread_mutex_unlock(&group_lock);
+    LOG_INFO("Asynchronous pet writes: %zu queued at most, %s when full, %zu statuses kept",
+        queue_limit, block_when_full ? "blocking" : "rejecting", status_count);
+    return EXIT_SUCCESS;
+}
+
+bool group_commit_async_enabled(void) {
+    return async_limit > 0;
+}
+
+/**
+ * @brief Queue a write without waiting for it
+ *
+ * @param kind The kind of write
+ * @param id The id of the pet
+ * @param pet The pet written, moved into the queue, or NULL for a delete
+ * @param operation Set to the operation id of the write once accepted
+ * @return enum group_commit_submit The outcome of the submission
+ */
+static enum group_commit_submit submit_async(enum group_write_kind kind, long long id, struct pet* pet, long long* operation) {
+    struct group_write* write = calloc(1, sizeof(*write));
+    if (write == NULL) {
+        LOG_ERROR("Memory allocation failed for an asynchronous write");
+        if (pet != NULL) {
+            pet_free(pet);
+        }
+        return GROUP_COMMIT_REFUSED;
+    }
+    write->kind = kind;
+    write->id = id;
+    write->async = true;
+    if (pet != NULL) {
+        write->owned = *pet;
+        memset(pet, 0, sizeof(*pet));
+        write->pet = &write->owned;
+    }
+
+    pthread_mutex_lock(&group_lock);
+    while (async_block && group_running && async_length >= async_limit) {
+        pthread_cond_wait(&group_room, &group_lock);
+    }
+    if (!group_running || async_length >= async_limit) {
+        enum group_commit_submit result = group_running ? GROUP_COMMIT_FULL : GROUP_COMMIT_REFUSED;
+        if (result == GROUP_COMMIT_FULL) {
+            group_stats.async_rejected++;
+        }
+        pthread_mutex_unlock(&group_lock);
+        pet_free(&write->owned);
+        free(write);
+        return result;
+    }
+    clock_gettime(CLOCK_REALTIME, &write->queued_at);
+    write->operation = next_operation++;
+    record_status(write->operation, GROUP_COMMIT_QUEUED);
+    *operation = write->operation;
+
+    if (queue_tail != NULL) {
+        queue_tail->next = write;
+    }
+    else {
+        queue_head = write;
+    }
+    queue_tail = write;
+    queue_length++;
+    async_length++;
+    group_stats.writes++;
+    group_stats.async_writes++;
+    pthread_cond_signal(&group_arrival);
+    pthread_mutex_unlock(&group_lock);
+    return GROUP_COMMIT_ACCEPTED;
+}
+
+enum group_commit_submit group_commit_pet_insert_async(struct pet* pet, long long* operation) {
+    return submit_async(GROUP_WRITE_INSERT, pet->has_id ? pet->id : 0, pet, operation);
+}
+
+enum group_commit_submit group_commit_pet_update_async(struct pet* update, long long* operation) {
+    if (!update->has_id) {
+        LOG_ERROR("Update document does not contain an id");
+        pet_free(update);
+        return GROUP_COMMIT_REFUSED;
+    }
+    return submit_async(GROUP_WRITE_UPDATE, update->id, update, operation);
+}
+
+enum group_commit_submit group_commit_pet_delete_async(long long id, long long* operation) {
+    return submit_async(GROUP_WRITE_DELETE, id, NULL, operation);
+}
+
+enum group_commit_status group_commit_operation_status(long long operation) {
+    enum group_commit_status status = GROUP_COMMIT_UNKNOWN;
+    pthread_mutex_lock(&group_lock);
+    if (status_slots > 0 && operation > 0) {
+        const struct operation_status* entry = &statuses[(size_t)operation % status_slots];
+        if (entry->operation == operation) {
+            status = entry->status;
+        }
+    }
+    pthread_mutex_unlock(&group_lock);
+    return status;
+}
+
+void group_commit_get_stats(struct group_commit_stats* stats) {
+    pthread_mutex_lock(&group_lock);
+    *stats = group_stats;
+    stats->async_queued = async_length;
+    pthread_mutex_unlock(&group_lock);
+}
+
+void group_commit_cleanup(void) {
+    if (group_collection == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&group_lock);
+    group_running = false;
+    pthread_cond_signal(&group_arrival);
+    pthread_cond_broadcast(&group_room);
+    pthread_mutex_unlock(&group_lock);
+    pthread_join(group_writer, NULL);
+    group_collection = NULL;
+    free(group_batch);
+    group_batch = NULL;
+    async_limit = 0;
+    free(statuses);
+    statuses = NULL;
+    status_slots = 0;
+}
@@ -0,0 +1,160 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "model.h" // Include the Pet and User model
+
+/**
+ * Group commit of the pet writes of concurrent requests.
+ *
+ * Request threads hand their insert, update or delete to a writer thread and block until it
+ * is acknowledged. The writer collects the writes queued until the batch holds max_ops of
+ * them or the first one has waited window_us, reads the stored pets the updates and deletes
+ * replace in one round trip, and sends every write of the batch in one pipeline (db_batch).
+ * Each request is then completed with the outcome of its own commands.
+ *
+ * Writes to the same pet in one batch are applied in the order they were queued.
+ *
+ * Once group_commit_async_init is called, writes may also be queued without waiting: the
+ * request gets an operation id back right away and the writer applies the write with the
+ * next batch. At most queue_limit asynchronous writes wait at once; beyond that a write is
+ * rejected, or waits for room if the queue is set to block. The status of the most recent
+ * operations is kept in a ring, so that clients can poll for completion.
+ */
+
+/**
+ * Outcome of the submission of an asynchronous write.
+ */
+enum group_commit_submit {
+    GROUP_COMMIT_ACCEPTED,  // Queued, the operation id is set
+    GROUP_COMMIT_FULL,      // The queue is full
+    GROUP_COMMIT_REFUSED    // Invalid write, out of memory or writer stopped
+};
+
+/**
+ * Status of an asynchronous write.
+ */
+enum group_commit_status {
+    GROUP_COMMIT_UNKNOWN,   // Never issued, or too old to be kept
+    GROUP_COMMIT_QUEUED,
+    GROUP_COMMIT_APPLIED,
+    GROUP_COMMIT_FAILED
+};
+
+/**
+ * Counters of the group commit.
+ */
+struct group_commit_stats {
+    unsigned long long writes;    // Writes submitted
+    unsigned long long batches;   // Pipelines sent
+    unsigned long long failures;  // Writes that failed
+    size_t largest_batch;
+    size_t max_ops;
+    unsigned int window_us;
+    unsigned long long async_writes;    // Asynchronous writes accepted
+    unsigned long long async_rejected;  // Asynchronous writes rejected because the queue was full
+    size_t async_queued;                // Asynchronous writes waiting
+    size_t async_limit;
+};
+
+/**
+ * @brief Starts the writer thread.
+ *
+ * @param collection_name The name of the pet collection, which must outlive the writer.
+ * @param max_ops The number of writes that flushes a batch right away.
+ * @param window_us The longest time a write waits for others to join its batch, in microseconds.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int group_commit_init(const char* collection_name, size_t max_ops, unsigned int window_us);
+
+/**
+ * @brief Checks whether pet writes go through the group commit.
+ */
+bool group_commit_enabled(void);
+
+/**
+ * @brief Inserts a pet, as db_pet_insert does, and waits for the acknowledgement.
+ *
+ * @return bool Returns true on success, false on failure.
+ */
+bool group_commit_pet_insert(const struct pet* pet);
+
+/**
+ * @brief Replaces a stored pet, as db_pet_update does, and waits for the acknowledgement.
+ *
+ * @return bool Returns true on success, false if the pet does not exist or on failure.
+ */
+bool group_commit_pet_update(const struct pet* update);
+
+/**
+ * @brief Deletes a pet, as db_pet_delete does, and waits for the acknowledgement.
+ *
+ * @return bool Returns true on success, false if the pet does not exist or on failure.
+ */
+bool group_commit_pet_delete(long long id);
+
+/**
+ * @brief Accepts asynchronous writes, once the writer is started.
+ *
+ * @param queue_limit The most asynchronous writes waiting at once.
+ * @param status_count The number of recent operations whose status is kept, at least queue_limit.
+ * @param block_when_full Makes a write wait for room rather than be rejected when the queue is full.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int group_commit_async_init(size_t queue_limit, size_t status_count, bool block_when_full);
+
+/**
+ * @brief Checks whether pet writes may be queued without waiting.
+ */
+bool group_commit_async_enabled(void);
+
+/**
+ * @brief Queues the insert of a pet without waiting for it.
+ *
+ * @param pet The pet, moved into the queue: it is released whatever the outcome.
+ * @param operation Set to the operation id of the write when it is accepted.
+ * @return enum group_commit_submit The outcome of the submission.
+ */
+enum group_commit_submit group_commit_pet_insert_async(struct pet* pet, long long* operation);
+
+/**
+ * @brief Queues the update of a stored pet without waiting for it.
+ *
+ * @param update The pet, moved into the queue: it is released whatever the outcome.
+ * @param operation Set to the operation id of the write when it is accepted.
+ * @return enum group_commit_submit The outcome of the submission.
+ */
+enum group_commit_submit group_commit_pet_update_async(struct pet* update, long long* operation);
+
+/**
+ * @brief Queues the delete of a pet without waiting for it.
+ *
+ * @param id The id of the pet.
+ * @param operation Set to the operation id of the write when it is accepted.
+ * @return enum group_commit_submit The outcome of the submission.
+ */
+enum group_commit_submit group_commit_pet_delete_async(long long id, long long* operation);
+
+/**
+ * @brief Gets the status of an asynchronous write.
+ *
+ * @param operation The operation id returned when the write was accepted.
+ * @return enum group_commit_status The status, GROUP_COMMIT_UNKNOWN once it is too old to be kept.
+ */
+enum group_commit_status group_commit_operation_status(long long operation);
+
+/**
+ * @brief Copies the counters of the group commit.
+ */
+void group_commit_get_stats(struct group_commit_stats* stats);
+
+/**
+ * @brief Applies the writes still queued, asynchronous ones included, and stops the writer thread.
+ *
+ * Must not be called while requests are submitting writes.
+ */
+void group_commit_cleanup(void);
+
+#endif // GROUP_COMMIT_H
@@ -1,19 +1,41 @@
 #include "database.h"
 #include "handlers.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <cjson/cJSON.h>
+#include "arena.h" // Include the cJSON request arena
+#include "auto-pipeline.h" // Include the Redis auto-pipeline
+#include "body-compress.h" // Include the response compression
+#include "doc-stream.h" // Include the document stream splitter
+#include "group-commit.h" // Include the group commit of pet writes
+#include "hedged-read.h" // Include the hedged reads
+#include "json-minify.h" // Include the JSON validator and minifier
 #include "log-utils.h" // Include the log utils header
+#include "shm-cache.h" // Include the shared document cache
+#include "stale-cache.h" // Include the stale-while-revalidate cache
 
-// Helper function to parse JSON and log errors
-static cJSON* parse_json(const char* json_payload) {
-    cJSON* doc = cJSON_Parse(json_payload);
-    if (!doc) {
+// Maximum number of ids of GET /v2/pet?ids=
+#define PET_IDS_MAX 1000
+
+// Helper function to parse a Pet payload and log errors
+static bool parse_pet(const char* json_payload, struct pet* pet) {
+    if (!pet_parse(json_payload, strlen(json_payload), pet)) {
+        LOG_ERROR("Failed to parse JSON");
+        return false;
+    }
+    return true;
+}
+
+// Helper function to parse a User payload and log errors
+static bool parse_user(const char* json_payload, struct user* user) {
+    if (!user_parse(json_payload, strlen(json_payload), user)) {
         LOG_ERROR("Failed to parse JSON");
+        return false;
     }
-    return doc;
+    return true;
 }
 
 // Helper function to create a query JSON object
@@ -41,6 +63,164 @@ static cJSON* create_query(const char* field, const char* operator, const char*
     return query;
 }
 
+/**
+ * @brief Helper function to read the next entity tag of an If-None-Match or If-Match list
+ *
+ * @param p The position in the list, advanced past the entity tag
+ * @param etag Set to the entity tag, without its weak prefix
+ * @param len Set to the length of the entity tag
+ * @param weak Set when the entity tag is weak (W/"...")
+ * @return true if an entity tag was found, false at the end of the list
+ */
+static bool next_etag(const char** p, const char** etag, size_t* len, bool* weak) {
+    const char* c = *p;
+    while (*c == ' ' || *c == '\t' || *c == ',') {
+        c++;
+    }
+    if (*c == '\0') {
+        return false;
+    }
+    *weak = strncmp(c, "W/", 2) == 0;
+    if (*weak) {
+        c += 2;
+    }
+    const char* end = c;
+    while (*end != '\0' && *end != ',' && *end != ' ' && *end != '\t') {
+        end++;
+    }
+    *etag = c;
+    *len = (size_t)(end - c);
+    *p = end;
+    return true;
+}
+
+/**
+ * @brief Helper function to check an If-None-Match or If-Match list against an ETag
+ *
+ * @param list The list of entity tags
+ * @param etag The ETag of the current representation
+ * @param weak Weak comparison (If-None-Match) when true; strong comparison (If-Match),
+ *        where weak entity tags never match, when false
+ */
+static bool etag_matches(const char* list, const char* etag, bool weak) {
+    size_t etag_len = strlen(etag);
+    const char* entry;
+    size_t len;
+    bool entry_weak;
+    while (next_etag(&list, &entry, &len, &entry_weak)) {
+        if ((weak || !entry_weak) && len == etag_len && strncmp(entry, etag, etag_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Outcome of matching an If-Match header against the versions of a pet
+enum if_match_result {
+    IF_MATCH_VERSION,   // The version to update is selected
+    IF_MATCH_NONE,      // No version can match
+    IF_MATCH_FAILED     // The current version could not be read
+};
+
+/**
+ * @brief Helper function to select the version an If-Match header allows to update
+ *
+ * A single entity tag is used as is, so the update costs no extra round trip; with a list
+ * the current version is read and must be one of them.
+ *
+ * @param if_match The If-Match header
+ * @param id The id of the pet
+ * @param version Set to the version, or -1 for "*" (any existing version)
+ * @return enum if_match_result IF_MATCH_FAILED if the list needed the current version and
+ *         Redis did not answer
+ */
+static enum if_match_result if_match_version(const char* if_match, long long id, long long* version) {
+    const char* p = if_match;
+    const char* entry;
+    size_t len;
+    bool weak;
+    size_t count = 0;
+    while (next_etag(&p, &entry, &len, &weak)) {
+        if (len == 1 && entry[0] == '*') {
+            *version = -1;
+            return IF_MATCH_VERSION;
+        }
+        // Weak entity tags never match with the strong comparison of If-Match
+        if (!weak && len > 3 && strncmp(entry, "\"v", 2) == 0 && entry[len - 1] == '"') {
+            char* end = NULL;
+            long long value = strtoll(entry + 2, &end, 10);
+            if (end == entry + len - 1 && value > 0) {
+                *version = value;
+                count++;
+            }
+        }
+    }
+    if (count <= 1) {
+        return count == 1 ? IF_MATCH_VERSION : IF_MATCH_NONE;
+    }
+
+    char pet_id[24];
+    sprintf(pet_id, "%lld", id);
+    long long current = db_document_version("pets", pet_id);
+    if (current < 0) {
+        return IF_MATCH_FAILED;
+    }
+    char etag[ETAG_SIZE];
+    snprintf(etag, sizeof(etag), "\"v%lld\"", current);
+    *version = current;
+    return etag_matches(if_match, etag, false) ? IF_MATCH_VERSION : IF_MATCH_NONE;
+}
+
+/**
+ * @brief Helper function to set the ETag of a query on a field index
+ *
+ * Generations only grow, so their sum changes with every write to any of the entries.
+ *
+ * @return true if the ETag was set, false if there are no values or the generations could not be read
+ */
+static bool set_index_etag(const char* field, const char* values, struct conditional_get* cond) {
+    if (values == NULL) {
+        // Without the query argument the result is always empty
+        return false;
+    }
+    char* values_copy = strdup(values);
+    const char** entries = calloc(strlen(values) / 2 + 1, sizeof(*entries));
+    long long* generations = calloc(strlen(values) / 2 + 1, sizeof(*generations));
+    bool success = values_copy != NULL && entries != NULL && generations != NULL;
+    if (success) {
+        size_t count = 0;
+        for (char* token = strtok(values_copy, ","); token != NULL; token = strtok(NULL, ",")) {
+            entries[count++] = token;
+        }
+        success = db_index_generations("pets", field, entries, count, generations);
+        long long sum = 0;
+        for (size_t i = 0; success && i < count; i++) {
+            sum += generations[i];
+        }
+        if (success) {
+            snprintf(cond->etag, ETAG_SIZE, "\"g%lld\"", sum);
+        }
+    }
+    free(values_copy);
+    free(entries);
+    free(generations);
+    return success;
+}
+
+// Helper function to read a pet or operation id given as text
+// Only the canonical decimal form is accepted ("7", not "007", "+7" or " 7"), so that the id
+// read here and the Redis key built from the text always name the same pet.
+static bool parse_pet_id(const char* id, long long* value) {
+    const char* digits = *id == '-' ? id + 1 : id;
+    if (*digits < '0' || *digits > '9' || (*digits == '0' && (digits[1] != '\0' || digits != id))) {
+        return false;
+    }
+    char* end = NULL;
+    errno = 0;
+    *value = strtoll(id, &end, 10);
+    return *end == '\0' && errno != ERANGE;
+}
+
 /**
  * @brief Creates a new pet from the given JSON payload.
  *
@@ -49,46 +229,322 @@ static cJSON* create_query(const char* field, const char* operator, const char*
  */
 int handle_create_pet(const char* json_payload) {
     LOG_INFO("handle_create_pet");
-    cJSON* doc = parse_json(json_payload);
-    if (!doc) return EXIT_FAILURE;
+    struct pet pet;
+    if (!parse_pet(json_payload, &pet)) return EXIT_FAILURE;
 
-    int result = db_pet_insert("pets", doc) ? EXIT_SUCCESS : EXIT_FAILURE;
+    bool inserted = group_commit_enabled() ? group_commit_pet_insert(&pet) : db_pet_insert("pets", &pet);
+    int result = inserted ? EXIT_SUCCESS : EXIT_FAILURE;
     if (result == EXIT_FAILURE) {
         LOG_ERROR("Failed to insert pet");
     }
+    // Even after a failure: the write may have reached Redis
+    if (pet.has_id) {
+        shm_cache_invalidate(pet.id);
+    }
 
-    cJSON_Delete(doc);
+    pet_free(&pet);
     return result;
 }
 
 /**
  * @brief Updates an existing pet with the given JSON payload.
  *
+ * With an If-Match header the update is a compare-and-swap on the version of the pet.
+ *
  * @param json_payload The JSON payload containing the updated pet details.
- * @return int Returns EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ * @param if_match The If-Match header of the request, or NULL.
+ * @param etag Set to the ETag of the updated pet when if_match is given (ETAG_SIZE bytes).
+ * @return int Returns EXIT_SUCCESS on success, HANDLER_PRECONDITION_FAILED if If-Match does
+ *         not match the stored pet, HANDLER_UNAVAILABLE if the current version could not be
+ *         read, EXIT_FAILURE on failure.
  */
-int handle_update_pet(const char* json_payload) {
+int handle_update_pet(const char* json_payload, const char* if_match, char* etag) {
     LOG_INFO("handle_update_pet");
-    cJSON* update = parse_json(json_payload);
-    if (!update) return EXIT_FAILURE;
+    struct pet update;
+    if (!parse_pet(json_payload, &update)) return EXIT_FAILURE;
 
-    // Read the JSON payload and extract the id field
-    cJSON* id_item = cJSON_GetObjectItem(update, "id");
-    if (!cJSON_IsNumber(id_item)) {
+    // The id field selects the pet to update
+    if (!update.has_id) {
         LOG_ERROR("Failed to find 'id' field in JSON");
-        cJSON_Delete(update);
+        pet_free(&update);
         return EXIT_FAILURE;
     }
 
-    int result = db_pet_update("pets", update) ? EXIT_SUCCESS : EXIT_FAILURE;
+    int result;
+    if (if_match == NULL) {
+        bool updated = group_commit_enabled() ? group_commit_pet_update(&update) : db_pet_update("pets", &update);
+        result = updated ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else {
+        long long version = 0;
+        enum if_match_result match = if_match_version(if_match, update.id, &version);
+        if (match == IF_MATCH_FAILED) {
+            LOG_ERROR("Failed to read the version of pet %lld", update.id);
+            pet_free(&update);
+            return HANDLER_UNAVAILABLE;
+        }
+        if (match == IF_MATCH_NONE) {
+            LOG_ERROR("If-Match does not match pet %lld", update.id);
+            pet_free(&update);
+            return HANDLER_PRECONDITION_FAILED;
+        }
+        long long new_version = 0;
+        enum db_write_result write = db_pet_update_versioned("pets", &update, version, &new_version);
+        if (write == DB_WRITE_DONE) {
+            snprintf(etag, ETAG_SIZE, "\"v%lld\"", new_version);
+        }
+        result = write == DB_WRITE_DONE ? EXIT_SUCCESS : write == DB_WRITE_CONFLICT ? HANDLER_PRECONDITION_FAILED : EXIT_FAILURE;
+    }
     if (result == EXIT_FAILURE) {
         LOG_ERROR("Failed to update pet");
     }
+    if (result != HANDLER_PRECONDITION_FAILED) {
+        shm_cache_invalidate(update.id);
+    }
 
-    cJSON_Delete(update);
+    pet_free(&update);
     return result;
 }
 
+// Outcome of one document of a bulk import
+enum import_result {
+    IMPORT_PENDING,
+    IMPORT_CREATED,
+    IMPORT_INVALID,
+    IMPORT_FAILED
+};
+
+struct import_item {
+    bool has_id;
+    long long id;
+    enum import_result result;
+};
+
+/**
+ * State of a bulk import of pets or users, fed with the body as it arrives.
+ */
+struct bulk_import {
+    const char* collection_name;
+    bool users;                 // Documents are users rather than pets
+    struct doc_stream stream;
+    struct doc_buffer pending;  // Bytes received but not consumed by the splitter yet
+    struct db_batch* batch;
+    struct import_item* items;
+    size_t count;
+    size_t cap;
+    bool malformed;
+};
+
+// db_batch_result_fn recording the outcome of an imported document
+static void import_result(void* arg, size_t tag, bool success) {
+    struct bulk_import* import = arg;
+    import->items[tag].result = success ? IMPORT_CREATED : IMPORT_FAILED;
+    // Reported once the pipeline holding the document is flushed, so after the write
+    if (!import->users && import->items[tag].has_id) {
+        shm_cache_invalidate(import->items[tag].id);
+    }
+}
+
+// Validates, parses and queues one document of the import
+static bool import_document(struct bulk_import* import, char* json, size_t len) {
+    if (import->count == import->cap) {
+        size_t cap = import->cap ? import->cap * 2 : 256;
+        struct import_item* items = realloc(import->items, cap * sizeof(struct import_item));
+        if (items == NULL) {
+            LOG_ERROR("Memory allocation failed for import results");
+            return false;
+        }
+        import->items = items;
+        import->cap = cap;
+    }
+    size_t index = import->count++;
+    struct import_item* item = &import->items[index];
+    item->has_id = false;
+    item->result = IMPORT_INVALID;
+
+    if (!json_minify(json, len, &len)) {
+        LOG_ERROR("Invalid JSON at index %zu of the import", index);
+        return true;
+    }
+
+    // The result is set before queuing: a flush triggered by the insert reports it right away
+    if (import->users) {
+        struct user user;
+        if (!user_parse(json, len, &user)) {
+            LOG_ERROR("Invalid user at index %zu of the import", index);
+            return true;
+        }
+        item->has_id = user.has_id;
+        item->id = user.id;
+        if (user.has_id && user.username != NULL) {
+            item->result = IMPORT_PENDING;
+            if (!db_batch_add_user(import->batch, &user, index)) {
+                import->items[index].result = IMPORT_FAILED;
+            }
+        }
+        user_free(&user);
+    }
+    else {
+        struct pet pet;
+        if (!pet_parse(json, len, &pet)) {
+            LOG_ERROR("Invalid pet at index %zu of the import", index);
+            return true;
+        }
+        item->has_id = pet.has_id;
+        item->id = pet.id;
+        if (pet.has_id && pet.status != NULL) {
+            item->result = IMPORT_PENDING;
+            if (!db_batch_add_pet(import->batch, &pet, index)) {
+                import->items[index].result = IMPORT_FAILED;
+            }
+        }
+        pet_free(&pet);
+    }
+    return true;
+}
+
+// Creates an import of the documents of a collection
+static struct bulk_import* import_begin(const char* collection_name, bool users, size_t pipeline_size) {
+    struct bulk_import* import = calloc(1, sizeof(struct bulk_import));
+    if (import == NULL) {
+        LOG_ERROR("Memory allocation failed for import");
+        return NULL;
+    }
+    import->collection_name = collection_name;
+    import->users = users;
+    doc_stream_init(&import->stream);
+    import->batch = db_batch_create(collection_name, pipeline_size, import_result, import);
+    if (import->batch == NULL) {
+        free(import);
+        return NULL;
+    }
+    return import;
+}
+
+/**
+ * @brief Starts a bulk import of pets.
+ *
+ * @param pipeline_size The number of pets written per Redis pipeline.
+ * @return struct bulk_import* The import, or NULL on failure.
+ */
+struct bulk_import* handle_pet_import_begin(size_t pipeline_size) {
+    LOG_INFO("handle_pet_import_begin");
+    return import_begin("pets", false, pipeline_size);
+}
+
+/**
+ * @brief Imports the documents completed by a chunk of the request body.
+ *
+ * @param import The import.
+ * @param data The chunk of the body.
+ * @param len The length of the chunk.
+ * @return int Returns EXIT_SUCCESS on success, EXIT_FAILURE once the body is malformed.
+ */
+int handle_import_feed(struct bulk_import* import, const char* data, size_t len) {
+    if (import->malformed) {
+        return EXIT_FAILURE;
+    }
+    if (!doc_buffer_append(&import->pending, data, len)) {
+        LOG_ERROR("Memory allocation failed for import data");
+        import->malformed = true;
+        return EXIT_FAILURE;
+    }
+
+    size_t start;
+    size_t doc_len;
+    enum doc_stream_status status;
+    while ((status = doc_stream_next(&import->stream, import->pending.data, import->pending.len, &start, &doc_len)) == DOC_STREAM_DOCUMENT) {
+        if (!import_document(import, import->pending.data + start, doc_len)) {
+            status = DOC_STREAM_ERROR;
+            break;
+        }
+    }
+    if (status == DOC_STREAM_ERROR) {
+        LOG_ERROR("Malformed import body at byte %zu", doc_stream_position(&import->stream));
+        import->malformed = true;
+    }
+
+    // The Redis connection is shared with the other requests, so nothing may stay queued
+    db_batch_flush(import->batch);
+
+    size_t consumed = doc_stream_consumed(&import->stream);
+    if (consumed > 0) {
+        memmove(import->pending.data, import->pending.data + consumed, import->pending.len - consumed);
+        import->pending.len -= consumed;
+        doc_stream_discard(&import->stream, consumed);
+    }
+    return import->malformed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief Completes a bulk import and reports the outcome of every document.
+ *
+ * @param import The import.
+ * @param complete Set to false if the body was malformed; the documents before the error are imported.
+ * @return char* A JSON object with the counts and per-item results.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_import_finish(struct bulk_import* import, bool* complete) {
+    if (!import->malformed && !doc_stream_finish(&import->stream)) {
+        LOG_ERROR("Import body ends in the middle of a document");
+        import->malformed = true;
+    }
+    db_batch_flush(import->batch);
+    *complete = !import->malformed;
+
+    static const char* names[] = { "failed", "created", "invalid", "failed" };
+    size_t counts[4] = { 0 };
+    for (size_t i = 0; i < import->count; i++) {
+        counts[import->items[i].result]++;
+    }
+    LOG_INFO("Imported %zu %s: %zu created, %zu invalid, %zu failed", import->count, import->collection_name,
+        counts[IMPORT_CREATED], counts[IMPORT_INVALID], counts[IMPORT_PENDING] + counts[IMPORT_FAILED]);
+
+    struct doc_buffer out = { 0 };
+    char line[128];
+    int n = snprintf(line, sizeof(line), "{\"created\":%zu,\"invalid\":%zu,\"failed\":%zu,",
+        counts[IMPORT_CREATED], counts[IMPORT_INVALID], counts[IMPORT_PENDING] + counts[IMPORT_FAILED]);
+    bool success = doc_buffer_append(&out, line, (size_t)n);
+    if (import->malformed) {
+        n = snprintf(line, sizeof(line), "\"error\":\"Malformed body at byte %zu\",", doc_stream_position(&import->stream));
+        success = success && doc_buffer_append(&out, line, (size_t)n);
+    }
+    success = success && doc_buffer_append(&out, "\"results\":[", 12);
+    for (size_t i = 0; success && i < import->count; i++) {
+        const struct import_item* item = &import->items[i];
+        if (item->has_id) {
+            n = snprintf(line, sizeof(line), "%s{\"index\":%zu,\"id\":%lld,\"result\":\"%s\"}",
+                i ? "," : "", i, item->id, names[item->result]);
+        }
+        else {
+            n = snprintf(line, sizeof(line), "%s{\"index\":%zu,\"result\":\"%s\"}", i ? "," : "", i, names[item->result]);
+        }
+        success = doc_buffer_append(&out, line, (size_t)n);
+    }
+    success = success && doc_buffer_append(&out, "]}", 3);
+    if (!success) {
+        LOG_ERROR("Memory allocation failed for import results");
+        doc_buffer_free(&out);
+        return NULL;
+    }
+    return out.data;
+}
+
+/**
+ * @brief Releases a bulk import.
+ *
+ * @param import The import, may be NULL.
+ */
+void handle_import_free(struct bulk_import* import) {
+    if (import == NULL) {
+        return;
+    }
+    db_batch_free(import->batch);
+    doc_buffer_free(&import->pending);
+    free(import->items);
+    free(import);
+}
+
 /**
  * @brief Deletes a pet with the given ID.
  *
@@ -98,13 +554,201 @@ int handle_update_pet(const char* json_payload) {
 int handle_delete_pet(const char* id) {
     LOG_INFO("delete pet with the id: %s", id);
 
-    int result = db_pet_delete("pets", id) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (!db_pet_filter_might_contain(id)) {
+        return EXIT_FAILURE;
+    }
+
+    long long pet_id;
+    bool integer_id = parse_pet_id(id, &pet_id);
+    bool deleted = group_commit_enabled() && integer_id ? group_commit_pet_delete(pet_id) : db_pet_delete("pets", id);
+    int result = deleted ? EXIT_SUCCESS : EXIT_FAILURE;
     if (result == EXIT_FAILURE) {
         LOG_ERROR("Failed to delete pet");
     }
+    if (integer_id) {
+        shm_cache_invalidate(pet_id);
+    }
     return result;
 }
 
+// Helper function to map the outcome of an asynchronous write to a handler result
+static int async_result(enum group_commit_submit submit) {
+    switch (submit) {
+    case GROUP_COMMIT_ACCEPTED:
+        return EXIT_SUCCESS;
+    case GROUP_COMMIT_FULL:
+        LOG_WARN("Asynchronous write queue is full");
+        return HANDLER_QUEUE_FULL;
+    default:
+        LOG_ERROR("Failed to queue the pet write");
+        return EXIT_FAILURE;
+    }
+}
+
+/**
+ * @brief Validates a new pet and queues its insert.
+ *
+ * @param json_payload The JSON payload containing the pet details.
+ * @param operation Set to the operation id of the write when it is accepted.
+ * @return int Returns EXIT_SUCCESS when queued, HANDLER_INVALID_INPUT, HANDLER_QUEUE_FULL or EXIT_FAILURE.
+ */
+int handle_create_pet_async(const char* json_payload, long long* operation) {
+    LOG_INFO("handle_create_pet_async");
+    struct pet pet;
+    if (!parse_pet(json_payload, &pet)) return HANDLER_INVALID_INPUT;
+
+    // Checked now: the client is gone by the time the writer would reject it
+    if (!pet.has_id || pet.status == NULL) {
+        LOG_ERROR("Pet has no id or no status");
+        pet_free(&pet);
+        return HANDLER_INVALID_INPUT;
+    }
+    return async_result(group_commit_pet_insert_async(&pet, operation));
+}
+
+/**
+ * @brief Validates a pet update and queues it.
+ *
+ * @param json_payload The JSON payload containing the updated pet details.
+ * @param operation Set to the operation id of the write when it is accepted.
+ * @return int Returns EXIT_SUCCESS when queued, HANDLER_INVALID_INPUT, HANDLER_NOT_FOUND,
+ *         HANDLER_QUEUE_FULL or EXIT_FAILURE.
+ */
+int handle_update_pet_async(const char* json_payload, long long* operation) {
+    LOG_INFO("handle_update_pet_async");
+    struct pet update;
+    if (!parse_pet(json_payload, &update)) return HANDLER_INVALID_INPUT;
+
+    if (!update.has_id) {
+        LOG_ERROR("Failed to find 'id' field in JSON");
+        pet_free(&update);
+        return HANDLER_INVALID_INPUT;
+    }
+    char id[32];
+    snprintf(id, sizeof(id), "%lld", update.id);
+    if (!db_pet_filter_might_contain(id)) {
+        pet_free(&update);
+        return HANDLER_NOT_FOUND;
+    }
+    return async_result(group_commit_pet_update_async(&update, operation));
+}
+
+/**
+ * @brief Queues the delete of a pet.
+ *
+ * @param id The ID of the pet to delete.
+ * @param operation Set to the operation id of the write when it is accepted.
+ * @return int Returns EXIT_SUCCESS when queued, HANDLER_INVALID_INPUT, HANDLER_NOT_FOUND,
+ *         HANDLER_QUEUE_FULL or EXIT_FAILURE.
+ */
+int handle_delete_pet_async(const char* id, long long* operation) {
+    LOG_INFO("queue delete of pet with the id: %s", id);
+
+    long long pet_id;
+    if (!parse_pet_id(id, &pet_id)) {
+        return HANDLER_INVALID_INPUT;
+    }
+    if (!db_pet_filter_might_contain(id)) {
+        return HANDLER_NOT_FOUND;
+    }
+    return async_result(group_commit_pet_delete_async(pet_id, operation));
+}
+
+/**
+ * @brief Gets the status of an asynchronous pet write.
+ *
+ * @param id The operation id.
+ * @return char* A JSON string with the operation id and its status, or NULL if unknown.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_get_operation(const char* id) {
+    long long operation;
+    if (!parse_pet_id(id, &operation)) {
+        return NULL;
+    }
+    const char* status;
+    switch (group_commit_operation_status(operation)) {
+    case GROUP_COMMIT_QUEUED:
+        status = "queued";
+        break;
+    case GROUP_COMMIT_APPLIED:
+        status = "applied";
+        break;
+    case GROUP_COMMIT_FAILED:
+        status = "failed";
+        break;
+    default:
+        return NULL;
+    }
+    char* json = malloc(64);
+    if (json != NULL) {
+        snprintf(json, 64, "{\"operationId\":%lld,\"status\":\"%s\"}", operation, status);
+    }
+    return json;
+}
+
+// Helper function to name the query of an index in the stale cache, e.g. "status:available,sold"
+static char* stale_key(const char* index, const char* values) {
+    size_t size = strlen(index) + strlen(values) + 2;
+    char* key = malloc(size);
+    if (key != NULL) {
+        snprintf(key, size, "%s:%s", index, values);
+    }
+    return key;
+}
+
+// Helper function to answer an index query from the stale cache; false on a miss
+static bool stale_index_lookup(const char* key, struct conditional_get* cond, char** json) {
+    unsigned int age_ms = 0;
+    char* cached = stale_cache_get(key, cond->max_stale_ms, cond->etag, ETAG_SIZE, &age_ms);
+    if (cached == NULL) {
+        return false;
+    }
+    cond->stale = true;
+    cond->age_sec = age_ms / 1000;
+    if (cond->etag[0] != '\0' && cond->if_none_match && etag_matches(cond->if_none_match, cond->etag, true)) {
+        cond->not_modified = true;
+        free(cached);
+        cached = NULL;
+    }
+    *json = cached;
+    return true;
+}
+
+// Refresher jobs: the read runs again on Redis, which stores its result in the caches
+static void refresh_pets_by_tags(const char* tags) {
+    if (db_thread_attach() != EXIT_SUCCESS) {
+        return;
+    }
+    arena_begin();
+    struct conditional_get cond = { 0 };
+    free(handle_get_pet_by_tags(tags, &cond));
+    arena_end();
+    db_thread_report();
+}
+
+static void refresh_pets_by_state(const char* statuses) {
+    if (db_thread_attach() != EXIT_SUCCESS) {
+        return;
+    }
+    arena_begin();
+    struct conditional_get cond = { 0 };
+    free(handle_get_pet_by_state(statuses, &cond));
+    arena_end();
+    db_thread_report();
+}
+
+static void refresh_pet_by_id(const char* id) {
+    if (db_thread_attach() != EXIT_SUCCESS) {
+        return;
+    }
+    arena_begin();
+    struct conditional_get cond = { 0 };
+    free(handle_get_pet_by_id(id, &cond));
+    arena_end();
+    db_thread_report();
+}
+
 /**
  * @brief Finds pets by the given tags.
  *
@@ -112,20 +756,48 @@ int handle_delete_pet(const char* id) {
  * @return char* A JSON string containing the list of pets that match the tags: "tag01,tag02".
  *         The caller is responsible for freeing the returned string.
  */
-char* handle_get_pet_by_tags(const char* tags) {
+char* handle_get_pet_by_tags(const char* tags, struct conditional_get* cond) {
     LOG_INFO("find pets with the given tags: %s", tags);
 
+    // While Redis is degraded, the last result is served and read again in the background
+    char* key = stale_cache_enabled() && tags ? stale_key("tags", tags) : NULL;
+    char* stale = NULL;
+    if (key && cond->max_stale_ms > 0 && stale_index_lookup(key, cond, &stale)) {
+        stale_cache_refresh(key, refresh_pets_by_tags, tags);
+        free(key);
+        return stale;
+    }
+    if (cond->offline) {
+        free(key);
+        return NULL;
+    }
+
+    // The generations are read before the documents, so the ETag is never newer than the body
+    if (set_index_etag("tags", tags, cond) && cond->if_none_match && etag_matches(cond->if_none_match, cond->etag, true)) {
+        cond->not_modified = true;
+        free(key);
+        return NULL;
+    }
+
     cJSON* query = create_query("pets:tags", "eq", tags);
-    if (!query) return strdup("[]");
+    if (!query) {
+        free(key);
+        return strdup("[]");
+    }
 
-    cJSON* result = db_find("pets", query);
-    char* json = result ? cJSON_PrintUnformatted(result) : strdup("[]");
-    if (!result) {
-        LOG_ERROR("No pets found with the given tags");
+    // The stored documents are written out without parsing them
+    char* json = db_find_json("pets", query);
+    if (!json) {
+        // The ETag set from the generations must not validate a result that was never read
+        LOG_ERROR("Failed to find pets with the given tags");
+        cond->etag[0] = '\0';
+    }
+    else if (key) {
+        stale_cache_put(key, json, cond->etag);
     }
 
+    free(key);
     cJSON_Delete(query);
-    cJSON_Delete(result);
     return json;
 }
 
@@ -136,42 +808,192 @@ char* handle_get_pet_by_tags(const char* tags) {
  * @return char* A JSON string containing the list of pets that match the list of status: "available,sold".
  *         The caller is responsible for freeing the returned string.
  */
-char* handle_get_pet_by_state(const char* statuses) {
+char* handle_get_pet_by_state(const char* statuses, struct conditional_get* cond) {
     LOG_INFO("find_pets_by_state with the given statuses: %s", statuses);
 
+    // While Redis is degraded, the last result is served and read again in the background
+    char* key = stale_cache_enabled() && statuses ? stale_key("status", statuses) : NULL;
+    char* stale = NULL;
+    if (key && cond->max_stale_ms > 0 && stale_index_lookup(key, cond, &stale)) {
+        stale_cache_refresh(key, refresh_pets_by_state, statuses);
+        free(key);
+        return stale;
+    }
+    if (cond->offline) {
+        free(key);
+        return NULL;
+    }
+
+    // The generations are read before the documents, so the ETag is never newer than the body
+    if (set_index_etag("status", statuses, cond) && cond->if_none_match && etag_matches(cond->if_none_match, cond->etag, true)) {
+        cond->not_modified = true;
+        free(key);
+        return NULL;
+    }
+
     cJSON* query = create_query("pets:status", "eq", statuses);
-    if (!query) return strdup("[]");
+    if (!query) {
+        free(key);
+        return strdup("[]");
+    }
 
     LOG_INFO("handle_get_pet_by_state query: %s", cJSON_PrintUnformatted(query));
 
-    cJSON* result = db_find("pets", query);
-    char* json = result ? cJSON_PrintUnformatted(result) : strdup("[]");
-    if (!result) {
-        LOG_ERROR("No pets found in the given state");
+    char* json = db_find_json("pets", query);
+    if (!json) {
+        // The ETag set from the generations must not validate a result that was never read
+        LOG_ERROR("Failed to find pets in the given state");
+        cond->etag[0] = '\0';
+    }
+    else if (key) {
+        stale_cache_put(key, json, cond->etag);
     }
 
+    free(key);
     cJSON_Delete(query);
-    cJSON_Delete(result);
     return json;
 }
 
+// Helper function to answer a pet read from the shared cache, within the staleness budget; false on a miss
+static bool shared_cache_lookup(long long pet_id, uint32_t* ticket, struct conditional_get* cond, char** json) {
+    struct shm_cache_entry entry;
+    char* cached = shm_cache_get(pet_id, cond->max_stale_ms, &entry, ticket);
+    if (cached == NULL) {
+        return false;
+    }
+    long long version = entry.version;
+    cond->stale = entry.stale;
+    cond->age_sec = entry.age_ms / 1000;
+    if (version > 0) {
+        snprintf(cond->etag, ETAG_SIZE, "\"v%lld\"", version);
+    }
+    else {
+        cond->etag[0] = '\0';
+    }
+    if (version > 0 && cond->if_none_match && etag_matches(cond->if_none_match, cond->etag, true)) {
+        cond->not_modified = true;
+        free(cached);
+        cached = NULL;
+    }
+    *json = cached;
+    return true;
+}
+
 /**
  * @brief Finds a pet by the given ID.
  *
  * @param id The ID of the pet to search for.
- * @return char* A JSON string containing the pet details.
+ * @return char* A JSON string containing the pet details, or NULL if the pet does not exist.
  *         The caller is responsible for freeing the returned string.
  */
-char* handle_get_pet_by_id(const char* id) {
+char* handle_get_pet_by_id(const char* id, struct conditional_get* cond) {
     LOG_INFO("find_pet_by_id with the given id: %s", id);
 
-    cJSON* result = db_find_one("pets", id);
-    char* json = result ? cJSON_PrintUnformatted(result) : strdup("{\"error\":\"Failed to find pet by id\"}");
-    if (!result) {
+    // Definite misses are answered without a round trip to Redis
+    if (!db_pet_filter_might_contain(id)) {
+        return NULL;
+    }
+
+    // Documents shared by the workers of the host, valid until a write or their TTL
+    long long pet_id = 0;
+    uint32_t ticket = 0;
+    bool cacheable = shm_cache_enabled() && parse_pet_id(id, &pet_id);
+    char* cached = NULL;
+    if (cacheable && shared_cache_lookup(pet_id, &ticket, cond, &cached)) {
+        if (cond->stale) {
+            char key[32];
+            snprintf(key, sizeof(key), "pet:%lld", pet_id);
+            stale_cache_refresh(key, refresh_pet_by_id, id);
+        }
+        return cached;
+    }
+    if (cond->offline) {
+        return NULL;
+    }
+
+    // A matching version is answered without reading the document
+    if (cond->if_none_match) {
+        long long version = db_document_version("pets", id);
+        if (version > 0) {
+            snprintf(cond->etag, ETAG_SIZE, "\"v%lld\"", version);
+            if (etag_matches(cond->if_none_match, cond->etag, true)) {
+                cond->not_modified = true;
+                return NULL;
+            }
+        }
+    }
+
+    long long version = -1;
+    char* json = db_find_one_json_versioned("pets", id, &version);
+    if (!json) {
         LOG_ERROR("No pet found with the given ID");
+        cond->etag[0] = '\0';
+        // Only a miss Redis answered counts: failures say nothing about the filter
+        if (version >= 0) {
+            db_pet_filter_report_false_positive();
+        }
+        return NULL;
+    }
+    // Documents written before versions were kept have none
+    if (version > 0) {
+        snprintf(cond->etag, ETAG_SIZE, "\"v%lld\"", version);
+    }
+    else {
+        cond->etag[0] = '\0';
+    }
+    if (cacheable && version >= 0) {
+        shm_cache_put(pet_id, version, json, strlen(json), ticket);
     }
+    return json;
+}
 
-    cJSON_Delete(result);
+/**
+ * @brief Finds the pets of a comma separated list of ids (GET /v2/pet?ids=1,2,3).
+ *
+ * @param ids The comma separated list of ids.
+ * @param valid Set to false if the list is empty, too long or holds an id that is not a
+ *        canonical integer.
+ * @return char* A JSON array of the pets found, in the order of the ids, or NULL on failure.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_get_pets_by_ids(const char* ids, bool* valid) {
+    LOG_INFO("handle_get_pets_by_ids: %s", ids);
+    *valid = false;
+
+    char* list = strdup(ids);
+    const char** pet_ids = calloc(PET_IDS_MAX, sizeof(*pet_ids));
+    if (list == NULL || pet_ids == NULL) {
+        LOG_ERROR("Memory allocation failed for the ids");
+        free(list);
+        free(pet_ids);
+        return NULL;
+    }
+
+    size_t count = 0;
+    char* id = list;
+    while (id != NULL) {
+        char* next = strchr(id, ',');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        long long pet_id;
+        if (!parse_pet_id(id, &pet_id) || count == PET_IDS_MAX) {
+            LOG_ERROR("Invalid list of pet ids");
+            free(list);
+            free(pet_ids);
+            return NULL;
+        }
+        // Definite misses are left out without a round trip to Redis
+        if (db_pet_filter_might_contain(id)) {
+            pet_ids[count++] = id;
+        }
+        id = next;
+    }
+    *valid = true;
+
+    char* json = db_find_many_json("pets", pet_ids, count);
+    free(list);
+    free(pet_ids);
     return json;
 }
 
@@ -183,15 +1005,43 @@ char* handle_get_pet_by_id(const char* id) {
  */
 int handle_create_user(const char* json_payload) {
     LOG_INFO("handle_create_user");
-    cJSON* doc = parse_json(json_payload);
-    if (!doc) return EXIT_FAILURE;
+    struct user user;
+    if (!parse_user(json_payload, &user)) return EXIT_FAILURE;
 
-    int result = db_user_insert("users", doc) ? EXIT_SUCCESS : EXIT_FAILURE;
+    int result = db_user_insert("users", &user) ? EXIT_SUCCESS : EXIT_FAILURE;
     if (result == EXIT_FAILURE) {
         LOG_ERROR("Failed to insert user");
     }
 
-    cJSON_Delete(doc);
+    user_free(&user);
+    return result;
+}
+
+/**
+ * @brief Creates the users of a JSON array (POST /v2/user/createWithList and createWithArray).
+ *
+ * The inserts of all the users are sent as a single pipeline and the replies checked at the end.
+ *
+ * @param json_payload The JSON array of users.
+ * @param complete Set to false if the payload is not an array of objects.
+ * @return char* A JSON object with the counts and per-item results.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_create_users_with_list(const char* json_payload, bool* complete) {
+    LOG_INFO("handle_create_users_with_list");
+    if (json_payload[0] != '[') {
+        LOG_ERROR("Expected a JSON array of users");
+        *complete = false;
+        return strdup("{\"error\":\"Expected a JSON array of users\"}");
+    }
+
+    struct bulk_import* import = import_begin("users", true, 0);
+    if (import == NULL) {
+        return NULL;
+    }
+    handle_import_feed(import, json_payload, strlen(json_payload));
+    char* result = handle_import_finish(import, complete);
+    handle_import_free(import);
     return result;
 }
 
@@ -204,23 +1054,22 @@ int handle_create_user(const char* json_payload) {
 int handle_update_user(const char* json_payload) {
    
     LOG_INFO("handle_update_user");   
-    cJSON* update = parse_json(json_payload);
-    if (!update) return EXIT_FAILURE;
+    struct user update;
+    if (!parse_user(json_payload, &update)) return EXIT_FAILURE;
 
-    // Read the JSON payload and extract the id field
-    cJSON* id_item = cJSON_GetObjectItem(update, "id");
-    if (!cJSON_IsNumber(id_item)) {
+    // The id field selects the user to update
+    if (!update.has_id) {
         LOG_ERROR("Failed to find 'id' field in JSON");
-        cJSON_Delete(update);
+        user_free(&update);
         return EXIT_FAILURE;
     }
 
-    int result = db_pet_update("users", update) ? EXIT_SUCCESS : EXIT_FAILURE;
+    int result = db_user_update("users", &update) ? EXIT_SUCCESS : EXIT_FAILURE;
     if (result == EXIT_FAILURE) {
         LOG_ERROR("Failed to update user");
     }
 
-    cJSON_Delete(update);
+    user_free(&update);
     return result;
 }
 
@@ -244,32 +1093,18 @@ int handle_delete_user(const char* id) {
  * @brief Finds users by the given username.
  *
  * @param username The username to search for.
- * @return char* A JSON string containing the list of users that match the username.
+ * @return char* A JSON string containing the user with the given username.
  *         The caller is responsible for freeing the returned string.
  */
 char* handle_get_user_by_username(const char* username) {
     LOG_INFO("find_users_by_username with the given username: %s", username);
 
-    // Example query: { "operator": "eq", "field" : "username", "value" : "email_user@example.com" }
-    cJSON* query = create_query("users:username", "eq", username);
-    if (!query) return strdup("[]");
-
-    char* json = NULL;
-    cJSON* result = db_find("users", query);
-
-    // if result is an array and not empty returns first element of the array
-    cJSON* user = NULL;
-    if (cJSON_IsArray(result)) {
-        user = cJSON_GetArrayItem(result, 0);
-    }
-
-    json = user ? cJSON_PrintUnformatted(user) : strdup("{\"error\":\"No users found with the given username\"}");
-    if (!result) {
+    // The stored document is returned verbatim, without parsing it
+    char* json = db_find_user_by_username("users", username);
+    if (!json) {
         LOG_ERROR("No users found with the given username");
+        json = strdup("{\"error\":\"No users found with the given username\"}");
     }
-
-    cJSON_Delete(query);
-    cJSON_Delete(result);
     return json;
 }
 
@@ -296,25 +1131,23 @@ char* handle_post_user_logout(const char* username) {
  */
 int handle_post_user_login(const char* json_payload) {
     LOG_INFO("handle_post_user_login");
-    cJSON* doc = parse_json(json_payload);
-    if (!doc) return EXIT_FAILURE;
+    struct user login;
+    if (!parse_user(json_payload, &login)) return EXIT_FAILURE;
 
     // Check if the username and password fields are present
-    cJSON* username_item = cJSON_GetObjectItem(doc, "username");
-    cJSON* password_item = cJSON_GetObjectItem(doc, "password");
-    if (!cJSON_IsString(username_item) || !cJSON_IsString(password_item)) {
+    if (login.username == NULL || login.password == NULL) {
         LOG_ERROR("Missing 'username' or 'password' field in JSON");
-        cJSON_Delete(doc);
+        user_free(&login);
         return EXIT_FAILURE;
     }
 
     // Check if the username and password match
-    int result = (strcmp(username_item->valuestring, "admin") == 0 && strcmp(password_item->valuestring, "admin") == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    int result = (strcmp(login.username, "admin") == 0 && strcmp(login.password, "admin") == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
     if (result == EXIT_FAILURE) {
         LOG_ERROR("Invalid username or password");
     }
 
-    cJSON_Delete(doc);
+    user_free(&login);
     return result;
 }
 
@@ -328,13 +1161,11 @@ char* handle_get_all_users() {
     LOG_INFO("find_all_users");
 
     // Use method find_all to get all users
-    cJSON* result = db_find_all("users");
-    char* json = result ? cJSON_PrintUnformatted(result) : strdup("[]");
-    if (!result) {
+    char* json = db_find_all_json("users");
+    if (!json) {
         LOG_ERROR("No users found");
+        json = strdup("[]");
     }
-
-    cJSON_Delete(result);
     return json;
 }
 
@@ -348,12 +1179,127 @@ char* handle_get_all_users() {
 char* handle_get_user_by_id(const char* id) {
     LOG_INFO("find_user_by_id with the given id : %s", id);
 
-    cJSON* result = db_find_one("users", id);
-    char* json = result ? cJSON_PrintUnformatted(result) : strdup("{\"error\":\"Failed to find user by id\"}");
-    if (!result) {
+    char* json = db_find_one_json("users", id);
+    if (!json) {
         LOG_ERROR("No user found with the given ID");
+        json = strdup("{\"error\":\"Failed to find user by id\"}");
+    }
+    return json;
+}
+
+/**
+ * @brief Gets the server metrics.
+ *
+ * @return char* A JSON string containing the metrics.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_get_metrics() {
+    cJSON* metrics = cJSON_CreateObject();
+    cJSON* pet_filter = db_pet_filter_stats();
+    if (pet_filter) {
+        cJSON_AddItemToObject(metrics, "petFilter", pet_filter);
+    }
+
+    cJSON_AddItemToObject(metrics, "redis", db_connection_stats());
+
+    if (arena_enabled()) {
+        struct arena_stats stats;
+        arena_get_stats(&stats);
+        cJSON* arena = cJSON_AddObjectToObject(metrics, "requestArena");
+        cJSON_AddNumberToObject(arena, "chunkBytes", (double)stats.chunk_size);
+        cJSON_AddNumberToObject(arena, "requests", (double)stats.scopes);
+        cJSON_AddNumberToObject(arena, "chunkAllocations", (double)stats.chunks);
+        cJSON_AddNumberToObject(arena, "peakBytes", (double)stats.peak_bytes);
+    }
+
+    struct compress_stats compress;
+    compress_get_stats(&compress);
+    cJSON* compression = cJSON_AddObjectToObject(metrics, "compressionCache");
+    cJSON_AddNumberToObject(compression, "hits", (double)compress.hits);
+    cJSON_AddNumberToObject(compression, "misses", (double)compress.misses);
+    cJSON_AddNumberToObject(compression, "evictions", (double)compress.evictions);
+    cJSON_AddNumberToObject(compression, "entries", (double)compress.entries);
+    cJSON_AddNumberToObject(compression, "bytes", (double)compress.bytes);
+    cJSON_AddNumberToObject(compression, "maxBytes", (double)compress.max_bytes);
+
+    if (group_commit_enabled()) {
+        struct group_commit_stats group;
+        group_commit_get_stats(&group);
+        cJSON* group_commit = cJSON_AddObjectToObject(metrics, "groupCommit");
+        cJSON_AddNumberToObject(group_commit, "writes", (double)group.writes);
+        cJSON_AddNumberToObject(group_commit, "batches", (double)group.batches);
+        cJSON_AddNumberToObject(group_commit, "failures", (double)group.failures);
+        cJSON_AddNumberToObject(group_commit, "largestBatch", (double)group.largest_batch);
+        cJSON_AddNumberToObject(group_commit, "maxOps", (double)group.max_ops);
+        cJSON_AddNumberToObject(group_commit, "windowUs", (double)group.window_us);
+        if (group_commit_async_enabled()) {
+            cJSON_AddNumberToObject(group_commit, "asyncWrites", (double)group.async_writes);
+            cJSON_AddNumberToObject(group_commit, "asyncRejected", (double)group.async_rejected);
+            cJSON_AddNumberToObject(group_commit, "asyncQueued", (double)group.async_queued);
+            cJSON_AddNumberToObject(group_commit, "asyncQueueSize", (double)group.async_limit);
+        }
+    }
+
+    if (auto_pipeline_enabled()) {
+        struct auto_pipeline_stats pipeline;
+        auto_pipeline_get_stats(&pipeline);
+        cJSON* auto_pipeline = cJSON_AddObjectToObject(metrics, "autoPipeline");
+        cJSON_AddNumberToObject(auto_pipeline, "requests", (double)pipeline.requests);
+        cJSON_AddNumberToObject(auto_pipeline, "commands", (double)pipeline.commands);
+        cJSON_AddNumberToObject(auto_pipeline, "batches", (double)pipeline.batches);
+        cJSON_AddNumberToObject(auto_pipeline, "writes", (double)pipeline.writes);
+        cJSON_AddNumberToObject(auto_pipeline, "largestBatch", (double)pipeline.largest_batch);
+        cJSON_AddNumberToObject(auto_pipeline, "windowUs", (double)pipeline.window_us);
+        cJSON_AddNumberToObject(auto_pipeline, "maxWindowUs", (double)pipeline.max_window_us);
+    }
+
+    if (shm_cache_enabled()) {
+        struct shm_cache_stats shared;
+        shm_cache_get_stats(&shared);
+        cJSON* cache = cJSON_AddObjectToObject(metrics, "sharedCache");
+        cJSON_AddNumberToObject(cache, "slots", (double)shared.slots);
+        cJSON_AddNumberToObject(cache, "slotBytes", (double)shared.slot_size);
+        cJSON_AddNumberToObject(cache, "hits", (double)shared.hits);
+        cJSON_AddNumberToObject(cache, "staleHits", (double)shared.stale_hits);
+        cJSON_AddNumberToObject(cache, "misses", (double)shared.misses);
+        cJSON_AddNumberToObject(cache, "expired", (double)shared.expired);
+        cJSON_AddNumberToObject(cache, "stores", (double)shared.stores);
+        cJSON_AddNumberToObject(cache, "invalidations", (double)shared.invalidations);
+    }
+
+    if (stale_cache_enabled()) {
+        struct stale_cache_stats stale;
+        stale_cache_get_stats(&stale);
+        cJSON* cache = cJSON_AddObjectToObject(metrics, "staleCache");
+        cJSON_AddNumberToObject(cache, "hits", (double)stale.hits);
+        cJSON_AddNumberToObject(cache, "misses", (double)stale.misses);
+        cJSON_AddNumberToObject(cache, "stores", (double)stale.stores);
+        cJSON_AddNumberToObject(cache, "refreshes", (double)stale.refreshes);
+        cJSON_AddNumberToObject(cache, "refreshesDropped", (double)stale.dropped);
+        cJSON_AddNumberToObject(cache, "entries", (double)stale.entries);
+        cJSON_AddNumberToObject(cache, "bytes", (double)stale.bytes);
+        cJSON_AddNumberToObject(cache, "maxBytes", (double)stale.max_bytes);
+    }
+
+    if (hedged_read_enabled()) {
+        struct hedged_read_stats hedge;
+        hedged_read_get_stats(&hedge);
+        cJSON* hedged_reads = cJSON_AddObjectToObject(metrics, "hedgedReads");
+        cJSON_AddNumberToObject(hedged_reads, "reads", (double)hedge.reads);
+        cJSON_AddNumberToObject(hedged_reads, "hedged", (double)hedge.hedged);
+        cJSON_AddNumberToObject(hedged_reads, "hedgeWins", (double)hedge.hedge_wins);
+        cJSON_AddNumberToObject(hedged_reads, "overBudget", (double)hedge.over_budget);
+        cJSON_AddNumberToObject(hedged_reads, "hedgeRate", hedge.reads > 0 ? (double)hedge.hedged / (double)hedge.reads : 0.0);
+        cJSON_AddNumberToObject(hedged_reads, "hedgeWinRate", hedge.hedged > 0 ? (double)hedge.hedge_wins / (double)hedge.hedged : 0.0);
+        cJSON_AddNumberToObject(hedged_reads, "delayUs", (double)hedge.delay_us);
+        cJSON_AddNumberToObject(hedged_reads, "percentile", (double)hedge.percentile);
+        cJSON_AddNumberToObject(hedged_reads, "maxPercent", (double)hedge.max_percent);
     }
 
-    cJSON_Delete(result);
+    // The printed text lives in the request arena, the caller frees a malloc'd copy
+    char* printed = cJSON_PrintUnformatted(metrics);
+    char* json = printed ? strdup(printed) : NULL;
+    cJSON_free(printed);
+    cJSON_Delete(metrics);
     return json;
 }
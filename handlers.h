@@ -1,6 +1,33 @@
 #ifndef HANDLERS_H
 #define HANDLERS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ETAG_SIZE 32
+#define HANDLER_PRECONDITION_FAILED 2
+#define HANDLER_INVALID_INPUT 3
+#define HANDLER_NOT_FOUND 4
+#define HANDLER_QUEUE_FULL 5
+#define HANDLER_UNAVAILABLE 6
+
+/**
+ * Conditional GET: the validator sent by the client and the one of the response.
+ *
+ * It also carries the staleness budget of the route: while Redis is degraded, reads are answered
+ * from the caches up to max_stale_ms past the freshness of their entries, and refreshed in the
+ * background. Offline reads return NULL when nothing is cached.
+ */
+struct conditional_get {
+    const char* if_none_match;  // If-None-Match header of the request, or NULL
+    char etag[ETAG_SIZE];       // Set to the ETag of the response, empty when it has none
+    bool not_modified;          // Set when the If-None-Match header matches the ETag
+    unsigned int max_stale_ms;  // How long past its freshness a cached response may be served, 0 for none
+    bool offline;               // Redis is unreachable: only cached responses are served
+    bool stale;                 // Set when the response was served stale; a refresh is queued
+    unsigned int age_sec;       // Set to the age of a stale response
+};
+
 /**
  * @brief Creates a new pet from the given JSON payload.
  *
@@ -12,10 +39,58 @@ int handle_create_pet(const char* json_payload);
 /**
  * @brief Updates an existing pet with the given JSON payload.
  *
+ * With an If-Match header the update only applies if the pet is still at one of the
+ * versions listed ("v<version>" entity tags, or "*" for any existing pet). The version is
+ * compared and the pet written atomically on the Redis side.
+ *
  * @param json_payload The JSON payload containing the updated pet details.
- * @return int Returns 0 on success, non-zero on failure.
+ * @param if_match The If-Match header of the request, or NULL.
+ * @param etag Set to the ETag of the updated pet when if_match is given (ETAG_SIZE bytes).
+ * @return int Returns 0 on success, HANDLER_PRECONDITION_FAILED if If-Match does not match
+ *         the stored pet, HANDLER_UNAVAILABLE if the current version could not be read,
+ *         another non-zero value on failure.
+ */
+int handle_update_pet(const char* json_payload, const char* if_match, char* etag);
+
+/**
+ * State of a bulk import of pets or users.
+ */
+struct bulk_import;
+
+/**
+ * @brief Starts a bulk import of pets.
+ *
+ * @param pipeline_size The number of pets written per Redis pipeline.
+ * @return struct bulk_import* The import, or NULL on failure.
+ */
+struct bulk_import* handle_pet_import_begin(size_t pipeline_size);
+
+/**
+ * @brief Imports the documents completed by a chunk of the request body.
+ *
+ * The body is NDJSON or a JSON array. Documents are written as soon as they are complete.
+ *
+ * @param import The import.
+ * @param data The chunk of the body.
+ * @param len The length of the chunk.
+ * @return int Returns 0 on success, non-zero once the body is malformed.
+ */
+int handle_import_feed(struct bulk_import* import, const char* data, size_t len);
+
+/**
+ * @brief Completes a bulk import and reports the outcome of every document.
+ *
+ * @param import The import.
+ * @param complete Set to false if the body was malformed; the documents before the error are imported.
+ * @return char* A JSON object with the counts and per-item results.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_import_finish(struct bulk_import* import, bool* complete);
+
+/**
+ * @brief Releases a bulk import.
  */
-int handle_update_pet(const char* json_payload);
+void handle_import_free(struct bulk_import* import);
 
 /**
  * @brief Deletes a pet with the given ID.
@@ -25,32 +100,89 @@ int handle_update_pet(const char* json_payload);
  */
 int handle_delete_pet(const char* id);
 
+/**
+ * @brief Validates a new pet and queues its insert, to be applied in the background.
+ *
+ * @param json_payload The JSON payload containing the pet details.
+ * @param operation Set to the operation id of the write when it is accepted.
+ * @return int Returns 0 when the write is queued, HANDLER_INVALID_INPUT if the pet has no id
+ *         or status, HANDLER_QUEUE_FULL if the queue is full, non-zero on other failures.
+ */
+int handle_create_pet_async(const char* json_payload, long long* operation);
+
+/**
+ * @brief Validates a pet update and queues it, to be applied in the background.
+ *
+ * @param json_payload The JSON payload containing the updated pet details.
+ * @param operation Set to the operation id of the write when it is accepted.
+ * @return int Returns 0 when the write is queued, HANDLER_INVALID_INPUT if the pet has no id,
+ *         HANDLER_NOT_FOUND if the pet does not exist, HANDLER_QUEUE_FULL if the queue is
+ *         full, non-zero on other failures.
+ */
+int handle_update_pet_async(const char* json_payload, long long* operation);
+
+/**
+ * @brief Queues the delete of a pet, to be applied in the background.
+ *
+ * @param id The ID of the pet to delete.
+ * @param operation Set to the operation id of the write when it is accepted.
+ * @return int Returns 0 when the write is queued, HANDLER_INVALID_INPUT if the id is not an
+ *         integer, HANDLER_NOT_FOUND if the pet does not exist, HANDLER_QUEUE_FULL if the
+ *         queue is full, non-zero on other failures.
+ */
+int handle_delete_pet_async(const char* id, long long* operation);
+
+/**
+ * @brief Gets the status of an asynchronous pet write.
+ *
+ * @param id The operation id returned when the write was accepted.
+ * @return char* A JSON string with the operation id and its status (queued, applied or
+ *         failed), or NULL if the operation is unknown or too old to be kept.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_get_operation(const char* id);
+
 /**
  * @brief Finds pets by the given tags.
  *
  * @param tags The tags to search for.
- * @return char* A JSON string containing the list of pets that match the tags.
+ * @param cond The conditional GET; the result is NULL when not_modified is set.
+ * @return char* A JSON string containing the list of pets that match the tags, or NULL on failure.
  *         The caller is responsible for freeing the returned string.
  */
-char* handle_get_pet_by_tags(const char* tags);
+char* handle_get_pet_by_tags(const char* tags, struct conditional_get* cond);
 
 /**
  * @brief Finds pets by the given status list.
  *
  * @param statuses The list of state to search for.
- * @return char* A JSON string containing the list of pets that match the different state.
+ * @param cond The conditional GET; the result is NULL when not_modified is set.
+ * @return char* A JSON string containing the list of pets that match the different state,
+ *         or NULL on failure.
  *         The caller is responsible for freeing the returned string.
  */
-char* handle_get_pet_by_state(const char* statuses);
+char* handle_get_pet_by_state(const char* statuses, struct conditional_get* cond);
 
 /**
  * @brief Finds a pet by the given ID.
  *
  * @param id The ID of the pet to search for.
- * @return char* A JSON string containing the pet details.
+ * @param cond The conditional GET; the result is NULL when not_modified is set.
+ * @return char* A JSON string containing the pet details, or NULL if the pet does not exist.
  *         The caller is responsible for freeing the returned string.
  */
-char* handle_get_pet_by_id(const char* id);
+char* handle_get_pet_by_id(const char* id, struct conditional_get* cond);
+
+/**
+ * @brief Finds the pets of a comma separated list of ids in a single Redis round trip.
+ *
+ * @param ids The comma separated list of ids.
+ * @param valid Set to false if the list is empty, too long or holds an id that is not a
+ *        canonical integer (no sign other than "-", no leading zeros, no spaces).
+ * @return char* A JSON array of the pets found, in the order of the ids, or NULL on failure.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_get_pets_by_ids(const char* ids, bool* valid);
 
 // User methods
 /**
@@ -61,6 +193,16 @@ char* handle_get_pet_by_id(const char* id);
  */
 int handle_create_user(const char* json_payload);
 
+/**
+ * @brief Creates the users of a JSON array in a single pipeline.
+ *
+ * @param json_payload The JSON array of users.
+ * @param complete Set to false if the payload is not an array of objects.
+ * @return char* A JSON object with the counts and per-item results.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_create_users_with_list(const char* json_payload, bool* complete);
+
 /**
  * @brief Updates an existing user with the given JSON payload.
  *
@@ -115,9 +257,17 @@ char* handle_get_all_users();
  * @brief Finds users by the given username.
  *
  * @param username The username to search for.
- * @return char* A JSON string containing the list of users that match the username.
+ * @return char* A JSON string containing the user with the given username.
  *         The caller is responsible for freeing the returned string.
  */
 char* handle_get_user_by_username(const char* username);
 
+/**
+ * @brief Gets the server metrics.
+ *
+ * @return char* A JSON string containing the metrics.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* handle_get_metrics();
+
 #endif
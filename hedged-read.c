@@ -0,0 +1,311 @@
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hedged-read.h"
+#include "clock-utils.h"
+#include "log-utils.h" // Include the log utils header
+
+#define HEDGE_SUB_BUCKETS 4                         // Buckets per power of two of microseconds
+#define HEDGE_BUCKETS (32 * HEDGE_SUB_BUCKETS)
+#define HEDGE_MIN_SAMPLES 100                       // Samples needed before the first hedge
+#define HEDGE_DECAY_SAMPLES 4096                    // The counts are halved at this many samples
+#define HEDGE_DELAY_REFRESH 64                      // Samples between two computations of the delay
+
+/**
+ * Commands of a read on one connection, and the replies received so far.
+ */
+struct hedge_leg {
+    redisContext* context;
+    redisReply** replies;
+    size_t received;
+    bool failed;
+};
+
+static bool hedge_enabled = false;
+static unsigned int hedge_percentile = 0;
+static unsigned int hedge_min_delay_us = 0;
+static unsigned int hedge_max_percent = 0;
+
+// Histogram of the latencies of the reads
+static _Atomic unsigned int latency_counts[HEDGE_BUCKETS];
+static _Atomic unsigned int latency_total = 0;
+static _Atomic unsigned int hedge_delay_us = 0;
+
+static _Atomic unsigned long long stat_reads = 0;
+static _Atomic unsigned long long stat_hedged = 0;
+static _Atomic unsigned long long stat_hedge_wins = 0;
+static _Atomic unsigned long long stat_over_budget = 0;
+
+/**
+ * @brief Enable the hedging of reads
+ *
+ * @param percentile The percentile of the read latencies used as the hedge delay
+ * @param min_delay_us The shortest hedge delay
+ * @param max_percent The most reads hedged, in percent of all the reads
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int hedged_read_init(unsigned int percentile, unsigned int min_delay_us, unsigned int max_percent) {
+    if (percentile < 1 || percentile > 99 || max_percent > 100) {
+        LOG_ERROR("Invalid hedged read settings: percentile %u, budget %u%%", percentile, max_percent);
+        return EXIT_FAILURE;
+    }
+    hedge_percentile = percentile;
+    hedge_min_delay_us = min_delay_us;
+    hedge_max_percent = max_percent;
+    hedge_enabled = true;
+    LOG_INFO("Hedged reads after the p%u latency, at least %u us, for up to %u%% of the reads", percentile, min_delay_us,
+        max_percent);
+    return EXIT_SUCCESS;
+}
+
+bool hedged_read_enabled(void) {
+    return hedge_enabled;
+}
+
+// Bucket of a latency: HEDGE_SUB_BUCKETS linear steps within every power of two
+static size_t latency_bucket(uint64_t us) {
+    if (us < HEDGE_SUB_BUCKETS) {
+        return (size_t)us;
+    }
+    int log2 = 63 - __builtin_clzll(us);
+    size_t sub = (size_t)((us >> (log2 - 2)) & (HEDGE_SUB_BUCKETS - 1));
+    size_t bucket = (size_t)(log2 - 1) * HEDGE_SUB_BUCKETS + sub;
+    return bucket < HEDGE_BUCKETS ? bucket : HEDGE_BUCKETS - 1;
+}
+
+// Upper bound of the latencies of a bucket
+static uint64_t bucket_limit(size_t bucket) {
+    if (bucket < HEDGE_SUB_BUCKETS) {
+        return bucket + 1;
+    }
+    int log2 = (int)(bucket / HEDGE_SUB_BUCKETS) + 1;
+    uint64_t sub = bucket % HEDGE_SUB_BUCKETS;
+    return ((uint64_t)(HEDGE_SUB_BUCKETS + sub + 1)) << (log2 - 2);
+}
+
+// Helper function to compute the hedge delay from the histogram
+static void update_delay(void) {
+    unsigned int counts[HEDGE_BUCKETS];
+    unsigned long long total = 0;
+    for (size_t i = 0; i < HEDGE_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&latency_counts[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total < HEDGE_MIN_SAMPLES) {
+        atomic_store_explicit(&hedge_delay_us, 0, memory_order_relaxed);
+        return;
+    }
+    unsigned long long rank = (total * hedge_percentile + 99) / 100;
+    unsigned long long seen = 0;
+    size_t bucket = 0;
+    while (bucket < HEDGE_BUCKETS - 1 && (seen += counts[bucket]) < rank) {
+        bucket++;
+    }
+    uint64_t delay = bucket_limit(bucket);
+    if (delay < hedge_min_delay_us) {
+        delay = hedge_min_delay_us;
+    }
+    atomic_store_explicit(&hedge_delay_us, delay > UINT32_MAX ? UINT32_MAX : (unsigned int)delay, memory_order_relaxed);
+}
+
+// Helper function to add the latency of a read to the histogram
+static void record_read(uint64_t us) {
+    atomic_fetch_add_explicit(&latency_counts[latency_bucket(us)], 1, memory_order_relaxed);
+    unsigned int total = atomic_fetch_add_explicit(&latency_total, 1, memory_order_relaxed) + 1;
+    if (total % HEDGE_DECAY_SAMPLES == 0) {
+        // Older samples weigh half as much; concurrent records may be halved too, which is harmless
+        for (size_t i = 0; i < HEDGE_BUCKETS; i++) {
+            atomic_store_explicit(&latency_counts[i], atomic_load_explicit(&latency_counts[i], memory_order_relaxed) / 2,
+                memory_order_relaxed);
+        }
+    }
+    if (total % HEDGE_DELAY_REFRESH == 0) {
+        update_delay();
+    }
+}
+
+// Helper function to check the hedge budget
+static bool hedge_allowed(void) {
+    unsigned long long reads = atomic_load_explicit(&stat_reads, memory_order_relaxed);
+    unsigned long long hedged = atomic_load_explicit(&stat_hedged, memory_order_relaxed);
+    return (hedged + 1) * 100 <= reads * hedge_max_percent;
+}
+
+// Helper function to write the commands of a read to a connection
+static bool leg_send(struct hedge_leg* leg, char** commands, const size_t* lens, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (redisAppendFormattedCommand(leg->context, commands[i], lens[i]) != REDIS_OK) {
+            return false;
+        }
+    }
+    int done = 0;
+    while (!done) {
+        if (redisBufferWrite(leg->context, &done) != REDIS_OK) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Helper function to read the replies available on a readable connection
+static bool leg_receive(struct hedge_leg* leg, size_t count) {
+    if (redisBufferRead(leg->context) != REDIS_OK) {
+        return false;
+    }
+    while (leg->received < count) {
+        void* reply = NULL;
+        if (redisGetReplyFromReader(leg->context, &reply) != REDIS_OK) {
+            return false;
+        }
+        if (reply == NULL) {
+            break;
+        }
+        leg->replies[leg->received++] = reply;
+    }
+    return true;
+}
+
+static void leg_release(struct hedge_leg* leg) {
+    for (size_t i = 0; i < leg->received; i++) {
+        freeReplyObject(leg->replies[i]);
+    }
+    leg->received = 0;
+}
+
+/**
+ * @brief Run formatted read commands, hedging them on a second connection if they are slow
+ *
+ * @param first The connection the commands are sent to first
+ * @param second The connection of the hedge, opened if NULL, closed and cleared if it loses
+ * @param connect Opens the second connection
+ * @param uri The URI of the server
+ * @param commands The formatted commands
+ * @param lens The lengths of the commands
+ * @param count The number of commands
+ * @param replies Set to the replies of the commands
+ * @param timeout_ms The longest wait for the replies, 0 to wait forever
+ * @return enum hedged_read_winner The connection whose replies were returned
+ */
+enum hedged_read_winner hedged_read_exec(redisContext* first, redisContext** second, hedged_read_connect_fn connect, const char* uri,
+    char** commands, const size_t* lens, size_t count, redisReply** replies, unsigned int timeout_ms) {
+    redisReply** hedge_replies = calloc(count > 0 ? count : 1, sizeof(*hedge_replies));
+    if (hedge_replies == NULL) {
+        LOG_ERROR("Memory allocation failed for the hedged read");
+        return HEDGED_READ_FAILED;
+    }
+    struct hedge_leg legs[2] = { { first, replies, 0, false }, { NULL, hedge_replies, 0, true } };
+    atomic_fetch_add_explicit(&stat_reads, 1, memory_order_relaxed);
+    uint64_t start = monotonic_us();
+    unsigned int delay_us = atomic_load_explicit(&hedge_delay_us, memory_order_relaxed);
+    bool may_hedge = delay_us > 0;
+    int winner = -1;
+
+    legs[0].failed = !leg_send(&legs[0], commands, lens, count);
+    while (winner < 0 && !(legs[0].failed && legs[1].failed)) {
+        // Wait for the hedge delay first, then for the timeout
+        uint64_t elapsed = monotonic_us() - start;
+        int wait_ms = -1;
+        if (may_hedge) {
+            wait_ms = elapsed >= delay_us ? 0 : (int)((delay_us - elapsed + 999) / 1000);
+        }
+        else if (timeout_ms > 0) {
+            wait_ms = elapsed >= (uint64_t)timeout_ms * 1000 ? 0 : (int)(((uint64_t)timeout_ms * 1000 - elapsed + 999) / 1000);
+        }
+
+        struct pollfd fds[2];
+        struct hedge_leg* watched[2];
+        nfds_t nfds = 0;
+        for (int i = 0; i < 2; i++) {
+            if (!legs[i].failed) {
+                fds[nfds].fd = legs[i].context->fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                watched[nfds++] = &legs[i];
+            }
+        }
+        int ready = poll(fds, nfds, wait_ms);
+        if (ready < 0) {
+            continue;
+        }
+        if (ready == 0) {
+            if (!may_hedge) {
+                break; // Timed out
+            }
+            may_hedge = false;
+            if (legs[0].failed) {
+                continue;
+            }
+            if (!hedge_allowed()) {
+                atomic_fetch_add_explicit(&stat_over_budget, 1, memory_order_relaxed);
+                continue;
+            }
+            if (*second == NULL) {
+                *second = connect(uri);
+            }
+            if (*second != NULL) {
+                atomic_fetch_add_explicit(&stat_hedged, 1, memory_order_relaxed);
+                legs[1].context = *second;
+                legs[1].failed = !leg_send(&legs[1], commands, lens, count);
+            }
+            continue;
+        }
+        for (nfds_t i = 0; i < nfds && winner < 0; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            struct hedge_leg* leg = watched[i];
+            if (!leg_receive(leg, count)) {
+                leg->failed = true;
+                leg_release(leg);
+            }
+            else if (leg->received == count) {
+                winner = leg == &legs[0] ? 0 : 1;
+            }
+        }
+    }
+
+    enum hedged_read_winner result = HEDGED_READ_FAILED;
+    if (winner >= 0) {
+        record_read(monotonic_us() - start);
+    }
+    if (winner == 0) {
+        result = HEDGED_READ_FIRST;
+    }
+    else if (winner == 1) {
+        result = HEDGED_READ_SECOND;
+        atomic_fetch_add_explicit(&stat_hedge_wins, 1, memory_order_relaxed);
+        // The partial replies of the first connection live in the same array
+        leg_release(&legs[0]);
+        memcpy(replies, hedge_replies, count * sizeof(*replies));
+        legs[1].received = 0;
+    }
+    else {
+        leg_release(&legs[0]);
+        if (first->err == 0) {
+            // Replies may still come, so the connection cannot be used any longer
+            first->err = REDIS_ERR_IO;
+            strcpy(first->errstr, "Read timed out");
+        }
+    }
+    // The hedge connection is closed whenever it did not win: its replies may be on the way
+    if (legs[1].context != NULL && winner != 1) {
+        leg_release(&legs[1]);
+        redisFree(*second);
+        *second = NULL;
+    }
+    free(hedge_replies);
+    return result;
+}
+
+void hedged_read_get_stats(struct hedged_read_stats* stats) {
+    stats->reads = atomic_load_explicit(&stat_reads, memory_order_relaxed);
+    stats->hedged = atomic_load_explicit(&stat_hedged, memory_order_relaxed);
+    stats->hedge_wins = atomic_load_explicit(&stat_hedge_wins, memory_order_relaxed);
+    stats->over_budget = atomic_load_explicit(&stat_over_budget, memory_order_relaxed);
+    stats->delay_us = atomic_load_explicit(&hedge_delay_us, memory_order_relaxed);
+    stats->percentile = hedge_percentile;
+    stats->max_percent = hedge_max_percent;
+}
@@ -0,0 +1,97 @@
+#ifndef HEDGED_READ_H
+#define HEDGED_READ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * Hedged reads: a slow read is sent a second time on another connection, and the first
+ * complete answer wins.
+ *
+ * The commands of a read are written to the first connection. If their replies are not
+ * all back after the hedge delay, the same commands are written to a second connection
+ * to the same data, and both connections are watched with poll. The connection that
+ * answers first wins. The other one still has replies on the way, so it cannot be reused
+ * and is closed.
+ *
+ * The hedge delay is a percentile of the recent latencies of the reads, with a floor. It
+ * is kept in a log-scale histogram whose counts are halved every few thousand reads, so
+ * that it follows the latency of the server. Reads are not hedged before the histogram
+ * holds enough samples, nor once more than max_percent of the reads have been hedged.
+ * That budget keeps a slow server from getting twice the load.
+ */
+
+/**
+ * Opens the second connection of a hedged read.
+ *
+ * @param uri The URI of the server.
+ * @return redisContext* The connection, or NULL if it cannot be opened.
+ */
+typedef redisContext* (*hedged_read_connect_fn)(const char* uri);
+
+/**
+ * Connection whose answer was used.
+ */
+enum hedged_read_winner {
+    HEDGED_READ_FAILED,   // No connection answered, or the reads timed out
+    HEDGED_READ_FIRST,
+    HEDGED_READ_SECOND    // The first connection was left with replies pending: the caller closes it and
+                          // takes the second one in its place
+};
+
+/**
+ * Counters of the hedged reads.
+ */
+struct hedged_read_stats {
+    unsigned long long reads;       // Reads run
+    unsigned long long hedged;      // Reads sent a second time
+    unsigned long long hedge_wins;  // Hedged reads answered first by the second connection
+    unsigned long long over_budget; // Reads past the hedge delay that were not hedged
+    unsigned int delay_us;          // Current hedge delay, 0 before enough samples
+    unsigned int percentile;
+    unsigned int max_percent;
+};
+
+/**
+ * @brief Enables the hedging of reads.
+ *
+ * @param percentile The percentile of the read latencies used as the hedge delay, from 1 to 99.
+ * @param min_delay_us The shortest hedge delay, in microseconds.
+ * @param max_percent The most reads hedged, in percent of all the reads.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int hedged_read_init(unsigned int percentile, unsigned int min_delay_us, unsigned int max_percent);
+
+/**
+ * @brief Checks whether reads are hedged.
+ */
+bool hedged_read_enabled(void);
+
+/**
+ * @brief Runs formatted read commands, hedging them if they are slow.
+ *
+ * The delay is waited with poll, so it is rounded up to the millisecond.
+ *
+ * @param first The connection the commands are sent to first.
+ * @param second The connection of the hedge. It is opened with connect if it is NULL. It is
+ *        closed and set to NULL if it loses the race or fails.
+ * @param connect Opens the second connection.
+ * @param uri The URI of the server of both connections.
+ * @param commands The formatted commands, not freed.
+ * @param lens The lengths of the commands.
+ * @param count The number of commands.
+ * @param replies Set to the replies of the commands, in order, unless the read failed.
+ * @param timeout_ms The longest wait for the replies, 0 to wait forever. On a timeout,
+ *        the first connection is flagged with an I/O error.
+ * @return enum hedged_read_winner The connection whose replies were returned.
+ */
+enum hedged_read_winner hedged_read_exec(redisContext* first, redisContext** second, hedged_read_connect_fn connect, const char* uri,
+    char** commands, const size_t* lens, size_t count, redisReply** replies, unsigned int timeout_ms);
+
+/**
+ * @brief Copies the counters of the hedged reads.
+ */
+void hedged_read_get_stats(struct hedged_read_stats* stats);
+
+#endif // HEDGED_READ_H
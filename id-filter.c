@@ -0,0 +1,136 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "id-filter.h"
+
+#define ID_FILTER_MAX_HASHES 16
+
+struct id_filter {
+    uint8_t* counters;
+    size_t size;
+    unsigned int hashes;
+    size_t count;
+};
+
+// 64-bit FNV-1a followed by a murmur3 finalizer to spread short numeric ids
+uint64_t id_hash(const char* id, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)id[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Kirsch-Mitzenmacher double hashing: index_i = h1 + i * h2
+static void id_positions(const struct id_filter* filter, const char* id, size_t len, size_t* positions) {
+    uint64_t h = id_hash(id, len);
+    uint64_t h1 = h & 0xffffffffULL;
+    uint64_t h2 = (h >> 32) | 1;
+    for (unsigned int i = 0; i < filter->hashes; i++) {
+        positions[i] = (size_t)((h1 + i * h2) % filter->size);
+    }
+}
+
+/**
+ * @brief Create a filter sized for the expected number of ids and false positive rate
+ *
+ * @param expected_items The number of ids the filter is sized for
+ * @param fp_rate The target false positive rate at expected_items
+ * @return struct id_filter* The filter, or NULL on failure
+ */
+struct id_filter* id_filter_create(size_t expected_items, double fp_rate) {
+    if (expected_items == 0) {
+        expected_items = 1;
+    }
+    if (fp_rate <= 0 || fp_rate >= 1) {
+        fp_rate = 0.01;
+    }
+
+    struct id_filter* filter = calloc(1, sizeof(struct id_filter));
+    if (filter == NULL) {
+        return NULL;
+    }
+
+    // m = -n ln(p) / ln(2)^2 counters and k = m / n ln(2) hash functions
+    double size = ceil(-(double)expected_items * log(fp_rate) / (M_LN2 * M_LN2));
+    filter->size = size < 64 ? 64 : (size_t)size;
+    filter->hashes = (unsigned int)round((double)filter->size / expected_items * M_LN2);
+    if (filter->hashes < 1) {
+        filter->hashes = 1;
+    }
+    if (filter->hashes > ID_FILTER_MAX_HASHES) {
+        filter->hashes = ID_FILTER_MAX_HASHES;
+    }
+
+    filter->counters = calloc(filter->size, sizeof(uint8_t));
+    if (filter->counters == NULL) {
+        free(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+void id_filter_add(struct id_filter* filter, const char* id, size_t len) {
+    size_t positions[ID_FILTER_MAX_HASHES];
+    id_positions(filter, id, len, positions);
+    for (unsigned int i = 0; i < filter->hashes; i++) {
+        if (filter->counters[positions[i]] < UINT8_MAX) {
+            filter->counters[positions[i]]++;
+        }
+    }
+    filter->count++;
+}
+
+void id_filter_remove(struct id_filter* filter, const char* id, size_t len) {
+    size_t positions[ID_FILTER_MAX_HASHES];
+    id_positions(filter, id, len, positions);
+    for (unsigned int i = 0; i < filter->hashes; i++) {
+        // Saturated counters have lost their exact value and stay set
+        uint8_t counter = filter->counters[positions[i]];
+        if (counter > 0 && counter < UINT8_MAX) {
+            filter->counters[positions[i]]--;
+        }
+    }
+    if (filter->count > 0) {
+        filter->count--;
+    }
+}
+
+bool id_filter_might_contain(const struct id_filter* filter, const char* id, size_t len) {
+    size_t positions[ID_FILTER_MAX_HASHES];
+    id_positions(filter, id, len, positions);
+    for (unsigned int i = 0; i < filter->hashes; i++) {
+        if (filter->counters[positions[i]] == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t id_filter_count(const struct id_filter* filter) {
+    return filter->count;
+}
+
+double id_filter_estimated_fp_rate(const struct id_filter* filter) {
+    // (1 - e^(-k n / m))^k
+    double k = filter->hashes;
+    return pow(1.0 - exp(-k * (double)filter->count / (double)filter->size), k);
+}
+
+size_t id_filter_size(const struct id_filter* filter) {
+    return filter->size * sizeof(uint8_t);
+}
+
+void id_filter_free(struct id_filter* filter) {
+    if (filter) {
+        free(filter->counters);
+        free(filter);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef ID_FILTER_H
+#define ID_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Counting Bloom filter of document ids.
+ *
+ * A negative answer from id_filter_might_contain is definite, a positive one may be a
+ * false positive. Counters make removals possible; a counter that saturates is never
+ * decremented again, which can only add false positives. The filter is not thread-safe.
+ */
+struct id_filter;
+
+/**
+ * @brief Creates a filter sized for the expected number of ids and false positive rate.
+ *
+ * @param expected_items The number of ids the filter is sized for.
+ * @param fp_rate The target false positive rate at expected_items, between 0 and 1.
+ * @return struct id_filter* The filter, or NULL on failure.
+ */
+struct id_filter* id_filter_create(size_t expected_items, double fp_rate);
+
+/**
+ * @brief Adds an id to the filter.
+ */
+void id_filter_add(struct id_filter* filter, const char* id, size_t len);
+
+/**
+ * @brief Removes an id previously added to the filter.
+ */
+void id_filter_remove(struct id_filter* filter, const char* id, size_t len);
+
+/**
+ * @brief Checks whether an id may be in the filter.
+ *
+ * @return bool Returns false when the id is definitely not in the filter.
+ */
+bool id_filter_might_contain(const struct id_filter* filter, const char* id, size_t len);
+
+/**
+ * @brief Returns the number of ids currently in the filter.
+ */
+size_t id_filter_count(const struct id_filter* filter);
+
+/**
+ * @brief Estimates the false positive rate from the current number of ids.
+ */
+double id_filter_estimated_fp_rate(const struct id_filter* filter);
+
+/**
+ * @brief Returns the memory used by the filter counters, in bytes.
+ */
+size_t id_filter_size(const struct id_filter* filter);
+
+/**
+ * @brief Releases the filter.
+ */
+void id_filter_free(struct id_filter* filter);
+
+/**
+ * @brief Hashes an id: 64-bit FNV-1a followed by the MurmurHash3 finalizer.
+ *
+ * The final mix spreads short numeric ids, so the hash also places keys on the shard ring.
+ */
+uint64_t id_hash(const char* id, size_t len);
+
+#endif // ID_FILTER_H
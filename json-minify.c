@@ -0,0 +1,387 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "json-minify.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define JSON_MINIFY_X86 1
+#include <immintrin.h>
+#endif
+
+#define JSON_MINIFY_MAX_DEPTH 1000 // Same as CJSON_NESTING_LIMIT
+
+/* ---------------------------------------------------------------------------
+ * Span scanners
+ *
+ * string_span returns the length of the prefix that can be copied verbatim inside a
+ * string (no quote, backslash or control character); whitespace_span returns the length
+ * of the whitespace prefix.
+ * ------------------------------------------------------------------------ */
+
+static bool is_whitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool ends_string_span(char c) {
+    return c == '"' || c == '\\' || (unsigned char)c < 0x20;
+}
+
+static size_t string_span_scalar(const char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && !ends_string_span(p[i])) {
+        i++;
+    }
+    return i;
+}
+
+static size_t whitespace_span_scalar(const char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && is_whitespace(p[i])) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef JSON_MINIFY_X86
+
+static size_t string_span_sse2(const char* p, size_t n) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(p + i));
+        // max(c, 0x1F) == 0x1F exactly for the control characters (unsigned compare)
+        __m128i stop = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(stop);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + string_span_scalar(p + i, n - i);
+}
+
+static size_t whitespace_span_sse2(const char* p, size_t n) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i white = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, carriage_return)));
+        unsigned int mask = ~(unsigned int)_mm_movemask_epi8(white) & 0xFFFFu;
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + whitespace_span_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t string_span_avx2(const char* p, size_t n) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1F);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i stop = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(stop);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + string_span_sse2(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t whitespace_span_avx2(const char* p, size_t n) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i carriage_return = _mm256_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i white = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, tab)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline), _mm256_cmpeq_epi8(chunk, carriage_return)));
+        unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(white);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + whitespace_span_sse2(p + i, n - i);
+}
+
+#endif // JSON_MINIFY_X86
+
+struct span_scanner {
+    const char* name;
+    size_t (*string_span)(const char* p, size_t n);
+    size_t (*whitespace_span)(const char* p, size_t n);
+};
+
+static const struct span_scanner scalar_scanner = { "scalar", string_span_scalar, whitespace_span_scalar };
+#ifdef JSON_MINIFY_X86
+static const struct span_scanner sse2_scanner = { "sse2", string_span_sse2, whitespace_span_sse2 };
+static const struct span_scanner avx2_scanner = { "avx2", string_span_avx2, whitespace_span_avx2 };
+#endif
+
+static const struct span_scanner* select_scanner(void) {
+#ifdef JSON_MINIFY_X86
+    return __builtin_cpu_supports("avx2") ? &avx2_scanner : &sse2_scanner;
+#else
+    return &scalar_scanner;
+#endif
+}
+
+const char* json_minify_isa(void) {
+    (void)scalar_scanner; // Only used as the fallback on non-x86 targets
+    return select_scanner()->name;
+}
+
+/* ---------------------------------------------------------------------------
+ * Minifier
+ * ------------------------------------------------------------------------ */
+
+/**
+ * Read and write positions over the text being minified; the write position never passes
+ * the read position, so the text is rewritten in place.
+ */
+struct minifier {
+    char* buf;
+    size_t len;
+    size_t r;
+    size_t w;
+    const struct span_scanner* scanner;
+};
+
+enum minify_state {
+    EXPECT_VALUE,
+    EXPECT_VALUE_OR_CLOSE,  // After '['
+    EXPECT_KEY,
+    EXPECT_KEY_OR_CLOSE,    // After '{'
+    EXPECT_COLON,
+    EXPECT_COMMA_OR_CLOSE,  // After a value inside a container
+    EXPECT_END              // After the top-level value
+};
+
+static void copy_bytes(struct minifier* m, size_t n) {
+    if (m->w != m->r) {
+        memmove(m->buf + m->w, m->buf + m->r, n);
+    }
+    m->w += n;
+    m->r += n;
+}
+
+static bool is_hex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Copies a string starting at its opening quote, checking its escapes
+static bool copy_string(struct minifier* m) {
+    copy_bytes(m, 1);
+    for (;;) {
+        copy_bytes(m, m->scanner->string_span(m->buf + m->r, m->len - m->r));
+        if (m->r == m->len) {
+            return false;
+        }
+        char c = m->buf[m->r];
+        if (c == '"') {
+            copy_bytes(m, 1);
+            return true;
+        }
+        if (c != '\\' || m->r + 1 == m->len) {
+            return false;
+        }
+        char escape = m->buf[m->r + 1];
+        if (escape == 'u') {
+            if (m->len - m->r < 6 || !is_hex(m->buf[m->r + 2]) || !is_hex(m->buf[m->r + 3]) ||
+                !is_hex(m->buf[m->r + 4]) || !is_hex(m->buf[m->r + 5])) {
+                return false;
+            }
+            copy_bytes(m, 6);
+        }
+        else if (escape != '\0' && strchr("\"\\/bfnrt", escape) != NULL) {
+            copy_bytes(m, 2);
+        }
+        else {
+            return false;
+        }
+    }
+}
+
+static size_t digit_span(const struct minifier* m, size_t at) {
+    size_t i = at;
+    while (i < m->len && is_digit(m->buf[i])) {
+        i++;
+    }
+    return i - at;
+}
+
+// Copies a number: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+static bool copy_number(struct minifier* m) {
+    size_t end = m->r;
+    if (m->buf[end] == '-') {
+        end++;
+    }
+    size_t digits = digit_span(m, end);
+    if (digits == 0 || (digits > 1 && m->buf[end] == '0')) {
+        return false;
+    }
+    end += digits;
+    if (end < m->len && m->buf[end] == '.') {
+        digits = digit_span(m, end + 1);
+        if (digits == 0) {
+            return false;
+        }
+        end += 1 + digits;
+    }
+    if (end < m->len && (m->buf[end] == 'e' || m->buf[end] == 'E')) {
+        end++;
+        if (end < m->len && (m->buf[end] == '+' || m->buf[end] == '-')) {
+            end++;
+        }
+        digits = digit_span(m, end);
+        if (digits == 0) {
+            return false;
+        }
+        end += digits;
+    }
+    copy_bytes(m, end - m->r);
+    return true;
+}
+
+static bool copy_literal(struct minifier* m, const char* word) {
+    size_t len = strlen(word);
+    if (m->len - m->r < len || memcmp(m->buf + m->r, word, len) != 0) {
+        return false;
+    }
+    copy_bytes(m, len);
+    return true;
+}
+
+// Copies a scalar value (string, number or literal)
+static bool copy_scalar(struct minifier* m) {
+    char c = m->buf[m->r];
+    if (c == '"') {
+        return copy_string(m);
+    }
+    if (c == '-' || is_digit(c)) {
+        return copy_number(m);
+    }
+    if (c == 't') {
+        return copy_literal(m, "true");
+    }
+    if (c == 'f') {
+        return copy_literal(m, "false");
+    }
+    if (c == 'n') {
+        return copy_literal(m, "null");
+    }
+    return false;
+}
+
+/**
+ * @brief Validate JSON text and strip the whitespace between its tokens, in place
+ *
+ * @param json The JSON text
+ * @param len The length of the JSON text
+ * @param out_len Set to the length of the minified text
+ * @return true on success, false if the text is not valid JSON
+ */
+bool json_minify(char* json, size_t len, size_t* out_len) {
+    struct minifier m = { json, len, 0, 0, select_scanner() };
+    bool objects[JSON_MINIFY_MAX_DEPTH]; // true for an object, false for an array
+    int depth = 0;
+    enum minify_state state = EXPECT_VALUE;
+
+    for (;;) {
+        m.r += m.scanner->whitespace_span(m.buf + m.r, m.len - m.r);
+        if (m.r == m.len) {
+            break;
+        }
+        char c = m.buf[m.r];
+
+        switch (state) {
+        case EXPECT_VALUE_OR_CLOSE:
+        case EXPECT_KEY_OR_CLOSE:
+            if (c == (state == EXPECT_KEY_OR_CLOSE ? '}' : ']')) {
+                copy_bytes(&m, 1);
+                depth--;
+                state = depth == 0 ? EXPECT_END : EXPECT_COMMA_OR_CLOSE;
+                continue;
+            }
+            if (state == EXPECT_KEY_OR_CLOSE) {
+                state = EXPECT_KEY;
+                continue;
+            }
+            // fallthrough
+        case EXPECT_VALUE:
+            if (c == '{' || c == '[') {
+                if (depth == JSON_MINIFY_MAX_DEPTH) {
+                    return false;
+                }
+                objects[depth++] = c == '{';
+                copy_bytes(&m, 1);
+                state = c == '{' ? EXPECT_KEY_OR_CLOSE : EXPECT_VALUE_OR_CLOSE;
+                continue;
+            }
+            if (!copy_scalar(&m)) {
+                return false;
+            }
+            state = depth == 0 ? EXPECT_END : EXPECT_COMMA_OR_CLOSE;
+            continue;
+
+        case EXPECT_KEY:
+            if (c != '"' || !copy_string(&m)) {
+                return false;
+            }
+            state = EXPECT_COLON;
+            continue;
+
+        case EXPECT_COLON:
+            if (c != ':') {
+                return false;
+            }
+            copy_bytes(&m, 1);
+            state = EXPECT_VALUE;
+            continue;
+
+        case EXPECT_COMMA_OR_CLOSE:
+            if (c == ',') {
+                copy_bytes(&m, 1);
+                state = objects[depth - 1] ? EXPECT_KEY : EXPECT_VALUE;
+                continue;
+            }
+            if (c != (objects[depth - 1] ? '}' : ']')) {
+                return false;
+            }
+            copy_bytes(&m, 1);
+            depth--;
+            state = depth == 0 ? EXPECT_END : EXPECT_COMMA_OR_CLOSE;
+            continue;
+
+        case EXPECT_END:
+            return false;
+        }
+    }
+
+    if (state != EXPECT_END) {
+        return false;
+    }
+    *out_len = m.w;
+    return true;
+}
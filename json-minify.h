@@ -0,0 +1,32 @@
+#ifndef JSON_MINIFY_H
+#define JSON_MINIFY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Validating JSON minifier for uploaded bodies.
+ *
+ * The text is checked against the JSON grammar (structure, strings and escapes, numbers and
+ * literals) and the whitespace between tokens is removed, in a single pass and in place.
+ * Runs of string content and of whitespace are scanned with SSE2 or AVX2, selected at run
+ * time, with a scalar fallback on other targets.
+ */
+
+/**
+ * @brief Validates JSON text and strips the whitespace between its tokens, in place.
+ *
+ * @param json The JSON text; it is rewritten in place.
+ * @param len The length of the JSON text.
+ * @param out_len Set to the length of the minified text on success.
+ * @return bool Returns false if the text is not valid JSON; the text is then left in an
+ *         unspecified state.
+ */
+bool json_minify(char* json, size_t len, size_t* out_len);
+
+/**
+ * @brief Returns the name of the scanner used by json_minify ("avx2", "sse2" or "scalar").
+ */
+const char* json_minify_isa(void);
+
+#endif // JSON_MINIFY_H
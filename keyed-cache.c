@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyed-cache.h"
+#include "clock-utils.h"
+#include "log-utils.h" // Include the log utils header
+
+/**
+ * Value kept in the cache.
+ */
+struct keyed_cache_entry {
+    char* key;
+    uint64_t hash;
+    char* data;
+    size_t len;
+    uint64_t stored_ms;
+};
+
+/**
+ * @brief Create an empty cache
+ *
+ * @param cache The cache
+ * @param slot_count The number of slots
+ * @param max_bytes The size of the cache, 0 to keep nothing
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int keyed_cache_init(struct keyed_cache* cache, size_t slot_count, size_t max_bytes) {
+    memset(cache, 0, sizeof(*cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    if (max_bytes > 0 && slot_count > 0) {
+        cache->slots = calloc(slot_count, sizeof(*cache->slots));
+        if (cache->slots == NULL) {
+            LOG_ERROR("Memory allocation failed for the cache slots");
+            return EXIT_FAILURE;
+        }
+        cache->slot_count = slot_count;
+    }
+    cache->stats.max_bytes = max_bytes;
+    return EXIT_SUCCESS;
+}
+
+bool keyed_cache_enabled(const struct keyed_cache* cache) {
+    return cache->slots != NULL;
+}
+
+static void cache_evict(struct keyed_cache* cache, struct keyed_cache_entry* entry) {
+    if (entry->key == NULL) {
+        return;
+    }
+    cache->stats.bytes -= entry->len;
+    cache->stats.entries--;
+    free(entry->key);
+    free(entry->data);
+    memset(entry, 0, sizeof(*entry));
+}
+
+// FNV-1a hash of a cache key
+static uint64_t cache_hash(const char* key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* c = (const unsigned char*)key; *c; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Copies a value with a terminating NUL, so string values can be used as they are
+static char* copy_bytes(const char* data, size_t len) {
+    char* copy = malloc(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, data, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/**
+ * @brief Store a copy of a value, replacing the entry of the same slot
+ *
+ * The copies are made outside the lock.
+ *
+ * @param cache The cache
+ * @param key The key of the value
+ * @param data The value
+ * @param len The length of the value
+ */
+void keyed_cache_put(struct keyed_cache* cache, const char* key, const char* data, size_t len) {
+    if (cache->slots == NULL || len > cache->stats.max_bytes) {
+        return;
+    }
+    char* entry_key = strdup(key);
+    char* entry_data = copy_bytes(data, len);
+    if (entry_key == NULL || entry_data == NULL) {
+        free(entry_key);
+        free(entry_data);
+        return;
+    }
+
+    uint64_t hash = cache_hash(key);
+    struct keyed_cache_entry* entry = &cache->slots[hash % cache->slot_count];
+    pthread_mutex_lock(&cache->lock);
+    if (entry->key != NULL) {
+        cache_evict(cache, entry);
+        cache->stats.evictions++;
+    }
+    while (cache->stats.bytes + len > cache->stats.max_bytes) {
+        struct keyed_cache_entry* victim = &cache->slots[cache->hand];
+        cache->hand = (cache->hand + 1) % cache->slot_count;
+        if (victim->key != NULL) {
+            cache_evict(cache, victim);
+            cache->stats.evictions++;
+        }
+    }
+    entry->key = entry_key;
+    entry->hash = hash;
+    entry->data = entry_data;
+    entry->len = len;
+    entry->stored_ms = monotonic_ms();
+    cache->stats.bytes += len;
+    cache->stats.entries++;
+    cache->stats.stores++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * @brief Look up a value
+ *
+ * @param cache The cache
+ * @param key The key of the value
+ * @param max_age_ms The oldest entry accepted, or KEYED_CACHE_ANY_AGE
+ * @param len Set to the length of the value
+ * @param age_ms Set to the time since the value was stored, or NULL
+ * @return char* A NUL-terminated copy of the value, or NULL on a miss
+ */
+char* keyed_cache_get(struct keyed_cache* cache, const char* key, uint64_t max_age_ms, size_t* len, uint64_t* age_ms) {
+    if (cache->slots == NULL) {
+        return NULL;
+    }
+    uint64_t hash = cache_hash(key);
+    struct keyed_cache_entry* entry = &cache->slots[hash % cache->slot_count];
+    char* copy = NULL;
+    pthread_mutex_lock(&cache->lock);
+    uint64_t now = monotonic_ms();
+    if (entry->key != NULL && entry->hash == hash && strcmp(entry->key, key) == 0 &&
+        now - entry->stored_ms < max_age_ms) {
+        copy = copy_bytes(entry->data, entry->len);
+    }
+    if (copy != NULL) {
+        cache->stats.hits++;
+        *len = entry->len;
+        if (age_ms != NULL) {
+            *age_ms = now - entry->stored_ms;
+        }
+    }
+    else {
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return copy;
+}
+
+void keyed_cache_get_stats(struct keyed_cache* cache, struct keyed_cache_stats* stats) {
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void keyed_cache_cleanup(struct keyed_cache* cache) {
+    if (cache->slots == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < cache->slot_count; i++) {
+        cache_evict(cache, &cache->slots[i]);
+    }
+    free(cache->slots);
+    cache->slots = NULL;
+}
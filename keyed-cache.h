@@ -0,0 +1,93 @@
+#ifndef KEYED_CACHE_H
+#define KEYED_CACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Byte-bounded cache of byte strings under string keys, safe to share between threads.
+ *
+ * The cache is direct-mapped: an entry replaces whatever occupied its slot. When the entries
+ * would exceed the size of the cache, a clock hand sweeps the slots and evicts them in turn
+ * until the new entry fits. Every entry remembers when it was stored, so readers can refuse
+ * entries older than they accept.
+ */
+
+#define KEYED_CACHE_ANY_AGE UINT64_MAX
+
+struct keyed_cache_entry;
+
+/**
+ * Counters of a keyed cache.
+ */
+struct keyed_cache_stats {
+    unsigned long long stores;
+    unsigned long long hits;
+    unsigned long long misses;    // Lookups that found no entry, or none young enough
+    unsigned long long evictions; // Entries dropped to make room for others
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+};
+
+struct keyed_cache {
+    pthread_mutex_t lock;
+    struct keyed_cache_entry* slots; // NULL when the cache keeps nothing
+    size_t slot_count;
+    size_t hand;                     // Next slot evicted when the cache is over its size
+    struct keyed_cache_stats stats;
+};
+
+/**
+ * @brief Creates an empty cache.
+ *
+ * @param cache The cache.
+ * @param slot_count The number of slots.
+ * @param max_bytes The size of the cache, 0 to keep nothing.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int keyed_cache_init(struct keyed_cache* cache, size_t slot_count, size_t max_bytes);
+
+/**
+ * @brief Checks whether the cache keeps entries.
+ */
+bool keyed_cache_enabled(const struct keyed_cache* cache);
+
+/**
+ * @brief Stores a copy of a value, replacing the entry of the same slot.
+ *
+ * Values larger than the whole cache are not stored.
+ *
+ * @param cache The cache.
+ * @param key The key of the value.
+ * @param data The value.
+ * @param len The length of the value.
+ */
+void keyed_cache_put(struct keyed_cache* cache, const char* key, const char* data, size_t len);
+
+/**
+ * @brief Looks up a value.
+ *
+ * @param cache The cache.
+ * @param key The key of the value.
+ * @param max_age_ms The oldest entry accepted, in milliseconds, or KEYED_CACHE_ANY_AGE.
+ * @param len Set to the length of the value.
+ * @param age_ms Set to the time since the value was stored, or NULL.
+ * @return char* A NUL-terminated copy of the value, or NULL on a miss.
+ *         The caller is responsible for freeing the returned buffer.
+ */
+char* keyed_cache_get(struct keyed_cache* cache, const char* key, uint64_t max_age_ms, size_t* len, uint64_t* age_ms);
+
+/**
+ * @brief Copies the counters of the cache.
+ */
+void keyed_cache_get_stats(struct keyed_cache* cache, struct keyed_cache_stats* stats);
+
+/**
+ * @brief Frees the entries and the slots of the cache.
+ */
+void keyed_cache_cleanup(struct keyed_cache* cache);
+
+#endif // KEYED_CACHE_H
@@ -7,16 +7,93 @@
 #include <microhttpd.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <limits.h>
 
 #include "handlers.h" // Include your API handler functions
 #include "database.h" // Include Redis database functions
+#include "capture.h" // Include the traffic capture functions
+#include "arena.h" // Include the cJSON request arena
+#include "json-minify.h" // Include the JSON validator and minifier
+#include "body-compress.h" // Include the response compression
+#include "prefork.h" // Include the prefork worker supervisor
+#include "shm-cache.h" // Include the shared document cache
+#include "group-commit.h" // Include the group commit of pet writes
+#include "stale-cache.h" // Include the stale-while-revalidate cache
 #include "log-utils.h" // Include the log utils header
 
 #define HTTP_CONTENT_TYPE_JSON "application/json"
+#define CAPTURE_DEFAULT_SAMPLE_RATE 0.01
+#define CAPTURE_DEFAULT_MAX_RECORDS 10000
+#define PET_FILTER_DEFAULT_CAPACITY 1000000
+#define PET_FILTER_DEFAULT_FP_RATE 0.01
+#define PET_FILTER_DEFAULT_REBUILD_SEC 300
+#define REQUEST_ARENA_DEFAULT_SIZE (64 * 1024)
+#define BULK_DEFAULT_PIPELINE_SIZE 1000
+#define BULK_PET_URL "/v2/pet/bulk"
+#define COMPRESS_DEFAULT_MIN_SIZE 1024
+#define COMPRESS_DEFAULT_CACHE_BYTES (16 * 1024 * 1024)
+#define SHARED_CACHE_DEFAULT_SLOT_SIZE 1024
+#define SHARED_CACHE_DEFAULT_TTL_MS 5000
+#define AUTO_PIPELINE_DEFAULT_WINDOW_US 50
+#define GROUP_COMMIT_DEFAULT_MAX_OPS 128
+#define GROUP_COMMIT_DEFAULT_WINDOW_US 200
+#define ASYNC_WRITES_DEFAULT_QUEUE_SIZE 10000
+#define ASYNC_WRITES_DEFAULT_STATUS_SIZE 100000
+#define ASYNC_WRITES_RETRY_AFTER_SEC 1
+#define REDIS_DEFAULT_CONNECT_TIMEOUT_MS 1000
+#define REDIS_DEFAULT_COMMAND_TIMEOUT_MS 2000
+#define REDIS_DEFAULT_HEALTH_CHECK_MS 1000
+#define REDIS_DEFAULT_BREAKER_FAILURES 5
+#define REDIS_DEFAULT_BREAKER_OPEN_MS 500
+#define REDIS_DEFAULT_BREAKER_MAX_OPEN_MS 30000
+#define STALE_DEFAULT_PET_MS 60000
+#define STALE_DEFAULT_FIND_BY_STATUS_MS 30000
+#define STALE_DEFAULT_FIND_BY_TAGS_MS 30000
+#define STALE_DEFAULT_LATENCY_MS 100
+#define STALE_DEFAULT_CACHE_BYTES (16 * 1024 * 1024)
+#define HEDGE_DEFAULT_PERCENTILE 95
+#define HEDGE_DEFAULT_MIN_DELAY_US 1000
+#define HEDGE_DEFAULT_MAX_PERCENT 10
+#define HTTP_WARNING_STALE "110 - \"Response is Stale\""
+#define OPERATIONS_URL "/v2/operations/"
+#define HTTP_HEADER_PREFER "Prefer"
+#define HTTP_HEADER_PREFERENCE_APPLIED "Preference-Applied"
+#define HTTP_PREFER_RESPOND_ASYNC "respond-async"
+#define HTTP_HEADER_READ_FROM "X-Read-From"
+#define HTTP_READ_FROM_PRIMARY "primary"
+
+// Pets written per Redis pipeline by POST /v2/pet/bulk
+static size_t bulk_pipeline_size = BULK_DEFAULT_PIPELINE_SIZE;
+
+// Pet writes answered with 202 Accepted before they are applied
+enum async_writes {
+    ASYNC_WRITES_OFF,
+    ASYNC_WRITES_PREFER,  // When the request sends Prefer: respond-async
+    ASYNC_WRITES_ALWAYS
+};
+static enum async_writes async_writes = ASYNC_WRITES_OFF;
+
+// Staleness budgets of the cached routes, 0 while stale-while-revalidate is off
+static unsigned int stale_pet_ms = 0;
+static unsigned int stale_find_by_status_ms = 0;
+static unsigned int stale_find_by_tags_ms = 0;
+
+/**
+ * @brief Connection-specific data kept by microhttpd between calls of request_handler.
+ */
+struct request_context {
+    char* data;              // Accumulated upload data, NUL-terminated
+    size_t size;             // Length of the accumulated upload data
+    struct timeval arrival;  // Time the request headers were received
+    struct bulk_import* import; // Bulk import fed with the body as it arrives, instead of data
+    bool offline;            // Redis was unreachable when the request arrived: only cached reads are served
+};
 
 volatile sig_atomic_t keep_running = 1;
 
@@ -28,6 +105,77 @@ void handle_signal(int signal) {
     }
 }
 
+/**
+ * @brief Creates and sends an HTTP response, compressed if the client accepts it.
+ *
+ * @param connection The MHD_Connection object.
+ * @param message The response message to send.
+ * @param status_code The HTTP status code.
+ * @param etag The ETag of the response, or NULL or empty for none.
+ * @param cache_key The resource and content version the compressed body is cached under, or NULL.
+ * @param stale_age The age in seconds of a response served stale, or NULL for a fresh one.
+ * @return int Returns MHD_YES on success, MHD_NO on failure.
+ */
+static int queue_response(struct MHD_Connection* connection, const char* message, unsigned int status_code, const char* etag,
+    const char* cache_key, const unsigned int* stale_age) {
+    size_t len = strlen(message);
+    const char* accept_encoding = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+    enum content_encoding encoding = compress_negotiate(accept_encoding, len);
+
+    struct MHD_Response* response = NULL;
+    if (encoding != CONTENT_ENCODING_IDENTITY) {
+        size_t compressed_len = 0;
+        char* compressed = cache_key ? compress_cached(cache_key, message, len, encoding, &compressed_len)
+                                     : compress_body(message, len, encoding, &compressed_len);
+        if (compressed != NULL) {
+            response = MHD_create_response_from_buffer(compressed_len, compressed, MHD_RESPMEM_MUST_FREE);
+            if (!response) {
+                free(compressed);
+                return MHD_NO;
+            }
+            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, compress_encoding_name(encoding));
+        }
+    }
+    if (response == NULL) {
+        response = MHD_create_response_from_buffer(len, (void*)message, MHD_RESPMEM_MUST_COPY);
+        if (!response) {
+            return MHD_NO;
+        }
+    }
+
+    // Set the content type to application/json
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, HTTP_CONTENT_TYPE_JSON);
+    if (etag != NULL && etag[0] != '\0') {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+    }
+    if (compress_eligible(len)) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+    }
+    if (stale_age != NULL) {
+        char age[16];
+        snprintf(age, sizeof(age), "%u", *stale_age);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_AGE, age);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_WARNING, HTTP_WARNING_STALE);
+    }
+
+    int ret = MHD_queue_response(connection, status_code, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+/**
+ * @brief Creates and sends an HTTP response with an ETag.
+ *
+ * @param connection The MHD_Connection object.
+ * @param message The response message to send.
+ * @param status_code The HTTP status code.
+ * @param etag The ETag of the response, or NULL or empty for none.
+ * @return int Returns MHD_YES on success, MHD_NO on failure.
+ */
+static int send_response_etag(struct MHD_Connection* connection, const char* message, unsigned int status_code, const char* etag) {
+    return queue_response(connection, message, status_code, etag, NULL, NULL);
+}
+
 /**
  * @brief Creates and sends an HTTP response.
  *
@@ -37,19 +185,281 @@ void handle_signal(int signal) {
  * @return int Returns MHD_YES on success, MHD_NO on failure.
  */
 static int send_response(struct MHD_Connection* connection, const char* message, unsigned int status_code) {
+    return send_response_etag(connection, message, status_code, NULL);
+}
+
+/**
+ * @brief Sends a 503 response asking the client to retry later.
+ *
+ * @param connection The MHD_Connection object.
+ * @param message The response message to send.
+ * @param retry_after_sec The Retry-After delay in seconds, at least 1.
+ * @return int Returns MHD_YES on success, MHD_NO on failure.
+ */
+static int send_unavailable(struct MHD_Connection* connection, const char* message, unsigned int retry_after_sec) {
     struct MHD_Response* response = MHD_create_response_from_buffer(strlen(message), (void*)message, MHD_RESPMEM_MUST_COPY);
     if (!response) {
         return MHD_NO;
     }
+    char retry_after[16];
+    snprintf(retry_after, sizeof(retry_after), "%u", retry_after_sec > 0 ? retry_after_sec : 1);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, HTTP_CONTENT_TYPE_JSON);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_RETRY_AFTER, retry_after);
 
-    // Set the content type to application/json
+    int ret = MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// Helper function to tell whether the request sends Prefer: respond-async
+static bool prefers_async(struct MHD_Connection* connection) {
+    const char* prefer = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, HTTP_HEADER_PREFER);
+    return prefer != NULL && strstr(prefer, HTTP_PREFER_RESPOND_ASYNC) != NULL;
+}
+
+// Helper function to tell whether the request sends X-Read-From: primary, to read its own writes
+static bool reads_primary(struct MHD_Connection* connection) {
+    const char* read_from = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, HTTP_HEADER_READ_FROM);
+    return read_from != NULL && strcasecmp(read_from, HTTP_READ_FROM_PRIMARY) == 0;
+}
+
+// Helper function to tell whether a pet write is queued rather than applied before the response
+static bool write_async(struct MHD_Connection* connection) {
+    return async_writes == ASYNC_WRITES_ALWAYS || (async_writes == ASYNC_WRITES_PREFER && prefers_async(connection));
+}
+
+/**
+ * @brief Sends the response to a pet write queued for asynchronous application.
+ *
+ * An accepted write gets 202 with its operation id, and the status URL in a Location header.
+ * A full queue gets 503.
+ *
+ * @param connection The MHD_Connection object.
+ * @param result The result of the async handler.
+ * @param operation The operation id of the accepted write.
+ * @return int Returns MHD_YES on success, MHD_NO on failure.
+ */
+static int send_async_response(struct MHD_Connection* connection, int result, long long operation) {
+    if (result == HANDLER_INVALID_INPUT) {
+        return send_response(connection, "Invalid pet", MHD_HTTP_BAD_REQUEST);
+    }
+    if (result == HANDLER_NOT_FOUND) {
+        return send_response(connection, "Pet not found", MHD_HTTP_NOT_FOUND);
+    }
+    if (result == HANDLER_QUEUE_FULL) {
+        return send_unavailable(connection, "Write queue is full", ASYNC_WRITES_RETRY_AFTER_SEC);
+    }
+    if (result != EXIT_SUCCESS) {
+        return send_response(connection, "Failed to queue pet write", MHD_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    char message[96];
+    char location[64];
+    snprintf(message, sizeof(message), "{\"operationId\":%lld,\"status\":\"queued\"}", operation);
+    snprintf(location, sizeof(location), OPERATIONS_URL "%lld", operation);
+    struct MHD_Response* response = MHD_create_response_from_buffer(strlen(message), (void*)message, MHD_RESPMEM_MUST_COPY);
+    if (!response) {
+        return MHD_NO;
+    }
     MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, HTTP_CONTENT_TYPE_JSON);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_LOCATION, location);
+    if (prefers_async(connection)) {
+        MHD_add_response_header(response, HTTP_HEADER_PREFERENCE_APPLIED, HTTP_PREFER_RESPOND_ASYNC);
+    }
 
-    int ret = MHD_queue_response(connection, status_code, response);
+    int ret = MHD_queue_response(connection, MHD_HTTP_ACCEPTED, response);
     MHD_destroy_response(response);
     return ret;
 }
 
+/**
+ * @brief Appends a chunk of uploaded data to the request context.
+ *
+ * @param ctx The request context.
+ * @param upload_data The data uploaded in the request.
+ * @param upload_data_size The size of the uploaded data, reset to 0 once consumed.
+ * @return MHD_Result Returns MHD_YES on success, MHD_NO on failure.
+ */
+static enum MHD_Result append_upload_data(struct request_context* ctx, const char* upload_data, size_t* upload_data_size) {
+    char* data = realloc(ctx->data, ctx->size + *upload_data_size + 1);
+    if (data == NULL) {
+        return MHD_NO;
+    }
+    memcpy(data + ctx->size, upload_data, *upload_data_size);
+    ctx->size += *upload_data_size;
+    data[ctx->size] = '\0';
+    ctx->data = data;
+    *upload_data_size = 0;
+    return MHD_YES;
+}
+
+/**
+ * @brief Appends a percent-encoded query string component to a buffer.
+ */
+static size_t append_url_encoded(char* buffer, size_t pos, size_t size, const char* value) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (const unsigned char* c = (const unsigned char*)value; *c && pos + 4 < size; c++) {
+        if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') ||
+            *c == '-' || *c == '_' || *c == '.' || *c == '~' || *c == ',') {
+            buffer[pos++] = (char)*c;
+        }
+        else {
+            buffer[pos++] = '%';
+            buffer[pos++] = hex[*c >> 4];
+            buffer[pos++] = hex[*c & 0x0F];
+        }
+    }
+    buffer[pos] = '\0';
+    return pos;
+}
+
+// Query string rebuilt from the GET arguments of a captured request
+struct query_builder {
+    char buffer[CAPTURE_RECORD_SIZE];
+    size_t pos;
+};
+
+// MHD_KeyValueIterator appending one GET argument to a query_builder
+static enum MHD_Result append_query_arg(void* cls, enum MHD_ValueKind kind, const char* key, const char* value) {
+    (void)kind; // Mark unused parameter
+    struct query_builder* query = cls;
+    size_t size = sizeof(query->buffer);
+    if (query->pos + 2 < size) {
+        char separator = query->pos == 0 ? '?' : '&';
+        query->buffer[query->pos++] = separator;
+        query->pos = append_url_encoded(query->buffer, query->pos, size, key);
+        if (value && query->pos + 2 < size) {
+            query->buffer[query->pos++] = '=';
+            query->pos = append_url_encoded(query->buffer, query->pos, size, value);
+        }
+    }
+    return MHD_YES;
+}
+
+/**
+ * @brief Sends the answer of a conditional GET: 304 when not modified, the result otherwise.
+ *
+ * Compressed bodies of results with an ETag are cached under the URI and the ETag. Results
+ * served stale carry Age and Warning headers; an offline read that found nothing cached gets 503.
+ *
+ * @param connection The MHD_Connection object.
+ * @param url The requested URL.
+ * @param result The result of the handler, NULL on failure or when not modified.
+ * @param cond The conditional GET.
+ * @param error The message sent with error_code when the handler failed.
+ * @param error_code The HTTP status code of a failure.
+ * @return int Returns MHD_YES on success, MHD_NO on failure.
+ */
+static int send_conditional_response(struct MHD_Connection* connection, const char* url, char* result, const struct conditional_get* cond,
+    const char* error, unsigned int error_code) {
+    if (cond->not_modified) {
+        return send_response_etag(connection, "", MHD_HTTP_NOT_MODIFIED, cond->etag);
+    }
+    if (result == NULL && cond->offline) {
+        return send_unavailable(connection, "Database unavailable", db_retry_after_sec());
+    }
+    if (result == NULL) {
+        return send_response(connection, error, error_code);
+    }
+
+    char cache_key[CAPTURE_RECORD_SIZE + ETAG_SIZE];
+    if (cond->etag[0] != '\0') {
+        struct query_builder query;
+        query.pos = 0;
+        query.buffer[0] = '\0';
+        MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, &append_query_arg, &query);
+        snprintf(cache_key, sizeof(cache_key), "%s%s %s", url, query.buffer, cond->etag);
+    }
+    int ret = queue_response(connection, result, MHD_HTTP_OK, cond->etag, cond->etag[0] != '\0' ? cache_key : NULL,
+        cond->stale ? &cond->age_sec : NULL);
+    free(result);
+    return ret;
+}
+
+/**
+ * @brief Records the request in the capture file if it is sampled.
+ *
+ * @param connection The MHD_Connection object.
+ * @param ctx The request context.
+ * @param url The requested URL.
+ * @param method The HTTP method.
+ */
+static void capture_if_sampled(struct MHD_Connection* connection, struct request_context* ctx, const char* url, const char* method) {
+    if (!capture_sample()) {
+        return;
+    }
+
+    // microhttpd hands the query string over decoded, so rebuild it
+    struct query_builder query;
+    query.pos = 0;
+    query.buffer[0] = '\0';
+    MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, &append_query_arg, &query);
+
+    char uri[CAPTURE_RECORD_SIZE];
+    snprintf(uri, sizeof(uri), "%s%s", url, query.buffer);
+    capture_request(method, uri, ctx->data, ctx->size, &ctx->arrival);
+}
+
+/**
+ * @brief Validates the JSON body of a request and strips its whitespace in place.
+ *
+ * @param ctx The request context holding the body.
+ * @return bool Returns false if the body is not valid JSON.
+ */
+static bool minify_body(struct request_context* ctx) {
+    size_t len;
+    if (!json_minify(ctx->data, ctx->size, &len)) {
+        LOG_ERROR("Invalid JSON body");
+        return false;
+    }
+    ctx->size = len;
+    ctx->data[len] = '\0';
+    return true;
+}
+
+/**
+ * @brief Releases the connection-specific data once a request is completed.
+ *
+ * @param cls Unused parameter.
+ * @param connection Unused parameter.
+ * @param con_cls Pointer to connection-specific data.
+ * @param toe Unused parameter.
+ */
+static void request_completed(void* cls, struct MHD_Connection* connection, void** con_cls, enum MHD_RequestTerminationCode toe) {
+    (void)cls; // Mark unused parameter
+    (void)connection; // Mark unused parameter
+    (void)toe; // Mark unused parameter
+
+    struct request_context* ctx = *con_cls;
+    if (ctx) {
+        handle_import_free(ctx->import);
+        free(ctx->data);
+        free(ctx);
+        *con_cls = NULL;
+    }
+}
+
+static enum MHD_Result route_request(struct MHD_Connection* connection, struct request_context* ctx, const char* url, const char* method);
+
+/**
+ * @brief Prepares the conditional GET of a cached read.
+ *
+ * The staleness budget of the route only applies while Redis is unreachable or slow.
+ *
+ * @param connection The MHD_Connection object.
+ * @param ctx The request context.
+ * @param stale_budget_ms The staleness budget of the route.
+ * @return struct conditional_get The conditional GET.
+ */
+static struct conditional_get cached_read(struct MHD_Connection* connection, const struct request_context* ctx,
+    unsigned int stale_budget_ms) {
+    struct conditional_get cond = { 0 };
+    cond.if_none_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+    cond.offline = ctx->offline;
+    cond.max_stale_ms = stale_budget_ms > 0 && (ctx->offline || db_degraded()) ? stale_budget_ms : 0;
+    return cond;
+}
+
 /**
  * @brief Handles incoming HTTP requests and routes them to the appropriate handler.
  *
@@ -77,70 +487,134 @@ static enum MHD_Result request_handler(void* cls,
 
     // Allocate memory for connection-specific data if not already allocated
     if (*con_cls == NULL) {
-        *con_cls = calloc(1, sizeof(char));
-        if (*con_cls == NULL) {
+        // HTTP threads open their Redis connection on their first request, and again after a
+        // failure; while the circuit breaker is open the request fails fast, unless it is a pet
+        // read that the caches may still answer
+        bool offline = false;
+        if (db_thread_attach() != EXIT_SUCCESS) {
+            LOG_ERROR("Failed to connect to the database");
+            if (strncmp(url, "/v2/pet/", 8) != 0 || strcmp(method, "GET") != 0) {
+                return send_unavailable(connection, "Database unavailable", db_retry_after_sec());
+            }
+            offline = true;
+        }
+        struct request_context* ctx = calloc(1, sizeof(struct request_context));
+        if (ctx == NULL) {
             return MHD_NO;
         }
+        ctx->offline = offline;
+        ctx->data = calloc(1, sizeof(char));
+        if (ctx->data == NULL) {
+            free(ctx);
+            return MHD_NO;
+        }
+        gettimeofday(&ctx->arrival, NULL);
+        if (strcmp(method, "POST") == 0 && strcmp(url, BULK_PET_URL) == 0) {
+            ctx->import = handle_pet_import_begin(bulk_pipeline_size);
+            if (ctx->import == NULL) {
+                free(ctx->data);
+                free(ctx);
+                return MHD_NO;
+            }
+        }
+        *con_cls = ctx;
         return MHD_YES;
     }
 
-    // Handle POST /pet
-    if (strcmp(method, "POST") == 0 && strcmp(url, "/v2/pet") == 0) {
-        if (*upload_data_size != 0) {
-            // Accumulate the uploaded data
-            char* data = (char*)*con_cls;
-            size_t current_length = data ? strlen(data) : 0;
-            data = realloc(data, current_length + *upload_data_size + 1);
-            if (data == NULL) {
-                return MHD_NO;
-            }
-            memcpy(data + current_length, upload_data, *upload_data_size);
-            data[current_length + *upload_data_size] = '\0';
-            *con_cls = data;
+    // Accumulate the uploaded data until the whole body has been received
+    struct request_context* ctx = *con_cls;
+    if (*upload_data_size != 0) {
+        if (ctx->import != NULL) {
+            // Bulk imports are written as the body arrives; errors are reported at the end
+            handle_import_feed(ctx->import, upload_data, *upload_data_size);
             *upload_data_size = 0;
             return MHD_YES;
         }
-        else {
-            // Process the accumulated data
-            char* data = (char*)*con_cls;
-            if (handle_create_pet(data) != 0) {
-                free(data);
-                return send_response(connection, "Failed to create pet", MHD_HTTP_INTERNAL_SERVER_ERROR);
-            }
-            free(data);
-            return send_response(connection, "Pet created successfully", MHD_HTTP_OK);
+        return append_upload_data(ctx, upload_data, upload_data_size);
+    }
+
+    // Bulk bodies are not kept, so they cannot be captured
+    if (ctx->import == NULL) {
+        capture_if_sampled(connection, ctx, url, method);
+    }
+
+    // GET requests read from a replica, unless they ask for the primary
+    db_route_reads(strcmp(method, "GET") == 0 && !ctx->offline && !reads_primary(connection));
+
+    // cJSON memory of the handlers is released all at once when the request is answered
+    arena_begin();
+    enum MHD_Result ret = route_request(connection, ctx, url, method);
+    arena_end();
+    db_thread_report();
+    return ret;
+}
+
+/**
+ * @brief Routes a request whose body has been received to the appropriate handler.
+ *
+ * @param connection The MHD_Connection object.
+ * @param ctx The request context holding the body.
+ * @param url The requested URL.
+ * @param method The HTTP method (GET, POST, PUT, DELETE).
+ * @return MHD_Result Returns MHD_YES on success, MHD_NO on failure.
+ */
+static enum MHD_Result route_request(struct MHD_Connection* connection, struct request_context* ctx, const char* url, const char* method) {
+    // Handle POST /pet
+    if (strcmp(method, "POST") == 0 && strcmp(url, "/v2/pet") == 0) {
+        if (!minify_body(ctx)) {
+            return send_response(connection, "Invalid JSON", MHD_HTTP_BAD_REQUEST);
+        }
+        if (write_async(connection)) {
+            long long operation = 0;
+            return send_async_response(connection, handle_create_pet_async(ctx->data, &operation), operation);
+        }
+        if (handle_create_pet(ctx->data) != 0) {
+            return send_response(connection, "Failed to create pet", MHD_HTTP_INTERNAL_SERVER_ERROR);
         }
+        return send_response(connection, "Pet created successfully", MHD_HTTP_OK);
+    }
+    // Handle POST /pet/bulk
+    else if (ctx->import != NULL) {
+        bool complete;
+        char* result = handle_import_finish(ctx->import, &complete);
+        if (result == NULL) {
+            return send_response(connection, "Failed to import pets", MHD_HTTP_INTERNAL_SERVER_ERROR);
+        }
+        int ret = send_response(connection, result, complete ? MHD_HTTP_OK : MHD_HTTP_BAD_REQUEST);
+        free(result);
+        return ret;
     }
     // Handle PUT /pet
     else if (strcmp(method, "PUT") == 0 && strcmp(url, "/v2/pet") == 0) {
-        if (*upload_data_size != 0) {
-            // Accumulate the uploaded data
-            char* data = (char*)*con_cls;
-            size_t current_length = data ? strlen(data) : 0;
-            data = realloc(data, current_length + *upload_data_size + 1);
-            if (data == NULL) {
-                return MHD_NO;
-            }
-            memcpy(data + current_length, upload_data, *upload_data_size);
-            data[current_length + *upload_data_size] = '\0';
-            *con_cls = data;
-            *upload_data_size = 0;
-            return MHD_YES;
+        if (!minify_body(ctx)) {
+            return send_response(connection, "Invalid JSON", MHD_HTTP_BAD_REQUEST);
         }
-        else {
-            // Process the accumulated data
-            char* data = (char*)*con_cls;
-            if (handle_update_pet(data) != 0) {
-                free(data);
-                return send_response(connection, "Failed to update pet", MHD_HTTP_INTERNAL_SERVER_ERROR);
-            }
-            free(data);
-            return send_response(connection, "Pet updated successfully", MHD_HTTP_OK);
+        const char* if_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_MATCH);
+        // A conditional update is answered with its outcome, so it is never queued
+        if (if_match == NULL && write_async(connection)) {
+            long long operation = 0;
+            return send_async_response(connection, handle_update_pet_async(ctx->data, &operation), operation);
+        }
+        char etag[ETAG_SIZE] = "";
+        int result = handle_update_pet(ctx->data, if_match, etag);
+        if (result == HANDLER_PRECONDITION_FAILED) {
+            return send_response(connection, "Pet was modified", MHD_HTTP_PRECONDITION_FAILED);
+        }
+        if (result == HANDLER_UNAVAILABLE) {
+            return send_unavailable(connection, "Database unavailable", db_retry_after_sec());
+        }
+        if (result != 0) {
+            return send_response(connection, "Failed to update pet", MHD_HTTP_INTERNAL_SERVER_ERROR);
         }
+        return send_response_etag(connection, "Pet updated successfully", MHD_HTTP_OK, etag);
     }
     // Handle DELETE /pet/{id}
     else if (strncmp(url, "/v2/pet/", 7) == 0 && strcmp(method, "DELETE") == 0) {
         const char* id = url + 8; // Extract ID from URL
+        if (write_async(connection)) {
+            long long operation = 0;
+            return send_async_response(connection, handle_delete_pet_async(id, &operation), operation);
+        }
         if (handle_delete_pet(id) != 0) {
             return send_response(connection, "Failed to delete pet", MHD_HTTP_NOT_FOUND);
         }
@@ -149,20 +623,28 @@ static enum MHD_Result request_handler(void* cls,
     // Handle GET /pet/findByTags
     else if (strcmp(url, "/v2/pet/findByTags") == 0 && strcmp(method, "GET") == 0) {
         const char* tags = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "tags");
-        char* result = handle_get_pet_by_tags(tags);
-        if (result == NULL) {
-            return send_response(connection, "Failed to find pets by tags", MHD_HTTP_INTERNAL_SERVER_ERROR);
-        }
-        int ret = send_response(connection, result, MHD_HTTP_OK);
-        free(result);
-        return ret;
+        struct conditional_get cond = cached_read(connection, ctx, stale_find_by_tags_ms);
+        char* result = handle_get_pet_by_tags(tags, &cond);
+        return send_conditional_response(connection, url, result, &cond, "Failed to find pets by tags", MHD_HTTP_INTERNAL_SERVER_ERROR);
     }
     // Handle GET /pet/findByState
     else if (strcmp(url, "/v2/pet/findByStatus") == 0 && strcmp(method, "GET") == 0) {
         const char* state = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "status");
-        char* result = handle_get_pet_by_state(state);
+        struct conditional_get cond = cached_read(connection, ctx, stale_find_by_status_ms);
+        char* result = handle_get_pet_by_state(state, &cond);
+        return send_conditional_response(connection, url, result, &cond, "Failed to find pets by state", MHD_HTTP_INTERNAL_SERVER_ERROR);
+    }
+    // Handle GET /pet?ids=1,2,3
+    else if (strcmp(url, "/v2/pet") == 0 && strcmp(method, "GET") == 0) {
+        const char* ids = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "ids");
+        if (ids == NULL) {
+            return send_response(connection, "Missing ids", MHD_HTTP_BAD_REQUEST);
+        }
+        bool valid;
+        char* result = handle_get_pets_by_ids(ids, &valid);
         if (result == NULL) {
-            return send_response(connection, "Failed to find pets by state", MHD_HTTP_INTERNAL_SERVER_ERROR);
+            return valid ? send_response(connection, "Failed to find pets by ID", MHD_HTTP_INTERNAL_SERVER_ERROR)
+                         : send_response(connection, "Invalid ids", MHD_HTTP_BAD_REQUEST);
         }
         int ret = send_response(connection, result, MHD_HTTP_OK);
         free(result);
@@ -171,9 +653,15 @@ static enum MHD_Result request_handler(void* cls,
     // Handle GET /pet/{petId}
     else if (strncmp(url, "/v2/pet/", 7) == 0 && strcmp(method, "GET") == 0) {
         const char* id = url + 8; // Extract ID from URL
-        char* result = handle_get_pet_by_id(id);
+        struct conditional_get cond = cached_read(connection, ctx, stale_pet_ms);
+        char* result = handle_get_pet_by_id(id, &cond);
+        return send_conditional_response(connection, url, result, &cond, "Failed to find pet by ID", MHD_HTTP_NOT_FOUND);
+    }
+    // Handle GET /v2/operations/{operationId}
+    else if (strncmp(url, OPERATIONS_URL, strlen(OPERATIONS_URL)) == 0 && strcmp(method, "GET") == 0) {
+        char* result = handle_get_operation(url + strlen(OPERATIONS_URL));
         if (result == NULL) {
-            return send_response(connection, "Failed to find pet by ID", MHD_HTTP_NOT_FOUND);
+            return send_response(connection, "Operation not found", MHD_HTTP_NOT_FOUND);
         }
         int ret = send_response(connection, result, MHD_HTTP_OK);
         free(result);
@@ -181,30 +669,27 @@ static enum MHD_Result request_handler(void* cls,
     }
     // User methods POST /v2/user
     else if (strcmp(url, "/v2/user") == 0 && strcmp(method, "POST") == 0) {
-        if (*upload_data_size != 0) {
-            // Accumulate the uploaded data
-            char* data = (char*)*con_cls;
-            size_t current_length = data ? strlen(data) : 0;
-            data = realloc(data, current_length + *upload_data_size + 1);
-            if (data == NULL) {
-                return MHD_NO;
-            }
-            memcpy(data + current_length, upload_data, *upload_data_size);
-            data[current_length + *upload_data_size] = '\0';
-            *con_cls = data;
-            *upload_data_size = 0;
-            return MHD_YES;
+        if (!minify_body(ctx)) {
+            return send_response(connection, "Invalid JSON", MHD_HTTP_BAD_REQUEST);
         }
-        else {
-            // Process the accumulated data
-            char* data = (char*)*con_cls;
-            if (handle_create_user(data) != 0) {
-                free(data);
-                return send_response(connection, "Failed to create user", MHD_HTTP_INTERNAL_SERVER_ERROR);
-            }
-            free(data);
-            return send_response(connection, "User created successfully", MHD_HTTP_OK);
+        if (handle_create_user(ctx->data) != 0) {
+            return send_response(connection, "Failed to create user", MHD_HTTP_INTERNAL_SERVER_ERROR);
         }
+        return send_response(connection, "User created successfully", MHD_HTTP_OK);
+    }
+    // User methods POST /v2/user/createWithList and /v2/user/createWithArray
+    else if ((strcmp(url, "/v2/user/createWithList") == 0 || strcmp(url, "/v2/user/createWithArray") == 0) && strcmp(method, "POST") == 0) {
+        if (!minify_body(ctx)) {
+            return send_response(connection, "Invalid JSON", MHD_HTTP_BAD_REQUEST);
+        }
+        bool complete;
+        char* result = handle_create_users_with_list(ctx->data, &complete);
+        if (result == NULL) {
+            return send_response(connection, "Failed to create users", MHD_HTTP_INTERNAL_SERVER_ERROR);
+        }
+        int ret = send_response(connection, result, complete ? MHD_HTTP_OK : MHD_HTTP_BAD_REQUEST);
+        free(result);
+        return ret;
     }
     // User methods GET /v2/user/{username}
     else if (strncmp(url, "/v2/user/", 9) == 0 && strcmp(method, "GET") == 0) {
@@ -237,30 +722,13 @@ static enum MHD_Result request_handler(void* cls,
     }
     // User methods POST /v2/user/login
     else if (strcmp(url, "/v2/user/login") == 0 && strcmp(method, "POST") == 0) {
-        if (*upload_data_size != 0) {
-            // Accumulate the uploaded data
-            char* data = (char*)*con_cls;
-            size_t current_length = data ? strlen(data) : 0;
-            data = realloc(data, current_length + *upload_data_size + 1);
-            if (data == NULL) {
-                return MHD_NO;
-            }
-            memcpy(data + current_length, upload_data, *upload_data_size);
-            data[current_length + *upload_data_size] = '\0';
-            *con_cls = data;
-            *upload_data_size = 0;
-            return MHD_YES;
+        if (!minify_body(ctx)) {
+            return send_response(connection, "Invalid JSON", MHD_HTTP_BAD_REQUEST);
         }
-        else {
-            // Process the accumulated data
-            char* data = (char*)*con_cls;
-            if (handle_post_user_login(data) != 0) {
-                free(data);
-                return send_response(connection, "Failed to login user", MHD_HTTP_INTERNAL_SERVER_ERROR);
-            }
-            free(data);
-            return send_response(connection, "User logged in successfully", MHD_HTTP_OK);
+        if (handle_post_user_login(ctx->data) != 0) {
+            return send_response(connection, "Failed to login user", MHD_HTTP_INTERNAL_SERVER_ERROR);
         }
+        return send_response(connection, "User logged in successfully", MHD_HTTP_OK);
     }
     // User methods GET /v2/user/logout
     else if (strcmp(url, "/v2/user/logout") == 0 && strcmp(method, "POST") == 0) {
@@ -274,6 +742,17 @@ static enum MHD_Result request_handler(void* cls,
         return ret;
     }
 
+    // Handle GET /v2/metrics
+    else if (strcmp(url, "/v2/metrics") == 0 && strcmp(method, "GET") == 0) {
+        char* result = handle_get_metrics();
+        if (result == NULL) {
+            return send_response(connection, "Failed to get metrics", MHD_HTTP_INTERNAL_SERVER_ERROR);
+        }
+        int ret = send_response(connection, result, MHD_HTTP_OK);
+        free(result);
+        return ret;
+    }
+
     // If no route matches, return 404
     return send_response(connection, "Not found", MHD_HTTP_NOT_FOUND);
 }
@@ -311,31 +790,283 @@ int main() {
     // Log db_uri
     LOG_INFO("redisURI: %s", db_uri);
 
+    // Serve the cJSON allocations of each request from a per-thread arena unless disabled
+    const char* arena_size = getenv("requestArenaSize");
+    size_t request_arena_size = arena_size ? strtoul(arena_size, NULL, 10) : REQUEST_ARENA_DEFAULT_SIZE;
+    if (request_arena_size != 0 && arena_init(request_arena_size) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to initialize the request arena");
+        return 1;
+    }
+
+    LOG_INFO("JSON body minifier: %s", json_minify_isa());
+
+    // Compress responses from compressMinSize bytes, caching bodies with an ETag
+    const char* compress_min_size = getenv("compressMinSize");
+    const char* compress_cache_size = getenv("compressCacheSize");
+    if (compress_init(compress_min_size ? strtoul(compress_min_size, NULL, 10) : COMPRESS_DEFAULT_MIN_SIZE,
+            compress_cache_size ? strtoul(compress_cache_size, NULL, 10) : COMPRESS_DEFAULT_CACHE_BYTES) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to initialize response compression");
+        return 1;
+    }
+
+    // Share a cache of pet documents between the workers if a size is given; it is mapped
+    // before the fork so that every worker inherits it
+    const char* shared_cache_size = getenv("sharedCacheSize");
+    if (shared_cache_size != NULL && strtoul(shared_cache_size, NULL, 10) > 0) {
+        const char* slot_size = getenv("sharedCacheSlotSize");
+        const char* ttl_ms = getenv("sharedCacheTtlMs");
+        if (shm_cache_init(strtoul(shared_cache_size, NULL, 10),
+                slot_size ? strtoul(slot_size, NULL, 10) : SHARED_CACHE_DEFAULT_SLOT_SIZE,
+                ttl_ms ? (unsigned int)strtoul(ttl_ms, NULL, 10) : SHARED_CACHE_DEFAULT_TTL_MS) != EXIT_SUCCESS) {
+            LOG_ERROR("Failed to initialize the shared cache");
+            compress_cleanup();
+            return 1;
+        }
+    }
+
+    const char* pipeline_size = getenv("bulkPipelineSize");
+    if (pipeline_size != NULL && strtoul(pipeline_size, NULL, 10) > 0) {
+        bulk_pipeline_size = strtoul(pipeline_size, NULL, 10);
+    }
+
+    // Fork shared-nothing worker processes if requested; each one goes on with its own
+    // capture file, Redis connection and HTTP daemon, bound with SO_REUSEPORT
+    const char* workers = getenv("workers");
+    unsigned int worker_count = workers ? (unsigned int)strtoul(workers, NULL, 10) : 0;
+    int worker = -1;
+    const char* pet_filter = getenv("petFilter");
+    if (worker_count > 0 && pet_filter != NULL && strcmp(pet_filter, "1") == 0) {
+        // A worker would answer 404 for the pets created through the others until its next rebuild
+        LOG_ERROR("The pet filter is not supported with workers");
+        compress_cleanup();
+        shm_cache_cleanup();
+        return 1;
+    }
+    if (worker_count > 0) {
+        worker = prefork_run(worker_count);
+        if (worker < 0) {
+            compress_cleanup();
+            shm_cache_cleanup();
+            LOG_WARN("Server is down");
+            return 0;
+        }
+    }
+
+    // Enable traffic capture if a capture file is provided
+    const char* capture_file = getenv("captureFile");
+    if (capture_file != NULL) {
+        const char* sample_rate = getenv("captureSampleRate");
+        const char* max_records = getenv("captureMaxRecords");
+        char worker_capture_file[PATH_MAX];
+        if (worker >= 0) {
+            snprintf(worker_capture_file, sizeof(worker_capture_file), "%s.%d", capture_file, worker);
+            capture_file = worker_capture_file;
+        }
+        if (capture_init(capture_file,
+                sample_rate ? atof(sample_rate) : CAPTURE_DEFAULT_SAMPLE_RATE,
+                max_records ? (unsigned int)atoi(max_records) : CAPTURE_DEFAULT_MAX_RECORDS) != EXIT_SUCCESS) {
+            LOG_ERROR("Failed to initialize traffic capture");
+            compress_cleanup();
+            shm_cache_cleanup();
+            return 1;
+        }
+    }
+
+    // Time out connects and replies, so that a dead Redis does not hold requests
+    const char* connect_timeout_ms = getenv("redisConnectTimeoutMs");
+    const char* command_timeout_ms = getenv("redisCommandTimeoutMs");
+    db_set_timeouts(connect_timeout_ms ? (unsigned int)strtoul(connect_timeout_ms, NULL, 10) : REDIS_DEFAULT_CONNECT_TIMEOUT_MS,
+        command_timeout_ms ? (unsigned int)strtoul(command_timeout_ms, NULL, 10) : REDIS_DEFAULT_COMMAND_TIMEOUT_MS);
+
     // Initialize the database and check for errors
     if (db_init(db_uri) != EXIT_SUCCESS) {
         LOG_ERROR("Failed to initialize the database");
         return 1;
     }
 
+    // Spread the documents over more Redis servers by consistent hashing of their ids
+    const char* shard_uris = getenv("redisShardURIs");
+    if (shard_uris != NULL && shard_uris[0] != '\0' && db_shards_init(shard_uris) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to add the shards");
+        db_cleanup();
+        return 1;
+    }
+
+    // Share the reads of GET requests between read replicas
+    const char* replica_uris = getenv("redisReplicaURIs");
+    if (replica_uris != NULL && replica_uris[0] != '\0' && db_replicas_init(replica_uris) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to add the read replicas");
+        db_cleanup();
+        return 1;
+    }
+
+    // Send the slowest reads of pets by id a second time, and use the first answer
+    const char* hedged_reads = getenv("hedgedReads");
+    if (hedged_reads != NULL && strcmp(hedged_reads, "1") == 0) {
+        const char* percentile = getenv("hedgePercentile");
+        const char* min_delay_us = getenv("hedgeMinDelayUs");
+        const char* max_percent = getenv("hedgeMaxPercent");
+        if (db_hedged_reads_init(percentile ? (unsigned int)strtoul(percentile, NULL, 10) : HEDGE_DEFAULT_PERCENTILE,
+                min_delay_us ? (unsigned int)strtoul(min_delay_us, NULL, 10) : HEDGE_DEFAULT_MIN_DELAY_US,
+                max_percent ? (unsigned int)strtoul(max_percent, NULL, 10) : HEDGE_DEFAULT_MAX_PERCENT) != EXIT_SUCCESS) {
+            LOG_ERROR("Failed to enable the hedged reads");
+            db_cleanup();
+            return 1;
+        }
+    }
+
+    // Reconnect after failures, fail fast while Redis is down and PING it in the background
+    const char* health_check_ms = getenv("redisHealthCheckMs");
+    const char* breaker_failures = getenv("redisBreakerFailures");
+    const char* breaker_open_ms = getenv("redisBreakerOpenMs");
+    const char* breaker_max_open_ms = getenv("redisBreakerMaxOpenMs");
+    if (db_health_init(health_check_ms ? (unsigned int)strtoul(health_check_ms, NULL, 10) : REDIS_DEFAULT_HEALTH_CHECK_MS,
+            breaker_failures ? (unsigned int)strtoul(breaker_failures, NULL, 10) : REDIS_DEFAULT_BREAKER_FAILURES,
+            breaker_open_ms ? (unsigned int)strtoul(breaker_open_ms, NULL, 10) : REDIS_DEFAULT_BREAKER_OPEN_MS,
+            breaker_max_open_ms ? (unsigned int)strtoul(breaker_max_open_ms, NULL, 10) : REDIS_DEFAULT_BREAKER_MAX_OPEN_MS) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to start the Redis health checks");
+        db_cleanup();
+        return 1;
+    }
+
+    // Select the storage layout and encoding of the documents
+    struct db_storage layout = { 0 };
+    const char* bucket_size = getenv("storageBucketSize");
+    if (bucket_size != NULL) {
+        layout.bucket_size = (unsigned int)strtoul(bucket_size, NULL, 10);
+    }
+    const char* storage_format = getenv("storageFormat");
+    if (storage_format != NULL && !doc_format_parse(storage_format, &layout.format)) {
+        LOG_ERROR("Invalid storageFormat %s, expected json or msgpack", storage_format);
+        db_cleanup();
+        return 1;
+    }
+    db_set_storage(&layout);
+
+    // Enable the negative lookup filter of pet ids if requested
+    if (pet_filter != NULL && strcmp(pet_filter, "1") == 0) {
+        const char* capacity = getenv("petFilterCapacity");
+        const char* fp_rate = getenv("petFilterFpRate");
+        const char* rebuild_sec = getenv("petFilterRebuildSec");
+        if (db_pet_filter_init(capacity ? strtoul(capacity, NULL, 10) : PET_FILTER_DEFAULT_CAPACITY,
+                fp_rate ? atof(fp_rate) : PET_FILTER_DEFAULT_FP_RATE,
+                rebuild_sec ? (unsigned int)atoi(rebuild_sec) : PET_FILTER_DEFAULT_REBUILD_SEC) != EXIT_SUCCESS) {
+            LOG_ERROR("Failed to build the pet filter");
+            db_cleanup();
+            return 1;
+        }
+    }
+
+    // Answer requests on a pool of httpThreads threads, each with its own Redis connection
+    const char* http_threads = getenv("httpThreads");
+    unsigned int thread_count = http_threads ? (unsigned int)strtoul(http_threads, NULL, 10) : 0;
+
+    // Coalesce the document reads of concurrent requests onto one shared connection
+    const char* auto_pipeline = getenv("autoPipeline");
+    if (auto_pipeline != NULL && strcmp(auto_pipeline, "1") == 0) {
+        const char* window_us = getenv("autoPipelineWindowUs");
+        if (db_auto_pipeline_init(window_us ? (unsigned int)strtoul(window_us, NULL, 10) : AUTO_PIPELINE_DEFAULT_WINDOW_US) != EXIT_SUCCESS) {
+            LOG_ERROR("Failed to start the auto-pipeline");
+            db_cleanup();
+            return 1;
+        }
+    }
+
+    // Apply the pet writes of concurrent requests in shared pipelines
+    const char* group_commit = getenv("groupCommit");
+    if (group_commit != NULL && strcmp(group_commit, "1") == 0) {
+        const char* max_ops = getenv("groupCommitMaxOps");
+        const char* window_us = getenv("groupCommitWindowUs");
+        if (group_commit_init("pets",
+                max_ops ? strtoul(max_ops, NULL, 10) : GROUP_COMMIT_DEFAULT_MAX_OPS,
+                window_us ? (unsigned int)strtoul(window_us, NULL, 10) : GROUP_COMMIT_DEFAULT_WINDOW_US) != EXIT_SUCCESS) {
+            LOG_ERROR("Failed to start the group commit");
+            db_cleanup();
+            return 1;
+        }
+    }
+
+    // Answer pet writes with 202 Accepted and apply them with the group commit: asyncWrites=prefer
+    // when the request sends Prefer: respond-async, asyncWrites=always for every write
+    const char* async_mode = getenv("asyncWrites");
+    if (async_mode != NULL && (strcmp(async_mode, "prefer") == 0 || strcmp(async_mode, "always") == 0)) {
+        const char* queue_size = getenv("asyncQueueSize");
+        const char* status_size = getenv("asyncStatusSize");
+        const char* queue_full = getenv("asyncQueueFull");
+        if (group_commit_async_init(queue_size ? strtoul(queue_size, NULL, 10) : ASYNC_WRITES_DEFAULT_QUEUE_SIZE,
+                status_size ? strtoul(status_size, NULL, 10) : ASYNC_WRITES_DEFAULT_STATUS_SIZE,
+                queue_full != NULL && strcmp(queue_full, "block") == 0) != EXIT_SUCCESS) {
+            LOG_ERROR("Failed to enable asynchronous writes, which need groupCommit=1");
+            group_commit_cleanup();
+            db_cleanup();
+            return 1;
+        }
+        async_writes = strcmp(async_mode, "always") == 0 ? ASYNC_WRITES_ALWAYS : ASYNC_WRITES_PREFER;
+    }
+
+    // Serve cached reads past their freshness while Redis is down or slower than staleLatencyMs,
+    // and refresh them in the background
+    const char* stale_while_revalidate = getenv("staleWhileRevalidate");
+    if (stale_while_revalidate != NULL && strcmp(stale_while_revalidate, "1") == 0) {
+        const char* pet_ms = getenv("stalePetMs");
+        const char* find_by_status_ms = getenv("staleFindByStatusMs");
+        const char* find_by_tags_ms = getenv("staleFindByTagsMs");
+        const char* latency_ms = getenv("staleLatencyMs");
+        const char* cache_size = getenv("staleCacheSize");
+        if (stale_cache_init(cache_size ? strtoul(cache_size, NULL, 10) : STALE_DEFAULT_CACHE_BYTES) != EXIT_SUCCESS) {
+            LOG_ERROR("Failed to start stale-while-revalidate");
+            group_commit_cleanup();
+            db_cleanup();
+            return 1;
+        }
+        stale_pet_ms = pet_ms ? (unsigned int)strtoul(pet_ms, NULL, 10) : STALE_DEFAULT_PET_MS;
+        stale_find_by_status_ms = find_by_status_ms ? (unsigned int)strtoul(find_by_status_ms, NULL, 10) : STALE_DEFAULT_FIND_BY_STATUS_MS;
+        stale_find_by_tags_ms = find_by_tags_ms ? (unsigned int)strtoul(find_by_tags_ms, NULL, 10) : STALE_DEFAULT_FIND_BY_TAGS_MS;
+        db_set_slow_threshold(latency_ms ? (unsigned int)strtoul(latency_ms, NULL, 10) : STALE_DEFAULT_LATENCY_MS);
+    }
+
     memset(&loopback_addr, 0, sizeof(loopback_addr));
     loopback_addr.sin_family = AF_INET;
     loopback_addr.sin_port = htons(listen_port);
     loopback_addr.sin_addr.s_addr = inet_addr(ipAddr);
 
-    // Start the HTTP server
-    daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD,
-        listen_port,
-        NULL,
-        NULL,
-        &request_handler,
-        NULL,
-        MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)120,
-        MHD_OPTION_SOCK_ADDR, (struct sockaddr*)(&loopback_addr),
-        MHD_OPTION_END);
+    // Start the HTTP server; workers share the listening address with SO_REUSEPORT
+    if (worker >= 0) {
+        daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD,
+            listen_port,
+            NULL,
+            NULL,
+            &request_handler,
+            NULL,
+            MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)120,
+            MHD_OPTION_THREAD_POOL_SIZE, thread_count,
+            MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+            MHD_OPTION_SOCK_ADDR, (struct sockaddr*)(&loopback_addr),
+            MHD_OPTION_LISTENING_ADDRESS_REUSE, (unsigned int)1,
+            MHD_OPTION_END);
+    }
+    else {
+        daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD,
+            listen_port,
+            NULL,
+            NULL,
+            &request_handler,
+            NULL,
+            MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)120,
+            MHD_OPTION_THREAD_POOL_SIZE, thread_count,
+            MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+            MHD_OPTION_SOCK_ADDR, (struct sockaddr*)(&loopback_addr),
+            MHD_OPTION_END);
+    }
 
     if (NULL == daemon) {
         LOG_ERROR("Failed to start HTTP server");
+        stale_cache_cleanup();
+        group_commit_cleanup();
         db_cleanup();
+        capture_cleanup();
+        compress_cleanup();
+        shm_cache_cleanup();
         return 1;
     }
     LOG_INFO("Server is running on http://%s:%d", ipAddr, listen_port);
@@ -351,8 +1082,13 @@ int main() {
 
     MHD_stop_daemon(daemon);
 
-    // Cleanup the database connection
+    // Cleanup the database connection, once the queued writes are applied
+    stale_cache_cleanup();
+    group_commit_cleanup();
     db_cleanup();
+    capture_cleanup();
+    compress_cleanup();
+    shm_cache_cleanup();
 
     LOG_WARN("Server is down");
 
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "database.h" // Include Redis database functions
+#include "log-utils.h" // Include the log utils header
+
+#define MIGRATE_MAX_COLLECTIONS 8
+#define MIGRATE_DEFAULT_URI "redis://:@127.0.0.1:6379"
+
+static void usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [-f bucket_size] [-t bucket_size] [-e format] [-c collection]... [-v] [redisURI]\n"
+        "  -f bucket_size  Layout the documents are stored in (default 0: one key per document)\n"
+        "  -t bucket_size  Layout to move the documents to (default 0: one key per document)\n"
+        "  -e format       Encoding to rewrite the documents in, json or msgpack (default json)\n"
+        "  -c collection   Collection to migrate, may be repeated (default: pets and users)\n"
+        "  -v              Keep the database log output on stdout\n"
+        "The redisURI defaults to the redisURI environment variable, then %s\n"
+        "The shards listed in the redisShardURIs environment variable are migrated as well\n",
+        program, MIGRATE_DEFAULT_URI);
+}
+
+/**
+ * @brief Moves the stored documents between storage layouts and encodings.
+ *
+ * Documents are read in whatever encoding they are stored in and rewritten in the target one.
+ * Stop the servers (or at least the writes) while migrating, then restart them with the
+ * storageBucketSize and storageFormat matching the target layout.
+ *
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int main(int argc, char** argv) {
+    struct db_storage from = { 0 };
+    struct db_storage to = { 0 };
+    int verbose = 0;
+    const char* collections[MIGRATE_MAX_COLLECTIONS];
+    int collection_count = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t:e:c:vh")) != -1) {
+        switch (opt) {
+        case 'f': from.bucket_size = (unsigned int)atoi(optarg); break;
+        case 't': to.bucket_size = (unsigned int)atoi(optarg); break;
+        case 'e':
+            if (!doc_format_parse(optarg, &to.format)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (collection_count == MIGRATE_MAX_COLLECTIONS) {
+                usage(argv[0]);
+                return 1;
+            }
+            collections[collection_count++] = optarg;
+            break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (collection_count == 0) {
+        collections[collection_count++] = "pets";
+        collections[collection_count++] = "users";
+    }
+
+    const char* redis_uri = optind < argc ? argv[optind] : getenv("redisURI");
+    if (redis_uri == NULL) {
+        redis_uri = MIGRATE_DEFAULT_URI;
+    }
+    if (db_init(redis_uri) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to initialize the database");
+        return 1;
+    }
+    // Every shard migrates its own documents
+    const char* shard_uris = getenv("redisShardURIs");
+    if (shard_uris != NULL && shard_uris[0] != '\0' && db_shards_init(shard_uris) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to add the shards");
+        db_cleanup();
+        return 1;
+    }
+
+    if (!verbose && freopen("/dev/null", "w", stdout) == NULL) {
+        LOG_WARN("Failed to silence stdout");
+    }
+
+    int status = 0;
+    long long memory_before = db_used_memory();
+    for (int i = 0; i < collection_count; i++) {
+        size_t migrated = 0;
+        bool success = db_migrate_storage(collections[i], &from, &to, &migrated);
+        fprintf(stderr, "%s: %zu documents moved from bucket size %u to bucket size %u, %s encoding%s\n",
+            collections[i], migrated, from.bucket_size, to.bucket_size, doc_format_name(to.format), success ? "" : " (failed)");
+        if (!success) {
+            status = 1;
+            break;
+        }
+    }
+    long long memory_after = db_used_memory();
+    if (memory_before >= 0 && memory_after >= 0) {
+        fprintf(stderr, "used_memory: %lld -> %lld bytes\n", memory_before, memory_after);
+    }
+
+    db_cleanup();
+    return status;
+}
@@ -0,0 +1,612 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "model.h"
+
+#define MODEL_MAX_DEPTH 64
+#define MODEL_MAX_NUMBER 32
+
+#define KEY_IS(key, key_len, name) ((key_len) == sizeof(name) - 1 && memcmp((key), (name), (key_len)) == 0)
+
+/**
+ * Single pass reader over the JSON text of one document. Unescaped strings are copied
+ * into the strings buffer, which is as large as the text: unescaping never makes a
+ * string longer than its quoted form, so it cannot overflow.
+ */
+struct model_reader {
+    const char* p;
+    const char* end;
+    char* strings;
+    size_t strings_len;
+};
+
+static void skip_whitespace(struct model_reader* r) {
+    while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r')) {
+        r->p++;
+    }
+}
+
+static bool read_literal(struct model_reader* r, const char* word) {
+    size_t len = strlen(word);
+    if ((size_t)(r->end - r->p) < len || memcmp(r->p, word, len) != 0) {
+        return false;
+    }
+    r->p += len;
+    return true;
+}
+
+// Reads a string or null (*value set to NULL)
+static bool read_string(struct model_reader* r, const char** value) {
+    skip_whitespace(r);
+    if (r->p < r->end && *r->p == 'n') {
+        *value = NULL;
+        return read_literal(r, "null");
+    }
+    if (r->p >= r->end || *r->p != '"') {
+        return false;
+    }
+    char* dst = r->strings + r->strings_len;
+    size_t len;
+    if (!doc_json_unescape(&r->p, r->end, dst, &len)) {
+        return false;
+    }
+    dst[len] = '\0';
+    r->strings_len += len + 1;
+    *value = dst;
+    return true;
+}
+
+// Reads an integer or null (*present set to false)
+static bool read_integer(struct model_reader* r, bool* present, long long* value) {
+    skip_whitespace(r);
+    if (r->p < r->end && *r->p == 'n') {
+        *present = false;
+        return read_literal(r, "null");
+    }
+
+    char number[MODEL_MAX_NUMBER];
+    size_t len = 0;
+    if (r->p < r->end && *r->p == '-') {
+        number[len++] = *r->p++;
+    }
+    while (r->p < r->end && *r->p >= '0' && *r->p <= '9' && len < sizeof(number) - 1) {
+        number[len++] = *r->p++;
+    }
+    number[len] = '\0';
+    if (len == 0 || number[len - 1] == '-') {
+        return false;
+    }
+    // Fractions, exponents and out of range values are not integers of the model
+    if (r->p < r->end && ((*r->p >= '0' && *r->p <= '9') || *r->p == '.' || *r->p == 'e' || *r->p == 'E')) {
+        return false;
+    }
+    errno = 0;
+    *value = strtoll(number, NULL, 10);
+    *present = true;
+    return errno == 0;
+}
+
+// Skips a value of any type, checking its syntax
+static bool skip_value(struct model_reader* r, int depth) {
+    if (depth > MODEL_MAX_DEPTH) {
+        return false;
+    }
+    skip_whitespace(r);
+    if (r->p >= r->end) {
+        return false;
+    }
+    switch (*r->p) {
+    case '"': {
+        // Unescaped into the strings buffer and dropped
+        const char* ignored;
+        size_t mark = r->strings_len;
+        bool success = read_string(r, &ignored);
+        r->strings_len = mark;
+        return success;
+    }
+    case '{':
+    case '[': {
+        char close = *r->p == '{' ? '}' : ']';
+        r->p++;
+        skip_whitespace(r);
+        if (r->p < r->end && *r->p == close) {
+            r->p++;
+            return true;
+        }
+        for (;;) {
+            if (close == '}') {
+                if (!skip_value(r, depth + 1)) {
+                    return false;
+                }
+                skip_whitespace(r);
+                if (r->p >= r->end || *r->p != ':') {
+                    return false;
+                }
+                r->p++;
+            }
+            if (!skip_value(r, depth + 1)) {
+                return false;
+            }
+            skip_whitespace(r);
+            if (r->p < r->end && *r->p == ',') {
+                r->p++;
+                continue;
+            }
+            if (r->p < r->end && *r->p == close) {
+                r->p++;
+                return true;
+            }
+            return false;
+        }
+    }
+    case 't': return read_literal(r, "true");
+    case 'f': return read_literal(r, "false");
+    case 'n': return read_literal(r, "null");
+    default: {
+        const char* start = r->p;
+        while (r->p < r->end && strchr("+-0123456789.eE", *r->p) != NULL) {
+            r->p++;
+        }
+        return r->p > start;
+    }
+    }
+}
+
+// Starts reading an object; null sets *present to false
+static bool begin_object(struct model_reader* r, bool* present) {
+    skip_whitespace(r);
+    if (r->p < r->end && *r->p == 'n') {
+        *present = false;
+        return read_literal(r, "null");
+    }
+    if (r->p >= r->end || *r->p != '{') {
+        return false;
+    }
+    r->p++;
+    *present = true;
+    return true;
+}
+
+/**
+ * @brief Helper function to move to the next member of the object being read
+ *
+ * Keys are matched as written; a key spelled with escape sequences is treated as unknown.
+ *
+ * @return int 1 with the key of the next member, 0 after the closing brace, -1 on error
+ */
+static int next_member(struct model_reader* r, bool* first, const char** key, size_t* key_len) {
+    skip_whitespace(r);
+    if (*first) {
+        *first = false;
+        if (r->p < r->end && *r->p == '}') {
+            r->p++;
+            return 0;
+        }
+    }
+    else if (r->p < r->end && *r->p == ',') {
+        r->p++;
+        skip_whitespace(r);
+    }
+    else if (r->p < r->end && *r->p == '}') {
+        r->p++;
+        return 0;
+    }
+    else {
+        return -1;
+    }
+
+    if (r->p >= r->end || *r->p != '"') {
+        return -1;
+    }
+    const char* start = ++r->p;
+    while (r->p < r->end && *r->p != '"') {
+        if (*r->p == '\\' && r->p + 1 < r->end) {
+            r->p++;
+        }
+        r->p++;
+    }
+    if (r->p >= r->end) {
+        return -1;
+    }
+    *key = start;
+    *key_len = (size_t)(r->p - start);
+    r->p++;
+    skip_whitespace(r);
+    if (r->p >= r->end || *r->p != ':') {
+        return -1;
+    }
+    r->p++;
+    return 1;
+}
+
+// Same as next_member for the elements of an array, leaving the reader at the next element
+static int next_element(struct model_reader* r, bool* first) {
+    skip_whitespace(r);
+    if (*first) {
+        *first = false;
+        if (r->p < r->end && *r->p == ']') {
+            r->p++;
+            return 0;
+        }
+        return 1;
+    }
+    if (r->p < r->end && *r->p == ',') {
+        r->p++;
+        return 1;
+    }
+    if (r->p < r->end && *r->p == ']') {
+        r->p++;
+        return 0;
+    }
+    return -1;
+}
+
+static bool begin_array(struct model_reader* r, bool* present) {
+    skip_whitespace(r);
+    if (r->p < r->end && *r->p == 'n') {
+        *present = false;
+        return read_literal(r, "null");
+    }
+    if (r->p >= r->end || *r->p != '[') {
+        return false;
+    }
+    r->p++;
+    *present = true;
+    return true;
+}
+
+// Grows an array whose capacity is the smallest power of two, at least 4, above count
+static bool grow_array(void** items, size_t count, size_t size) {
+    if (count != 0 && (count < 4 || (count & (count - 1)) != 0)) {
+        return true;
+    }
+    void* grown = realloc(*items, (count == 0 ? 4 : count * 2) * size);
+    if (grown == NULL) {
+        return false;
+    }
+    *items = grown;
+    return true;
+}
+
+static bool at_end(struct model_reader* r) {
+    skip_whitespace(r);
+    return r->p == r->end;
+}
+
+/* ---------------------------------------------------------------------------
+ * Pet
+ * ------------------------------------------------------------------------ */
+
+static bool read_category(struct model_reader* r, struct pet* pet) {
+    if (!begin_object(r, &pet->has_category)) {
+        return false;
+    }
+    if (!pet->has_category) {
+        return true;
+    }
+    bool first = true;
+    const char* key;
+    size_t key_len;
+    int more;
+    while ((more = next_member(r, &first, &key, &key_len)) == 1) {
+        bool success;
+        if (KEY_IS(key, key_len, "id")) {
+            success = read_integer(r, &pet->has_category_id, &pet->category_id);
+        }
+        else if (KEY_IS(key, key_len, "name")) {
+            success = read_string(r, &pet->category_name);
+        }
+        else {
+            success = skip_value(r, 0);
+        }
+        if (!success) {
+            return false;
+        }
+    }
+    return more == 0;
+}
+
+static bool read_photo_urls(struct model_reader* r, struct pet* pet) {
+    if (!begin_array(r, &pet->has_photo_urls)) {
+        return false;
+    }
+    if (!pet->has_photo_urls) {
+        return true;
+    }
+    bool first = true;
+    int more;
+    while ((more = next_element(r, &first)) == 1) {
+        const char* url;
+        if (!read_string(r, &url) || url == NULL ||
+            !grow_array((void**)&pet->photo_urls, pet->photo_url_count, sizeof(const char*))) {
+            return false;
+        }
+        pet->photo_urls[pet->photo_url_count++] = url;
+    }
+    return more == 0;
+}
+
+static bool read_tags(struct model_reader* r, struct pet* pet) {
+    if (!begin_array(r, &pet->has_tags)) {
+        return false;
+    }
+    if (!pet->has_tags) {
+        return true;
+    }
+    bool first = true;
+    int more;
+    while ((more = next_element(r, &first)) == 1) {
+        bool present;
+        if (!begin_object(r, &present) || !present ||
+            !grow_array((void**)&pet->tags, pet->tag_count, sizeof(struct pet_tag))) {
+            return false;
+        }
+        struct pet_tag* tag = &pet->tags[pet->tag_count++];
+        memset(tag, 0, sizeof(*tag));
+
+        bool first_member = true;
+        const char* key;
+        size_t key_len;
+        int member;
+        while ((member = next_member(r, &first_member, &key, &key_len)) == 1) {
+            bool success;
+            if (KEY_IS(key, key_len, "id")) {
+                success = read_integer(r, &tag->has_id, &tag->id);
+            }
+            else if (KEY_IS(key, key_len, "name")) {
+                success = read_string(r, &tag->name);
+            }
+            else {
+                success = skip_value(r, 0);
+            }
+            if (!success) {
+                return false;
+            }
+        }
+        if (member != 0) {
+            return false;
+        }
+    }
+    return more == 0;
+}
+
+static bool read_pet(struct model_reader* r, struct pet* pet) {
+    bool present;
+    if (!begin_object(r, &present) || !present) {
+        return false;
+    }
+    bool first = true;
+    const char* key;
+    size_t key_len;
+    int more;
+    while ((more = next_member(r, &first, &key, &key_len)) == 1) {
+        bool success;
+        if (KEY_IS(key, key_len, "id")) {
+            success = read_integer(r, &pet->has_id, &pet->id);
+        }
+        else if (KEY_IS(key, key_len, "category")) {
+            success = read_category(r, pet);
+        }
+        else if (KEY_IS(key, key_len, "name")) {
+            success = read_string(r, &pet->name);
+        }
+        else if (KEY_IS(key, key_len, "photoUrls")) {
+            success = read_photo_urls(r, pet);
+        }
+        else if (KEY_IS(key, key_len, "tags")) {
+            success = read_tags(r, pet);
+        }
+        else if (KEY_IS(key, key_len, "status")) {
+            success = read_string(r, &pet->status);
+        }
+        else {
+            success = skip_value(r, 0);
+        }
+        if (!success) {
+            return false;
+        }
+    }
+    return more == 0 && at_end(r);
+}
+
+/**
+ * @brief Parse a Pet document
+ *
+ * @param json The JSON text
+ * @param len The length of the JSON text
+ * @param pet The pet to fill
+ * @return true on success, false if the text is not a valid Pet
+ */
+bool pet_parse(const char* json, size_t len, struct pet* pet) {
+    memset(pet, 0, sizeof(*pet));
+    pet->strings = malloc(len + 1);
+    if (pet->strings == NULL) {
+        return false;
+    }
+    struct model_reader reader = { json, json + len, pet->strings, 0 };
+    if (!read_pet(&reader, pet)) {
+        pet_free(pet);
+        return false;
+    }
+    return true;
+}
+
+void pet_free(struct pet* pet) {
+    free(pet->photo_urls);
+    free(pet->tags);
+    free(pet->strings);
+    memset(pet, 0, sizeof(*pet));
+}
+
+/* ---------------------------------------------------------------------------
+ * User
+ * ------------------------------------------------------------------------ */
+
+static bool read_user(struct model_reader* r, struct user* user) {
+    bool present;
+    if (!begin_object(r, &present) || !present) {
+        return false;
+    }
+    bool first = true;
+    const char* key;
+    size_t key_len;
+    int more;
+    while ((more = next_member(r, &first, &key, &key_len)) == 1) {
+        bool success;
+        if (KEY_IS(key, key_len, "id")) {
+            success = read_integer(r, &user->has_id, &user->id);
+        }
+        else if (KEY_IS(key, key_len, "username")) {
+            success = read_string(r, &user->username);
+        }
+        else if (KEY_IS(key, key_len, "firstName")) {
+            success = read_string(r, &user->first_name);
+        }
+        else if (KEY_IS(key, key_len, "lastName")) {
+            success = read_string(r, &user->last_name);
+        }
+        else if (KEY_IS(key, key_len, "email")) {
+            success = read_string(r, &user->email);
+        }
+        else if (KEY_IS(key, key_len, "password")) {
+            success = read_string(r, &user->password);
+        }
+        else if (KEY_IS(key, key_len, "phone")) {
+            success = read_string(r, &user->phone);
+        }
+        else if (KEY_IS(key, key_len, "userStatus")) {
+            success = read_integer(r, &user->has_user_status, &user->user_status);
+        }
+        else {
+            success = skip_value(r, 0);
+        }
+        if (!success) {
+            return false;
+        }
+    }
+    return more == 0 && at_end(r);
+}
+
+/**
+ * @brief Parse a User document
+ *
+ * @param json The JSON text
+ * @param len The length of the JSON text
+ * @param user The user to fill
+ * @return true on success, false if the text is not a valid User
+ */
+bool user_parse(const char* json, size_t len, struct user* user) {
+    memset(user, 0, sizeof(*user));
+    user->strings = malloc(len + 1);
+    if (user->strings == NULL) {
+        return false;
+    }
+    struct model_reader reader = { json, json + len, user->strings, 0 };
+    if (!read_user(&reader, user)) {
+        user_free(user);
+        return false;
+    }
+    return true;
+}
+
+void user_free(struct user* user) {
+    free(user->strings);
+    memset(user, 0, sizeof(*user));
+}
+
+/* ---------------------------------------------------------------------------
+ * Writers
+ * ------------------------------------------------------------------------ */
+
+static bool write_key(struct doc_buffer* out, const char* key, bool* first) {
+    bool success = (*first || doc_buffer_append(out, ",", 1)) &&
+        doc_json_write_string(out, key, strlen(key)) &&
+        doc_buffer_append(out, ":", 1);
+    *first = false;
+    return success;
+}
+
+static bool write_string_field(struct doc_buffer* out, const char* key, const char* value, bool* first) {
+    if (value == NULL) {
+        return true;
+    }
+    return write_key(out, key, first) && doc_json_write_string(out, value, strlen(value));
+}
+
+static bool write_integer_field(struct doc_buffer* out, const char* key, bool present, long long value, bool* first) {
+    if (!present) {
+        return true;
+    }
+    char number[MODEL_MAX_NUMBER];
+    int len = snprintf(number, sizeof(number), "%lld", value);
+    return write_key(out, key, first) && doc_buffer_append(out, number, (size_t)len);
+}
+
+/**
+ * @brief Append the JSON text of a Pet document
+ *
+ * @param pet The pet
+ * @param out The buffer the JSON text is appended to
+ * @return true on success, false if the buffer cannot grow
+ */
+bool pet_write(const struct pet* pet, struct doc_buffer* out) {
+    bool first = true;
+    bool success = doc_buffer_append(out, "{", 1) &&
+        write_integer_field(out, "id", pet->has_id, pet->id, &first);
+
+    if (success && pet->has_category) {
+        bool first_member = true;
+        success = write_key(out, "category", &first) && doc_buffer_append(out, "{", 1) &&
+            write_integer_field(out, "id", pet->has_category_id, pet->category_id, &first_member) &&
+            write_string_field(out, "name", pet->category_name, &first_member) &&
+            doc_buffer_append(out, "}", 1);
+    }
+    success = success && write_string_field(out, "name", pet->name, &first);
+
+    if (success && pet->has_photo_urls) {
+        success = write_key(out, "photoUrls", &first) && doc_buffer_append(out, "[", 1);
+        for (size_t i = 0; success && i < pet->photo_url_count; i++) {
+            success = (i == 0 || doc_buffer_append(out, ",", 1)) &&
+                doc_json_write_string(out, pet->photo_urls[i], strlen(pet->photo_urls[i]));
+        }
+        success = success && doc_buffer_append(out, "]", 1);
+    }
+
+    if (success && pet->has_tags) {
+        success = write_key(out, "tags", &first) && doc_buffer_append(out, "[", 1);
+        for (size_t i = 0; success && i < pet->tag_count; i++) {
+            bool first_member = true;
+            success = (i == 0 || doc_buffer_append(out, ",", 1)) && doc_buffer_append(out, "{", 1) &&
+                write_integer_field(out, "id", pet->tags[i].has_id, pet->tags[i].id, &first_member) &&
+                write_string_field(out, "name", pet->tags[i].name, &first_member) &&
+                doc_buffer_append(out, "}", 1);
+        }
+        success = success && doc_buffer_append(out, "]", 1);
+    }
+
+    return success && write_string_field(out, "status", pet->status, &first) &&
+        doc_buffer_append(out, "}", 1);
+}
+
+/**
+ * @brief Append the JSON text of a User document
+ *
+ * @param user The user
+ * @param out The buffer the JSON text is appended to
+ * @return true on success, false if the buffer cannot grow
+ */
+bool user_write(const struct user* user, struct doc_buffer* out) {
+    bool first = true;
+    return doc_buffer_append(out, "{", 1) &&
+        write_integer_field(out, "id", user->has_id, user->id, &first) &&
+        write_string_field(out, "username", user->username, &first) &&
+        write_string_field(out, "firstName", user->first_name, &first) &&
+        write_string_field(out, "lastName", user->last_name, &first) &&
+        write_string_field(out, "email", user->email, &first) &&
+        write_string_field(out, "password", user->password, &first) &&
+        write_string_field(out, "phone", user->phone, &first) &&
+        write_integer_field(out, "userStatus", user->has_user_status, user->user_status, &first) &&
+        doc_buffer_append(out, "}", 1);
+}
@@ -0,0 +1,101 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "doc-codec.h" // Include the document codec header
+
+/**
+ * Pet and User documents of the petstore OpenAPI model.
+ *
+ * pet_parse and user_parse read JSON text in a single pass straight into these structs,
+ * checking the type of every known field; unknown fields are skipped. pet_write and
+ * user_write print them back without an intermediate tree, in the field order of the
+ * model. String fields point into the strings buffer owned by the struct and are NULL
+ * when the field is absent or null.
+ */
+
+struct pet_tag {
+    bool has_id;
+    long long id;
+    const char* name;
+};
+
+struct pet {
+    bool has_id;
+    long long id;
+    bool has_category;
+    bool has_category_id;
+    long long category_id;
+    const char* category_name;
+    const char* name;
+    bool has_photo_urls;
+    const char** photo_urls;
+    size_t photo_url_count;
+    bool has_tags;
+    struct pet_tag* tags;
+    size_t tag_count;
+    const char* status;
+    char* strings;
+};
+
+struct user {
+    bool has_id;
+    long long id;
+    const char* username;
+    const char* first_name;
+    const char* last_name;
+    const char* email;
+    const char* password;
+    const char* phone;
+    bool has_user_status;
+    long long user_status;
+    char* strings;
+};
+
+/**
+ * @brief Parses a Pet document.
+ *
+ * @param json The JSON text.
+ * @param len The length of the JSON text.
+ * @param pet The pet to fill; release it with pet_free on success.
+ * @return bool Returns false if the text is not valid JSON or a field has the wrong type.
+ */
+bool pet_parse(const char* json, size_t len, struct pet* pet);
+
+/**
+ * @brief Appends the JSON text of a Pet document.
+ *
+ * @return bool Returns false if the buffer cannot grow.
+ */
+bool pet_write(const struct pet* pet, struct doc_buffer* out);
+
+/**
+ * @brief Releases the memory owned by a parsed pet.
+ */
+void pet_free(struct pet* pet);
+
+/**
+ * @brief Parses a User document.
+ *
+ * @param json The JSON text.
+ * @param len The length of the JSON text.
+ * @param user The user to fill; release it with user_free on success.
+ * @return bool Returns false if the text is not valid JSON or a field has the wrong type.
+ */
+bool user_parse(const char* json, size_t len, struct user* user);
+
+/**
+ * @brief Appends the JSON text of a User document.
+ *
+ * @return bool Returns false if the buffer cannot grow.
+ */
+bool user_write(const struct user* user, struct doc_buffer* out);
+
+/**
+ * @brief Releases the memory owned by a parsed user.
+ */
+void user_free(struct user* user);
+
+#endif // MODEL_H
@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "prefork.h"
+#include "log-utils.h" // Include the log utils header
+
+// Workers that exit sooner than this after being started are restarted after a delay
+#define PREFORK_MIN_UPTIME_SEC 1
+
+struct worker {
+    pid_t pid;
+    time_t started;
+};
+
+static volatile sig_atomic_t supervising = 1;
+
+static void handle_supervisor_signal(int signal) {
+    (void)signal; // Mark unused parameter
+    supervising = 0;
+}
+
+/**
+ * @brief Helper function to start a worker process
+ *
+ * @return pid_t 0 in the worker, the pid of the worker in the parent, -1 on failure
+ */
+static pid_t start_worker(struct worker* worker, unsigned int index) {
+    // Log lines still buffered would otherwise be written by both processes
+    fflush(stdout);
+    fflush(stderr);
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOG_ERROR("Failed to fork worker %u: %s", index, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        // Stop with the parent, even if it is killed without running its shutdown
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) {
+            _exit(1);
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        return 0;
+    }
+    worker->pid = pid;
+    worker->started = time(NULL);
+    LOG_INFO("Worker %u started (pid %d)", index, (int)pid);
+    return pid;
+}
+
+/**
+ * @brief Fork the workers and supervise them
+ *
+ * @param workers The number of worker processes
+ * @return int The index of the worker in a worker, -1 in the parent
+ */
+int prefork_run(unsigned int workers) {
+    struct worker* pool = calloc(workers, sizeof(*pool));
+    if (pool == NULL) {
+        LOG_ERROR("Memory allocation failed for the workers");
+        return -1;
+    }
+
+    // No SA_RESTART, so that waitpid returns when a termination signal arrives
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_supervisor_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (unsigned int i = 0; i < workers; i++) {
+        pid_t pid = start_worker(&pool[i], i);
+        if (pid == 0) {
+            free(pool);
+            return (int)i;
+        }
+    }
+
+    while (supervising) {
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        unsigned int index = 0;
+        while (index < workers && pool[index].pid != pid) {
+            index++;
+        }
+        if (index == workers) {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            LOG_ERROR("Worker %u (pid %d) killed by signal %d", index, (int)pid, WTERMSIG(status));
+        }
+        else {
+            LOG_ERROR("Worker %u (pid %d) exited with status %d", index, (int)pid, WEXITSTATUS(status));
+        }
+        pool[index].pid = 0;
+        if (!supervising) {
+            break;
+        }
+
+        // A worker that fails at startup is not restarted in a tight loop
+        if (time(NULL) - pool[index].started < PREFORK_MIN_UPTIME_SEC) {
+            sleep(PREFORK_MIN_UPTIME_SEC);
+        }
+        if (supervising && start_worker(&pool[index], index) == 0) {
+            free(pool);
+            return (int)index;
+        }
+    }
+
+    LOG_WARN("Stopping the workers");
+    for (unsigned int i = 0; i < workers; i++) {
+        if (pool[i].pid > 0) {
+            kill(pool[i].pid, SIGTERM);
+        }
+    }
+    for (unsigned int i = 0; i < workers; i++) {
+        if (pool[i].pid > 0) {
+            while (waitpid(pool[i].pid, NULL, 0) < 0 && errno == EINTR) {
+            }
+        }
+    }
+    free(pool);
+    return -1;
+}
@@ -0,0 +1,25 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+/**
+ * Prefork mode: the server runs as N shared-nothing worker processes.
+ *
+ * Every worker binds the same address with SO_REUSEPORT, so the kernel spreads the incoming
+ * connections across them, and opens its own Redis connection, HTTP daemon and caches. The
+ * parent only supervises: it restarts workers that exit and, on SIGINT or SIGTERM, stops
+ * them all and waits for them. Workers are sent SIGTERM if the parent dies.
+ */
+
+/**
+ * @brief Forks the workers and supervises them.
+ *
+ * Returns in each worker right after the fork, with the index of the worker, so that the
+ * worker goes on initializing the server. Returns in the parent once all the workers have
+ * stopped after a termination signal.
+ *
+ * @param workers The number of worker processes.
+ * @return int The index of the worker (0 to workers - 1) in a worker, -1 in the parent.
+ */
+int prefork_run(unsigned int workers);
+
+#endif // PREFORK_H
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "database.h" // Include Redis database functions
+#include "log-utils.h" // Include the log utils header
+
+#define REBALANCE_DEFAULT_URI "redis://:@127.0.0.1:6379"
+
+static void usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s -f shardURIs [-v] [redisURI]\n"
+        "  -f shardURIs  Comma separated URIs of all the shards the documents are spread over now\n"
+        "  -v            Keep the database log output on stdout\n"
+        "The new shards are the redisURI, which defaults to the redisURI environment variable then %s,\n"
+        "and the redisShardURIs environment variable. The storageBucketSize and storageFormat\n"
+        "environment variables select the layout of the documents, as for the server.\n",
+        program, REBALANCE_DEFAULT_URI);
+}
+
+/**
+ * @brief Moves the stored documents to their shards after shards were added or removed.
+ *
+ * Run it with the environment the servers will be restarted with, and the list of the shards
+ * the documents were spread over until now. Stop the writes while it runs, then restart the
+ * servers with the new redisShardURIs.
+ *
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int main(int argc, char** argv) {
+    const char* from_uris = NULL;
+    int verbose = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:vh")) != -1) {
+        switch (opt) {
+        case 'f': from_uris = optarg; break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (from_uris == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char* redis_uri = optind < argc ? argv[optind] : getenv("redisURI");
+    if (redis_uri == NULL) {
+        redis_uri = REBALANCE_DEFAULT_URI;
+    }
+    if (db_init(redis_uri) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to initialize the database");
+        return 1;
+    }
+    const char* shard_uris = getenv("redisShardURIs");
+    if (shard_uris != NULL && shard_uris[0] != '\0' && db_shards_init(shard_uris) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to add the shards");
+        db_cleanup();
+        return 1;
+    }
+
+    struct db_storage layout = { 0 };
+    const char* bucket_size = getenv("storageBucketSize");
+    if (bucket_size != NULL) {
+        layout.bucket_size = (unsigned int)strtoul(bucket_size, NULL, 10);
+    }
+    const char* storage_format = getenv("storageFormat");
+    if (storage_format != NULL && !doc_format_parse(storage_format, &layout.format)) {
+        LOG_ERROR("Invalid storageFormat %s, expected json or msgpack", storage_format);
+        db_cleanup();
+        return 1;
+    }
+    db_set_storage(&layout);
+
+    if (!verbose && freopen("/dev/null", "w", stdout) == NULL) {
+        LOG_WARN("Failed to silence stdout");
+    }
+
+    int status = 0;
+    size_t moved = 0;
+    bool success = db_rebalance_pets("pets", from_uris, &moved);
+    fprintf(stderr, "pets: %zu documents moved to their shard%s\n", moved, success ? "" : " (failed)");
+    if (success) {
+        success = db_rebalance_users("users", from_uris, &moved);
+        fprintf(stderr, "users: %zu documents moved to their shard%s\n", moved, success ? "" : " (failed)");
+    }
+    if (!success) {
+        status = 1;
+    }
+
+    db_cleanup();
+    return status;
+}
@@ -0,0 +1,394 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <cjson/cJSON.h>
+
+#include "log-utils.h" // Include the log utils header
+
+#define REPLAY_DEFAULT_CONNECTIONS 4
+#define REPLAY_RESPONSE_BUFFER 65536
+
+/**
+ * A captured request, see capture.h for the record format.
+ */
+struct replay_request {
+    long long ts;
+    char* method;
+    char* url;
+    char* body;
+    size_t body_size;
+    int status;
+    double latency_us;
+    double lag_us;
+};
+
+struct replay_state {
+    const char* host;
+    const char* port;
+    double speed;
+    struct replay_request* requests;
+    size_t count;
+    size_t next;
+    double start_us;
+};
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sleep_until(double deadline_us) {
+    double remaining = deadline_us - now_us();
+    if (remaining > 0) {
+        struct timespec ts = { (time_t)(remaining / 1e6), (long)((long long)remaining % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int compare_requests(const void* a, const void* b) {
+    const struct replay_request* x = a;
+    const struct replay_request* y = b;
+    return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static char* dup_string(const cJSON* item) {
+    return strdup(cJSON_IsString(item) ? item->valuestring : "");
+}
+
+/**
+ * @brief Loads a capture file and sorts its records by arrival time.
+ *
+ * @param path The path of the capture file.
+ * @param max The maximum number of records to load (0 for all).
+ * @param count Receives the number of records loaded.
+ * @return struct replay_request* The records, or NULL on failure.
+ */
+static struct replay_request* load_capture(const char* path, size_t max, size_t* count) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        LOG_ERROR("Failed to open capture file %s", path);
+        return NULL;
+    }
+
+    size_t capacity = 1024;
+    struct replay_request* requests = malloc(capacity * sizeof(*requests));
+    char* line = NULL;
+    size_t line_size = 0;
+    *count = 0;
+
+    while (requests && getline(&line, &line_size, file) != -1 && (max == 0 || *count < max)) {
+        cJSON* record = cJSON_Parse(line);
+        if (record == NULL) {
+            continue;
+        }
+        cJSON* ts = cJSON_GetObjectItem(record, "ts");
+        cJSON* method = cJSON_GetObjectItem(record, "method");
+        cJSON* url = cJSON_GetObjectItem(record, "url");
+        if (!cJSON_IsNumber(ts) || !cJSON_IsString(method) || !cJSON_IsString(url)) {
+            cJSON_Delete(record);
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            struct replay_request* grown = realloc(requests, capacity * sizeof(*requests));
+            if (grown == NULL) {
+                cJSON_Delete(record);
+                break;
+            }
+            requests = grown;
+        }
+        struct replay_request* request = &requests[(*count)++];
+        memset(request, 0, sizeof(*request));
+        request->ts = (long long)ts->valuedouble;
+        request->method = dup_string(method);
+        request->url = dup_string(url);
+        request->body = dup_string(cJSON_GetObjectItem(record, "body"));
+        request->body_size = strlen(request->body);
+        cJSON_Delete(record);
+    }
+
+    free(line);
+    fclose(file);
+    if (requests) {
+        qsort(requests, *count, sizeof(*requests), compare_requests);
+    }
+    return requests;
+}
+
+static int connect_server(const char* host, const char* port) {
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* addr = result; addr; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+static int send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends one request on a keep-alive connection and reads the whole response.
+ *
+ * @return int The HTTP status code, or -1 on a connection error.
+ */
+static int send_request(int fd, const char* host, const struct replay_request* request, char* buffer, int* keep_alive) {
+    char header[1024];
+    int header_size = snprintf(header, sizeof(header),
+        "%s %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
+        request->method, request->url, host, request->body_size);
+    if (header_size <= 0 || (size_t)header_size >= sizeof(header) ||
+        send_all(fd, header, (size_t)header_size) != 0 ||
+        send_all(fd, request->body, request->body_size) != 0) {
+        return -1;
+    }
+
+    // Read until the end of the headers
+    size_t received = 0;
+    char* body = NULL;
+    while (body == NULL) {
+        if (received == REPLAY_RESPONSE_BUFFER - 1) {
+            return -1;
+        }
+        ssize_t n = recv(fd, buffer + received, REPLAY_RESPONSE_BUFFER - 1 - received, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        received += (size_t)n;
+        buffer[received] = '\0';
+        body = strstr(buffer, "\r\n\r\n");
+    }
+    body += 4;
+
+    int status = 0;
+    if (sscanf(buffer, "HTTP/%*d.%*d %d", &status) != 1) {
+        return -1;
+    }
+
+    size_t content_length = 0;
+    *keep_alive = 1;
+    for (char* line = strstr(buffer, "\r\n"); line && line + 2 < body; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            content_length = strtoul(line + 17, NULL, 10);
+        }
+        else if (strncasecmp(line + 2, "Connection: close", 17) == 0) {
+            *keep_alive = 0;
+        }
+    }
+
+    // Drain the rest of the body
+    size_t body_received = received - (size_t)(body - buffer);
+    while (body_received < content_length) {
+        size_t wanted = content_length - body_received;
+        ssize_t n = recv(fd, buffer, wanted < REPLAY_RESPONSE_BUFFER ? wanted : REPLAY_RESPONSE_BUFFER, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        body_received += (size_t)n;
+    }
+    return status;
+}
+
+static void* replay_worker(void* arg) {
+    struct replay_state* state = arg;
+    char* buffer = malloc(REPLAY_RESPONSE_BUFFER);
+    int fd = -1;
+
+    while (buffer) {
+        size_t index = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+        if (index >= state->count) {
+            break;
+        }
+        struct replay_request* request = &state->requests[index];
+
+        // Requests are scheduled at their recorded offset, divided by the speed factor
+        double scheduled = state->start_us;
+        if (state->speed > 0) {
+            scheduled += (request->ts - state->requests[0].ts) / state->speed;
+            sleep_until(scheduled);
+        }
+
+        double start = now_us();
+        request->lag_us = state->speed > 0 ? start - scheduled : 0;
+        int keep_alive = 1;
+        request->status = -1;
+        for (int attempt = 0; attempt < 2 && request->status < 0; attempt++) {
+            if (fd < 0) {
+                fd = connect_server(state->host, state->port);
+            }
+            if (fd >= 0) {
+                request->status = send_request(fd, state->host, request, buffer, &keep_alive);
+            }
+            if (request->status < 0 || !keep_alive) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                fd = -1;
+            }
+        }
+        request->latency_us = now_us() - start;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void report(const struct replay_state* state, double elapsed_us) {
+    size_t classes[6] = { 0 };
+    double* latencies = malloc(state->count * sizeof(double));
+    double total = 0;
+    double max_lag = 0;
+    for (size_t i = 0; i < state->count; i++) {
+        const struct replay_request* request = &state->requests[i];
+        int status_class = request->status < 0 ? 0 : request->status / 100;
+        classes[status_class >= 1 && status_class <= 5 ? status_class : 0]++;
+        if (latencies) {
+            latencies[i] = request->latency_us;
+        }
+        total += request->latency_us;
+        if (request->lag_us > max_lag) {
+            max_lag = request->lag_us;
+        }
+    }
+
+    fprintf(stdout, "requests: %zu in %.3f s (%.1f req/s)\n", state->count, elapsed_us / 1e6, state->count / (elapsed_us / 1e6));
+    fprintf(stdout, "status: 2xx=%zu 3xx=%zu 4xx=%zu 5xx=%zu errors=%zu\n", classes[2], classes[3], classes[4], classes[5], classes[0] + classes[1]);
+    if (latencies && state->count > 0) {
+        qsort(latencies, state->count, sizeof(double), compare_double);
+        fprintf(stdout, "latency: mean=%.1f us p50=%.1f us p99=%.1f us max=%.1f us\n",
+            total / state->count, latencies[state->count / 2], latencies[(size_t)(state->count * 0.99)], latencies[state->count - 1]);
+    }
+    if (state->speed > 0) {
+        fprintf(stdout, "max schedule lag: %.1f us\n", max_lag);
+    }
+    free(latencies);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [-s speed] [-c connections] [-n max] capture.jsonl [host:port]\n"
+        "  -s speed        Playback speed: 1 replays at the recorded rate, 2 twice as fast, 0 as fast as possible (default 1)\n"
+        "  -c connections  Number of concurrent keep-alive connections (default %d)\n"
+        "  -n max          Replay at most max requests\n"
+        "  host:port       Target server (default localhost:8080)\n",
+        program, REPLAY_DEFAULT_CONNECTIONS);
+}
+
+/**
+ * @brief Replays a capture written by the server's capture mode against a server.
+ *
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int main(int argc, char** argv) {
+    struct replay_state state;
+    memset(&state, 0, sizeof(state));
+    state.speed = 1;
+    int connections = REPLAY_DEFAULT_CONNECTIONS;
+    size_t max = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:n:h")) != -1) {
+        switch (opt) {
+        case 's': state.speed = atof(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 'n': max = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || connections <= 0 || state.speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char target[256];
+    snprintf(target, sizeof(target), "%s", optind + 1 < argc ? argv[optind + 1] : "localhost:8080");
+    char* colon = strrchr(target, ':');
+    if (colon == NULL) {
+        LOG_ERROR("Invalid target format. Expected format: host:port");
+        return 1;
+    }
+    *colon = '\0';
+    state.host = target;
+    state.port = colon + 1;
+
+    state.requests = load_capture(argv[optind], max, &state.count);
+    if (state.requests == NULL) {
+        return 1;
+    }
+    if (state.count == 0) {
+        LOG_WARN("No requests found in %s", argv[optind]);
+        free(state.requests);
+        return 0;
+    }
+
+    pthread_t* threads = calloc((size_t)connections, sizeof(pthread_t));
+    if (threads == NULL) {
+        free(state.requests);
+        return 1;
+    }
+    state.start_us = now_us();
+    for (int i = 0; i < connections; i++) {
+        pthread_create(&threads[i], NULL, replay_worker, &state);
+    }
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report(&state, now_us() - state.start_us);
+
+    for (size_t i = 0; i < state.count; i++) {
+        free(state.requests[i].method);
+        free(state.requests[i].url);
+        free(state.requests[i].body);
+    }
+    free(state.requests);
+    free(threads);
+    return 0;
+}
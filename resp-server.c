@@ -0,0 +1,1100 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "resp-server.h"
+#include "log-utils.h" // Include the log utils header
+
+#define RS_MAX_ARGS 4096
+#define RS_READ_CHUNK 16384
+#define RS_SCAN_DEFAULT_COUNT 10
+
+enum rs_type { RS_STRING, RS_SET, RS_HASH };
+
+struct rs_dict;
+
+struct rs_entry {
+    char* key;
+    size_t klen;
+    int type;
+    char* val;
+    size_t vlen;
+    struct rs_dict* set;
+    struct rs_entry* next;
+};
+
+struct rs_dict {
+    struct rs_entry** buckets;
+    size_t nbuckets;
+    size_t used;
+};
+
+struct rs_buf {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+struct rs_client {
+    int fd;
+    int proto;
+    volatile int done;
+    pthread_t thread;
+    struct resp_server* server;
+    struct rs_client* next;
+};
+
+struct resp_server {
+    int listen_fd;
+    int port;
+    char* unix_path;
+    volatile int running;
+    volatile unsigned int latency_us;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct rs_dict* db;
+    struct rs_client* clients;
+    unsigned long long errors; // Error replies sent, guarded by lock
+};
+
+/* ---------------------------------------------------------------------------
+ * Dictionary
+ * ------------------------------------------------------------------------ */
+
+static size_t rs_hash(const char* key, size_t len) {
+    size_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static struct rs_dict* rs_dict_create(void) {
+    struct rs_dict* dict = calloc(1, sizeof(*dict));
+    if (dict == NULL) {
+        return NULL;
+    }
+    dict->nbuckets = 16;
+    dict->buckets = calloc(dict->nbuckets, sizeof(struct rs_entry*));
+    if (dict->buckets == NULL) {
+        free(dict);
+        return NULL;
+    }
+    return dict;
+}
+
+static void rs_dict_free(struct rs_dict* dict);
+
+static void rs_entry_free(struct rs_entry* entry) {
+    free(entry->key);
+    free(entry->val);
+    if (entry->set) {
+        rs_dict_free(entry->set);
+    }
+    free(entry);
+}
+
+static void rs_dict_clear(struct rs_dict* dict) {
+    for (size_t i = 0; i < dict->nbuckets; i++) {
+        struct rs_entry* entry = dict->buckets[i];
+        while (entry) {
+            struct rs_entry* next = entry->next;
+            rs_entry_free(entry);
+            entry = next;
+        }
+        dict->buckets[i] = NULL;
+    }
+    dict->used = 0;
+}
+
+static void rs_dict_free(struct rs_dict* dict) {
+    if (dict == NULL) {
+        return;
+    }
+    rs_dict_clear(dict);
+    free(dict->buckets);
+    free(dict);
+}
+
+static struct rs_entry* rs_dict_find(const struct rs_dict* dict, const char* key, size_t klen) {
+    if (dict == NULL) {
+        return NULL;
+    }
+    struct rs_entry* entry = dict->buckets[rs_hash(key, klen) & (dict->nbuckets - 1)];
+    while (entry) {
+        if (entry->klen == klen && memcmp(entry->key, key, klen) == 0) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static void rs_dict_grow(struct rs_dict* dict) {
+    size_t nbuckets = dict->nbuckets * 2;
+    struct rs_entry** buckets = calloc(nbuckets, sizeof(struct rs_entry*));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < dict->nbuckets; i++) {
+        struct rs_entry* entry = dict->buckets[i];
+        while (entry) {
+            struct rs_entry* next = entry->next;
+            size_t slot = rs_hash(entry->key, entry->klen) & (nbuckets - 1);
+            entry->next = buckets[slot];
+            buckets[slot] = entry;
+            entry = next;
+        }
+    }
+    free(dict->buckets);
+    dict->buckets = buckets;
+    dict->nbuckets = nbuckets;
+}
+
+// Returns the entry for key, creating it with the given type when missing.
+static struct rs_entry* rs_dict_add(struct rs_dict* dict, const char* key, size_t klen, int type, int* created) {
+    struct rs_entry* entry = rs_dict_find(dict, key, klen);
+    if (created) {
+        *created = entry == NULL;
+    }
+    if (entry) {
+        return entry;
+    }
+    if (dict->used >= dict->nbuckets) {
+        rs_dict_grow(dict);
+    }
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->key = malloc(klen + 1);
+    if (entry->key == NULL) {
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->key, key, klen);
+    entry->key[klen] = '\0';
+    entry->klen = klen;
+    entry->type = type;
+    size_t slot = rs_hash(key, klen) & (dict->nbuckets - 1);
+    entry->next = dict->buckets[slot];
+    dict->buckets[slot] = entry;
+    dict->used++;
+    return entry;
+}
+
+static int rs_dict_remove(struct rs_dict* dict, const char* key, size_t klen) {
+    if (dict == NULL) {
+        return 0;
+    }
+    struct rs_entry** link = &dict->buckets[rs_hash(key, klen) & (dict->nbuckets - 1)];
+    while (*link) {
+        struct rs_entry* entry = *link;
+        if (entry->klen == klen && memcmp(entry->key, key, klen) == 0) {
+            *link = entry->next;
+            rs_entry_free(entry);
+            dict->used--;
+            return 1;
+        }
+        link = &entry->next;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Reply encoding
+ * ------------------------------------------------------------------------ */
+
+static void rs_buf_append(struct rs_buf* buf, const char* data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : RS_READ_CHUNK;
+        while (cap < buf->len + len) {
+            cap *= 2;
+        }
+        char* grown = realloc(buf->data, cap);
+        if (grown == NULL) {
+            return;
+        }
+        buf->data = grown;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void rs_reply_header(struct rs_buf* out, char prefix, long long n) {
+    char header[32];
+    int len = snprintf(header, sizeof(header), "%c%lld\r\n", prefix, n);
+    rs_buf_append(out, header, (size_t)len);
+}
+
+static void rs_reply_status(struct rs_buf* out, const char* status) {
+    rs_buf_append(out, "+", 1);
+    rs_buf_append(out, status, strlen(status));
+    rs_buf_append(out, "\r\n", 2);
+}
+
+static void rs_reply_error(struct rs_buf* out, const char* error) {
+    rs_buf_append(out, "-", 1);
+    rs_buf_append(out, error, strlen(error));
+    rs_buf_append(out, "\r\n", 2);
+}
+
+static void rs_reply_bulk(struct rs_buf* out, const char* data, size_t len) {
+    rs_reply_header(out, '$', (long long)len);
+    rs_buf_append(out, data, len);
+    rs_buf_append(out, "\r\n", 2);
+}
+
+static void rs_reply_cstr(struct rs_buf* out, const char* str) {
+    rs_reply_bulk(out, str, strlen(str));
+}
+
+static void rs_reply_nil(struct rs_buf* out, int proto) {
+    if (proto == 3) {
+        rs_buf_append(out, "_\r\n", 3);
+    }
+    else {
+        rs_buf_append(out, "$-1\r\n", 5);
+    }
+}
+
+static void rs_reply_set_header(struct rs_buf* out, int proto, size_t n) {
+    rs_reply_header(out, proto == 3 ? '~' : '*', (long long)n);
+}
+
+static void rs_reply_map_header(struct rs_buf* out, int proto, size_t n) {
+    if (proto == 3) {
+        rs_reply_header(out, '%', (long long)n);
+    }
+    else {
+        rs_reply_header(out, '*', (long long)n * 2);
+    }
+}
+
+static void rs_reply_wrongtype(struct rs_buf* out) {
+    rs_reply_error(out, "WRONGTYPE Operation against a key holding the wrong kind of value");
+}
+
+/* ---------------------------------------------------------------------------
+ * Commands
+ * ------------------------------------------------------------------------ */
+
+struct rs_cmd {
+    int argc;
+    char** argv;
+    size_t* argvlen;
+};
+
+static int rs_arg_is(const struct rs_cmd* cmd, int i, const char* name) {
+    return i < cmd->argc && cmd->argvlen[i] == strlen(name) && strncasecmp(cmd->argv[i], name, cmd->argvlen[i]) == 0;
+}
+
+static void rs_cmd_hello(struct rs_client* client, const struct rs_cmd* cmd, struct rs_buf* out) {
+    if (cmd->argc > 1) {
+        int proto = atoi(cmd->argv[1]);
+        if (proto != 2 && proto != 3) {
+            rs_reply_error(out, "NOPROTO unsupported protocol version");
+            return;
+        }
+        client->proto = proto;
+    }
+    rs_reply_map_header(out, client->proto, 4);
+    rs_reply_cstr(out, "server");
+    rs_reply_cstr(out, "resp-server");
+    rs_reply_cstr(out, "proto");
+    rs_reply_header(out, ':', client->proto);
+    rs_reply_cstr(out, "mode");
+    rs_reply_cstr(out, "standalone");
+    rs_reply_cstr(out, "role");
+    rs_reply_cstr(out, "master");
+}
+
+static void rs_reply_string_entry(struct rs_buf* out, int proto, const struct rs_entry* entry) {
+    if (entry == NULL) {
+        rs_reply_nil(out, proto);
+    }
+    else if (entry->type != RS_STRING) {
+        rs_reply_wrongtype(out);
+    }
+    else {
+        rs_reply_bulk(out, entry->val, entry->vlen);
+    }
+}
+
+static void rs_cmd_set(struct resp_server* server, const struct rs_cmd* cmd, struct rs_buf* out) {
+    struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]);
+    if (entry && entry->type != RS_STRING) {
+        rs_dict_remove(server->db, cmd->argv[1], cmd->argvlen[1]);
+    }
+    entry = rs_dict_add(server->db, cmd->argv[1], cmd->argvlen[1], RS_STRING, NULL);
+    char* val = malloc(cmd->argvlen[2] + 1);
+    if (entry == NULL || val == NULL) {
+        free(val);
+        rs_reply_error(out, "OOM command not allowed");
+        return;
+    }
+    memcpy(val, cmd->argv[2], cmd->argvlen[2]);
+    val[cmd->argvlen[2]] = '\0';
+    free(entry->val);
+    entry->val = val;
+    entry->vlen = cmd->argvlen[2];
+    rs_reply_status(out, "OK");
+}
+
+static void rs_cmd_sadd(struct resp_server* server, const struct rs_cmd* cmd, struct rs_buf* out) {
+    struct rs_entry* entry = rs_dict_add(server->db, cmd->argv[1], cmd->argvlen[1], RS_SET, NULL);
+    if (entry == NULL) {
+        rs_reply_error(out, "OOM command not allowed");
+        return;
+    }
+    if (entry->type != RS_SET) {
+        rs_reply_wrongtype(out);
+        return;
+    }
+    if (entry->set == NULL) {
+        entry->set = rs_dict_create();
+    }
+    long long added = 0;
+    for (int i = 2; i < cmd->argc; i++) {
+        int created = 0;
+        rs_dict_add(entry->set, cmd->argv[i], cmd->argvlen[i], RS_STRING, &created);
+        added += created;
+    }
+    rs_reply_header(out, ':', added);
+}
+
+static void rs_cmd_hset(struct resp_server* server, const struct rs_cmd* cmd, struct rs_buf* out) {
+    if (cmd->argc % 2 != 0) {
+        rs_reply_error(out, "ERR wrong number of arguments");
+        return;
+    }
+    struct rs_entry* entry = rs_dict_add(server->db, cmd->argv[1], cmd->argvlen[1], RS_HASH, NULL);
+    if (entry == NULL) {
+        rs_reply_error(out, "OOM command not allowed");
+        return;
+    }
+    if (entry->type != RS_HASH) {
+        rs_reply_wrongtype(out);
+        return;
+    }
+    if (entry->set == NULL) {
+        entry->set = rs_dict_create();
+    }
+    long long added = 0;
+    for (int i = 2; i + 1 < cmd->argc; i += 2) {
+        int created = 0;
+        struct rs_entry* field = rs_dict_add(entry->set, cmd->argv[i], cmd->argvlen[i], RS_STRING, &created);
+        char* val = malloc(cmd->argvlen[i + 1] + 1);
+        if (field == NULL || val == NULL) {
+            free(val);
+            rs_reply_error(out, "OOM command not allowed");
+            return;
+        }
+        memcpy(val, cmd->argv[i + 1], cmd->argvlen[i + 1]);
+        val[cmd->argvlen[i + 1]] = '\0';
+        free(field->val);
+        field->val = val;
+        field->vlen = cmd->argvlen[i + 1];
+        added += created;
+    }
+    rs_reply_header(out, ':', added);
+}
+
+static void rs_cmd_hincrby(struct resp_server* server, const struct rs_cmd* cmd, struct rs_buf* out) {
+    char* end = NULL;
+    errno = 0;
+    long long increment = strtoll(cmd->argv[3], &end, 10);
+    if (cmd->argvlen[3] == 0 || *end != '\0' || errno == ERANGE) {
+        rs_reply_error(out, "ERR value is not an integer or out of range");
+        return;
+    }
+    struct rs_entry* entry = rs_dict_add(server->db, cmd->argv[1], cmd->argvlen[1], RS_HASH, NULL);
+    if (entry == NULL) {
+        rs_reply_error(out, "OOM command not allowed");
+        return;
+    }
+    if (entry->type != RS_HASH) {
+        rs_reply_wrongtype(out);
+        return;
+    }
+    if (entry->set == NULL) {
+        entry->set = rs_dict_create();
+    }
+    struct rs_entry* field = rs_dict_add(entry->set, cmd->argv[2], cmd->argvlen[2], RS_STRING, NULL);
+    if (field == NULL) {
+        rs_reply_error(out, "OOM command not allowed");
+        return;
+    }
+    long long value = 0;
+    if (field->val != NULL) {
+        value = strtoll(field->val, &end, 10);
+        if (field->vlen == 0 || *end != '\0') {
+            rs_reply_error(out, "ERR hash value is not an integer");
+            return;
+        }
+    }
+    if ((increment > 0 && value > LLONG_MAX - increment) || (increment < 0 && value < LLONG_MIN - increment)) {
+        rs_reply_error(out, "ERR increment or decrement would overflow");
+        return;
+    }
+    value += increment;
+    char* val = malloc(24);
+    if (val == NULL) {
+        rs_reply_error(out, "OOM command not allowed");
+        return;
+    }
+    free(field->val);
+    field->val = val;
+    field->vlen = (size_t)sprintf(val, "%lld", value);
+    rs_reply_header(out, ':', value);
+}
+
+// Returns the field of a hash key, NULL when missing; *wrongtype is set for other types.
+static struct rs_entry* rs_hash_field(struct resp_server* server, const struct rs_cmd* cmd, int i, int* wrongtype) {
+    struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]);
+    *wrongtype = entry && entry->type != RS_HASH;
+    if (entry == NULL || *wrongtype) {
+        return NULL;
+    }
+    return rs_dict_find(entry->set, cmd->argv[i], cmd->argvlen[i]);
+}
+
+static void rs_cmd_srem(struct resp_server* server, const struct rs_cmd* cmd, struct rs_buf* out) {
+    struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]);
+    if (entry && entry->type != RS_SET) {
+        rs_reply_wrongtype(out);
+        return;
+    }
+    long long removed = 0;
+    if (entry) {
+        for (int i = 2; i < cmd->argc; i++) {
+            removed += rs_dict_remove(entry->set, cmd->argv[i], cmd->argvlen[i]);
+        }
+        if (entry->set == NULL || entry->set->used == 0) {
+            rs_dict_remove(server->db, cmd->argv[1], cmd->argvlen[1]);
+        }
+    }
+    rs_reply_header(out, ':', removed);
+}
+
+static void rs_cmd_smembers(struct resp_server* server, struct rs_client* client, const struct rs_cmd* cmd, struct rs_buf* out) {
+    struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]);
+    if (entry && entry->type != RS_SET) {
+        rs_reply_wrongtype(out);
+        return;
+    }
+    struct rs_dict* set = entry ? entry->set : NULL;
+    rs_reply_set_header(out, client->proto, set ? set->used : 0);
+    if (set == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < set->nbuckets; i++) {
+        for (struct rs_entry* member = set->buckets[i]; member; member = member->next) {
+            rs_reply_bulk(out, member->key, member->klen);
+        }
+    }
+}
+
+static void rs_cmd_sscan(struct resp_server* server, const struct rs_cmd* cmd, struct rs_buf* out) {
+    struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]);
+    if (entry && entry->type != RS_SET) {
+        rs_reply_wrongtype(out);
+        return;
+    }
+    size_t cursor = strtoull(cmd->argv[2], NULL, 10);
+    size_t count = RS_SCAN_DEFAULT_COUNT;
+    const char* pattern = NULL;
+    for (int i = 3; i + 1 < cmd->argc; i += 2) {
+        if (rs_arg_is(cmd, i, "COUNT")) {
+            count = strtoull(cmd->argv[i + 1], NULL, 10);
+        }
+        else if (rs_arg_is(cmd, i, "MATCH")) {
+            pattern = cmd->argv[i + 1];
+        }
+    }
+
+    struct rs_dict* set = entry ? entry->set : NULL;
+    struct rs_buf members = { 0 };
+    size_t found = 0;
+    size_t next = 0;
+    if (set) {
+        // The cursor is a bucket index: whole buckets are returned until COUNT is reached
+        size_t bucket = cursor;
+        for (; bucket < set->nbuckets && found < count; bucket++) {
+            for (struct rs_entry* member = set->buckets[bucket]; member; member = member->next) {
+                if (pattern == NULL || fnmatch(pattern, member->key, 0) == 0) {
+                    rs_reply_bulk(&members, member->key, member->klen);
+                    found++;
+                }
+            }
+        }
+        next = bucket < set->nbuckets ? bucket : 0;
+    }
+
+    char next_cursor[32];
+    snprintf(next_cursor, sizeof(next_cursor), "%zu", next);
+    rs_reply_header(out, '*', 2);
+    rs_reply_cstr(out, next_cursor);
+    rs_reply_header(out, '*', (long long)found);
+    if (members.len) {
+        rs_buf_append(out, members.data, members.len);
+    }
+    free(members.data);
+}
+
+// Runs one command; the caller holds the server lock.
+static void rs_dispatch(struct rs_client* client, const struct rs_cmd* cmd, struct rs_buf* out) {
+    struct resp_server* server = client->server;
+    const char* name = cmd->argv[0];
+    int argc = cmd->argc;
+
+#define RS_ARITY(min) \
+    if (argc < (min)) { \
+        rs_reply_error(out, "ERR wrong number of arguments"); \
+        return; \
+    }
+
+    if (strcasecmp(name, "PING") == 0) {
+        if (argc > 1) {
+            rs_reply_bulk(out, cmd->argv[1], cmd->argvlen[1]);
+        }
+        else {
+            rs_reply_status(out, "PONG");
+        }
+    }
+    else if (strcasecmp(name, "ECHO") == 0) {
+        RS_ARITY(2);
+        rs_reply_bulk(out, cmd->argv[1], cmd->argvlen[1]);
+    }
+    else if (strcasecmp(name, "HELLO") == 0) {
+        rs_cmd_hello(client, cmd, out);
+    }
+    else if (strcasecmp(name, "AUTH") == 0 || strcasecmp(name, "SELECT") == 0 || strcasecmp(name, "CLIENT") == 0) {
+        rs_reply_status(out, "OK");
+    }
+    else if (strcasecmp(name, "GET") == 0) {
+        RS_ARITY(2);
+        rs_reply_string_entry(out, client->proto, rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]));
+    }
+    else if (strcasecmp(name, "MGET") == 0) {
+        RS_ARITY(2);
+        rs_reply_header(out, '*', argc - 1);
+        for (int i = 1; i < argc; i++) {
+            struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[i], cmd->argvlen[i]);
+            if (entry && entry->type != RS_STRING) {
+                entry = NULL;
+            }
+            rs_reply_string_entry(out, client->proto, entry);
+        }
+    }
+    else if (strcasecmp(name, "SET") == 0) {
+        RS_ARITY(3);
+        rs_cmd_set(server, cmd, out);
+    }
+    else if (strcasecmp(name, "DEL") == 0 || strcasecmp(name, "UNLINK") == 0) {
+        RS_ARITY(2);
+        long long removed = 0;
+        for (int i = 1; i < argc; i++) {
+            removed += rs_dict_remove(server->db, cmd->argv[i], cmd->argvlen[i]);
+        }
+        rs_reply_header(out, ':', removed);
+    }
+    else if (strcasecmp(name, "EXISTS") == 0) {
+        RS_ARITY(2);
+        long long found = 0;
+        for (int i = 1; i < argc; i++) {
+            found += rs_dict_find(server->db, cmd->argv[i], cmd->argvlen[i]) != NULL;
+        }
+        rs_reply_header(out, ':', found);
+    }
+    else if (strcasecmp(name, "SADD") == 0) {
+        RS_ARITY(3);
+        rs_cmd_sadd(server, cmd, out);
+    }
+    else if (strcasecmp(name, "SREM") == 0) {
+        RS_ARITY(3);
+        rs_cmd_srem(server, cmd, out);
+    }
+    else if (strcasecmp(name, "HSET") == 0) {
+        RS_ARITY(4);
+        rs_cmd_hset(server, cmd, out);
+    }
+    else if (strcasecmp(name, "HGET") == 0) {
+        RS_ARITY(3);
+        int wrongtype = 0;
+        struct rs_entry* field = rs_hash_field(server, cmd, 2, &wrongtype);
+        if (wrongtype) {
+            rs_reply_wrongtype(out);
+        }
+        else {
+            rs_reply_string_entry(out, client->proto, field);
+        }
+    }
+    else if (strcasecmp(name, "HMGET") == 0) {
+        RS_ARITY(3);
+        int wrongtype = 0;
+        rs_hash_field(server, cmd, 1, &wrongtype);
+        if (wrongtype) {
+            rs_reply_wrongtype(out);
+        }
+        else {
+            rs_reply_header(out, '*', argc - 2);
+            for (int i = 2; i < argc; i++) {
+                rs_reply_string_entry(out, client->proto, rs_hash_field(server, cmd, i, &wrongtype));
+            }
+        }
+    }
+    else if (strcasecmp(name, "HINCRBY") == 0) {
+        RS_ARITY(4);
+        rs_cmd_hincrby(server, cmd, out);
+    }
+    else if (strcasecmp(name, "EVAL") == 0 || strcasecmp(name, "EVALSHA") == 0 || strcasecmp(name, "SCRIPT") == 0) {
+        // SCRIPT LOAD fails too, which sends the callers to their paths without scripting
+        rs_reply_error(out, RESP_SERVER_NO_SCRIPTING);
+    }
+    else if (strcasecmp(name, "HDEL") == 0) {
+        RS_ARITY(3);
+        struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]);
+        if (entry && entry->type != RS_HASH) {
+            rs_reply_wrongtype(out);
+            return;
+        }
+        long long removed = 0;
+        if (entry) {
+            for (int i = 2; i < argc; i++) {
+                removed += rs_dict_remove(entry->set, cmd->argv[i], cmd->argvlen[i]);
+            }
+            if (entry->set == NULL || entry->set->used == 0) {
+                rs_dict_remove(server->db, cmd->argv[1], cmd->argvlen[1]);
+            }
+        }
+        rs_reply_header(out, ':', removed);
+    }
+    else if (strcasecmp(name, "HLEN") == 0) {
+        RS_ARITY(2);
+        struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]);
+        rs_reply_header(out, ':', entry && entry->type == RS_HASH && entry->set ? (long long)entry->set->used : 0);
+    }
+    else if (strcasecmp(name, "SMEMBERS") == 0) {
+        RS_ARITY(2);
+        rs_cmd_smembers(server, client, cmd, out);
+    }
+    else if (strcasecmp(name, "SISMEMBER") == 0) {
+        RS_ARITY(3);
+        struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]);
+        int member = entry && entry->type == RS_SET && rs_dict_find(entry->set, cmd->argv[2], cmd->argvlen[2]) != NULL;
+        rs_reply_header(out, ':', member);
+    }
+    else if (strcasecmp(name, "SCARD") == 0) {
+        RS_ARITY(2);
+        struct rs_entry* entry = rs_dict_find(server->db, cmd->argv[1], cmd->argvlen[1]);
+        rs_reply_header(out, ':', entry && entry->type == RS_SET && entry->set ? (long long)entry->set->used : 0);
+    }
+    else if (strcasecmp(name, "SSCAN") == 0) {
+        RS_ARITY(3);
+        rs_cmd_sscan(server, cmd, out);
+    }
+    else if (strcasecmp(name, "DBSIZE") == 0) {
+        rs_reply_header(out, ':', (long long)server->db->used);
+    }
+    else if (strcasecmp(name, "FLUSHALL") == 0 || strcasecmp(name, "FLUSHDB") == 0) {
+        rs_dict_clear(server->db);
+        rs_reply_status(out, "OK");
+    }
+    else {
+        char error[128];
+        snprintf(error, sizeof(error), "ERR unknown command '%.64s'", name);
+        rs_reply_error(out, error);
+    }
+#undef RS_ARITY
+}
+
+// Executes one command and counts the error replies; the caller holds the server lock.
+static void rs_execute(struct rs_client* client, const struct rs_cmd* cmd, struct rs_buf* out) {
+    size_t start = out->len;
+    rs_dispatch(client, cmd, out);
+    if (out->len > start && out->data[start] == '-') {
+        client->server->errors++;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Request parsing
+ * ------------------------------------------------------------------------ */
+
+// Parses a length line "<prefix><n>\r\n" starting at buf[*pos]; returns 0 when incomplete.
+static int rs_parse_length(const char* buf, size_t len, size_t* pos, long long* value) {
+    const char* end = memchr(buf + *pos, '\r', len - *pos);
+    if (end == NULL || (size_t)(end - buf) + 1 >= len) {
+        return 0;
+    }
+    *value = strtoll(buf + *pos + 1, NULL, 10);
+    *pos = (size_t)(end - buf) + 2;
+    return 1;
+}
+
+/**
+ * Parses one command from the input buffer. Arguments point into the buffer and are
+ * NUL-terminated in place. Returns the number of bytes consumed, 0 when the command
+ * is incomplete, or -1 on a protocol error.
+ */
+static long rs_parse_command(char* buf, size_t len, struct rs_cmd* cmd) {
+    cmd->argc = 0;
+    if (len == 0) {
+        return 0;
+    }
+
+    if (buf[0] != '*') {
+        // Inline command: space separated words terminated by a newline
+        char* nl = memchr(buf, '\n', len);
+        if (nl == NULL) {
+            return 0;
+        }
+        size_t consumed = (size_t)(nl - buf) + 1;
+        *nl = '\0';
+        if (nl > buf && nl[-1] == '\r') {
+            nl[-1] = '\0';
+        }
+        char* save = NULL;
+        for (char* word = strtok_r(buf, " \t", &save); word && cmd->argc < RS_MAX_ARGS; word = strtok_r(NULL, " \t", &save)) {
+            cmd->argv[cmd->argc] = word;
+            cmd->argvlen[cmd->argc] = strlen(word);
+            cmd->argc++;
+        }
+        return (long)consumed;
+    }
+
+    size_t pos = 0;
+    long long count = 0;
+    if (!rs_parse_length(buf, len, &pos, &count)) {
+        return 0;
+    }
+    if (count < 0 || count > RS_MAX_ARGS) {
+        return -1;
+    }
+    for (long long i = 0; i < count; i++) {
+        long long arglen = 0;
+        if (pos >= len) {
+            return 0;
+        }
+        if (buf[pos] != '$') {
+            return -1;
+        }
+        if (!rs_parse_length(buf, len, &pos, &arglen)) {
+            return 0;
+        }
+        if (arglen < 0) {
+            return -1;
+        }
+        if (pos + (size_t)arglen + 2 > len) {
+            return 0;
+        }
+        cmd->argv[i] = buf + pos;
+        cmd->argvlen[i] = (size_t)arglen;
+        buf[pos + (size_t)arglen] = '\0';
+        pos += (size_t)arglen + 2;
+    }
+    cmd->argc = (int)count;
+    return (long)pos;
+}
+
+static void rs_sleep_us(unsigned int us) {
+    struct timespec ts = { us / 1000000, (long)(us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+}
+
+static int rs_write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void* rs_client_main(void* arg) {
+    struct rs_client* client = arg;
+    struct resp_server* server = client->server;
+    struct rs_buf in = { 0 };
+    struct rs_buf out = { 0 };
+    struct rs_cmd cmd;
+    cmd.argv = malloc(RS_MAX_ARGS * sizeof(char*));
+    cmd.argvlen = malloc(RS_MAX_ARGS * sizeof(size_t));
+    char* chunk = malloc(RS_READ_CHUNK);
+
+    while (cmd.argv && cmd.argvlen && chunk && server->running) {
+        ssize_t n = recv(client->fd, chunk, RS_READ_CHUNK, 0);
+        if (n <= 0) {
+            break;
+        }
+        rs_buf_append(&in, chunk, (size_t)n);
+
+        // Execute every complete command; pipelined commands share one round trip
+        size_t offset = 0;
+        int failed = 0;
+        pthread_mutex_lock(&server->lock);
+        while (offset < in.len) {
+            long consumed = rs_parse_command(in.data + offset, in.len - offset, &cmd);
+            if (consumed == 0) {
+                break;
+            }
+            if (consumed < 0) {
+                rs_reply_error(&out, "ERR Protocol error");
+                failed = 1;
+                break;
+            }
+            offset += (size_t)consumed;
+            if (cmd.argc > 0) {
+                rs_execute(client, &cmd, &out);
+            }
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        // Keep the unparsed tail (an incomplete command) for the next read
+        if (offset > 0) {
+            memmove(in.data, in.data + offset, in.len - offset);
+            in.len -= offset;
+        }
+
+        if (out.len > 0) {
+            unsigned int latency_us = server->latency_us;
+            if (latency_us > 0) {
+                rs_sleep_us(latency_us);
+            }
+            if (rs_write_all(client->fd, out.data, out.len) != 0) {
+                break;
+            }
+            out.len = 0;
+        }
+        if (failed) {
+            break;
+        }
+    }
+
+    free(chunk);
+    free(cmd.argv);
+    free(cmd.argvlen);
+    free(in.data);
+    free(out.data);
+    close(client->fd);
+    client->done = 1;
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Server lifecycle
+ * ------------------------------------------------------------------------ */
+
+// Joins and frees clients whose connection has been closed.
+static void rs_reap_clients(struct resp_server* server, int all) {
+    struct rs_client** link = &server->clients;
+    while (*link) {
+        struct rs_client* client = *link;
+        if (all && !client->done) {
+            shutdown(client->fd, SHUT_RDWR);
+        }
+        if (all || client->done) {
+            pthread_join(client->thread, NULL);
+            *link = client->next;
+            free(client);
+        }
+        else {
+            link = &client->next;
+        }
+    }
+}
+
+static void* rs_accept_main(void* arg) {
+    struct resp_server* server = arg;
+    while (server->running) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (!server->running) {
+                break;
+            }
+            continue;
+        }
+        if (server->unix_path == NULL) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        rs_reap_clients(server, 0);
+
+        struct rs_client* client = calloc(1, sizeof(*client));
+        if (client == NULL) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->proto = 2;
+        client->server = server;
+        if (pthread_create(&client->thread, NULL, rs_client_main, client) != 0) {
+            LOG_ERROR("resp-server: failed to start client thread");
+            close(fd);
+            free(client);
+            continue;
+        }
+        client->next = server->clients;
+        server->clients = client;
+    }
+    return NULL;
+}
+
+static int rs_listen_unix(const char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("resp-server: socket path too long: %s", path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int rs_listen_tcp(int* port) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)*port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addrlen) != 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/**
+ * @brief Starts the stand-in server on a background thread
+ *
+ * @param unix_path Path of the Unix socket, or NULL to listen on TCP 127.0.0.1
+ * @param port TCP port when unix_path is NULL (0 picks a free port)
+ * @param latency_us Latency in microseconds injected before each batch of replies
+ * @return struct resp_server* The server handle, or NULL on failure
+ */
+struct resp_server* resp_server_start(const char* unix_path, int port, unsigned int latency_us) {
+    struct resp_server* server = calloc(1, sizeof(*server));
+    if (server == NULL) {
+        return NULL;
+    }
+    server->db = rs_dict_create();
+    server->latency_us = latency_us;
+    pthread_mutex_init(&server->lock, NULL);
+
+    if (unix_path) {
+        server->unix_path = strdup(unix_path);
+        server->listen_fd = server->unix_path ? rs_listen_unix(unix_path) : -1;
+    }
+    else {
+        server->port = port;
+        server->listen_fd = rs_listen_tcp(&server->port);
+    }
+
+    if (server->db == NULL || server->listen_fd < 0) {
+        LOG_ERROR("resp-server: failed to listen on %s", unix_path ? unix_path : "127.0.0.1");
+        if (server->listen_fd >= 0) {
+            close(server->listen_fd);
+        }
+        rs_dict_free(server->db);
+        free(server->unix_path);
+        free(server);
+        return NULL;
+    }
+
+    server->running = 1;
+    if (pthread_create(&server->thread, NULL, rs_accept_main, server) != 0) {
+        LOG_ERROR("resp-server: failed to start accept thread");
+        close(server->listen_fd);
+        rs_dict_free(server->db);
+        free(server->unix_path);
+        free(server);
+        return NULL;
+    }
+    LOG_INFO("resp-server listening on %s%s%d (latency %u us)", unix_path ? unix_path : "127.0.0.1", unix_path ? "" : ":",
+        unix_path ? 0 : server->port, latency_us);
+    return server;
+}
+
+int resp_server_port(const struct resp_server* server) {
+    return server->port;
+}
+
+void resp_server_set_latency(struct resp_server* server, unsigned int latency_us) {
+    server->latency_us = latency_us;
+}
+
+unsigned long long resp_server_errors(struct resp_server* server) {
+    pthread_mutex_lock(&server->lock);
+    unsigned long long errors = server->errors;
+    pthread_mutex_unlock(&server->lock);
+    return errors;
+}
+
+void resp_server_flush(struct resp_server* server) {
+    pthread_mutex_lock(&server->lock);
+    rs_dict_clear(server->db);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * @brief Stops the server, closes its clients and releases the store
+ *
+ * @param server The server handle
+ */
+void resp_server_stop(struct resp_server* server) {
+    if (server == NULL) {
+        return;
+    }
+    server->running = 0;
+    shutdown(server->listen_fd, SHUT_RDWR);
+    close(server->listen_fd);
+    pthread_join(server->thread, NULL);
+    rs_reap_clients(server, 1);
+
+    if (server->unix_path) {
+        unlink(server->unix_path);
+        free(server->unix_path);
+    }
+    pthread_mutex_destroy(&server->lock);
+    rs_dict_free(server->db);
+    free(server);
+}
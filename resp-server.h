@@ -0,0 +1,68 @@
+#ifndef RESP_SERVER_H
+#define RESP_SERVER_H
+
+/**
+ * In-process RESP2/RESP3 stand-in for Redis.
+ *
+ * It implements the subset of commands used by database.c (GET, SET, DEL, MGET,
+ * SADD, SREM, SMEMBERS, SSCAN, HINCRBY, ...) on an in-memory store, so the db_*
+ * functions can be benchmarked without a real Redis and its timing noise. A
+ * configurable latency is injected once per round trip to simulate network delay.
+ *
+ * Lua scripting is not implemented: EVAL, EVALSHA and SCRIPT reply with the
+ * RESP_SERVER_NO_SCRIPTING error.
+ */
+
+#define RESP_SERVER_NO_SCRIPTING "ERR scripting is not supported by resp-server"
+
+struct resp_server;
+
+/**
+ * @brief Starts the stand-in server on a background thread.
+ *
+ * @param unix_path Path of the Unix socket to listen on, or NULL to listen on TCP 127.0.0.1.
+ * @param port TCP port to listen on when unix_path is NULL (0 picks a free port).
+ * @param latency_us Latency in microseconds injected before each batch of replies.
+ * @return struct resp_server* The server handle, or NULL on failure.
+ */
+struct resp_server* resp_server_start(const char* unix_path, int port, unsigned int latency_us);
+
+/**
+ * @brief Returns the TCP port the server listens on (0 for a Unix socket).
+ *
+ * @param server The server handle.
+ * @return int The listening port.
+ */
+int resp_server_port(const struct resp_server* server);
+
+/**
+ * @brief Changes the injected latency of a running server.
+ *
+ * @param server The server handle.
+ * @param latency_us Latency in microseconds injected before each batch of replies.
+ */
+void resp_server_set_latency(struct resp_server* server, unsigned int latency_us);
+
+/**
+ * @brief Returns the number of error replies sent since the server started.
+ *
+ * @param server The server handle.
+ * @return unsigned long long The error replies, unknown commands included.
+ */
+unsigned long long resp_server_errors(struct resp_server* server);
+
+/**
+ * @brief Removes every key from the server's store.
+ *
+ * @param server The server handle.
+ */
+void resp_server_flush(struct resp_server* server);
+
+/**
+ * @brief Stops the server, closes its clients and releases the store.
+ *
+ * @param server The server handle.
+ */
+void resp_server_stop(struct resp_server* server);
+
+#endif // RESP_SERVER_H
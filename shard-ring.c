@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shard-ring.h"
+#include "id-filter.h"
+#include "log-utils.h" // Include the log utils header
+
+/**
+ * Point of a node on the ring.
+ */
+struct ring_point {
+    uint64_t hash;
+    size_t node;
+    const char* id; // Id of the node, only read while the ring is sorted
+};
+
+struct shard_ring {
+    struct ring_point* points; // Sorted by hash
+    size_t count;
+};
+
+static int compare_points(const void* a, const void* b) {
+    const struct ring_point* left = a;
+    const struct ring_point* right = b;
+    if (left->hash != right->hash) {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    // Ties, however unlikely, go to the same node whatever the order of the list, as node ids are unique
+    return strcmp(left->id, right->id);
+}
+
+const char* shard_ring_node_id(const char* uri) {
+    const char* id = strstr(uri, "://");
+    id = id != NULL ? id + 3 : uri;
+    const char* at = strrchr(id, '@');
+    return at != NULL ? at + 1 : id;
+}
+
+/**
+ * @brief Build the ring of the given nodes
+ *
+ * @param uris The URIs of the nodes
+ * @param count The number of nodes
+ * @return struct shard_ring* The ring, or NULL on failure
+ */
+struct shard_ring* shard_ring_create(const char* const* uris, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < i; j++) {
+            if (strcmp(shard_ring_node_id(uris[i]), shard_ring_node_id(uris[j])) == 0) {
+                LOG_ERROR("Shard %s is listed twice", shard_ring_node_id(uris[i]));
+                return NULL;
+            }
+        }
+    }
+    struct shard_ring* ring = calloc(1, sizeof(*ring));
+    if (ring == NULL || count == 0 || (ring->points = calloc(count * SHARD_RING_POINTS, sizeof(*ring->points))) == NULL) {
+        LOG_ERROR("Failed to build the shard ring");
+        free(ring);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const char* id = shard_ring_node_id(uris[i]);
+        size_t len = strlen(id);
+        char* point = malloc(len + 16);
+        if (point == NULL) {
+            LOG_ERROR("Failed to build the shard ring");
+            shard_ring_free(ring);
+            return NULL;
+        }
+        for (unsigned int j = 0; j < SHARD_RING_POINTS; j++) {
+            int point_len = sprintf(point, "%s#%u", id, j);
+            ring->points[ring->count].hash = id_hash(point, (size_t)point_len);
+            ring->points[ring->count].node = i;
+            ring->points[ring->count].id = id;
+            ring->count++;
+        }
+        free(point);
+    }
+    qsort(ring->points, ring->count, sizeof(*ring->points), compare_points);
+    return ring;
+}
+
+size_t shard_ring_locate(const struct shard_ring* ring, const char* key, size_t len) {
+    uint64_t hash = id_hash(key, len);
+    // First point at or after the hash, wrapping around to the first point
+    size_t low = 0;
+    size_t high = ring->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ring->points[mid].hash < hash) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return ring->points[low < ring->count ? low : 0].node;
+}
+
+void shard_ring_free(struct shard_ring* ring) {
+    if (ring == NULL) {
+        return;
+    }
+    free(ring->points);
+    free(ring);
+}
@@ -0,0 +1,57 @@
+#ifndef SHARD_RING_H
+#define SHARD_RING_H
+
+#include <stddef.h>
+
+/**
+ * Consistent hash ring placing keys on Redis nodes.
+ *
+ * Every node is hashed onto the ring at SHARD_RING_POINTS points, and a key belongs to the
+ * node of the first point at or after the hash of the key. Adding a node to N nodes only
+ * moves about 1/(N+1) of the keys, all of them to the new node, and the points spread the
+ * keys evenly.
+ *
+ * A node is identified by its URI without the scheme and the password, so that the ring
+ * does not change when a password does, nor with the order the nodes are listed in.
+ */
+
+#define SHARD_RING_POINTS 160
+
+struct shard_ring;
+
+/**
+ * @brief Builds the ring of the given nodes.
+ *
+ * @param uris The URIs of the nodes, in the format of db_init.
+ * @param count The number of nodes.
+ * @return struct shard_ring* The ring, or NULL on failure (e.g. the same node listed twice).
+ *         Release it with shard_ring_free.
+ */
+struct shard_ring* shard_ring_create(const char* const* uris, size_t count);
+
+/**
+ * @brief Finds the node a key belongs to.
+ *
+ * @param ring The ring.
+ * @param key The key.
+ * @param len The length of the key.
+ * @return size_t The index of the node in the list the ring was built from.
+ */
+size_t shard_ring_locate(const struct shard_ring* ring, const char* key, size_t len);
+
+/**
+ * @brief Returns the part of a URI identifying a node: the host and port, or the socket path.
+ *
+ * @param uri The URI of the node.
+ * @return const char* A pointer into the URI.
+ */
+const char* shard_ring_node_id(const char* uri);
+
+/**
+ * @brief Releases a ring.
+ *
+ * @param ring The ring, may be NULL.
+ */
+void shard_ring_free(struct shard_ring* ring);
+
+#endif // SHARD_RING_H
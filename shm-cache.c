@@ -0,0 +1,338 @@
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "shm-cache.h"
+#include "clock-utils.h"
+#include "log-utils.h" // Include the log utils header
+
+#define SHM_CACHE_MAGIC 0x70657463u
+#define SHM_CACHE_ALIGN 64
+#define SHM_CACHE_PROBES 4
+#define SHM_CACHE_READ_RETRIES 8
+#define SHM_CACHE_LOCK_SPINS 1000
+
+/**
+ * Header of the shared region, followed by the epochs and the slots.
+ */
+struct shm_header {
+    uint32_t magic;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint32_t ttl_ms;
+    _Atomic unsigned long long hits;
+    _Atomic unsigned long long stale_hits;
+    _Atomic unsigned long long misses;
+    _Atomic unsigned long long expired;
+    _Atomic unsigned long long stores;
+    _Atomic unsigned long long invalidations;
+};
+
+/**
+ * Cache slot. seq is odd while a writer updates the slot; len is 0 when the slot is empty.
+ */
+struct shm_slot {
+    _Atomic uint32_t seq;
+    uint32_t len;
+    int64_t id;
+    int64_t version;
+    uint64_t stored_ms;
+    char data[];
+};
+
+static void* region = NULL;
+static size_t region_size = 0;
+static struct shm_header* header = NULL;
+// Bumped by every invalidation of an id hashing to the slot; the tickets of the readers
+static _Atomic uint32_t* epochs = NULL;
+static char* slots = NULL;
+
+static size_t align_up(size_t value) {
+    return (value + SHM_CACHE_ALIGN - 1) & ~(size_t)(SHM_CACHE_ALIGN - 1);
+}
+
+static size_t home_slot(long long id) {
+    // 64-bit mix (splitmix64 finalizer), so that sequential ids spread over the table
+    uint64_t x = (uint64_t)id;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (size_t)(x % header->slot_count);
+}
+
+static struct shm_slot* slot_at(size_t index) {
+    return (struct shm_slot*)(slots + (index % header->slot_count) * header->slot_size);
+}
+
+static size_t slot_capacity(void) {
+    return header->slot_size - offsetof(struct shm_slot, data);
+}
+
+/**
+ * @brief Create the shared region
+ *
+ * The mapping is anonymous and shared, so the processes forked afterwards all see it.
+ *
+ * @param size The size of the shared region in bytes
+ * @param slot_size The size of a slot, rounded up to a cache line
+ * @param ttl_ms The time an entry is served
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int shm_cache_init(size_t size, size_t slot_size, unsigned int ttl_ms) {
+    slot_size = align_up(slot_size);
+    if (slot_size <= sizeof(struct shm_slot) || slot_size > UINT32_MAX) {
+        LOG_ERROR("Invalid shared cache slot size: %zu", slot_size);
+        return EXIT_FAILURE;
+    }
+    size_t header_size = align_up(sizeof(struct shm_header));
+    // Each slot also takes its epoch
+    size_t slot_count = size > header_size ? (size - header_size) / (slot_size + sizeof(uint32_t)) : 0;
+    if (slot_count > UINT32_MAX) {
+        slot_count = UINT32_MAX;
+    }
+    if (slot_count < SHM_CACHE_PROBES) {
+        LOG_ERROR("Shared cache size too small: %zu bytes", size);
+        return EXIT_FAILURE;
+    }
+    size_t epochs_size = align_up(slot_count * sizeof(uint32_t));
+    region_size = header_size + epochs_size + slot_count * slot_size;
+
+    region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        LOG_ERROR("Failed to map the shared cache (%zu bytes)", region_size);
+        region = NULL;
+        return EXIT_FAILURE;
+    }
+    // The mapping is zero-filled: all the slots are empty and unlocked
+    header = region;
+    header->magic = SHM_CACHE_MAGIC;
+    header->slot_count = (uint32_t)slot_count;
+    header->slot_size = (uint32_t)slot_size;
+    header->ttl_ms = ttl_ms;
+    epochs = (_Atomic uint32_t*)((char*)region + header_size);
+    slots = (char*)region + header_size + epochs_size;
+    LOG_INFO("Shared cache: %zu slots of %zu bytes, %u ms TTL", slot_count, slot_size, ttl_ms);
+    return EXIT_SUCCESS;
+}
+
+bool shm_cache_enabled(void) {
+    return header != NULL;
+}
+
+/**
+ * @brief Take a slot for writing
+ *
+ * @return uint32_t The sequence of the slot before it was taken, 1 if it is taken by another writer
+ */
+static uint32_t slot_try_lock(struct shm_slot* slot) {
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if ((seq & 1) != 0 || !atomic_compare_exchange_strong(&slot->seq, &seq, seq + 1)) {
+        return 1;
+    }
+    return seq;
+}
+
+static void slot_unlock(struct shm_slot* slot, uint32_t seq) {
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * @brief Read a slot holding an id
+ *
+ * @return int 1 when the slot holds the id, 0 when it does not, -1 when it was being written
+ */
+static int slot_read(struct shm_slot* slot, long long id, char** json, long long* version, uint64_t* stored_ms) {
+    uint32_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if ((before & 1) != 0) {
+        return -1;
+    }
+    uint32_t len = slot->len;
+    if (len == 0 || slot->id != id || len > slot_capacity()) {
+        atomic_thread_fence(memory_order_acquire);
+        return atomic_load_explicit(&slot->seq, memory_order_relaxed) == before ? 0 : -1;
+    }
+    char* copy = malloc((size_t)len + 1);
+    if (copy == NULL) {
+        return 0;
+    }
+    memcpy(copy, slot->data, len);
+    copy[len] = '\0';
+    *version = slot->version;
+    *stored_ms = slot->stored_ms;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != before) {
+        free(copy);
+        return -1;
+    }
+    *json = copy;
+    return 1;
+}
+
+/**
+ * @brief Look up a pet
+ *
+ * Readers take no lock: a slot updated while it was copied is read again.
+ *
+ * @param id The id of the pet
+ * @param max_stale_ms How long past its TTL an entry is still returned
+ * @param entry Set to the version and age of the cached document
+ * @param ticket Set by every lookup, to be passed to shm_cache_put
+ * @return char* A copy of the JSON text of the pet, or NULL on a miss
+ */
+char* shm_cache_get(long long id, unsigned int max_stale_ms, struct shm_cache_entry* entry, uint32_t* ticket) {
+    if (header == NULL) {
+        return NULL;
+    }
+    size_t home = home_slot(id);
+    // Taken before the lookup, so that an invalidation racing with the miss voids the ticket
+    *ticket = atomic_load(&epochs[home]);
+
+    for (size_t i = 0; i < SHM_CACHE_PROBES; i++) {
+        struct shm_slot* slot = slot_at(home + i);
+        for (int attempt = 0; attempt < SHM_CACHE_READ_RETRIES; attempt++) {
+            char* json = NULL;
+            uint64_t stored_ms = 0;
+            int found = slot_read(slot, id, &json, &entry->version, &stored_ms);
+            if (found < 0) {
+                sched_yield();
+                continue;
+            }
+            if (found == 0) {
+                break;
+            }
+            uint64_t age = monotonic_ms() - stored_ms;
+            if (age >= (uint64_t)header->ttl_ms + max_stale_ms) {
+                free(json);
+                atomic_fetch_add_explicit(&header->expired, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&header->misses, 1, memory_order_relaxed);
+                return NULL;
+            }
+            entry->age_ms = age > UINT32_MAX ? UINT32_MAX : (unsigned int)age;
+            entry->stale = age >= header->ttl_ms;
+            atomic_fetch_add_explicit(entry->stale ? &header->stale_hits : &header->hits, 1, memory_order_relaxed);
+            return json;
+        }
+    }
+    atomic_fetch_add_explicit(&header->misses, 1, memory_order_relaxed);
+    return NULL;
+}
+
+/**
+ * @brief Store a pet read from Redis after a miss
+ *
+ * The document replaces the slot holding the id, else an empty slot, else the oldest one.
+ * It is dropped if the pet was invalidated since the miss, or if another writer holds the slot.
+ *
+ * @param id The id of the pet
+ * @param version The version of the document
+ * @param json The JSON text of the pet
+ * @param len The length of the JSON text
+ * @param ticket The ticket returned by the shm_cache_get that missed
+ */
+void shm_cache_put(long long id, long long version, const char* json, size_t len, uint32_t ticket) {
+    if (header == NULL || len == 0 || len > slot_capacity()) {
+        return;
+    }
+    size_t home = home_slot(id);
+    if (atomic_load(&epochs[home]) != ticket) {
+        return;
+    }
+
+    // Unlocked scan; a wrong choice only costs a cached document
+    struct shm_slot* target = NULL;
+    struct shm_slot* empty = NULL;
+    struct shm_slot* oldest = NULL;
+    for (size_t i = 0; i < SHM_CACHE_PROBES; i++) {
+        struct shm_slot* slot = slot_at(home + i);
+        uint32_t slot_len = slot->len;
+        if (slot_len != 0 && slot->id == id) {
+            target = slot;
+            break;
+        }
+        if (slot_len == 0 && empty == NULL) {
+            empty = slot;
+        }
+        if (oldest == NULL || slot->stored_ms < oldest->stored_ms) {
+            oldest = slot;
+        }
+    }
+    if (target == NULL) {
+        target = empty != NULL ? empty : oldest;
+    }
+
+    uint32_t seq = slot_try_lock(target);
+    if (seq == 1) {
+        return;
+    }
+    // Checked again under the lock: shm_cache_invalidate bumps the epoch before it locks the slots
+    if (atomic_load(&epochs[home]) == ticket) {
+        memcpy(target->data, json, len);
+        target->id = id;
+        target->version = version;
+        target->stored_ms = monotonic_ms();
+        target->len = (uint32_t)len;
+        atomic_fetch_add_explicit(&header->stores, 1, memory_order_relaxed);
+    }
+    slot_unlock(target, seq);
+}
+
+/**
+ * @brief Drop a pet from the cache
+ *
+ * Waits for the writers of the slots, so that the entry is gone when the function returns.
+ *
+ * @param id The id of the pet
+ */
+void shm_cache_invalidate(long long id) {
+    if (header == NULL) {
+        return;
+    }
+    size_t home = home_slot(id);
+    atomic_fetch_add(&epochs[home], 1);
+    atomic_fetch_add_explicit(&header->invalidations, 1, memory_order_relaxed);
+
+    for (size_t i = 0; i < SHM_CACHE_PROBES; i++) {
+        struct shm_slot* slot = slot_at(home + i);
+        uint32_t seq = 1;
+        for (int spin = 0; spin < SHM_CACHE_LOCK_SPINS && (seq = slot_try_lock(slot)) == 1; spin++) {
+            sched_yield();
+        }
+        if (seq == 1) {
+            // Only a writer that died holding the slot keeps it; nobody can read it either
+            LOG_WARN("Shared cache slot of pet %lld is stuck", id);
+            continue;
+        }
+        if (slot->len != 0 && slot->id == id) {
+            slot->len = 0;
+        }
+        slot_unlock(slot, seq);
+    }
+}
+
+void shm_cache_get_stats(struct shm_cache_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (header == NULL) {
+        return;
+    }
+    stats->slots = header->slot_count;
+    stats->slot_size = header->slot_size;
+    stats->hits = atomic_load_explicit(&header->hits, memory_order_relaxed);
+    stats->stale_hits = atomic_load_explicit(&header->stale_hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&header->misses, memory_order_relaxed);
+    stats->expired = atomic_load_explicit(&header->expired, memory_order_relaxed);
+    stats->stores = atomic_load_explicit(&header->stores, memory_order_relaxed);
+    stats->invalidations = atomic_load_explicit(&header->invalidations, memory_order_relaxed);
+}
+
+void shm_cache_cleanup(void) {
+    if (region == NULL) {
+        return;
+    }
+    munmap(region, region_size);
+    region = NULL;
+    header = NULL;
+    epochs = NULL;
+    slots = NULL;
+}
@@ -0,0 +1,104 @@
+#ifndef SHM_CACHE_H
+#define SHM_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Pet document cache in shared memory.
+ *
+ * The cache lives in a memfd mapping created before the prefork workers are forked, so all
+ * the workers of a host share one copy of the hot set. It is an open-addressing table of
+ * fixed-size slots holding the JSON text and version of a pet. Every slot is protected by a
+ * seqlock: readers never block and retry if a writer updated the slot while they copied it;
+ * writers take the slot with a compare-and-swap and give up if another process holds it.
+ *
+ * Each write path invalidates the pets it wrote. A reader that misses gets a ticket and
+ * passes it back when it stores the document read from Redis; the document is dropped if the
+ * pet was invalidated in between, so a slow reader never stores a document older than a
+ * completed write. Entries also expire after a TTL, which bounds the staleness of documents
+ * written by other hosts. A caller may accept entries past their TTL, up to a staleness
+ * budget of its own, while Redis cannot answer in time.
+ */
+
+/**
+ * Entry found by a lookup.
+ */
+struct shm_cache_entry {
+    long long version;    // Version of the cached document
+    unsigned int age_ms;  // Time since the document was read from Redis
+    bool stale;           // The entry is past its TTL
+};
+
+/**
+ * Counters of the cache, summed over all the processes sharing it.
+ */
+struct shm_cache_stats {
+    size_t slots;
+    size_t slot_size;
+    unsigned long long hits;
+    unsigned long long stale_hits;  // Hits past the TTL, within the staleness budget of the caller
+    unsigned long long misses;
+    unsigned long long expired;
+    unsigned long long stores;
+    unsigned long long invalidations;
+};
+
+/**
+ * @brief Creates the shared cache.
+ *
+ * @param size The size of the shared region in bytes.
+ * @param slot_size The size of a slot; documents longer than a slot are not cached.
+ * @param ttl_ms The time an entry is served before it has to be read again from Redis.
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int shm_cache_init(size_t size, size_t slot_size, unsigned int ttl_ms);
+
+/**
+ * @brief Checks whether the cache is enabled.
+ */
+bool shm_cache_enabled(void);
+
+/**
+ * @brief Looks up a pet.
+ *
+ * @param id The id of the pet.
+ * @param max_stale_ms How long past its TTL an entry is still returned, flagged as stale.
+ * @param entry Set to the version and age of the cached document.
+ * @param ticket Set by every lookup, to be passed to shm_cache_put with the document read from
+ *        Redis after a miss (or a stale hit).
+ * @return char* A copy of the JSON text of the pet, or NULL on a miss.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* shm_cache_get(long long id, unsigned int max_stale_ms, struct shm_cache_entry* entry, uint32_t* ticket);
+
+/**
+ * @brief Stores a pet read from Redis after a miss.
+ *
+ * @param id The id of the pet.
+ * @param version The version of the document.
+ * @param json The JSON text of the pet.
+ * @param len The length of the JSON text.
+ * @param ticket The ticket returned by the shm_cache_get that missed.
+ */
+void shm_cache_put(long long id, long long version, const char* json, size_t len, uint32_t ticket);
+
+/**
+ * @brief Drops a pet from the cache, after it was written or deleted.
+ *
+ * @param id The id of the pet.
+ */
+void shm_cache_invalidate(long long id);
+
+/**
+ * @brief Copies the counters of the cache.
+ */
+void shm_cache_get_stats(struct shm_cache_stats* stats);
+
+/**
+ * @brief Unmaps the cache from the calling process.
+ */
+void shm_cache_cleanup(void);
+
+#endif // SHM_CACHE_H
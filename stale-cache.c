@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stale-cache.h"
+#include "keyed-cache.h"
+#include "log-utils.h" // Include the log utils header
+
+#define STALE_CACHE_SLOTS 1024
+#define STALE_REFRESH_QUEUE 256
+
+/**
+ * Refresh queued for the refresher thread.
+ */
+struct refresh_job {
+    char* key;
+    stale_refresh_fn refresh;
+    char* arg;
+};
+
+static bool stale_enabled = false;
+
+// Responses stored as the body followed by its NUL and the ETag
+static struct keyed_cache stale_responses = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Ring of refresh jobs, and the key of the one running
+static struct refresh_job refresh_queue[STALE_REFRESH_QUEUE];
+static size_t refresh_head = 0;
+static size_t refresh_count = 0;
+static char* refresh_running = NULL;
+static bool refresh_stopping = false;
+static unsigned long long refresh_runs = 0;
+static unsigned long long refresh_dropped = 0;
+static pthread_t refresh_thread;
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_ready = PTHREAD_COND_INITIALIZER;
+
+static void job_free(struct refresh_job* job) {
+    free(job->key);
+    free(job->arg);
+    memset(job, 0, sizeof(*job));
+}
+
+// Refresher thread: runs the queued refreshes one at a time
+static void* refresh_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&refresh_lock);
+    while (!refresh_stopping) {
+        if (refresh_count == 0) {
+            pthread_cond_wait(&refresh_ready, &refresh_lock);
+            continue;
+        }
+        struct refresh_job job = refresh_queue[refresh_head];
+        memset(&refresh_queue[refresh_head], 0, sizeof(job));
+        refresh_head = (refresh_head + 1) % STALE_REFRESH_QUEUE;
+        refresh_count--;
+        refresh_running = job.key;
+        pthread_mutex_unlock(&refresh_lock);
+
+        job.refresh(job.arg);
+
+        pthread_mutex_lock(&refresh_lock);
+        refresh_running = NULL;
+        refresh_runs++;
+        job_free(&job);
+    }
+    pthread_mutex_unlock(&refresh_lock);
+    return NULL;
+}
+
+/**
+ * @brief Create the cache and start the refresher thread
+ *
+ * @param max_bytes The size of the cache of responses, 0 to keep none
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int stale_cache_init(size_t max_bytes) {
+    if (keyed_cache_init(&stale_responses, STALE_CACHE_SLOTS, max_bytes) != EXIT_SUCCESS) {
+        LOG_ERROR("Failed to create the stale cache");
+        return EXIT_FAILURE;
+    }
+    refresh_stopping = false;
+    if (pthread_create(&refresh_thread, NULL, refresh_main, NULL) != 0) {
+        LOG_ERROR("Failed to start the stale cache refresher");
+        keyed_cache_cleanup(&stale_responses);
+        return EXIT_FAILURE;
+    }
+    stale_enabled = true;
+    LOG_INFO("Stale-while-revalidate enabled, %zu byte cache", max_bytes);
+    return EXIT_SUCCESS;
+}
+
+bool stale_cache_enabled(void) {
+    return stale_enabled;
+}
+
+void stale_cache_put(const char* key, const char* body, const char* etag) {
+    if (!keyed_cache_enabled(&stale_responses)) {
+        return;
+    }
+    size_t body_len = strlen(body);
+    size_t etag_len = etag != NULL ? strlen(etag) : 0;
+    char* response = malloc(body_len + etag_len + 2);
+    if (response == NULL) {
+        return;
+    }
+    memcpy(response, body, body_len + 1);
+    memcpy(response + body_len + 1, etag != NULL ? etag : "", etag_len + 1);
+    keyed_cache_put(&stale_responses, key, response, body_len + etag_len + 2);
+    free(response);
+}
+
+/**
+ * @brief Look up the last response of a query
+ *
+ * @param key The key naming the query
+ * @param max_age_ms The oldest entry accepted
+ * @param etag Set to the ETag of the response, empty for none
+ * @param etag_size The size of the etag buffer
+ * @param age_ms Set to the time since the response was read
+ * @return char* A copy of the response body, or NULL on a miss
+ */
+char* stale_cache_get(const char* key, unsigned int max_age_ms, char* etag, size_t etag_size, unsigned int* age_ms) {
+    size_t len = 0;
+    uint64_t age = 0;
+    // The body ends at its NUL, so the response is handed over as it is
+    char* body = keyed_cache_get(&stale_responses, key, max_age_ms, &len, &age);
+    if (body != NULL) {
+        *age_ms = (unsigned int)age;
+        if (etag_size > 0) {
+            strncpy(etag, body + strlen(body) + 1, etag_size - 1);
+            etag[etag_size - 1] = '\0';
+        }
+    }
+    return body;
+}
+
+void stale_cache_refresh(const char* key, stale_refresh_fn refresh, const char* arg) {
+    if (!stale_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&refresh_lock);
+    bool queued = refresh_running != NULL && strcmp(refresh_running, key) == 0;
+    for (size_t i = 0; i < refresh_count && !queued; i++) {
+        queued = strcmp(refresh_queue[(refresh_head + i) % STALE_REFRESH_QUEUE].key, key) == 0;
+    }
+    if (!queued) {
+        struct refresh_job* job = &refresh_queue[(refresh_head + refresh_count) % STALE_REFRESH_QUEUE];
+        if (refresh_count < STALE_REFRESH_QUEUE && (job->key = strdup(key)) != NULL &&
+            (job->arg = strdup(arg)) != NULL) {
+            job->refresh = refresh;
+            refresh_count++;
+            pthread_cond_signal(&refresh_ready);
+        }
+        else {
+            if (refresh_count < STALE_REFRESH_QUEUE) {
+                job_free(job);
+            }
+            refresh_dropped++;
+        }
+    }
+    pthread_mutex_unlock(&refresh_lock);
+}
+
+void stale_cache_get_stats(struct stale_cache_stats* stats) {
+    struct keyed_cache_stats cache_stats;
+    keyed_cache_get_stats(&stale_responses, &cache_stats);
+    stats->stores = cache_stats.stores;
+    stats->hits = cache_stats.hits;
+    stats->misses = cache_stats.misses;
+    stats->entries = cache_stats.entries;
+    stats->bytes = cache_stats.bytes;
+    stats->max_bytes = cache_stats.max_bytes;
+    pthread_mutex_lock(&refresh_lock);
+    stats->refreshes = refresh_runs;
+    stats->dropped = refresh_dropped;
+    pthread_mutex_unlock(&refresh_lock);
+}
+
+void stale_cache_cleanup(void) {
+    if (!stale_enabled) {
+        return;
+    }
+    stale_enabled = false;
+    pthread_mutex_lock(&refresh_lock);
+    refresh_stopping = true;
+    pthread_cond_signal(&refresh_ready);
+    pthread_mutex_unlock(&refresh_lock);
+    pthread_join(refresh_thread, NULL);
+    for (; refresh_count > 0; refresh_count--) {
+        job_free(&refresh_queue[refresh_head]);
+        refresh_head = (refresh_head + 1) % STALE_REFRESH_QUEUE;
+    }
+    keyed_cache_cleanup(&stale_responses);
+}
@@ -0,0 +1,97 @@
+#ifndef STALE_CACHE_H
+#define STALE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Last known responses of the index queries, served stale while Redis is slow or down.
+ *
+ * Every successful response of a cached route is kept under a key naming the query, with its
+ * ETag and the time it was read. Entries are never served while Redis is healthy; once it is
+ * degraded, a request may be answered with the last copy, if it is younger than the staleness
+ * budget of its route, and the query is run again in the background to refresh it.
+ *
+ * The background refresher is shared with the other stale-while-revalidate caches: any read
+ * served stale queues a refresh job, deduplicated by key, that a single thread runs when it
+ * can. Jobs are dropped when the queue is full.
+ *
+ * The cache is direct-mapped: an entry replaces whatever occupied its slot.
+ */
+
+/**
+ * Refreshes the entry read with the given argument, e.g. by running its query again.
+ */
+typedef void (*stale_refresh_fn)(const char* arg);
+
+/**
+ * Counters of the stale cache and of the refresher.
+ */
+struct stale_cache_stats {
+    unsigned long long stores;
+    unsigned long long hits;      // Stale responses served
+    unsigned long long misses;    // Lookups that found no entry young enough
+    unsigned long long refreshes; // Refresh jobs run
+    unsigned long long dropped;   // Refresh jobs dropped because the queue was full
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+};
+
+/**
+ * @brief Creates the cache and starts the refresher thread.
+ *
+ * @param max_bytes The size of the cache of responses, 0 to keep none (the refresher still runs).
+ * @return int Returns 0 on success, 1 on failure.
+ */
+int stale_cache_init(size_t max_bytes);
+
+/**
+ * @brief Checks whether stale-while-revalidate is enabled.
+ */
+bool stale_cache_enabled(void);
+
+/**
+ * @brief Keeps the last successful response of a query.
+ *
+ * @param key The key naming the query.
+ * @param body The response body.
+ * @param etag The ETag of the response, or NULL or empty for none.
+ */
+void stale_cache_put(const char* key, const char* body, const char* etag);
+
+/**
+ * @brief Looks up the last response of a query.
+ *
+ * @param key The key naming the query.
+ * @param max_age_ms The oldest entry accepted, in milliseconds.
+ * @param etag Set to the ETag of the response, empty for none.
+ * @param etag_size The size of the etag buffer.
+ * @param age_ms Set to the time since the response was read from Redis.
+ * @return char* A copy of the response body, or NULL on a miss.
+ *         The caller is responsible for freeing the returned string.
+ */
+char* stale_cache_get(const char* key, unsigned int max_age_ms, char* etag, size_t etag_size, unsigned int* age_ms);
+
+/**
+ * @brief Queues the refresh of an entry served stale.
+ *
+ * Does nothing if a refresh of the same key is already queued or running.
+ *
+ * @param key The key of the entry.
+ * @param refresh The function run by the refresher thread.
+ * @param arg The argument of the function, copied.
+ */
+void stale_cache_refresh(const char* key, stale_refresh_fn refresh, const char* arg);
+
+/**
+ * @brief Copies the counters of the cache.
+ */
+void stale_cache_get_stats(struct stale_cache_stats* stats);
+
+/**
+ * @brief Stops the refresher thread, dropping the jobs still queued, and frees the cache.
+ */
+void stale_cache_cleanup(void);
+
+#endif // STALE_CACHE_H